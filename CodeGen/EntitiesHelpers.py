@@ -12,6 +12,7 @@ pds_built_in_item_types = {
 	'DirectedGraph',
 	'IndexedVector',
 	'ItemTable',
+	'Lazy',
 	'Varying'
 }
 
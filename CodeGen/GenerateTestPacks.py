@@ -18,13 +18,16 @@ v1_0 = Version(
 			name = "TestEntityA", 
 			dependencies = [ 
 				Dependency( "ItemTable", include_in_header = True ),
+				Dependency( "Lazy", include_in_header = True ),
 				Dependency( "TestItemA", include_in_header = True ) 
 			],
 			templates = [ 
-				Template( "test_table", template = "ItemTable", types = ["item_ref","TestItemA"] , flags = ['zero_keys'] ) 
+				Template( "test_table", template = "ItemTable", types = ["item_ref","TestItemA"] , flags = ['zero_keys'] ),
+				Template( "lazy_test_table", template = "Lazy", types = ["test_table"] ) 
 			],
 			variables = [ 				
 				Variable( "test_table", name = "TestVariableA", optional = True, storageName="TstVarA" ),
+				Variable( "lazy_test_table", name = "LazyTable", optional = True, storageName="LzyTbl" ),
 				Variable( "string", name = "Name"),
 				Variable( "string", name = "OptionalText", optional = True, storageName="OptTxt" ) 
 			]
@@ -68,7 +71,10 @@ v1_2 = Version(
 			name = "TestEntityB",
 			renameVariables=[
 				("Name","Name2")
-			]
+			],
+			addVariables=[
+				Variable("entity_ref", "Children", vector = True) 
+			],
 		)
 	]
 )
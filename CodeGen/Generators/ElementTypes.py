@@ -130,7 +130,10 @@ def fwd_h():
 	lines.append('class EntityValidator;')
 	lines.append('class WriteStream;')
 	lines.append('class ReadStream;')
+	lines.append('class FileReadStreamSource;')
+	lines.append('class EntityHasher;')
 	lines.append('class Varying;')	
+	lines.append('struct LazySource;')
 	lines.append('')
 	lines.append('// @brief IndexedVector is the template class for all indexed vectors in pds')
 	lines.append('template <')
@@ -161,6 +164,9 @@ def fwd_h():
 	lines.append('	item_table_flags _Flags = item_table_flags(0),')
 	lines.append('	class _MapTy = std::unordered_map<_Kty, std::unique_ptr<_Ty>>')
 	lines.append('> class ItemTable;')
+	lines.append('')
+	lines.append('// @brief Lazy holds a value in an item, which is deserialized from the entity data on first access')
+	lines.append('template <class _Ty> class Lazy;')
 
 	# end of pds namespace
 	lines.append('}')
@@ -9,22 +9,59 @@ def EntityReader_h():
 	lines.append('')
 	lines.append('#pragma once')
 	lines.append('')
+	lines.append('#include <functional>')
+	lines.append('')
 	lines.append('#include "fwd.h"')
 	lines.append('')
 	lines.append('namespace pds')
 	lines.append('{')
 	lines.append('')
+	lines.append('class WorkerPool;')
+	lines.append('enum class serialization_type_index : u8;')
+	lines.append('')
 	lines.append('class EntityReader')
 	lines.append('{')
 	lines.append('private:')
 	lines.append('    ReadStream &sstream;')
-	lines.append('    const u64 end_position;')
+	lines.append('    u64 end_position;')
 	lines.append('')
-	lines.append('    std::unique_ptr<EntityReader> active_subsection;')
+	lines.append('    // the subsection reader is allocated on first use, and reused by the following subsections')
+	lines.append('    std::unique_ptr<EntityReader> subsection_reader;')
+	lines.append('    EntityReader *active_subsection = nullptr;')
+	lines.append('    EntityReader *BeginSubsection( const u64 section_end_position, const char *key, const u8 key_length );')
 	lines.append('    size_t active_subsection_array_size = 0;')
 	lines.append('    size_t active_subsection_index = size_t(~0);')
 	lines.append('    u64 active_subsection_end_pos = 0;')
 	lines.append('')
+	lines.append('    // if the active sections array has an offset table, the offsets of the sections, from the start of the sections')
+	lines.append('    vector<u64> active_subsection_offsets;')
+	lines.append('    u64 active_subsection_sections_start = 0;')
+	lines.append('    u64 active_subsection_block_end = 0;')
+	lines.append('')
+	lines.append('    vector<entity_ref> *collected_entity_refs = nullptr;')
+	lines.append('    WorkerPool *worker_pool = nullptr;')
+	lines.append('    std::shared_ptr<const void> data_owner;')
+	lines.append('')
+	lines.append('    // in key tolerant mode, the blocks in the key range are indexed on the first read, and reads seek to the block of the key')
+	lines.append('    struct KeyIndex;')
+	lines.append('    bool key_tolerant = false;')
+	lines.append('    u64 key_range_start = 0;')
+	lines.append('    u64 key_range_end = 0;')
+	lines.append('    std::unique_ptr<KeyIndex> key_index;')
+	lines.append('    bool keys_indexed = false;')
+	lines.append('    void SetKeyRange( u64 start_position, u64 end_position );')
+	lines.append('    status IndexKeys();')
+	lines.append('    status SeekToKey( serialization_type_index value_type, const char *key, const u8 key_length, u64 value_size, bool value_is_optional, bool &dest_projected, bool &dest_found );')
+	lines.append('')
+	lines.append('    // if set, only the values on the key paths are read, projection_path is the path of the section of the reader')
+	lines.append('    const vector<std::string> *projection = nullptr;')
+	lines.append('    std::string projection_path;')
+	lines.append('    bool IsProjected( const char *key, const u8 key_length ) const;')
+	lines.append('    void InheritSettings( EntityReader &section_reader, const char *key, const u8 key_length ) const;')
+	lines.append('')
+	lines.append('    // find the offsets of the sections of the active sections array, if it has no offset table')
+	lines.append('    status IndexSectionsArray();')
+	lines.append('')
 	lines.append('public:')
 	lines.append('    EntityReader( ReadStream &_sstream );')
 	lines.append('    EntityReader( ReadStream &_sstream , const u64 _end_position );')
@@ -45,8 +82,59 @@ def EntityReader_h():
 	lines.append('    status EndReadSectionInArray( const EntityReader *sections_array_reader , const size_t section_index );')
 	lines.append('    status EndReadSectionsArray( const EntityReader *sections_array_reader );')
 	lines.append('')
+	lines.append('    // If the sections array was written with an offset table (see WriteStream::SetSectionsArrayOffsetThreshold), the sections ')
+	lines.append('    // can be read in any order, and sections can be skipped. GetSectionInArrayRange returns the stream range of a section\'s data, ')
+	lines.append('    // which can be read by an EntityReader on a separate ReadStream, for instance to decode the sections in parallel.')
+	lines.append('    // Note that GetSectionInArrayRange reads from the stream of the reader, so get the ranges before starting the decoding.')
+	lines.append('    bool HasSectionsArrayOffsets() const { return !this->active_subsection_offsets.empty(); }')
+	lines.append('    status GetSectionInArrayRange( const EntityReader *sections_array_reader, const size_t section_index, u64 &dest_start_position, u64 &dest_end_position );')
+	lines.append('')
+	lines.append('    // Read all sections of the sections array, by calling read_section( index, has_data, section_reader ) for each section. ')
+	lines.append('    // If the reader has a worker pool and reads from memory, the sections are read in parallel, each with a separate reader, ')
+	lines.append('    // otherwise they are read in order. Must be called before any section is read, EndReadSectionsArray is still called after.')
+	lines.append('    status ReadSectionsInArray( const EntityReader *sections_array_reader, const std::function<status( size_t, bool, EntityReader & )> &read_section );')
+	lines.append('')
 	lines.append('    // The Read function template, specifically implemented for all supported value types.')
 	lines.append('    template <class T> status Read( const char *key, const u8 key_length, T &value );')
+	lines.append('')
+	lines.append('    // If set, all entity_ref values read by the reader and its subsections are appended to dest.')
+	lines.append('    // Used to find the entities referenced by an entity while it is deserialized.')
+	lines.append('    void SetEntityRefCollector( vector<entity_ref> *dest ) { this->collected_entity_refs = dest; }')
+	lines.append('')
+	lines.append('    // If set, ReadSectionsInArray reads the sections of large arrays in parallel on the pool. Inherited by subsections.')
+	lines.append('    // Arrays with fewer than ParallelMinSectionCount sections, or ParallelMinSectionsSize bytes of sections, are read in ')
+	lines.append('    // order on the calling thread, since indexing the sections and dispatching them to the pool costs more than it saves.')
+	lines.append('    static const u64 ParallelMinSectionCount = 16;')
+	lines.append('    static const u64 ParallelMinSectionsSize = 16 * 1024;')
+	lines.append('    void SetWorkerPool( WorkerPool *pool ) { this->worker_pool = pool; }')
+	lines.append('    WorkerPool *GetWorkerPool() const { return this->worker_pool; }')
+	lines.append('')
+	lines.append('    // If set, the reader is key tolerant: on the first read from a section, the blocks of the section are indexed by key, ')
+	lines.append('    // so the values can be read in any order, and values which are not read (such as values of keys which are unknown ')
+	lines.append('    // to the reader) are skipped. Reading a key which is not in the section fails with status::not_found, unless the value is ')
+	lines.append('    // optional, or a null section is allowed, in which case the value is read as empty, or the section as null. This way, ')
+	lines.append('    // entities which were written before an optional value was added can still be read. The key of a small value is not ')
+	lines.append('    // stored separately, so a value which is not read in the order it was written fails with status::invalid if another ')
+	lines.append('    // block of the section can also have the key (such as an empty value of a longer key which ends with the key). ')
+	lines.append('    // Inherited by subsections.')
+	lines.append('    void SetKeyTolerant( bool tolerant ) { this->key_tolerant = tolerant; }')
+	lines.append('    bool GetKeyTolerant() const { return this->key_tolerant; }')
+	lines.append('')
+	lines.append('    // If set, only the values on the key paths are read, which makes the reader key tolerant. A key path is the keys of ')
+	lines.append('    // the sections down to the value, separated by \'/\', such as "Bounds/Min", where the sections of a sections array ')
+	lines.append('    // share the path of the array. Values which are not read are left as is. Sections which are not read are ')
+	lines.append('    // returned as null if allowed, else as empty sections, and sections arrays as empty arrays. The key paths must ')
+	lines.append('    // be kept alive while reading.')
+	lines.append('    void SetProjection( const vector<std::string> *key_paths ) { this->projection = key_paths; this->key_tolerant = ( key_paths != nullptr ) || this->key_tolerant; }')
+	lines.append('')
+	lines.append('    // If set, owner keeps the data of the memory stream of the reader alive after the reader is done, which ')
+	lines.append('    // allows sections to be deferred, see DeferSection. Inherited by subsections.')
+	lines.append('    void SetDataOwner( std::shared_ptr<const void> owner ) { this->data_owner = std::move( owner ); }')
+	lines.append('')
+	lines.append('    // Called on a section reader, before anything is read from the section. If the reader has a data owner, the rest of ')
+	lines.append('    // the section is set in dest, to be read later, and the reader skips to the end of the section. The section is not ')
+	lines.append('    // deferred if the reader collects entity refs or is projected, since these need the values when the entity is read. ')
+	lines.append('    status DeferSection( LazySource &dest, bool &dest_deferred );')
 	lines.append('};')
 	lines.append('')
 	lines.append('}')
@@ -58,11 +146,46 @@ def EntityReader_h():
 	lines.extend(hlp.end_header_file("EntityReader.h"))
 	hlp.write_lines_to_file("../Include/pds/EntityReader.h",lines)
 
+# lines which append the read entity_ref values to the collector, if the type is entity_ref
+def collect_entity_refs( implementing_type, values, indent, is_vector ):
+	if implementing_type != 'entity_ref':
+		return []
+	lines = []
+	lines.append(f'{indent}if( this->collected_entity_refs )')
+	if is_vector:
+		lines.append(f'{indent}	this->collected_entity_refs->insert( this->collected_entity_refs->end(), {values}.begin(), {values}.end() );')
+	else:
+		lines.append(f'{indent}	this->collected_entity_refs->emplace_back( {values} );')
+	return lines
+
+# in key tolerant mode, seek to the block of the key before reading it. small blocks are matched by the size of the value.
+# values which are not in the projection of the reader are not read. optional values which are not in the section are reset.
+def seek_to_key( type_name, implementing_type, is_small_block, is_optional = False ):
+	value_size = f'sizeof( element_type_information<{implementing_type}>::value_type ) * element_type_information<{implementing_type}>::value_count' if is_small_block else '0'
+	value_is_optional = 'true' if is_optional else 'false'
+	lines = []
+	lines.append(f'	bool projected = true;')
+	lines.append(f'	bool found = true;')
+	lines.append(f'	const status seek_status = this->SeekToKey( serialization_type_index::{type_name}, key, key_length, {value_size}, {value_is_optional}, projected, found );')
+	lines.append(f'	if( !seek_status )')
+	lines.append(f'		return seek_status;')
+	lines.append(f'	if( !projected )')
+	lines.append(f'		return status::ok;')
+	if is_optional:
+		lines.append(f'	if( !found )')
+		lines.append(f'	{{')
+		lines.append(f'		dest_variable.reset();')
+		lines.append(f'		return status::ok;')
+		lines.append(f'	}}')
+	return lines
+
 def EntityReader_inl():
 	lines = []
 	lines.extend( hlp.generate_header() )
 	lines.append('')
 	lines.append('#include "reader_templates.h"')
+	lines.append('#include "WorkerPool.h"')
+	lines.append('#include "Lazy.h"')
 	lines.append('')
 	lines.append('namespace pds')
 	lines.append('{')
@@ -90,6 +213,7 @@ def EntityReader_inl():
 				lines.append(f'		return status::cant_read;')
 				lines.append(f'')
 				lines.append(f'	dest_variable = {implementing_type}::from_{item_type}( tmp_variable );')
+				lines.extend( collect_entity_refs( implementing_type, 'dest_variable', '	', False ) )
 				lines.append(f'')
 				lines.append(f'	return status::ok;')
 				lines.append(f'}}')
@@ -103,9 +227,14 @@ def EntityReader_inl():
 				lines.append(f'		return status::cant_read;')
 				lines.append(f'')
 				lines.append(f'	if( tmp_variable.has_value() )')
+				lines.append(f'	{{')
 				lines.append(f'		dest_variable.set( {implementing_type}::from_{item_type}(tmp_variable.value()) );')
+				lines.extend( collect_entity_refs( implementing_type, 'dest_variable.value()', '		', False ) )
+				lines.append(f'	}}')
 				lines.append(f'	else')
+				lines.append(f'	{{')
 				lines.append(f'		dest_variable.reset();')
+				lines.append(f'	}}')
 				lines.append(f'')
 				lines.append(f'	return status::ok;')
 				lines.append(f'}}')
@@ -122,6 +251,7 @@ def EntityReader_inl():
 				lines.append(f'	dest_variable.reserve( tmp_variable.size() );')
 				lines.append(f'	for( size_t i = 0; i < tmp_variable.size(); ++i )')
 				lines.append(f'		dest_variable.emplace_back( {implementing_type}::from_{item_type}(tmp_variable[i]) );')
+				lines.extend( collect_entity_refs( implementing_type, 'dest_variable', '	', True ) )
 				lines.append(f'')
 				lines.append(f'	return status::ok;')
 				lines.append(f'}}')
@@ -142,6 +272,7 @@ def EntityReader_inl():
 				lines.append(f'		dest_variable.values().reserve( tmp_variable.values().size() );')
 				lines.append(f'		for( size_t i = 0; i < tmp_variable.values().size(); ++i )')
 				lines.append(f'			dest_variable.values().emplace_back( {implementing_type}::from_{item_type}(tmp_variable.values()[i]) );')
+				lines.extend( collect_entity_refs( implementing_type, 'dest_variable.values()', '		', True ) )
 				lines.append(f'	}}')
 				lines.append(f'	else')
 				lines.append(f'	{{')
@@ -166,6 +297,7 @@ def EntityReader_inl():
 				lines.append(f'	dest_variable.values().reserve( tmp_variable.values().size() );')
 				lines.append(f'	for( size_t i = 0; i < tmp_variable.values().size(); ++i )')
 				lines.append(f'		dest_variable.values().emplace_back( {implementing_type}::from_{item_type}(tmp_variable.values()[i]) );')
+				lines.extend( collect_entity_refs( implementing_type, 'dest_variable.values()', '	', True ) )
 				lines.append(f'')
 				lines.append(f'	return status::ok;')
 				lines.append(f'}}')
@@ -189,6 +321,7 @@ def EntityReader_inl():
 				lines.append(f'		dest_variable.values().reserve( tmp_variable.values().size() );')
 				lines.append(f'		for( size_t i = 0; i < tmp_variable.values().size(); ++i )')
 				lines.append(f'			dest_variable.values().emplace_back( {implementing_type}::from_{item_type}(tmp_variable.values()[i]) );')
+				lines.extend( collect_entity_refs( implementing_type, 'dest_variable.values()', '		', True ) )
 				lines.append(f'	}}')
 				lines.append(f'	else')
 				lines.append(f'	{{')
@@ -203,6 +336,7 @@ def EntityReader_inl():
 				lines.append(f'// {type_name}: {implementing_type}')
 				lines.append(f'template <> status EntityReader::Read<{implementing_type}>( const char *key, const u8 key_length, {implementing_type} &dest_variable )')
 				lines.append(f'{{')
+				lines.extend( seek_to_key( type_name, implementing_type, basetype.name != 'string' ) )
 				lines.append(f'	reader_status status = read_single_item<serialization_type_index::{type_name},{implementing_type}>(this->sstream, key, key_length, false, &(dest_variable) );')
 				lines.append(f'	return (status != reader_status::fail) ? (status::ok) : (status::cant_read);')
 				lines.append(f'}}')
@@ -211,6 +345,7 @@ def EntityReader_inl():
 				lines.append(f'// {type_name}: optional_value<{implementing_type}>' )
 				lines.append(f'template <> status EntityReader::Read<optional_value<{implementing_type}>>( const char *key, const u8 key_length, optional_value<{implementing_type}> &dest_variable )')
 				lines.append(f'{{')
+				lines.extend( seek_to_key( type_name, implementing_type, basetype.name != 'string', True ) )
 				lines.append(f'	dest_variable.set();')
 				lines.append(f'	reader_status status = read_single_item<serialization_type_index::{type_name},{implementing_type}>(this->sstream, key, key_length, true, &(dest_variable.value()) );')
 				lines.append(f'	if( status == reader_status::success_empty )')
@@ -222,6 +357,7 @@ def EntityReader_inl():
 				lines.append(f'// {type_name}: vector<{implementing_type}>' )
 				lines.append(f'template <> status EntityReader::Read<vector<{implementing_type}>>( const char *key, const u8 key_length, vector<{implementing_type}> &dest_variable )')
 				lines.append(f'{{')
+				lines.extend( seek_to_key( array_type_name, implementing_type, False ) )
 				lines.append(f'	reader_status status = read_array<serialization_type_index::{array_type_name},{implementing_type}>(this->sstream, key, key_length, false, &(dest_variable), nullptr );')
 				lines.append(f'	return (status != reader_status::fail) ? (status::ok) : (status::cant_read);')
 				lines.append(f'}}')
@@ -230,6 +366,7 @@ def EntityReader_inl():
 				lines.append(f'// {type_name}: optional_vector<{implementing_type}>' )
 				lines.append(f'template <> status EntityReader::Read<optional_vector<{implementing_type}>>( const char *key, const u8 key_length, optional_vector<{implementing_type}> &dest_variable )')
 				lines.append(f'{{')
+				lines.extend( seek_to_key( array_type_name, implementing_type, False, True ) )
 				lines.append(f'	dest_variable.set();')
 				lines.append(f'	reader_status status = read_array<serialization_type_index::{array_type_name},{implementing_type}>(this->sstream, key, key_length, true, &(dest_variable.values()), nullptr );')
 				lines.append(f'	if( status == reader_status::success_empty )')
@@ -241,6 +378,7 @@ def EntityReader_inl():
 				lines.append(f'// {type_name}: idx_vector<{implementing_type}>' )
 				lines.append(f'template <> status EntityReader::Read<idx_vector<{implementing_type}>>( const char *key, const u8 key_length, idx_vector<{implementing_type}> &dest_variable )')
 				lines.append(f'{{')
+				lines.extend( seek_to_key( array_type_name, implementing_type, False ) )
 				lines.append(f'	reader_status status = read_array<serialization_type_index::{array_type_name},{implementing_type}>(this->sstream, key, key_length, false, &(dest_variable.values()), &(dest_variable.index()) );')
 				lines.append(f'	return (status != reader_status::fail) ? (status::ok) : (status::cant_read);')
 				lines.append(f'}}')
@@ -249,6 +387,7 @@ def EntityReader_inl():
 				lines.append(f'// {type_name}: optional_idx_vector<{implementing_type}>' )
 				lines.append(f'template <> status EntityReader::Read<optional_idx_vector<{implementing_type}>>( const char *key, const u8 key_length, optional_idx_vector<{implementing_type}> &dest_variable )')
 				lines.append(f'{{')
+				lines.extend( seek_to_key( array_type_name, implementing_type, False, True ) )
 				lines.append(f'	dest_variable.set();')
 				lines.append(f'	reader_status status = read_array<serialization_type_index::{array_type_name},{implementing_type}>(this->sstream, key, key_length, true, &(dest_variable.values()), &(dest_variable.index()) );')
 				lines.append(f'	if( status == reader_status::success_empty )')
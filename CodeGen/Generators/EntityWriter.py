@@ -7,23 +7,37 @@ def EntityWriter_h():
 	lines = []
 	lines.extend( hlp.begin_header_file('EntityWriter.h') )
 	lines.append('')
+	lines.append('#include <functional>')
+	lines.append('')
 	lines.append('#include "fwd.h"')
 	lines.append('')
 	lines.append('namespace pds')
 	lines.append('{')
 	lines.append('')
+	lines.append('class WorkerPool;')
+	lines.append('')
 	lines.append('class EntityWriter')
 	lines.append('{')
 	lines.append('private:')
 	lines.append('\tWriteStream &dstream;')
-	lines.append('\tconst u64 start_position;')
+	lines.append('\tu64 start_position;')
 	lines.append('')
-	lines.append('\tstd::unique_ptr<EntityWriter> active_subsection;')
+	lines.append('\t// the subsection writer is allocated on first use, and reused by the following subsections')
+	lines.append('\tstd::unique_ptr<EntityWriter> subsection_writer;')
+	lines.append('\tEntityWriter *active_subsection = nullptr;')
+	lines.append('\tvoid BeginSubsection();')
 	lines.append('')
 	lines.append('\tsize_t active_array_size = 0;')
 	lines.append('\tsize_t active_array_index = size_t(~0);')
 	lines.append('\tu64 active_array_index_start_position = 0;')
 	lines.append('')
+	lines.append('\t// if the active array has an offset table, the offsets of the sections, from the start of the sections (compacted positions, see WriteStream::GetCompactedPosition)')
+	lines.append('\tbool active_array_has_offsets = false;')
+	lines.append('\tu64 active_array_sections_start = 0;')
+	lines.append('\tvector<u64> active_array_offsets;')
+	lines.append('')
+	lines.append('\tWorkerPool *worker_pool = nullptr;')
+	lines.append('')
 	lines.append('public:')
 	lines.append('\tEntityWriter( WriteStream &_dstream );')
 	lines.append('\t~EntityWriter();')
@@ -40,8 +54,24 @@ def EntityWriter_h():
 	lines.append('\tstatus EndWriteSectionsArray( const EntityWriter *sections_array_writer );')
 	lines.append('\tstatus WriteNullSectionsArray( const char *key, const u8 key_length );')
 	lines.append('')
+	lines.append('\t// Write all sections of the sections array, by calling write_section( index, section_writer ) for each section. ')
+	lines.append('\t// If the writer has a worker pool, batches of sections are written in parallel to separate streams, which are then ')
+	lines.append('\t// copied in order into the stream, so the data is identical to writing the sections in order. Must be called ')
+	lines.append('\t// before any section is written, EndWriteSectionsArray is still called after.')
+	lines.append('\tstatus WriteSectionsInArray( const EntityWriter *sections_array_writer, const std::function<status( size_t, EntityWriter & )> &write_section );')
+	lines.append('')
 	lines.append('\t// The Write function template, specifically implemented for all supported value types.')
 	lines.append('\ttemplate <class T> status Write( const char *key, const u8 key_length, const T &value );')
+	lines.append('')
+	lines.append('\t// If set, WriteSectionsInArray writes the sections of large arrays in parallel on the pool. Inherited by subsections.')
+	lines.append('\t// The first ParallelSampledSectionCount sections are always written in order, and used to estimate the size of the ')
+	lines.append('\t// array. Arrays with fewer than ParallelMinSectionCount sections, or an estimated ParallelMinSectionsSize bytes of ')
+	lines.append('\t// sections, are written in order on the calling thread, since the batches cost more than they save.')
+	lines.append('\tstatic const u64 ParallelSampledSectionCount = 4;')
+	lines.append('\tstatic const u64 ParallelMinSectionCount = 16;')
+	lines.append('\tstatic const u64 ParallelMinSectionsSize = 16 * 1024;')
+	lines.append('\tvoid SetWorkerPool( WorkerPool *pool ) { this->worker_pool = pool; }')
+	lines.append('\tWorkerPool *GetWorkerPool() const { return this->worker_pool; }')
 	lines.append('};')
 	lines.append('')
 	lines.append('}')
@@ -58,6 +88,7 @@ def EntityWriter_inl():
 	lines.extend( hlp.generate_header() )
 	lines.append('')
 	lines.append('#include "writer_templates.h"')
+	lines.append('#include "WorkerPool.h"')
 	lines.append('')
 	lines.append('namespace pds')
 	lines.append('{')
@@ -1,114 +1,483 @@
 #include "_pds_macros.inl"
 
+// the blocks of a section, in the order of the stream. large blocks have the key directly after the size, 
+// but the key of a small block ends the block, and is matched when the key is looked up.
+struct EntityReader::KeyIndex
+{
+	struct Block
+	{
+		u64 position = 0; // the start of the block
+		u64 size = 0; // the size of the block, after the size value
+		u8 type = 0;
+		u8 key_length = 0; // large blocks only
+		char key[EntityMaxKeyLength]; // large blocks only
+	};
+
+	vector<Block> blocks;
+
+	// the indices of the blocks, sorted on a hash of the type and key. since the key length of a small block is 
+	// not known until the key is looked up, small blocks are hashed on the type, the size and the last character of the key.
+	vector<std::pair<u64, size_t>> lookup;
+
+	static u64 hash_bytes( u64 hash_value, const void *data, size_t size )
+	{
+		// FNV-1a
+		const u8 *bytes = (const u8 *)data;
+		for( size_t index = 0; index < size; ++index )
+		{
+			hash_value = ( hash_value ^ bytes[index] ) * 0x100000001b3ull;
+		}
+		return hash_value;
+	}
+
+	static u64 large_block_hash( u8 type, const char *key, u8 key_length )
+	{
+		return hash_bytes( hash_bytes( 0xcbf29ce484222325ull, &type, 1 ), key, key_length );
+	}
+
+	static u64 small_block_hash( u8 type, u64 size, char last_key_char )
+	{
+		const u8 values[3] = { type, u8( size ), u8( last_key_char ) };
+		return hash_bytes( 0xcbf29ce484222325ull, values, 3 );
+	}
+};
+
 EntityReader::EntityReader(ReadStream& _sstream)
 	: sstream(_sstream)
 	, end_position(_sstream.GetSize())
+	, key_range_start(_sstream.GetPosition())
+	, key_range_end(_sstream.GetSize())
 {
 }
 
-EntityReader::EntityReader( ReadStream &_sstream, const u64 _end_position ) : sstream( _sstream ), end_position( _end_position ) {}
+EntityReader::EntityReader( ReadStream &_sstream, const u64 _end_position ) 
+	: sstream( _sstream )
+	, end_position( _end_position ) 
+	, key_range_start( _sstream.GetPosition() )
+	, key_range_end( _end_position )
+{
+}
 
 EntityReader::~EntityReader() {}
 
+void EntityReader::SetKeyRange( u64 start_position, u64 end_position )
+{
+	this->key_range_start = start_position;
+	this->key_range_end = end_position;
+	this->keys_indexed = false;
+}
+
+status EntityReader::IndexKeys()
+{
+	// the index is reused between the sections of the reader
+	if( !this->key_index )
+	{
+		this->key_index = std::unique_ptr<KeyIndex>( new KeyIndex() );
+	}
+	KeyIndex *index = this->key_index.get();
+	index->blocks.clear();
+	index->lookup.clear();
+
+	// step through the blocks of the range, skipping over the values
+	u64 position = this->key_range_start;
+	while( position < this->key_range_end )
+	{
+		pdsReadValidate( sstream.SetPosition( position ), status::corrupted, section_beyond_block, position, this->key_range_end );
+
+		KeyIndex::Block block;
+		block.position = position;
+		block.type = sstream.Read<u8>();
+		u64 key_hash = 0;
+		if( block.type < 0x40 )
+		{
+			block.size = sstream.Read<u8>();
+			pdsReadValidate( block.size > 0, status::corrupted, unexpected_key_size, 0, 1 );
+		}
+		else
+		{
+			block.size = read_size_value( sstream );
+			const u64 key_position = sstream.GetPosition();
+			block.key_length = sstream.Read<u8>();
+			pdsReadValidate( block.key_length <= EntityMaxKeyLength && block.size > block.key_length, status::corrupted, unexpected_key_size, block.key_length, EntityMaxKeyLength );
+			sstream.Read( (u8 *)block.key, block.key_length );
+			sstream.SetPosition( key_position );
+			key_hash = KeyIndex::large_block_hash( block.type, block.key, block.key_length );
+		}
+
+		const u64 data_position = sstream.GetPosition();
+		pdsReadValidate( data_position <= this->key_range_end && block.size <= this->key_range_end - data_position, status::corrupted, section_beyond_block, position, this->key_range_end );
+		if( block.type < 0x40 )
+		{
+			sstream.SetPosition( data_position + block.size - 1 );
+			key_hash = KeyIndex::small_block_hash( block.type, block.size, char( sstream.Read<u8>() ) );
+		}
+		position = data_position + block.size;
+		index->lookup.emplace_back( key_hash, index->blocks.size() );
+		index->blocks.emplace_back( block );
+	}
+	std::sort( index->lookup.begin(), index->lookup.end() );
+
+	this->keys_indexed = true;
+	return status::ok;
+}
+
+bool EntityReader::IsProjected( const char *key, const u8 key_length ) const
+{
+	if( !this->projection )
+	{
+		return true;
+	}
+
+	// the value is read if it is on a key path, if it is a section on the way to a key path, or if it is in a section which is on a key path
+	const std::string path = this->projection_path + std::string( key, key_length );
+	for( const std::string &key_path : *this->projection )
+	{
+		const size_t common_length = std::min( path.size(), key_path.size() );
+		if( path.compare( 0, common_length, key_path, 0, common_length ) != 0 )
+		{
+			continue;
+		}
+		if( path.size() == key_path.size()
+			|| ( path.size() < key_path.size() && key_path[path.size()] == '/' )
+			|| ( path.size() > key_path.size() && path[key_path.size()] == '/' ) )
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+EntityReader *EntityReader::BeginSubsection( const u64 section_end_position, const char *key, const u8 key_length )
+{
+	if( !this->subsection_reader )
+	{
+		this->subsection_reader = std::unique_ptr<EntityReader>( new EntityReader( this->sstream, section_end_position ) );
+	}
+	else
+	{
+		// reset the state of the reused reader, it may have been left mid-section if a read failed
+		EntityReader &section_reader = *this->subsection_reader;
+		section_reader.end_position = section_end_position;
+		section_reader.active_subsection = nullptr;
+		section_reader.active_subsection_array_size = 0;
+		section_reader.active_subsection_index = size_t( ~0 );
+		section_reader.active_subsection_end_pos = 0;
+		section_reader.active_subsection_offsets.clear();
+		section_reader.active_subsection_sections_start = 0;
+		section_reader.active_subsection_block_end = 0;
+		section_reader.SetKeyRange( sstream.GetPosition(), section_end_position );
+	}
+	this->InheritSettings( *this->subsection_reader, key, key_length );
+	this->active_subsection = this->subsection_reader.get();
+	return this->active_subsection;
+}
+
+void EntityReader::InheritSettings( EntityReader &section_reader, const char *key, const u8 key_length ) const
+{
+	section_reader.collected_entity_refs = this->collected_entity_refs;
+	section_reader.worker_pool = this->worker_pool;
+	section_reader.key_tolerant = this->key_tolerant;
+	section_reader.projection = this->projection;
+	section_reader.data_owner = this->data_owner;
+	if( this->projection )
+	{
+		section_reader.projection_path = this->projection_path + std::string( key, key_length ) + '/';
+	}
+}
+
+status EntityReader::SeekToKey( serialization_type_index value_type, const char *key, const u8 key_length, u64 value_size, bool value_is_optional, bool &dest_projected, bool &dest_found )
+{
+	dest_projected = true;
+	dest_found = true;
+	if( !this->key_tolerant )
+	{
+		return status::ok;
+	}
+	if( !this->IsProjected( key, key_length ) )
+	{
+		dest_projected = false;
+		return status::ok;
+	}
+	if( !this->keys_indexed )
+	{
+		ctStatusCall( this->IndexKeys() );
+	}
+
+	const u8 type = (u8)value_type;
+	const KeyIndex &index = *this->key_index;
+	const auto block_has_key = [&]( const KeyIndex::Block &block ) -> bool
+	{
+		if( block.type != type )
+		{
+			return false;
+		}
+		if( type >= 0x40 )
+		{
+			return block.key_length == key_length && memcmp( block.key, key, key_length ) == 0;
+		}
+
+		// the block must have the size of an empty value, or of the value, and end with the key
+		if( block.size != key_length && block.size != key_length + value_size )
+		{
+			return false;
+		}
+		char block_key[EntityMaxKeyLength];
+		sstream.SetPosition( block.position + 2 + block.size - key_length );
+		return sstream.Read( (u8 *)block_key, key_length ) == key_length && memcmp( block_key, key, key_length ) == 0;
+	};
+
+	// first try the block at the current position, which is the block of the key if the values are read in the order they were written
+	const u64 current_position = sstream.GetPosition();
+	const auto in_order = std::lower_bound( index.blocks.begin(), index.blocks.end(), current_position, 
+		[]( const KeyIndex::Block &block, u64 position ) { return block.position < position; } );
+	if( in_order != index.blocks.end() && in_order->position == current_position && block_has_key( *in_order ) )
+	{
+		sstream.SetPosition( current_position );
+		return status::ok;
+	}
+
+	// look up the blocks with the key. a small block with the size of the value can also be the empty value of a longer 
+	// key which ends with the key, so if more than one block matches, the key is ambiguous, and no block is used.
+	const KeyIndex::Block *found_block = nullptr;
+	size_t found_count = 0;
+	const auto find_blocks = [&]( u64 key_hash )
+	{
+		auto range = std::equal_range( index.lookup.begin(), index.lookup.end(), std::make_pair( key_hash, size_t( 0 ) ), 
+			[]( const std::pair<u64, size_t> &a, const std::pair<u64, size_t> &b ) { return a.first < b.first; } );
+		for( auto it = range.first; it != range.second; ++it )
+		{
+			if( block_has_key( index.blocks[it->second] ) )
+			{
+				found_block = ( found_block ) ? found_block : &index.blocks[it->second];
+				++found_count;
+			}
+		}
+	};
+	if( type < 0x40 )
+	{
+		find_blocks( KeyIndex::small_block_hash( type, key_length, key[key_length - 1] ) );
+		if( value_size != 0 )
+		{
+			find_blocks( KeyIndex::small_block_hash( type, key_length + value_size, key[key_length - 1] ) );
+		}
+	}
+	else
+	{
+		find_blocks( KeyIndex::large_block_hash( type, key, key_length ) );
+	}
+	if( found_count > 1 )
+	{
+		set_read_error( sstream, read_error_code::ambiguous_key, key, key_length, found_count );
+		return status::invalid;
+	}
+	if( found_block )
+	{
+		sstream.SetPosition( found_block->position );
+		return status::ok;
+	}
+
+	// the key is not in the section. an optional value is read as empty, which is not an error
+	dest_found = false;
+	if( value_is_optional )
+	{
+		return status::ok;
+	}
+	set_read_error( sstream, read_error_code::key_not_found, key, key_length, type );
+	return status::not_found;
+}
+
 // Read a section. 
 // If the section is null, the section is directly closed, nullptr+success is returned 
 // from BeginReadSection, and EndReadSection shall not be called.
 status_return<EntityReader*> EntityReader::BeginReadSection( const char *key, const u8 key_length, const bool null_section_is_allowed )
 {
-	ctValidate(!this->active_subsection, status::invalid)
-		<< "This reader already has an active subsection. Close the subsection before opening a new."
-		<< ctValidateEnd;
+	// close the active subsection before opening a new
+	pdsReadValidate( !this->active_subsection, status::invalid, invalid_reader_call, 0, 0 );
 
-	// read block header
+	// read block header. if the section is not in the projection, return it as null if allowed, or else as an empty section.
+	// if the section is not in the stream, return it as null if allowed.
+	bool projected = true;
+	bool found = true;
+	ctStatusCall(this->SeekToKey(serialization_type_index::vt_subsection, key, key_length, 0, null_section_is_allowed, projected, found));
+	if( !found )
+	{
+		return status::ok;
+	}
+	if( !projected )
+	{
+		if( null_section_is_allowed )
+		{
+			return status::ok;
+		}
+		return this->BeginSubsection( sstream.GetPosition(), key, key_length );
+	}
 	const u64 end_of_section = begin_read_large_block(sstream, serialization_type_index::vt_subsection, key, key_length);
-	ctValidate(end_of_section != 0, status::cant_read)
-		<< "begin_read_large_block() failed unexpectedly, stream is probably corrupted"
-		<< ctValidateEnd;
+	if( end_of_section == 0 )
+	{
+		return status::cant_read; // the read error is recorded by the template
+	}
 
 	// if we are already at the end, end the block directly (if it is allowed)
 	if (end_of_section == sstream.GetPosition())
 	{
-		return (end_read_empty_large_block(sstream, key, null_section_is_allowed, end_of_section) == reader_status::fail)
+		return (end_read_empty_large_block(sstream, key, key_length, null_section_is_allowed, end_of_section) == reader_status::fail)
 			? status::invalid
 			: status::ok;
 	}
 
 	// allocate the subsection and return it to the caller to be used to read items in the subsection
-	this->active_subsection = std::unique_ptr<EntityReader>( new EntityReader( this->sstream, end_of_section ) );
-	return this->active_subsection.get();
+	return this->BeginSubsection( end_of_section, key, key_length );
 }
 
 status EntityReader::EndReadSection( const EntityReader *section_reader )
 {
-	ctValidate(section_reader == this->active_subsection.get(), status::invalid)
-		<< "Invalid parameter section_reader, it does not match the internal expected value."
-		<< ctValidateEnd;
+	pdsReadValidate( section_reader == this->active_subsection, status::invalid, invalid_reader_call, 0, 0 );
 
-	ctValidate(end_read_large_block( this->sstream, this->active_subsection->end_position ), status::invalid )
-		<< "end_read_large_block failed unexpectedly, the stream is corrupted or the reading is out of sync with the stream."
-		<< ctValidateEnd;
+	// a key tolerant section can have values which are not read, skip to the end
+	if( this->active_subsection->key_tolerant )
+	{
+		sstream.SetPosition( this->active_subsection->end_position );
+	}
+
+	pdsReadValidate( end_read_large_block( this->sstream, this->active_subsection->end_position ), status::invalid, unexpected_end_position, sstream.GetPosition(), this->active_subsection->end_position );
 
-	this->active_subsection.reset();
+	this->active_subsection = nullptr;
 	this->active_subsection_end_pos = 0;
 	return status::ok;
 }
 
+status EntityReader::DeferSection( LazySource &dest, bool &dest_deferred )
+{
+	dest_deferred = false;
+	const u8 *memory_data = sstream.GetMemoryData();
+	if( !this->data_owner || !memory_data || this->collected_entity_refs || this->projection )
+	{
+		return status::ok;
+	}
+
+	const u64 start_position = sstream.GetPosition();
+	pdsReadValidate( start_position <= this->end_position, status::invalid, unexpected_end_position, start_position, this->end_position );
+
+	dest.Owner = this->data_owner;
+	dest.Data = memory_data + start_position;
+	dest.Size = this->end_position - start_position;
+	dest.CompactEncoding = sstream.GetCompactEncoding();
+	dest.KeyTolerant = this->key_tolerant;
+	sstream.SetPosition( this->end_position );
+	dest_deferred = true;
+	return status::ok;
+}
+
 // Build a sections array. 
 // If the section is null, the section array is directly closed, nullptr+success is returned 
 // from BeginReadSectionsArray, and EndReadSectionsArray shall not be called.
 status_return<EntityReader *> EntityReader::BeginReadSectionsArray( const char *key, const u8 key_length, const bool null_section_array_is_allowed, vector<u32> *dest_index )
 {
-	ctValidate(!this->active_subsection, status::invalid)
-		<< "This reader already has an active subsection. Close the subsection before opening a new."
-		<< ctValidateEnd;
+	// close the active subsection before opening a new
+	pdsReadValidate( !this->active_subsection, status::invalid, invalid_reader_call, 0, 0 );
 
 	// read block header. if we are already at the end, the block is empty, end the block and make sure empty is allowed
+	// if the array is not in the projection, return it as null if allowed, or else as an empty array.
+	// if the array is not in the stream, return it as null if allowed.
+	bool projected = true;
+	bool found = true;
+	ctStatusCall(this->SeekToKey(serialization_type_index::vt_array_subsection, key, key_length, 0, null_section_array_is_allowed, projected, found));
+	if( !found )
+	{
+		return status::ok;
+	}
+	if( !projected )
+	{
+		if( null_section_array_is_allowed )
+		{
+			return status::ok;
+		}
+		this->active_subsection_array_size = 0;
+		this->active_subsection_index = size_t(~0);
+		this->active_subsection_offsets.clear();
+		this->active_subsection_sections_start = sstream.GetPosition();
+		this->active_subsection_block_end = sstream.GetPosition();
+		return this->BeginSubsection( sstream.GetPosition(), key, key_length );
+	}
 	const u64 end_of_section = begin_read_large_block(sstream, serialization_type_index::vt_array_subsection, key, key_length);
-	ctValidate(end_of_section != 0, status::cant_read)
-		<< "begin_read_large_block() failed unexpectedly, stream is probably corrupted"
-		<< ctValidateEnd;
+	if( end_of_section == 0 )
+	{
+		return status::cant_read; // the read error is recorded by the template
+	}
 
 	// if we are already at the end, end the block directly (if it is allowed)
 	if (end_of_section == sstream.GetPosition())
 	{
-		return (end_read_empty_large_block(sstream, key, null_section_array_is_allowed, end_of_section) == reader_status::fail)
+		return (end_read_empty_large_block(sstream, key, key_length, null_section_array_is_allowed, end_of_section) == reader_status::fail)
 			? status::invalid
 			: status::ok;
 	}
 
 	// read item size & count and index if it exists, or make sure we do not expect an index
 	size_t per_item_size = 0;
-	ctValidate(read_array_metadata_and_index(sstream, per_item_size, this->active_subsection_array_size, end_of_section, dest_index), status::invalid)
-		<< "read_array_metadata_and_index() failed unexpectedly, stream is probably corrupted"
-		<< ctValidateEnd;
+	u16 array_flags = 0;
+	if( !read_array_metadata_and_index(sstream, per_item_size, this->active_subsection_array_size, end_of_section, dest_index, &array_flags) )
+	{
+		return status::invalid; // the read error is recorded by the template
+	}
+	// encoded values are not supported for sections arrays
+	pdsReadValidate( (array_flags & ~ArraySectionsOffsetTableFlag) == 0, status::corrupted, unsupported_encoding, array_flags, 0 );
 
 	// set the subsection index to ~0 to indicate that we are before the first subsection
 	this->active_subsection_index = size_t(~0);
+	this->active_subsection_offsets.clear();
+	this->active_subsection_sections_start = sstream.GetPosition();
+	this->active_subsection_block_end = end_of_section;
+
+	// if the array has an offset table, read it from the end of the block, and validate the offsets
+	u64 end_of_sections = end_of_section;
+	if( (array_flags & ArraySectionsOffsetTableFlag) != 0 )
+	{
+		const u64 sections_start = this->active_subsection_sections_start;
+		const u64 array_size = this->active_subsection_array_size;
+		pdsReadValidate( array_size > 0 && array_size <= (end_of_section - sections_start) / sizeof(u64), status::corrupted, invalid_offset_table, array_size, 0 );
+		end_of_sections = end_of_section - array_size * sizeof(u64);
+
+		this->active_subsection_offsets.resize( this->active_subsection_array_size );
+		pdsReadValidate( sstream.SetPosition( end_of_sections ), status::corrupted, invalid_offset_table, end_of_sections, 0 );
+		sstream.Read( this->active_subsection_offsets.data(), array_size );
+		pdsReadValidate( sstream.SetPosition( sections_start ), status::corrupted, invalid_offset_table, sections_start, 0 );
+
+		// the sections are stored in order, and each section starts with a size value
+		u64 previous_offset = 0;
+		for( size_t i = 0; i < this->active_subsection_offsets.size(); ++i )
+		{
+			const u64 offset = this->active_subsection_offsets[i];
+			pdsReadValidate( offset < end_of_sections - sections_start && (i == 0 || offset > previous_offset), status::corrupted, invalid_offset_table, i, 0 );
+			previous_offset = offset;
+		}
+	}
 
 	// allocate the subsection and return it to the caller to be used to read items in the subsection
-	this->active_subsection = std::unique_ptr<EntityReader>( new EntityReader( this->sstream, end_of_section ) );
-	return this->active_subsection.get();
+	return this->BeginSubsection( end_of_sections, key, key_length );
 }
 
 status EntityReader::BeginReadSectionInArray( const EntityReader *sections_array_reader, const size_t section_index, bool *dest_section_has_data )
 {
-	ctValidate(sections_array_reader == this->active_subsection.get(), status::invalid_param)
-		<< "Invalid parameter sections_array_reader, it does not match the internal expected value."
-		<< ctValidateEnd;
+	pdsReadValidate( sections_array_reader == this->active_subsection, status::invalid_param, invalid_reader_call, 0, 0 );
 
-	ctValidate((this->active_subsection_index + 1) == section_index, status::invalid_param)
-		<< "Synch error, incorrect subsection index: " << section_index
-		<< " expected: " << (this->active_subsection_index + 1)
-		<< ctValidateEnd;
+	pdsReadValidate( section_index < this->active_subsection_array_size, status::invalid_param, invalid_reader_call, section_index, this->active_subsection_array_size );
 
-	ctValidate(section_index < this->active_subsection_array_size, status::invalid_param)
-		<< "Invalid subsection index: " << section_index
-		<< " total array size: " << this->active_subsection_array_size
-		<< ctValidateEnd;
+	// with an offset table, the sections can be read in any order, otherwise they must be read in sequence
+	if( this->HasSectionsArrayOffsets() )
+	{
+		pdsReadValidate( sstream.SetPosition( this->active_subsection_sections_start + this->active_subsection_offsets[section_index] ), status::corrupted, section_beyond_block, this->active_subsection_sections_start + this->active_subsection_offsets[section_index], this->active_subsection->end_position );
+	}
+	else
+	{
+		pdsReadValidate( (this->active_subsection_index + 1) == section_index, status::invalid_param, invalid_reader_call, section_index, this->active_subsection_index + 1 );
+	}
 
 	this->active_subsection_index = section_index;
-	const u64 section_size = sstream.Read<u64>();
+	const u64 section_size = read_size_value( sstream );
+	pdsReadValidate( sstream.GetPosition() <= this->active_subsection->end_position && section_size <= this->active_subsection->end_position - sstream.GetPosition(), status::corrupted, section_beyond_block, section_size, this->active_subsection->end_position );
 	this->active_subsection_end_pos = sstream.GetPosition() + section_size;
+	this->active_subsection->SetKeyRange( sstream.GetPosition(), this->active_subsection_end_pos );
 
 	if (dest_section_has_data)
 	{
@@ -118,9 +487,7 @@ status EntityReader::BeginReadSectionInArray( const EntityReader *sections_array
 	else
 	{
 		// if dest_section_has_data is null, the section is not allowed to be empty, and we need to check this
-		ctValidate(section_size != 0, status::invalid)
-			<< "A section which is not allowed to be empty, is empty in the stream."
-			<< ctValidateEnd;
+		pdsReadValidate( section_size != 0, status::invalid, empty_not_allowed, 0, 0 );
 	}
 
 	return status::ok;
@@ -128,43 +495,180 @@ status EntityReader::BeginReadSectionInArray( const EntityReader *sections_array
 
 status EntityReader::EndReadSectionInArray( const EntityReader *sections_array_reader, const size_t section_index )
 {
-	ctValidate(sections_array_reader == this->active_subsection.get(), status::invalid_param)
-		<< "Invalid parameter sections_array_reader, it does not match the internal expected value."
-		<< ctValidateEnd;
+	pdsReadValidate( sections_array_reader == this->active_subsection, status::invalid_param, invalid_reader_call, 0, 0 );
+
+	pdsReadValidate( this->active_subsection_index == section_index, status::invalid_param, invalid_reader_call, section_index, this->active_subsection_index );
 
-	ctValidate(this->active_subsection_index == section_index, status::invalid_param)
-		<< "Synch error, incorrect subsection index: " << section_index
-		<< " expected: " << this->active_subsection_index
-		<< ctValidateEnd;
+	// a key tolerant section can have values which are not read, skip to the end
+	if( this->active_subsection->key_tolerant )
+	{
+		sstream.SetPosition( this->active_subsection_end_pos );
+	}
 
 	const u64 end_pos = sstream.GetPosition();
-	ctValidate(end_pos == this->active_subsection_end_pos, status::invalid)
-		<< "The current subsection did not end where expected. Current" << end_pos
-		<< " expected: " << this->active_subsection_end_pos
-		<< ctValidateEnd;
+	pdsReadValidate( end_pos == this->active_subsection_end_pos, status::invalid, unexpected_end_position, end_pos, this->active_subsection_end_pos );
 	
 	return status::ok;
 }
 
 status EntityReader::EndReadSectionsArray( const EntityReader *sections_array_reader )
 {
-	ctValidate(sections_array_reader == this->active_subsection.get(), status::invalid)
-		<< "Invalid parameter sections_array_reader, it does not match the internal expected value."
-		<< ctValidateEnd;
+	pdsReadValidate( sections_array_reader == this->active_subsection, status::invalid, invalid_reader_call, 0, 0 );
 
-	ctValidate((this->active_subsection_index + 1) == this->active_subsection_array_size, status::invalid_param)
-		<< "Synch error, the subsection index does not equal the end of the array. Total sections read count:" << (this->active_subsection_index + 1)
-		<< " expected: " << this->active_subsection_array_size
-		<< ctValidateEnd;
+	// with an offset table, any sections may have been skipped, so skip to the end of the block
+	if( this->HasSectionsArrayOffsets() )
+	{
+		pdsReadValidate( sstream.SetPosition( this->active_subsection_block_end ), status::corrupted, section_beyond_block, this->active_subsection_block_end, 0 );
+	}
+	else
+	{
+		pdsReadValidate( (this->active_subsection_index + 1) == this->active_subsection_array_size, status::invalid_param, invalid_reader_call, this->active_subsection_index + 1, this->active_subsection_array_size );
+	}
 
-	ctValidate(end_read_large_block( this->sstream, this->active_subsection->end_position ), status::invalid )
-		<< "end_read_large_block failed unexpectedly, the stream is corrupted or the reading is out of sync with the stream."
-		<< ctValidateEnd;
+	pdsReadValidate( end_read_large_block( this->sstream, this->active_subsection_block_end ), status::invalid, unexpected_end_position, sstream.GetPosition(), this->active_subsection_block_end );
 
-	this->active_subsection.reset();
+	this->active_subsection = nullptr;
 	this->active_subsection_array_size = 0;
 	this->active_subsection_index = size_t( ~0 );
 	this->active_subsection_end_pos = 0;
+	this->active_subsection_offsets.clear();
+	this->active_subsection_sections_start = 0;
+	this->active_subsection_block_end = 0;
+	return status::ok;
+}
+
+status EntityReader::GetSectionInArrayRange( const EntityReader *sections_array_reader, const size_t section_index, u64 &dest_start_position, u64 &dest_end_position )
+{
+	pdsReadValidate( sections_array_reader == this->active_subsection, status::invalid_param, invalid_reader_call, 0, 0 );
+
+	// without an offset table, the sections can only be read in sequence
+	pdsReadValidate( this->HasSectionsArrayOffsets(), status::invalid, invalid_reader_call, 0, 0 );
+
+	pdsReadValidate( section_index < this->active_subsection_array_size, status::invalid_param, invalid_reader_call, section_index, this->active_subsection_array_size );
+
+	// read the size of the section, and restore the position of the stream
+	const u64 current_position = sstream.GetPosition();
+	pdsReadValidate( sstream.SetPosition( this->active_subsection_sections_start + this->active_subsection_offsets[section_index] ), status::corrupted, section_beyond_block, this->active_subsection_sections_start + this->active_subsection_offsets[section_index], this->active_subsection->end_position );
+	const u64 section_size = read_size_value( sstream );
+	dest_start_position = sstream.GetPosition();
+	sstream.SetPosition( current_position );
+
+	pdsReadValidate( dest_start_position <= this->active_subsection->end_position && section_size <= this->active_subsection->end_position - dest_start_position, status::corrupted, section_beyond_block, section_size, this->active_subsection->end_position );
+	dest_end_position = dest_start_position + section_size;
+	return status::ok;
+}
+
+status EntityReader::IndexSectionsArray()
+{
+	if( this->HasSectionsArrayOffsets() )
+	{
+		return status::ok;
+	}
+
+	// step through the size values of the sections, from the start of the array
+	const u64 sections_start = this->active_subsection_sections_start;
+	const u64 sections_end = this->active_subsection->end_position;
+	vector<u64> offsets( this->active_subsection_array_size );
+	u64 position = sections_start;
+	for( size_t index = 0; index < offsets.size(); ++index )
+	{
+		pdsReadValidate( position < sections_end && sstream.SetPosition( position ), status::corrupted, section_beyond_block, position, sections_end );
+		offsets[index] = position - sections_start;
+		const u64 section_size = read_size_value( sstream );
+		pdsReadValidate( sstream.GetPosition() <= sections_end && section_size <= sections_end - sstream.GetPosition(), status::corrupted, section_beyond_block, section_size, sections_end );
+		position = sstream.GetPosition() + section_size;
+	}
+	pdsReadValidate( position == sections_end, status::corrupted, unexpected_end_position, position, sections_end );
+
+	sstream.SetPosition( sections_start );
+	this->active_subsection_offsets = std::move( offsets );
+	return status::ok;
+}
+
+status EntityReader::ReadSectionsInArray( const EntityReader *sections_array_reader, const std::function<status( size_t, bool, EntityReader & )> &read_section )
+{
+	pdsReadValidate( sections_array_reader == this->active_subsection, status::invalid_param, invalid_reader_call, 0, 0 );
+
+	pdsReadValidate( this->active_subsection_index == size_t(~0), status::invalid, invalid_reader_call, this->active_subsection_index, size_t(~0) );
+
+	const size_t section_count = this->active_subsection_array_size;
+	const u8 *memory_data = sstream.GetMemoryData();
+
+	// read the sections in order, if they can not be read in parallel, or the array is too small to gain from it
+	const u64 sections_size = this->active_subsection->end_position - this->active_subsection_sections_start;
+	if( !this->worker_pool || !memory_data || section_count < ParallelMinSectionCount || sections_size < ParallelMinSectionsSize )
+	{
+		for( size_t index = 0; index < section_count; ++index )
+		{
+			bool has_data = false;
+			ctStatusCall( this->BeginReadSectionInArray( sections_array_reader, index, &has_data ) );
+			ctStatusCall( read_section( index, has_data, *this->active_subsection ) );
+			ctStatusCall( this->EndReadSectionInArray( sections_array_reader, index ) );
+		}
+		return status::ok;
+	}
+
+	// find the range of each section in the stream
+	ctStatusCall( this->IndexSectionsArray() );
+	vector<std::pair<u64, u64>> ranges( section_count );
+	for( size_t index = 0; index < section_count; ++index )
+	{
+		ctStatusCall( this->GetSectionInArrayRange( sections_array_reader, index, ranges[index].first, ranges[index].second ) );
+	}
+
+	// read the sections on the pool, each with a separate stream and reader. the entity refs are 
+	// collected per section, and appended in order afterwards, so the result matches reading in order.
+	vector<status> results( section_count, status::ok );
+	vector<read_error> errors( section_count );
+	vector<vector<entity_ref>> section_entity_refs( ( this->collected_entity_refs ) ? section_count : 0 );
+	const u64 stream_size = sstream.GetSize();
+	const bool compact_encoding = sstream.GetCompactEncoding();
+	this->worker_pool->ParallelFor( section_count, [&]( size_t index )
+	{
+		ReadStream section_stream( memory_data, stream_size );
+		section_stream.SetCompactEncoding( compact_encoding );
+		section_stream.SetPosition( ranges[index].first );
+
+		EntityReader section_reader( section_stream, ranges[index].second );
+		section_reader.collected_entity_refs = ( this->collected_entity_refs ) ? &section_entity_refs[index] : nullptr;
+		section_reader.worker_pool = this->worker_pool;
+		section_reader.key_tolerant = this->key_tolerant;
+		section_reader.projection = this->projection;
+		section_reader.projection_path = this->active_subsection->projection_path;
+		section_reader.data_owner = this->data_owner;
+
+		results[index] = read_section( index, ranges[index].second > ranges[index].first, section_reader );
+		if( section_reader.key_tolerant )
+		{
+			section_stream.SetPosition( ranges[index].second );
+		}
+		if( results[index] == status::ok && section_stream.GetPosition() != ranges[index].second )
+		{
+			set_read_error( section_stream, read_error_code::unexpected_end_position, nullptr, 0, section_stream.GetPosition(), ranges[index].second );
+			results[index] = status::invalid;
+		}
+		if( results[index] != status::ok )
+		{
+			errors[index] = last_read_error(); // the read errors are per thread, so move the error to the calling thread
+		}
+	} );
+
+	// report the first failed section
+	for( size_t index = 0; index < section_count; ++index )
+	{
+		if( results[index] != status::ok )
+		{
+			last_read_error() = errors[index];
+			return results[index];
+		}
+		if( this->collected_entity_refs )
+		{
+			this->collected_entity_refs->insert( this->collected_entity_refs->end(), section_entity_refs[index].begin(), section_entity_refs[index].end() );
+		}
+	}
+
+	// all sections are read, EndReadSectionsArray skips to the end of the array
+	this->active_subsection_index = section_count - 1;
 	return status::ok;
 }
 
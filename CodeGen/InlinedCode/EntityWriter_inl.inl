@@ -8,6 +8,29 @@ EntityWriter::EntityWriter(WriteStream& _dstream)
 
 EntityWriter::~EntityWriter() {}
 
+void EntityWriter::BeginSubsection()
+{
+	if( !this->subsection_writer )
+	{
+		this->subsection_writer = std::unique_ptr<EntityWriter>( new EntityWriter( this->dstream ) );
+	}
+	else
+	{
+		// reset the state of the reused writer, it may have been left mid-section if a write failed
+		EntityWriter &section_writer = *this->subsection_writer;
+		section_writer.start_position = this->dstream.GetPosition();
+		section_writer.active_subsection = nullptr;
+		section_writer.active_array_size = 0;
+		section_writer.active_array_index = size_t( ~0 );
+		section_writer.active_array_index_start_position = 0;
+		section_writer.active_array_has_offsets = false;
+		section_writer.active_array_sections_start = 0;
+		section_writer.active_array_offsets.clear();
+	}
+	this->subsection_writer->worker_pool = this->worker_pool;
+	this->active_subsection = this->subsection_writer.get();
+}
+
 // Build a section. 
 status_return<EntityWriter*> EntityWriter::BeginWriteSection( const char *key, const u8 key_length )
 {
@@ -16,19 +39,19 @@ status_return<EntityWriter*> EntityWriter::BeginWriteSection( const char *key, c
 		<< ctValidateEnd;
 
 	// create a writer for the array, to store the start position before calling the begin large block 
-	this->active_subsection = std::unique_ptr<EntityWriter>( new EntityWriter( this->dstream ) );
+	this->BeginSubsection();
 	ctStatusCall(begin_write_large_block(this->dstream, serialization_type_index::vt_subsection, key, key_length));
-	return this->active_subsection.get();
+	return this->active_subsection;
 }
 
 status EntityWriter::EndWriteSection( const EntityWriter *section_writer )
 {
-	ctValidate(section_writer == this->active_subsection.get(), status::invalid)
+	ctValidate(section_writer == this->active_subsection, status::invalid)
 		<< "Invalid parameter section_writer, it does not match the internal expected value."
 		<< ctValidateEnd;
 
 	ctStatusCall(end_write_large_block(this->dstream, this->active_subsection->start_position));
-	this->active_subsection.reset();
+	this->active_subsection = nullptr;
 	return status::ok;
 }
 
@@ -45,7 +68,7 @@ status_return<EntityWriter*> EntityWriter::BeginWriteSectionsArray( const char *
 		<< ctValidateEnd;
 
 	// create a writer for the array, to store the start position before calling the begin large block 
-	this->active_subsection = std::unique_ptr<EntityWriter>(new EntityWriter(this->dstream));
+	this->BeginSubsection();
 	
 	ctStatusCall(begin_write_large_block(this->dstream, serialization_type_index::vt_array_subsection, key, key_length));
 
@@ -53,22 +76,31 @@ status_return<EntityWriter*> EntityWriter::BeginWriteSectionsArray( const char *
 	if( array_size == (size_t)~0 )
 	{
 		this->active_array_size = 0;
-		return this->active_subsection.get();
+		return this->active_subsection;
 	}
 
-	// write out flags, index and array size
-	ctStatusCall(write_array_metadata_and_index(dstream, 0, array_size, index));
+	// write out flags, index and array size. large arrays get an offset table, if the stream is set up for it
+	const u64 offset_threshold = dstream.GetSectionsArrayOffsetThreshold();
+	this->active_array_has_offsets = ( offset_threshold > 0 && array_size >= offset_threshold );
+	const u16 array_flags = ( this->active_array_has_offsets ) ? ArraySectionsOffsetTableFlag : 0;
+	ctStatusCall(write_array_metadata_and_index(dstream, 0, array_size, index, array_flags));
 
 	// reset the size and write index in the array
 	this->active_array_size = array_size;
 	this->active_array_index = size_t( ~0 );
 	this->active_array_index_start_position = 0;
-	return this->active_subsection.get();
+	this->active_array_sections_start = dstream.GetCompactedPosition();
+	this->active_array_offsets.clear();
+	if( this->active_array_has_offsets )
+	{
+		this->active_array_offsets.reserve( array_size );
+	}
+	return this->active_subsection;
 }
 
 status EntityWriter::BeginWriteSectionInArray( const EntityWriter *sections_array_writer, const size_t section_index )
 {
-	ctValidate(sections_array_writer == this->active_subsection.get(), status::invalid)
+	ctValidate(sections_array_writer == this->active_subsection, status::invalid)
 		<< "Invalid parameter section_writer, it does not match the internal expected value."
 		<< ctValidateEnd;
 
@@ -84,16 +116,21 @@ status EntityWriter::BeginWriteSectionInArray( const EntityWriter *sections_arra
 
 	this->active_array_index = section_index;
 	this->active_array_index_start_position = this->dstream.GetPosition();
+	if( this->active_array_has_offsets )
+	{
+		// the sections before this one are ended, so with compact encoding, the offset only excludes their gaps
+		this->active_array_offsets.emplace_back( this->dstream.GetCompactedPosition() - this->active_array_sections_start );
+	}
 
-	// write a temporary subsection size (INT64_MAX on purpose, to provoke an error if we do not update it)
-	dstream.Write( (u64)INT64_MAX );
+	// write a placeholder for the subsection size, which is filled in when the subsection ends
+	dstream.WritePlaceholder();
 	ctSanityCheck(dstream.GetPosition() == (this->active_array_index_start_position + sizeof(u64)));
 	return status::ok;
 }
 
 status EntityWriter::EndWriteSectionInArray( const EntityWriter *sections_array_writer, const size_t section_index )
 {
-	ctValidate(sections_array_writer == this->active_subsection.get(), status::invalid)
+	ctValidate(sections_array_writer == this->active_subsection, status::invalid)
 		<< "Invalid parameter section_writer, it does not match the internal expected value."
 		<< ctValidateEnd;
 
@@ -104,16 +141,14 @@ status EntityWriter::EndWriteSectionInArray( const EntityWriter *sections_array_
 
 	const u64 end_pos = dstream.GetPosition();
 	const u64 block_size = end_pos - this->active_array_index_start_position - sizeof( u64 ); // total block size - ( sizeof( section_size_value )=8 )
-	dstream.SetPosition( this->active_array_index_start_position );
-	dstream.Write( block_size );
-	dstream.SetPosition( end_pos ); // move back the where we were
+	dstream.FillPlaceholder( this->active_array_index_start_position, block_size );
 	ctSanityCheck(end_pos > this->active_array_index_start_position);
 	return status::ok;
 }
 
 status EntityWriter::EndWriteSectionsArray( const EntityWriter *sections_array_writer )
 {
-	ctValidate(sections_array_writer == this->active_subsection.get(), status::invalid)
+	ctValidate(sections_array_writer == this->active_subsection, status::invalid)
 		<< "Invalid parameter section_writer, it does not match the internal expected value."
 		<< ctValidateEnd;
 
@@ -122,15 +157,23 @@ status EntityWriter::EndWriteSectionsArray( const EntityWriter *sections_array_w
 		<< " expected: " << this->active_array_size
 		<< ctValidateEnd;
 
+	// write the offset table, which ends the block
+	if( this->active_array_has_offsets )
+	{
+		dstream.Write( this->active_array_offsets.data(), this->active_array_offsets.size() );
+	}
+
 	ctValidate(end_write_large_block( this->dstream, this->active_subsection->start_position ), status::invalid )
 		<< "end_write_large_block failed unexpectedly, the stream is corrupted or the reading is out of sync with the stream."
 		<< ctValidateEnd;
 
 	// release active subsection writer
-	this->active_subsection.reset();
+	this->active_subsection = nullptr;
 	this->active_array_size = 0;
 	this->active_array_index = size_t( ~0 );
 	this->active_array_index_start_position = 0;
+	this->active_array_has_offsets = false;
+	this->active_array_offsets.clear();
 	return status::ok;
 }
 
@@ -140,4 +183,93 @@ status EntityWriter::WriteNullSectionsArray( const char *key, const u8 key_lengt
 	return this->EndWriteSectionsArray( subsection );
 }
 
+status EntityWriter::WriteSectionsInArray( const EntityWriter *sections_array_writer, const std::function<status( size_t, EntityWriter & )> &write_section )
+{
+	ctValidate(sections_array_writer == this->active_subsection, status::invalid_param)
+		<< "Invalid parameter sections_array_writer, it does not match the internal expected value."
+		<< ctValidateEnd;
+
+	ctValidate(this->active_array_index == size_t(~0), status::invalid)
+		<< "WriteSectionsInArray must be called before any section of the array is written"
+		<< ctValidateEnd;
+
+	const size_t section_count = this->active_array_size;
+
+	// write the first sections in order, and all of them if they can not be written in parallel
+	const bool can_write_in_parallel = this->worker_pool && section_count >= ParallelMinSectionCount;
+	const size_t sampled_count = ( can_write_in_parallel ) ? size_t( ParallelSampledSectionCount ) : section_count;
+	const u64 sections_start = dstream.GetPosition();
+	size_t index = 0;
+	for( ; index < sampled_count; ++index )
+	{
+		ctStatusCall( this->BeginWriteSectionInArray( sections_array_writer, index ) );
+		ctStatusCall( write_section( index, *this->active_subsection ) );
+		ctStatusCall( this->EndWriteSectionInArray( sections_array_writer, index ) );
+	}
+
+	// write the rest in order too, if the sampled sections estimate a small array
+	const u64 sampled_section_size = ( sampled_count > 0 ) ? ( dstream.GetPosition() - sections_start ) / sampled_count : 0;
+	if( index == section_count || sampled_section_size * section_count < ParallelMinSectionsSize )
+	{
+		for( ; index < section_count; ++index )
+		{
+			ctStatusCall( this->BeginWriteSectionInArray( sections_array_writer, index ) );
+			ctStatusCall( write_section( index, *this->active_subsection ) );
+			ctStatusCall( this->EndWriteSectionInArray( sections_array_writer, index ) );
+		}
+		return status::ok;
+	}
+
+	// split the rest of the sections into batches, a few per worker, so the workers are balanced. each batch is written 
+	// to a separate stream from the stream pool, with the same settings as the stream, and the end position of each 
+	// section is recorded. the streams are acquired and released on this thread, so they return to its pool.
+	const size_t first_index = index;
+	const size_t remaining_count = section_count - first_index;
+	const size_t batch_count = std::min( remaining_count, size_t( this->worker_pool->GetWorkerCount() + 1 ) * 4 );
+	const auto batch_start = [&]( size_t batch_index ) { return first_index + batch_index * remaining_count / batch_count; };
+	vector<WriteStreamPool::Handle> batch_streams;
+	batch_streams.reserve( batch_count );
+	for( size_t batch_index = 0; batch_index < batch_count; ++batch_index )
+	{
+		batch_streams.emplace_back( WriteStreamPool::Acquire( sampled_section_size * ( batch_start( batch_index + 1 ) - batch_start( batch_index ) ) ) );
+		WriteStream &batch_stream = *batch_streams.back();
+		batch_stream.SetCompactEncoding( dstream.GetCompactEncoding() );
+		batch_stream.SetCompressionThreshold( dstream.GetCompressionThreshold() );
+		batch_stream.SetSectionsArrayOffsetThreshold( dstream.GetSectionsArrayOffsetThreshold() );
+	}
+	vector<u64> section_ends( section_count );
+	vector<status> results( batch_count, status::ok );
+	this->worker_pool->ParallelFor( batch_count, [&]( size_t batch_index )
+	{
+		WriteStream &batch_stream = *batch_streams[batch_index];
+		for( size_t section_index = batch_start( batch_index ); section_index < batch_start( batch_index + 1 ) && results[batch_index] == status::ok; ++section_index )
+		{
+			EntityWriter section_writer( batch_stream );
+			section_writer.worker_pool = this->worker_pool;
+			results[batch_index] = write_section( section_index, section_writer );
+			section_ends[section_index] = batch_stream.GetPosition();
+		}
+	} );
+
+	// copy the sections into the stream, in order. the batch streams return to the pool when the handles are destroyed
+	for( size_t batch_index = 0; batch_index < batch_count; ++batch_index )
+	{
+		ctValidate(results[batch_index] == status::ok, results[batch_index])
+			<< "Writing a section of the sections array failed"
+			<< ctValidateEnd;
+
+		const u8 *batch_data = (const u8 *)batch_streams[batch_index]->GetData();
+		u64 section_start = 0;
+		for( size_t section_index = batch_start( batch_index ); section_index < batch_start( batch_index + 1 ); ++section_index )
+		{
+			ctStatusCall( this->BeginWriteSectionInArray( sections_array_writer, section_index ) );
+			dstream.Write( &batch_data[section_start], section_ends[section_index] - section_start );
+			ctStatusCall( this->EndWriteSectionInArray( sections_array_writer, section_index ) );
+			section_start = section_ends[section_index];
+		}
+	}
+
+	return status::ok;
+}
+
 #include "_pds_undef_macros.inl"
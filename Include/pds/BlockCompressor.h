@@ -0,0 +1,52 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+#pragma once
+#ifndef __PDS__BLOCKCOMPRESSOR_H__
+#define __PDS__BLOCKCOMPRESSOR_H__
+
+#include <vector>
+
+#include "fwd.h"
+
+namespace pds
+{
+
+// BlockCompressor compresses the values of large array blocks. The data is compressed using the LZ4 block
+// format, which is fast enough to decompress that reading compressed data is still bound by the I/O.
+// Before compression, numeric values can be filtered to make them more compressible: delta encoding
+// replaces integer values with the difference to the previous value, and byte shuffling groups the
+// n:th byte of all values together, so that the (mostly equal) high bytes of the values end up next to each other.
+class BlockCompressor
+{
+public:
+	// the maximum size of the compressed data, for data of size bytes which does not compress
+	static u64 GetMaxCompressedSize( u64 size );
+
+	// compress the data in the LZ4 block format. returns the size of the compressed data, or 0 if it does not fit in destCapacity.
+	static u64 Compress( const u8 *src, u64 srcSize, u8 *dest, u64 destCapacity );
+
+	// decompress data in the LZ4 block format. the decompressed data must be exactly destSize bytes.
+	static status Decompress( const u8 *src, u64 srcSize, u8 *dest, u64 destSize );
+
+	// shuffle count values of valueSize bytes, so that all first bytes are stored first, then all second bytes, etc.
+	static void Shuffle( const u8 *src, u8 *dest, u64 count, u64 valueSize );
+	static void Unshuffle( const u8 *src, u8 *dest, u64 count, u64 valueSize );
+
+	// delta encode count little endian integers of valueSize (1, 2, 4 or 8) bytes, in place. each value is replaced
+	// by the difference to the value stride values before it, so vectors are encoded per component.
+	static void DeltaEncode( u8 *data, u64 count, u64 valueSize, u64 stride );
+	static void DeltaDecode( u8 *data, u64 count, u64 valueSize, u64 stride );
+
+	// delta encode and shuffle count values from src into dest in one pass, which gives the same result as 
+	// DeltaEncode on a copy of src followed by Shuffle, without the intermediate copy
+	static void DeltaEncodeShuffle( const u8 *src, u8 *dest, u64 count, u64 valueSize, u64 stride );
+};
+
+}
+// namespace pds
+
+#ifdef PDS_IMPLEMENTATION
+#include "BlockCompressor.inl"
+#endif//PDS_IMPLEMENTATION
+
+#endif//__PDS__BLOCKCOMPRESSOR_H__
@@ -0,0 +1,282 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include <cstring>
+
+#include <ctle/log.h>
+
+namespace pds
+{
+#include "_pds_macros.inl"
+
+static const u64 lz4MinMatch = 4; // the shortest match which can be encoded
+static const u64 lz4LastLiterals = 5; // the last bytes of a block are always literals
+static const u64 lz4MatchFindLimit = 12; // a match can not start in the last bytes of a block
+static const u64 lz4MaxOffset = 0xffff; // the offset of a match is encoded in 16 bits
+static const uint lz4HashBits = 12;
+
+static u32 lz4Read32( const u8 *src )
+{
+	u32 value;
+	memcpy( &value, src, sizeof( value ) );
+	return value;
+}
+
+static u32 lz4Hash( u32 sequence )
+{
+	return ( sequence * 2654435761u ) >> ( 32 - lz4HashBits );
+}
+
+// write the part of a length which does not fit in the 4 bits of the token, as a run of bytes
+static bool lz4WriteLength( u8 *dest, u64 &destPos, u64 destCapacity, u64 length )
+{
+	while( length >= 255 )
+	{
+		if( destPos >= destCapacity )
+			return false;
+		dest[destPos++] = 255;
+		length -= 255;
+	}
+	if( destPos >= destCapacity )
+		return false;
+	dest[destPos++] = (u8)length;
+	return true;
+}
+
+// write a sequence of literals followed by a match. the last sequence of a block has no match, and matchLength is 0
+static bool lz4WriteSequence( u8 *dest, u64 &destPos, u64 destCapacity, const u8 *literals, u64 literalCount, u64 offset, u64 matchLength )
+{
+	if( destPos >= destCapacity )
+		return false;
+	const u64 tokenPos = destPos++;
+
+	const u8 literalNibble = (u8)( ( literalCount < 15 ) ? literalCount : 15 );
+	if( literalNibble == 15 && !lz4WriteLength( dest, destPos, destCapacity, literalCount - 15 ) )
+		return false;
+	if( literalCount > destCapacity - destPos )
+		return false;
+	memcpy( &dest[destPos], literals, (size_t)literalCount );
+	destPos += literalCount;
+
+	if( matchLength == 0 )
+	{
+		dest[tokenPos] = (u8)( literalNibble << 4 );
+		return true;
+	}
+
+	if( destCapacity - destPos < 2 )
+		return false;
+	dest[destPos++] = (u8)( offset & 0xff );
+	dest[destPos++] = (u8)( offset >> 8 );
+
+	const u64 matchCode = matchLength - lz4MinMatch;
+	const u8 matchNibble = (u8)( ( matchCode < 15 ) ? matchCode : 15 );
+	if( matchNibble == 15 && !lz4WriteLength( dest, destPos, destCapacity, matchCode - 15 ) )
+		return false;
+
+	dest[tokenPos] = (u8)( ( literalNibble << 4 ) | matchNibble );
+	return true;
+}
+
+// read the part of a length which does not fit in the 4 bits of the token
+static bool lz4ReadLength( const u8 *src, u64 &srcPos, u64 srcSize, u64 &length )
+{
+	u8 value;
+	do
+	{
+		if( srcPos >= srcSize )
+			return false;
+		value = src[srcPos++];
+		length += value;
+	} while( value == 255 );
+	return true;
+}
+
+static u64 readLittleEndian( const u8 *src, u64 valueSize )
+{
+	u64 value = 0;
+	for( u64 b = 0; b < valueSize; ++b )
+	{
+		value |= u64( src[b] ) << ( 8 * b );
+	}
+	return value;
+}
+
+static void writeLittleEndian( u8 *dest, u64 valueSize, u64 value )
+{
+	for( u64 b = 0; b < valueSize; ++b )
+	{
+		dest[b] = (u8)( value >> ( 8 * b ) );
+	}
+}
+
+u64 BlockCompressor::GetMaxCompressedSize( u64 size )
+{
+	return size + ( size / 255 ) + 16;
+}
+
+u64 BlockCompressor::Compress( const u8 *src, u64 srcSize, u8 *dest, u64 destCapacity )
+{
+	u64 destPos = 0;
+	u64 anchor = 0;
+
+	// greedy compression, each position is looked up in a hash table of the last position with the same 4 bytes
+	if( srcSize > lz4MatchFindLimit )
+	{
+		std::vector<u64> table( size_t( 1 ) << lz4HashBits, 0 );
+		const u64 matchLimit = srcSize - lz4LastLiterals;
+		const u64 searchEnd = srcSize - lz4MatchFindLimit;
+
+		u64 pos = 0;
+		while( pos < searchEnd )
+		{
+			const u32 sequence = lz4Read32( &src[pos] );
+			const u32 slot = lz4Hash( sequence );
+			const u64 candidate = table[slot];
+			table[slot] = pos;
+
+			if( candidate < pos && ( pos - candidate ) <= lz4MaxOffset && lz4Read32( &src[candidate] ) == sequence )
+			{
+				u64 matchLength = lz4MinMatch;
+				while( pos + matchLength < matchLimit && src[candidate + matchLength] == src[pos + matchLength] )
+				{
+					++matchLength;
+				}
+
+				if( !lz4WriteSequence( dest, destPos, destCapacity, &src[anchor], pos - anchor, pos - candidate, matchLength ) )
+					return 0;
+
+				pos += matchLength;
+				anchor = pos;
+			}
+			else
+			{
+				// step faster through data which does not compress
+				pos += 1 + ( ( pos - anchor ) >> 6 );
+			}
+		}
+	}
+
+	// the rest of the data is written as literals
+	if( !lz4WriteSequence( dest, destPos, destCapacity, &src[anchor], srcSize - anchor, 0, 0 ) )
+		return 0;
+
+	return destPos;
+}
+
+status BlockCompressor::Decompress( const u8 *src, u64 srcSize, u8 *dest, u64 destSize )
+{
+	u64 srcPos = 0;
+	u64 destPos = 0;
+	for( ;;)
+	{
+		ctValidate( srcPos < srcSize, status::corrupted ) << "The compressed data ends unexpectedly" << ctValidateEnd;
+		const u8 token = src[srcPos++];
+
+		// copy the literals
+		u64 literalCount = token >> 4;
+		ctValidate( literalCount < 15 || lz4ReadLength( src, srcPos, srcSize, literalCount ), status::corrupted ) << "The compressed data ends unexpectedly" << ctValidateEnd;
+		ctValidate( literalCount <= srcSize - srcPos && literalCount <= destSize - destPos, status::corrupted )
+			<< "The literals of the compressed data are out of bounds" << ctValidateEnd;
+		memcpy( &dest[destPos], &src[srcPos], (size_t)literalCount );
+		srcPos += literalCount;
+		destPos += literalCount;
+
+		// the last sequence has only literals
+		if( srcPos == srcSize )
+			break;
+
+		// copy the match, which may overlap the data it is copied to
+		ctValidate( srcSize - srcPos >= 2, status::corrupted ) << "The compressed data ends unexpectedly" << ctValidateEnd;
+		const u64 offset = u64( src[srcPos] ) | ( u64( src[srcPos + 1] ) << 8 );
+		srcPos += 2;
+		ctValidate( offset > 0 && offset <= destPos, status::corrupted ) << "The offset of a match in the compressed data is out of bounds" << ctValidateEnd;
+
+		u64 matchLength = token & 0xf;
+		ctValidate( matchLength < 15 || lz4ReadLength( src, srcPos, srcSize, matchLength ), status::corrupted ) << "The compressed data ends unexpectedly" << ctValidateEnd;
+		matchLength += lz4MinMatch;
+		ctValidate( matchLength <= destSize - destPos, status::corrupted ) << "A match of the compressed data is out of bounds" << ctValidateEnd;
+
+		const u8 *match = &dest[destPos - offset];
+		if( offset >= matchLength )
+		{
+			memcpy( &dest[destPos], match, (size_t)matchLength );
+		}
+		else
+		{
+			for( u64 i = 0; i < matchLength; ++i )
+			{
+				dest[destPos + i] = match[i];
+			}
+		}
+		destPos += matchLength;
+	}
+
+	ctValidate( destPos == destSize, status::corrupted ) << "The decompressed size " << destPos << " does not match the expected size " << destSize << ctValidateEnd;
+	return status::ok;
+}
+
+void BlockCompressor::Shuffle( const u8 *src, u8 *dest, u64 count, u64 valueSize )
+{
+	for( u64 b = 0; b < valueSize; ++b )
+	{
+		u8 *destPlane = &dest[b * count];
+		for( u64 i = 0; i < count; ++i )
+		{
+			destPlane[i] = src[i * valueSize + b];
+		}
+	}
+}
+
+void BlockCompressor::Unshuffle( const u8 *src, u8 *dest, u64 count, u64 valueSize )
+{
+	for( u64 b = 0; b < valueSize; ++b )
+	{
+		const u8 *srcPlane = &src[b * count];
+		for( u64 i = 0; i < count; ++i )
+		{
+			dest[i * valueSize + b] = srcPlane[i];
+		}
+	}
+}
+
+void BlockCompressor::DeltaEncode( u8 *data, u64 count, u64 valueSize, u64 stride )
+{
+	// encode from the end, so the previous values are still not encoded
+	for( u64 i = count; i-- > stride; )
+	{
+		const u64 value = readLittleEndian( &data[i * valueSize], valueSize );
+		const u64 previous = readLittleEndian( &data[( i - stride ) * valueSize], valueSize );
+		writeLittleEndian( &data[i * valueSize], valueSize, value - previous );
+	}
+}
+
+void BlockCompressor::DeltaDecode( u8 *data, u64 count, u64 valueSize, u64 stride )
+{
+	for( u64 i = stride; i < count; ++i )
+	{
+		const u64 delta = readLittleEndian( &data[i * valueSize], valueSize );
+		const u64 previous = readLittleEndian( &data[( i - stride ) * valueSize], valueSize );
+		writeLittleEndian( &data[i * valueSize], valueSize, previous + delta );
+	}
+}
+
+void BlockCompressor::DeltaEncodeShuffle( const u8 *src, u8 *dest, u64 count, u64 valueSize, u64 stride )
+{
+	for( u64 i = 0; i < count; ++i )
+	{
+		u64 value = readLittleEndian( &src[i * valueSize], valueSize );
+		if( i >= stride )
+		{
+			value -= readLittleEndian( &src[( i - stride ) * valueSize], valueSize );
+		}
+		for( u64 b = 0; b < valueSize; ++b )
+		{
+			dest[b * count + i] = (u8)( value >> ( 8 * b ) );
+		}
+	}
+}
+
+#include "_pds_undef_macros.inl"
+}
+// namespace pds
@@ -0,0 +1,177 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+#pragma once
+#ifndef __PDS__ENTITYCACHE_H__
+#define __PDS__ENTITYCACHE_H__
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <ctle/readers_writer_lock.h>
+
+#include "fwd.h"
+#include "entity_ref.h"
+
+namespace pds
+{
+
+// EntityCache holds the loaded entities of the EntityManager. The cache can be given a budget
+// of entities and bytes, and evicts entities which are not referenced outside of the cache when
+// the budget is exceeded. The eviction uses the CLOCK algorithm, an approximation of LRU: each entity
+// has a used flag, which is set when the entity is looked up, and cleared when the clock hand passes
+// over it. The hand evicts the first entity which is not used and not referenced, and only moves as
+// far as needed to get back within the budget, so there is no full scan of the cache.
+// Entities which the hand finds referenced are moved to a separate list, so the hand only passes 
+// over entities which can be evicted. The referenced entities are checked a few at a time, and are 
+// moved back when they are released. The work of each insert is bounded by EvictionStepBudget, so 
+// if the budget can not be reached within that many steps, the cache stays over the budget until 
+// the next insert.
+// The size of an entity is the size of its serialized data.
+// The cache is split into shards by the hash of the entity_ref, each with its own lock, map and clock 
+// hand, so lookups from many threads do not contend on a single lock. The budget is shared by all 
+// shards, and the shards are evicted from in round-robin order.
+class EntityCache
+{
+public:
+	// snapshot of the cache counters
+	struct Metrics
+	{
+		u64 Hits = 0;			// number of lookups which found the entity
+		u64 Misses = 0;			// number of lookups which did not find the entity
+		u64 Evictions = 0;		// number of entities removed from the cache
+		u64 EntityCount = 0;	// number of entities currently in the cache
+		u64 TotalSize = 0;		// the total size of the entities currently in the cache
+	};
+
+	// an entity to insert into the cache
+	struct Item
+	{
+		entity_ref Ref;
+		std::shared_ptr<const Entity> Value;
+		u64 Size = 0;
+
+		// the entities referenced by the entity, if they were collected when the entity was read, else nullptr
+		std::shared_ptr<const std::vector<entity_ref>> References;
+	};
+
+	// the shard count is rounded up to a power of two
+	explicit EntityCache( uint shardCount = 16 );
+	EntityCache( const EntityCache & ) = delete;
+	EntityCache &operator=( const EntityCache & ) = delete;
+
+	// sets the budget of the cache, 0 means unbounded. entities which are referenced outside
+	// of the cache are never evicted, so the budget can be exceeded while they are in use.
+	void SetBudget( u64 maxEntityCount, u64 maxTotalSize );
+
+	// returns the entity, or nullptr if not cached. counts as a hit or miss, and marks the entity as used.
+	std::shared_ptr<const Entity> Find( const entity_ref &ref );
+
+	// returns the refs in the list which are not cached. counts hits and misses, and marks the found entities as used.
+	// each shard is locked once.
+	std::vector<entity_ref> FindMissing( const std::vector<entity_ref> &refs );
+
+	// returns true if the entity is cached. does not count or mark the entity.
+	bool Contains( const entity_ref &ref );
+
+	// looks up the ref of a cached entity object. returns false if the object is not cached. 
+	// since the cache holds a reference to the object, the object can not be freed and its address 
+	// reused while it is found.
+	bool FindRef( const Entity *value, entity_ref &ref );
+
+	// looks up the entities referenced by a cached entity. returns false if the entity is not cached, or if its references are not known.
+	bool FindReferences( const entity_ref &ref, std::shared_ptr<const std::vector<entity_ref>> &references );
+
+	// sets the entities referenced by a cached entity. does nothing if the entity is not cached.
+	void SetReferences( const entity_ref &ref, std::shared_ptr<const std::vector<entity_ref>> references );
+
+	// forgets the refs of all cached entity objects, so FindRef does not find them until they are inserted again.
+	// used if the storage has changed, and the refs of the cached objects may no longer be stored.
+	void ClearRefsOfValues();
+
+	// inserts entities, with a single lock of each shard, and evicts entities if the budget is exceeded.
+	// entities which are already cached are not replaced.
+	void Insert( const Item *items, size_t count );
+	void Insert( const entity_ref &ref, const std::shared_ptr<const Entity> &value, u64 size );
+
+	// removes an entity from the cache, even if it is referenced outside of the cache. returns false if the entity is not cached.
+	bool Remove( const entity_ref &ref );
+
+	// removes all entities which are not referenced outside of the cache. returns the number of removed entities.
+	size_t EvictUnreferenced();
+
+	// returns a snapshot of the counters
+	Metrics GetMetrics();
+
+	uint GetShardCount() const { return this->ShardCount; }
+
+	// the max number of nodes the clock hands pass over (or check in the referenced lists) when evicting, per insert
+	static const size_t EvictionStepBudget = 1024;
+
+private:
+	struct Node
+	{
+		Node( const Item &item ) : Ref( item.Ref ), Value( item.Value ), Size( item.Size ), References( item.References ) {}
+
+		entity_ref Ref;
+		std::shared_ptr<const Entity> Value;
+		u64 Size = 0;
+		std::shared_ptr<const std::vector<entity_ref>> References;
+		std::atomic<bool> Used { true };
+		bool Referenced = false; // set if the node is in the Referenced list of the shard
+	};
+
+	struct Shard
+	{
+		// the nodes which can be evicted are kept in a list which the clock hand moves over. nodes which 
+		// were found to be referenced are kept in a separate list, until they are found to be released.
+		std::list<Node> Nodes;
+		std::list<Node> Referenced;
+		std::unordered_map<entity_ref, std::list<Node>::iterator> Index;
+		std::list<Node>::iterator Hand = Nodes.end();
+		std::list<Node>::iterator ReferencedHand = Referenced.end();
+		ctle::readers_writer_lock Lock;
+
+		std::atomic<u64> Hits { 0 };
+		std::atomic<u64> Misses { 0 };
+		u64 Evictions = 0;
+
+		// reverse lookup of the ref of the cached entity objects, which are spread over the shards by the 
+		// address of the object. ValueLock is taken last, and only one at a time, so it can be taken within a shard lock.
+		std::unordered_map<const Entity *, entity_ref> ValueRefs;
+		std::mutex ValueLock;
+
+		// keeps the members of neighbouring shards on separate cache lines
+		u8 Padding[64] = {};
+	};
+
+	std::unique_ptr<Shard[]> Shards;
+	uint ShardCount = 0;
+	uint ShardShift = 0;
+
+	// the budget, and the totals of all shards
+	std::atomic<u64> MaxEntityCount { 0 };
+	std::atomic<u64> MaxTotalSize { 0 };
+	std::atomic<u64> EntityCount { 0 };
+	std::atomic<u64> TotalSize { 0 };
+	std::atomic<uint> EvictionShard { 0 };
+
+	uint GetShardIndex( const entity_ref &ref ) const;
+	Shard &GetValueShard( const Entity *value );
+	void SetValueRef( const Entity *value, const entity_ref &ref );
+	bool IsOverBudget() const;
+	std::list<Node>::iterator EraseNode( Shard &shard, std::list<Node>::iterator it );
+	bool EvictFromShard( Shard &shard, size_t &stepsLeft );
+	bool MoveReleasedNodes( Shard &shard, size_t &stepsLeft );
+	void EvictToBudget();
+};
+
+}
+// namespace pds
+
+#ifdef PDS_IMPLEMENTATION
+#include "EntityCache.inl"
+#endif//PDS_IMPLEMENTATION
+
+#endif//__PDS__ENTITYCACHE_H__
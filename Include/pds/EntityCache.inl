@@ -0,0 +1,404 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include <algorithm>
+
+namespace pds
+{
+#include "_pds_macros.inl"
+
+EntityCache::EntityCache( uint shardCount )
+{
+	// round up to a power of two, and use the top bits of the hash to select the shard,
+	// since the low bits are used by the maps within the shards
+	this->ShardCount = 1;
+	uint shardBits = 0;
+	while( this->ShardCount < shardCount )
+	{
+		this->ShardCount <<= 1;
+		++shardBits;
+	}
+	this->ShardShift = uint( sizeof( size_t ) * 8 ) - shardBits;
+	this->Shards.reset( new Shard[this->ShardCount] );
+}
+
+uint EntityCache::GetShardIndex( const entity_ref &ref ) const
+{
+	if( this->ShardCount == 1 )
+		return 0;
+	return uint( std::hash<entity_ref>()( ref ) >> this->ShardShift );
+}
+
+EntityCache::Shard &EntityCache::GetValueShard( const Entity *value )
+{
+	if( this->ShardCount == 1 )
+		return this->Shards[0];
+
+	// mix the address, since the top bits of addresses are mostly the same
+	const u64 address = u64( reinterpret_cast<uintptr_t>( value ) );
+	const u64 mixed = ( address >> 4 ) * 0x9e3779b97f4a7c15ull;
+	const uint shardBits = uint( sizeof( size_t ) * 8 ) - this->ShardShift;
+	return this->Shards[uint( mixed >> ( 64 - shardBits ) )];
+}
+
+void EntityCache::SetValueRef( const Entity *value, const entity_ref &ref )
+{
+	Shard &valueShard = this->GetValueShard( value );
+	std::lock_guard<std::mutex> valueGuard( valueShard.ValueLock );
+	valueShard.ValueRefs.emplace( value, ref );
+}
+
+void EntityCache::SetBudget( u64 maxEntityCount, u64 maxTotalSize )
+{
+	this->MaxEntityCount = maxEntityCount;
+	this->MaxTotalSize = maxTotalSize;
+	this->EvictToBudget();
+}
+
+std::shared_ptr<const Entity> EntityCache::Find( const entity_ref &ref )
+{
+	Shard &shard = this->Shards[this->GetShardIndex( ref )];
+	ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+	const auto it = shard.Index.find( ref );
+	if( it == shard.Index.end() )
+	{
+		++shard.Misses;
+		return nullptr;
+	}
+
+	++shard.Hits;
+	it->second->Used.store( true, std::memory_order_relaxed );
+	return it->second->Value;
+}
+
+std::vector<entity_ref> EntityCache::FindMissing( const std::vector<entity_ref> &refs )
+{
+	// group the refs by shard, so each shard is locked once
+	std::vector<std::pair<uint, size_t>> order( refs.size() );
+	for( size_t i = 0; i < refs.size(); ++i )
+	{
+		order[i] = std::make_pair( this->GetShardIndex( refs[i] ), i );
+	}
+	std::sort( order.begin(), order.end() );
+
+	std::vector<entity_ref> missing;
+	size_t i = 0;
+	while( i < order.size() )
+	{
+		Shard &shard = this->Shards[order[i].first];
+		ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+		const size_t missingBefore = missing.size();
+		const size_t shardBegin = i;
+		for( ; i < order.size() && order[i].first == order[shardBegin].first; ++i )
+		{
+			const entity_ref &ref = refs[order[i].second];
+			const auto it = shard.Index.find( ref );
+			if( it == shard.Index.end() )
+			{
+				missing.emplace_back( ref );
+				continue;
+			}
+			it->second->Used.store( true, std::memory_order_relaxed );
+		}
+
+		const size_t missed = missing.size() - missingBefore;
+		shard.Hits += ( i - shardBegin ) - missed;
+		shard.Misses += missed;
+	}
+
+	return missing;
+}
+
+bool EntityCache::Contains( const entity_ref &ref )
+{
+	Shard &shard = this->Shards[this->GetShardIndex( ref )];
+	ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+	return shard.Index.find( ref ) != shard.Index.end();
+}
+
+bool EntityCache::FindReferences( const entity_ref &ref, std::shared_ptr<const std::vector<entity_ref>> &references )
+{
+	Shard &shard = this->Shards[this->GetShardIndex( ref )];
+	ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+	const auto it = shard.Index.find( ref );
+	if( it == shard.Index.end() || !it->second->References )
+		return false;
+
+	references = it->second->References;
+	return true;
+}
+
+void EntityCache::SetReferences( const entity_ref &ref, std::shared_ptr<const std::vector<entity_ref>> references )
+{
+	Shard &shard = this->Shards[this->GetShardIndex( ref )];
+	ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+	const auto it = shard.Index.find( ref );
+	if( it != shard.Index.end() )
+		it->second->References = std::move( references );
+}
+
+bool EntityCache::FindRef( const Entity *value, entity_ref &ref )
+{
+	Shard &valueShard = this->GetValueShard( value );
+	std::lock_guard<std::mutex> guard( valueShard.ValueLock );
+
+	const auto it = valueShard.ValueRefs.find( value );
+	if( it == valueShard.ValueRefs.end() )
+		return false;
+
+	ref = it->second;
+	return true;
+}
+
+void EntityCache::ClearRefsOfValues()
+{
+	for( uint s = 0; s < this->ShardCount; ++s )
+	{
+		std::lock_guard<std::mutex> guard( this->Shards[s].ValueLock );
+		this->Shards[s].ValueRefs.clear();
+	}
+}
+
+void EntityCache::Insert( const Item *items, size_t count )
+{
+	// group the items by shard, so each shard is locked once
+	std::vector<std::pair<uint, size_t>> order( count );
+	for( size_t i = 0; i < count; ++i )
+	{
+		order[i] = std::make_pair( this->GetShardIndex( items[i].Ref ), i );
+	}
+	std::sort( order.begin(), order.end() );
+
+	size_t i = 0;
+	while( i < order.size() )
+	{
+		Shard &shard = this->Shards[order[i].first];
+		ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+		const size_t shardBegin = i;
+		for( ; i < order.size() && order[i].first == order[shardBegin].first; ++i )
+		{
+			const Item &item = items[order[i].second];
+			const auto found = shard.Index.find( item.Ref );
+			if( found != shard.Index.end() )
+			{
+				// already cached. if it is the same object, make sure its ref can be looked up
+				if( found->second->Value == item.Value )
+				{
+					this->SetValueRef( item.Value.get(), item.Ref );
+				}
+				continue;
+			}
+
+			// insert the new node just behind the hand, so it is the last node the hand reaches
+			const auto it = shard.Nodes.emplace( shard.Hand, item );
+			shard.Index.emplace( item.Ref, it );
+			++this->EntityCount;
+			this->TotalSize += item.Size;
+			this->SetValueRef( item.Value.get(), item.Ref );
+		}
+	}
+
+	this->EvictToBudget();
+}
+
+void EntityCache::Insert( const entity_ref &ref, const std::shared_ptr<const Entity> &value, u64 size )
+{
+	Item item;
+	item.Ref = ref;
+	item.Value = value;
+	item.Size = size;
+	this->Insert( &item, 1 );
+}
+
+bool EntityCache::Remove( const entity_ref &ref )
+{
+	Shard &shard = this->Shards[this->GetShardIndex( ref )];
+	ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+	const auto it = shard.Index.find( ref );
+	if( it == shard.Index.end() )
+		return false;
+
+	this->EraseNode( shard, it->second );
+	return true;
+}
+
+size_t EntityCache::EvictUnreferenced()
+{
+	size_t count = 0;
+	for( uint s = 0; s < this->ShardCount; ++s )
+	{
+		Shard &shard = this->Shards[s];
+		ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+		for( std::list<Node> *nodes : { &shard.Nodes, &shard.Referenced } )
+		{
+			auto it = nodes->begin();
+			while( it != nodes->end() )
+			{
+				// if this entity is only held by us, remove it, else skip to next
+				if( it->Value.use_count() == 1 )
+				{
+					it = this->EraseNode( shard, it );
+					++count;
+				}
+				else
+				{
+					++it;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+EntityCache::Metrics EntityCache::GetMetrics()
+{
+	Metrics metrics;
+	for( uint s = 0; s < this->ShardCount; ++s )
+	{
+		Shard &shard = this->Shards[s];
+		ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+		metrics.Hits += shard.Hits;
+		metrics.Misses += shard.Misses;
+		metrics.Evictions += shard.Evictions;
+	}
+	metrics.EntityCount = this->EntityCount;
+	metrics.TotalSize = this->TotalSize;
+	return metrics;
+}
+
+bool EntityCache::IsOverBudget() const
+{
+	const u64 maxEntityCount = this->MaxEntityCount;
+	const u64 maxTotalSize = this->MaxTotalSize;
+	return ( maxEntityCount != 0 && this->EntityCount > maxEntityCount )
+		|| ( maxTotalSize != 0 && this->TotalSize > maxTotalSize );
+}
+
+std::list<EntityCache::Node>::iterator EntityCache::EraseNode( Shard &shard, std::list<Node>::iterator it )
+{
+	--this->EntityCount;
+	this->TotalSize -= it->Size;
+	++shard.Evictions;
+	shard.Index.erase( it->Ref );
+	{
+		Shard &valueShard = this->GetValueShard( it->Value.get() );
+		std::lock_guard<std::mutex> valueGuard( valueShard.ValueLock );
+		const auto valueIt = valueShard.ValueRefs.find( it->Value.get() );
+		if( valueIt != valueShard.ValueRefs.end() && valueIt->second == it->Ref )
+			valueShard.ValueRefs.erase( valueIt );
+	}
+
+	// keep the hands valid
+	if( it->Referenced )
+	{
+		const bool movesHand = ( shard.ReferencedHand == it );
+		auto next = shard.Referenced.erase( it );
+		if( movesHand )
+			shard.ReferencedHand = next;
+		return next;
+	}
+	const bool movesHand = ( shard.Hand == it );
+	auto next = shard.Nodes.erase( it );
+	if( movesHand )
+		shard.Hand = next;
+	return next;
+}
+
+bool EntityCache::EvictFromShard( Shard &shard, size_t &stepsLeft )
+{
+	for( ;;)
+	{
+		// each node is passed at most twice, once to clear the used flag, and once to evict it
+		size_t handSteps = 2 * shard.Nodes.size();
+		while( handSteps > 0 && stepsLeft > 0 )
+		{
+			--handSteps;
+			--stepsLeft;
+			if( shard.Hand == shard.Nodes.end() )
+				shard.Hand = shard.Nodes.begin();
+
+			// referenced nodes can't be evicted, move them out of the way of the hand
+			Node &node = *shard.Hand;
+			if( node.Value.use_count() > 1 )
+			{
+				const auto it = shard.Hand++;
+				node.Referenced = true;
+				shard.Referenced.splice( shard.Referenced.end(), shard.Nodes, it );
+				handSteps = ( handSteps > 0 ) ? ( handSteps - 1 ) : 0;
+				continue;
+			}
+
+			if( node.Used.exchange( false, std::memory_order_relaxed ) )
+			{
+				++shard.Hand;
+				continue;
+			}
+
+			shard.Hand = this->EraseNode( shard, shard.Hand );
+			return true;
+		}
+
+		// nothing to evict among the unreferenced nodes, look for nodes which have been released since they were moved
+		if( !this->MoveReleasedNodes( shard, stepsLeft ) )
+			return false;
+	}
+}
+
+bool EntityCache::MoveReleasedNodes( Shard &shard, size_t &stepsLeft )
+{
+	bool moved = false;
+	size_t checksLeft = shard.Referenced.size();
+	while( checksLeft > 0 && stepsLeft > 0 )
+	{
+		--checksLeft;
+		--stepsLeft;
+		if( shard.ReferencedHand == shard.Referenced.end() )
+			shard.ReferencedHand = shard.Referenced.begin();
+
+		Node &node = *shard.ReferencedHand;
+		if( node.Value.use_count() > 1 )
+		{
+			++shard.ReferencedHand;
+			continue;
+		}
+
+		// released, put it just behind the clock hand
+		const auto it = shard.ReferencedHand++;
+		node.Referenced = false;
+		shard.Nodes.splice( shard.Hand, shard.Referenced, it );
+		moved = true;
+	}
+	return moved;
+}
+
+void EntityCache::EvictToBudget()
+{
+	// evict one entity at a time from the shards in turn, until the step budget is used up. if no shard has an entity 
+	// which can be evicted, all entities are referenced, and the cache stays over budget until the next insert
+	size_t stepsLeft = EvictionStepBudget;
+	uint failedShards = 0;
+	while( this->IsOverBudget() && failedShards < this->ShardCount && stepsLeft > 0 )
+	{
+		Shard &shard = this->Shards[( this->EvictionShard++ ) & ( this->ShardCount - 1 )];
+		ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+		if( this->EvictFromShard( shard, stepsLeft ) )
+			failedShards = 0;
+		else
+			++failedShards;
+	}
+}
+
+#include "_pds_undef_macros.inl"
+}
+// namespace pds
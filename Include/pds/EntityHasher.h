@@ -0,0 +1,86 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+#pragma once
+#ifndef __PDS__ENTITYHASHER_H__
+#define __PDS__ENTITYHASHER_H__
+
+#include <memory>
+#include <vector>
+#include <ctle/hasher.h>
+
+#include "fwd.h"
+
+namespace pds
+{
+
+class WorkerPool;
+
+// the hash format of the entities, which is the format of the entity refs (keys) of a store
+enum class entity_hash_mode : u8
+{
+	// the plain hash of all of the data, which is hashed in order, on a single thread
+	flat = 0,
+
+	// data which is larger than a leaf is hashed as a tree of leaves, which can be hashed in any order, and in parallel
+	tree = 1,
+};
+
+// EntityHasher calculates the hash of the serialized data of an entity, which is the key of the entity in the storage.
+// In flat mode, the data is hashed in order, using Update. In tree mode, the data is split into leaves of LeafSize 
+// bytes. Data which fits in a single leaf is hashed directly, so the hash of small entities is the same as the flat hash.
+// Larger data is hashed as a tree: each leaf is hashed separately, and the hash is the hash of the leaf hashes followed 
+// by the total size. Since the leaves are independent, they can be hashed in any order, such as while the data is being written.
+class EntityHasher
+{
+public:
+#ifdef PDS_USE_SHA256
+	// use sha256, cryptographically secure, but slower
+	typedef ctle::hasher_sha256 Hasher;
+#else
+	// use hasher_2x_xxh128_dcb7be9cd0fcf505, which concatenates two 128 bit xxhash hashes into a 256bit hash, with a salt of 'dcb7be9cd0fcf505' on the second hash
+	// caveat, not cryptographically secure, but much faster
+	typedef ctle::hasher_2x_xxh128_dcb7be9cd0fcf505 Hasher;
+#endif
+
+	static const u64 LeafSize = 1024 * 256; // 256KB leaves
+	static const u64 ParallelMinLeafCount = 4; // data with fewer leaves is always hashed on the calling thread
+
+	EntityHasher( entity_hash_mode _Mode = entity_hash_mode::flat ) : Mode( _Mode ) {}
+
+	entity_hash_mode GetMode() const { return this->Mode; }
+
+	// hash the next part of the data, in order
+	status Update( const u8 *data, u64 size );
+
+	// hash one leaf of the data, in any order. all leaves are LeafSize bytes, except the last leaf. only valid in tree mode.
+	status HashLeaf( u64 leafIndex, const u8 *data, u64 size );
+
+	// finish the hash of data of totalSize bytes. all of the data must be hashed, either by Update or HashLeaf.
+	status_return<hash> Finish( u64 totalSize );
+
+	// calculate the hash of the data. in tree mode, if a pool is given, and the data has at least ParallelMinLeafCount leaves, 
+	// the leaves are hashed in parallel on the pool, and the calling thread.
+	static status_return<hash> Calculate( const u8 *data, u64 size, entity_hash_mode mode = entity_hash_mode::flat, WorkerPool *pool = nullptr );
+
+private:
+	entity_hash_mode Mode;
+
+	// the hasher of the current leaf, when hashing using Update
+	std::unique_ptr<Hasher> UpdateHasher;
+	u64 UpdatedSize = 0;
+
+	std::vector<hash> Leaves;
+	std::vector<bool> LeafIsHashed;
+	u64 HashedLeafCount = 0;
+
+	status SetLeaf( u64 leafIndex, const hash &leafHash );
+};
+
+}
+// namespace pds
+
+#ifdef PDS_IMPLEMENTATION
+#include "EntityHasher.inl"
+#endif//PDS_IMPLEMENTATION
+
+#endif//__PDS__ENTITYHASHER_H__
@@ -0,0 +1,183 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include <algorithm>
+
+#include <ctle/log.h>
+
+#include "WorkerPool.h"
+
+namespace pds
+{
+#include "_pds_macros.inl"
+
+status EntityHasher::SetLeaf( u64 leafIndex, const hash &leafHash )
+{
+	if( leafIndex >= this->Leaves.size() )
+	{
+		this->Leaves.resize( (size_t)leafIndex + 1 );
+		this->LeafIsHashed.resize( (size_t)leafIndex + 1, false );
+	}
+	ctValidate( !this->LeafIsHashed[(size_t)leafIndex], status::invalid_param ) << "Leaf " << leafIndex << " is already hashed" << ctValidateEnd;
+
+	this->Leaves[(size_t)leafIndex] = leafHash;
+	this->LeafIsHashed[(size_t)leafIndex] = true;
+	++this->HashedLeafCount;
+	return status::ok;
+}
+
+status EntityHasher::Update( const u8 *data, u64 size )
+{
+	if( this->Mode == entity_hash_mode::flat )
+	{
+		if( !this->UpdateHasher )
+		{
+			this->UpdateHasher.reset( new Hasher() );
+		}
+		ctStatusCall( this->UpdateHasher->update( data, (size_t)size ) );
+		this->UpdatedSize += size;
+		return status::ok;
+	}
+
+	while( size > 0 )
+	{
+		if( !this->UpdateHasher )
+		{
+			this->UpdateHasher.reset( new Hasher() );
+		}
+
+		// fill up the current leaf
+		const u64 leafFill = this->UpdatedSize % LeafSize;
+		const u64 count = std::min( size, LeafSize - leafFill );
+		ctStatusCall( this->UpdateHasher->update( data, (size_t)count ) );
+		this->UpdatedSize += count;
+		data += count;
+		size -= count;
+
+		// if the leaf is full, finish it
+		if( this->UpdatedSize % LeafSize == 0 )
+		{
+			hash leafHash;
+			ctStatusReturnCall( leafHash, this->UpdateHasher->finish() );
+			ctStatusCall( this->SetLeaf( this->UpdatedSize / LeafSize - 1, leafHash ) );
+			this->UpdateHasher.reset();
+		}
+	}
+	return status::ok;
+}
+
+status EntityHasher::HashLeaf( u64 leafIndex, const u8 *data, u64 size )
+{
+	ctValidate( this->Mode == entity_hash_mode::tree, status::invalid ) << "Leaves can only be hashed in tree mode" << ctValidateEnd;
+	ctValidate( size <= LeafSize, status::invalid_param ) << "The leaf is larger than the leaf size" << ctValidateEnd;
+
+	hash leafHash;
+	Hasher hasher;
+	ctStatusCall( hasher.update( data, (size_t)size ) );
+	ctStatusReturnCall( leafHash, hasher.finish() );
+	return this->SetLeaf( leafIndex, leafHash );
+}
+
+status_return<hash> EntityHasher::Finish( u64 totalSize )
+{
+	if( this->Mode == entity_hash_mode::flat )
+	{
+		ctValidate( this->UpdatedSize == totalSize, status::invalid )
+			<< "Not all of the data is hashed, " << this->UpdatedSize << " bytes hashed, expected " << totalSize << ctValidateEnd;
+
+		hash ret;
+		Hasher emptyHasher;
+		Hasher &hasher = ( this->UpdateHasher ) ? *this->UpdateHasher : emptyHasher;
+		ctStatusReturnCall( ret, hasher.finish() );
+		this->UpdateHasher.reset();
+		return ret;
+	}
+
+	// finish the last partial leaf of Update, or the empty leaf of empty data
+	if( this->UpdateHasher || totalSize == 0 )
+	{
+		hash leafHash;
+		Hasher emptyHasher;
+		Hasher &hasher = ( this->UpdateHasher ) ? *this->UpdateHasher : emptyHasher;
+		ctStatusReturnCall( leafHash, hasher.finish() );
+		ctStatusCall( this->SetLeaf( this->UpdatedSize / LeafSize, leafHash ) );
+		this->UpdateHasher.reset();
+	}
+
+	const u64 leafCount = std::max( ( totalSize + LeafSize - 1 ) / LeafSize, u64( 1 ) );
+	ctValidate( this->HashedLeafCount == leafCount && this->Leaves.size() == leafCount, status::invalid )
+		<< "Not all leaves of the data are hashed, " << this->HashedLeafCount << " leaves hashed, expected " << leafCount << ctValidateEnd;
+
+	// a single leaf is the hash of the data
+	if( leafCount == 1 )
+	{
+		return this->Leaves[0];
+	}
+
+	// hash the leaf hashes, followed by the total size (little endian)
+	hash ret;
+	Hasher hasher;
+	for( const hash &leafHash : this->Leaves )
+	{
+		ctStatusCall( hasher.update( (const u8 *)&leafHash, sizeof( hash ) ) );
+	}
+	u8 sizeBytes[8];
+	for( uint i = 0; i < 8; ++i )
+	{
+		sizeBytes[i] = u8( totalSize >> ( i * 8 ) );
+	}
+	ctStatusCall( hasher.update( sizeBytes, sizeof( sizeBytes ) ) );
+	ctStatusReturnCall( ret, hasher.finish() );
+	return ret;
+}
+
+status_return<hash> EntityHasher::Calculate( const u8 *data, u64 size, entity_hash_mode mode, WorkerPool *pool )
+{
+	EntityHasher hasher( mode );
+	if( mode == entity_hash_mode::flat )
+	{
+		ctStatusCall( hasher.Update( data, size ) );
+		return hasher.Finish( size );
+	}
+
+	const u64 leafCount = ( size + LeafSize - 1 ) / LeafSize;
+	if( !pool || leafCount < ParallelMinLeafCount )
+	{
+		for( u64 offset = 0; offset < size; offset += LeafSize )
+		{
+			ctStatusCall( hasher.HashLeaf( offset / LeafSize, &data[offset], std::min( size - offset, u64( LeafSize ) ) ) );
+		}
+		return hasher.Finish( size );
+	}
+
+	// hash the leaves in parallel, each into its own slot, and then combine them in order
+	std::vector<hash> leaves( (size_t)leafCount );
+	std::vector<status> results( (size_t)leafCount, status::ok );
+	pool->ParallelFor( (size_t)leafCount, [data, size, &leaves, &results]( size_t leafIndex )
+		{
+			const u64 offset = u64( leafIndex ) * LeafSize;
+			Hasher leafHasher;
+			results[leafIndex] = leafHasher.update( &data[offset], (size_t)std::min( size - offset, u64( LeafSize ) ) );
+			if( results[leafIndex] != status::ok )
+			{
+				return;
+			}
+			auto leafHash = leafHasher.finish();
+			results[leafIndex] = leafHash.status();
+			if( results[leafIndex] == status::ok )
+			{
+				leaves[leafIndex] = leafHash.value();
+			}
+		} );
+
+	for( size_t leafIndex = 0; leafIndex < leaves.size(); ++leafIndex )
+	{
+		ctStatusCall( results[leafIndex] );
+		ctStatusCall( hasher.SetLeaf( leafIndex, leaves[leafIndex] ) );
+	}
+	return hasher.Finish( size );
+}
+
+#include "_pds_undef_macros.inl"
+}
+// namespace pds
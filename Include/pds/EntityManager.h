@@ -4,14 +4,26 @@
 #ifndef __PDS__ENTITYMANAGER_H__
 #define __PDS__ENTITYMANAGER_H__
 
+#include <functional>
 #include <future>
 #include <ctle/readers_writer_lock.h>
 
 #include "pds.h"
+#include "WorkerPool.h"
+#include "EntityStorage.h"
+#include "EntityCache.h"
 
 namespace pds
 {
 
+// how the EntityManager verifies the hash of the entity data it loads
+enum class hash_verification : uint
+{
+	always = 0,				// the hash is verified before the load returns
+	sampled = 1,			// the hash is verified before the load returns, for one in HashVerificationSampleRate loads, the rest are not verified
+	background = 2,			// the load returns directly, and the hash is verified in a worker task afterwards
+	on_first_access = 3,	// the hash is verified the first time the entity is returned by GetLoadedEntity
+};
 
 class EntityManager
 {
@@ -32,25 +44,190 @@ public:
 		virtual status Validate( const Entity *obj, EntityValidator &validator ) const = 0;
 	};
 
+	// Settings used when initializing the EntityManager
+	struct Settings
+	{
+		// the number of worker threads used to load and write entities. 0 uses the hardware concurrency of the system
+		uint WorkerCount = 0;
+
+		// the max number of tasks waiting in each worker queue before LoadEntityAsync/AddEntityAsync 
+		// blocks the calling thread. 0 means unbounded
+		uint MaxQueueDepth = 1024;
+
+		// if set, entity files are memory mapped when loaded, and hashed and deserialized directly 
+		// from the mapped pages. if not set, the files are read into an allocation.
+		bool UseMemoryMappedFiles = true;
+
+		// if set, entity files are instead read in windows of this size, and deserialized and hashed while 
+		// the next window is read ahead. this bounds the memory used to load very large entities. 
+		// an entity is only returned if the hash of all of its data compares correctly. 0 reads entities in full.
+		u64 StreamingReadWindowSize = 0;
+
+		// if set, the values of arrays which are at least this many bytes in size are compressed when entities are 
+		// stored. compressed arrays are always read, regardless of the setting. note that the compressed data has a 
+		// different hash, so an entity stored with and without compression gets different references. 0 disables compression.
+		u64 ArrayCompressionThreshold = 0;
+
+		// if set, entities are stored with compact encoding, where block sizes and array counts are varints instead of 
+		// fixed 8 byte values, which shrinks entities with many small sections. the encoding is detected when entities
+		// are read, so both encodings can be read regardless of the setting. as with compression, the references differ.
+		bool CompactEncoding = false;
+
+		// if set, sections arrays with at least this many sections are stored with an offset table, so that the sections 
+		// can be read in any order. 0 stores no offset tables. as with compression, the references differ.
+		u64 SectionsArrayOffsetThreshold = 0;
+
+		// the backend used to store the entities
+		entity_storage_backend StorageBackend = entity_storage_backend::file_per_entity;
+
+		// the hash mode of the entity refs of a new store. the mode is recorded in the store, and an existing store keeps the mode 
+		// it was created with, see GetHashMode. in tree mode, the leaves of large entities are verified in parallel when loaded, and, 
+		// if CompactEncoding is off, are hashed while the entity is serialized. the flat mode hashes all of the data in order, 
+		// on a single thread, after the entity is serialized. 
+		// the refs of the modes differ for entities which are larger than EntityHasher::LeafSize.
+		entity_hash_mode HashMode = entity_hash_mode::flat;
+
+		// the max size of each pack file, if using the pack_files backend
+		u64 MaxPackFileSize = 1024 * 1024 * 1024;
+
+		// the budget of the entity cache. when exceeded, the least recently used entities which are
+		// not referenced outside of the EntityManager are evicted. 0 means unbounded. 
+		// the size of an entity is the size of its serialized data.
+		u64 CacheMaxEntityCount = 0;
+		u64 CacheMaxSize = 0;
+
+		// the number of shards of the entity cache, each with a separate lock. rounded up to a power of two
+		uint CacheShardCount = 16;
+
+		// how the hash of loaded entity data is verified. use anything other than always only if the storage 
+		// is trusted, for instance if the file system has checksums of its own. streamed reads always verify, 
+		// since the hashing is already overlapped with the reading.
+		hash_verification HashVerification = hash_verification::always;
+		uint HashVerificationSampleRate = 16;
+
+		// how the hash is verified by LoadEntityProjected. note that verifying the hash reads all of the entity data, not only 
+		// the projected values. on_first_access is handled as background, since projected entities are not cached.
+		hash_verification ProjectedHashVerification = hash_verification::always;
+
+		// called when an entity which is already loaded fails a deferred verification (background or on_first_access). 
+		// the entity is removed from the cache before the call. called from a worker thread for background verification.
+		std::function<void( const entity_ref &ref, status result )> CorruptionCallback;
+	};
+
 private:
 	std::string Path;
 
-	std::unordered_map<entity_ref, std::shared_ptr<const Entity>> Entities;
-	ctle::readers_writer_lock EntitiesLock;
+	std::unique_ptr<EntityCache> Cache = std::unique_ptr<EntityCache>( new EntityCache() );
 	std::vector<const PackageRecord *> Records;
+	Settings Config;
+	std::unique_ptr<EntityStorage> Storage;
+	entity_hash_mode HashMode = entity_hash_mode::flat;
+	WorkerPool Pool;
+
+	// state of a LoadEntityGraphAsync call, shared by all the load tasks of the graph
+	struct GraphLoad
+	{
+		std::promise<status> Promise;
+		std::atomic<size_t> PendingTasks { 0 };
+
+		std::mutex Lock;
+		std::unordered_map<entity_ref, uint> ScheduledDepth; // the max depth each entity has been scheduled with
+		status Result = status::ok;
+	};
+
+	// reads, verifies and deserializes an entity, without inserting it into the cache. 
+	// if referencedEntities is set, the entity_refs in the entity are appended to it
+	// if projection is set, only the values on the key paths are deserialized, see EntityReader::SetProjection
+	// if data is set, it is the data of the entity, which is already read from the storage
+	static status_return<EntityCache::Item> ReadEntity( EntityManager *pThis, const entity_ref &ref, std::vector<entity_ref> *referencedEntities = nullptr, const std::vector<std::string> *projection = nullptr, std::shared_ptr<EntityData> data = nullptr );
+	static status_return<EntityCache::Item> ReadEntityStreamed( EntityManager *pThis, const entity_ref &ref, std::vector<entity_ref> *referencedEntities );
+
+	// validates, serializes and stores an entity, without inserting it into the cache
+	static status_return<EntityCache::Item> StoreEntity( EntityManager *pThis, const std::shared_ptr<const Entity> &entity );
+
+	// running average of the size of the stored entities, used as the size hint of the write streams
+	std::atomic<u64> StoredSizeHint { 0 };
+
+	// the number of loads, used to select the loads to verify when sampling
+	std::atomic<u64> LoadCount { 0 };
+
+	// entities which are loaded, but not yet verified (background or on_first_access). the first GetLoadedEntity of an 
+	// on_first_access entity sets Verification, and concurrent calls wait for its result, so an entity is not returned 
+	// before it is verified. Corrupted is set if a verification failed, so an entity which is inserted into the cache 
+	// after the failure is still not returned.
+	struct UnverifiedEntity
+	{
+		bool Corrupted = false;
+		std::shared_future<status> Verification;
+	};
+	std::unordered_map<entity_ref, UnverifiedEntity> UnverifiedEntities;
+	std::mutex UnverifiedEntitiesLock;
+	std::atomic<size_t> UnverifiedEntityCount { 0 };
+
+	std::atomic<u64> CorruptedEntityCount { 0 };
+
+	// reads the data of a loaded entity from the storage again, and verifies it. reports the entity as corrupted if not.
+	status VerifyLoadedEntity( const entity_ref &ref );
+	void ReportCorruptedEntity( const entity_ref &ref, status result );
+
+	// returns true if the data of an entity which is being read should be verified before the read returns
+	bool ShouldVerifyOnRead( hash_verification verification );
 
-	void InsertEntity( const entity_ref &ref, const std::shared_ptr<const Entity> &entity );
+	// the loads which are in flight. concurrent loads of the same entity wait for the first load, instead of loading again
+	std::unordered_map<entity_ref, std::shared_future<status>> InFlight;
+	std::mutex InFlightLock;
+	std::atomic<u64> JoinedLoads { 0 };
 
-	static status ReadTask( EntityManager *pThis, const entity_ref ref );
+	// claims the load of an entity. returns true if the caller is to load the entity, and must call FinishLoad when done. 
+	// returns false if the entity is already being loaded, and sets pending to the future of that load.
+	bool ClaimLoad( const entity_ref &ref, std::promise<status> &promise, std::shared_future<status> &pending );
+	void FinishLoad( const entity_ref &ref, std::promise<status> &promise, status result );
+
+	// loads an entity into the cache, sharing the load with concurrent loads of the same entity. 
+	// if collectReferences is set, and the entity is read, the entities it references are kept in the cache
+	static status ReadTask( EntityManager *pThis, const entity_ref ref, bool collectReferences = false );
+	static void GraphLoadTask( EntityManager *pThis, const std::shared_ptr<GraphLoad> &load, const entity_ref ref, const uint depth );
+	void ScheduleGraphLoad( const std::shared_ptr<GraphLoad> &load, const entity_ref &ref, uint depth );
 	static status_return<entity_ref> WriteTask( EntityManager *pThis, std::shared_ptr<const Entity> entity );
 
 public:
+	~EntityManager();
+
 	status Initialize( const std::string &path, const std::vector<const PackageRecord *> &records );
+	status Initialize( const std::string &path, const std::vector<const PackageRecord *> &records, const Settings &settings );
+
+	// the hash mode of the entity refs of the store, which is recorded in the store when it is created
+	entity_hash_mode GetHashMode() const { return this->HashMode; }
 
-	// Asks the handler to load an entity and insert into the Entities map. 
+	// Asks the handler to load an entity and insert it into the entity cache. 
+	// Concurrent requests for the same entity share a single load, and get the same result.
 	std::future<status> LoadEntityAsync( const entity_ref &ref );
 	status LoadEntity( const entity_ref &ref );
 
+	// Reads only the values of an entity which are on the key paths, and returns the partially populated entity, which is not 
+	// inserted into the cache. The key paths are the keys of the values in the entity, and of the sections which contain them, 
+	// separated by '/', such as "Bounds/Min", see EntityReader::SetProjection. The values which are not on the key paths are not 
+	// read, so scanning a few values of large entities is cheap. The hash is verified as set by Settings::ProjectedHashVerification.
+	status_return<std::shared_ptr<const Entity>> LoadEntityProjected( const entity_ref &ref, const std::vector<std::string> &keyPaths );
+
+	// Loads a batch of entities. Duplicates and already loaded entities are skipped, the reads are 
+	// sorted in storage order, and entities which are stored next to each other are read with a single 
+	// read (see EntityStorage::ReadBatch). The entities are deserialized in parallel, with the calling 
+	// thread taking part. All loaded entities are inserted into the cache with a single lock. 
+	// If any entity fails to load, the rest are still loaded, and the first error is returned.
+	status LoadEntities( const std::vector<entity_ref> &refs );
+
+	// Loads an entity, and all entities it references, down to depth levels of references. 
+	// (depth 0 only loads the entity itself.) The references found while an entity is deserialized are 
+	// scheduled to load concurrently, so the graph is loaded as wide as the worker pool allows, 
+	// instead of one level at a time. The loads are shared with other loads of the same entities, 
+	// and the references are kept in the cache, so shared parts of graphs are read once. Entities which 
+	// were loaded or added without their references are read again from the storage if their 
+	// references are needed, but are not replaced in the cache.
+	// The future is ready when the whole graph is loaded. If any entity fails to load, the rest of
+	// the graph is still loaded, and the first error is returned.
+	std::future<status> LoadEntityGraphAsync( const entity_ref &ref, uint depth );
+
 	// Unloads all entities which are not referenced outside of the EntityHandler
 	// To make sure an entity is kept around, keep a reference to the entity using the 
 	// std::shared_ptr<const Entity> returned by GetLoadedEntity().
@@ -59,7 +236,8 @@ public:
 	// Checks if an entity is loaded. 
 	bool IsEntityLoaded( const entity_ref &ref );
 
-	// Returns a loaded entity, or nullptr if the entity is not loaded.
+	// Returns a loaded entity, or nullptr if the entity is not loaded. If the hash verification is 
+	// on_first_access, the entity is verified on the first call, and nullptr is returned if it is corrupted.
 	std::shared_ptr<const Entity> GetLoadedEntity( const entity_ref &ref );
 
 	// Transfers ownership of a writable entity to the handler. The entity is serialized
@@ -69,9 +247,33 @@ public:
 	// read-only.
 	// Note! If the exact same entity data (same hash of the serialized data) is added, the 
 	// existing reference will be returned and the status will be WAlreadyExists
+	// Note! If the same entity object is added again, or an entity object returned by GetLoadedEntity
+	// is added, the reference is returned directly, without serializing the entity again.
 	std::future<status_return<entity_ref>> AddEntityAsync( const std::shared_ptr<const Entity> &entity );
 	status_return<entity_ref> AddEntity( const std::shared_ptr<const Entity> &entity );
 
+	// Adds a batch of entities. The entities are serialized, hashed and stored in parallel, and 
+	// inserted into the cache with a single lock. Returns the references in the same order 
+	// as the entities. If any entity fails, no entities are inserted into the cache.
+	status_return<std::vector<entity_ref>> AddEntities( const std::vector<std::shared_ptr<const Entity>> &entities );
+
+	// Removes all stored entities for which keep returns false, and reclaims the storage space.
+	// Only supported by the pack_files storage backend.
+	status CompactStorage( const std::function<bool( const entity_ref & )> &keep );
+
+	// Returns a snapshot of the metrics of the worker queues, which can be used to size
+	// the WorkerCount and MaxQueueDepth settings.
+	std::vector<WorkerPool::QueueMetrics> GetQueueMetrics() const;
+
+	// Returns the number of load requests which were joined with a load of the same entity already in flight,
+	// instead of loading the entity again.
+	u64 GetJoinedLoadCount() const;
+
+	// Returns a snapshot of the hit, miss and eviction counters of the entity cache.
+	EntityCache::Metrics GetCacheMetrics();
+
+	// Returns the number of loaded entities which failed a deferred hash verification.
+	u64 GetCorruptedEntityCount() const;
 
 };
 
@@ -1,35 +1,92 @@
 // pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
 // Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
 
-#include <ctle/file_funcs.h>
-#include <ctle/hasher.h>
+#include <algorithm>
+
 #include <ctle/log.h>
 
 #include "Entity.h"
+#include "EntityHasher.h"
 
 namespace pds
 {
 #include "_pds_macros.inl"
 
-// calculate the hash value of the data, using the selected algo
-static status_return<hash> calculateHash( const u8 *data, size_t count )
+// verify that the hash of the data, in the hash mode of the store, is the expected hash. 
+// in tree mode, the leaves of large data are hashed in parallel on the pool.
+static status verifyHash( const u8 *data, u64 size, const hash &expected, entity_hash_mode mode, WorkerPool &pool )
 {
-	hash ret;
+	ctStatusAutoReturnCall( digest, EntityHasher::Calculate( data, size, mode, &pool ) );
+	if( digest != expected )
+	{
+		// hash does not compare correctly, the data is corrupted
+		return status::corrupted;
+	}
+	return status::ok;
+}
 
-#ifdef PDS_USE_SHA256
-	// use sha256, cryptographically secure, but slower
-	ctle::hasher_sha256 hasher;
-#else
-	// use hasher_2x_xxh128_dcb7be9cd0fcf505, which concatenates two 128 bit xxhash hashes into a 256bit hash, with a salt of 'dcb7be9cd0fcf505' on the second hash
-	// caveat, not cryptographically secure, but much faster
-	ctle::hasher_2x_xxh128_dcb7be9cd0fcf505 hasher;
-#endif
+// HashingReadStreamSource passes reads through to a source, and hashes the data in order as it is read.
+// data which is skipped over is read and hashed when data after it is read, or by Finish.
+class HashingReadStreamSource : public ReadStreamSource
+{
+public:
+	HashingReadStreamSource( ReadStreamSource &_Source, entity_hash_mode mode ) : Source( _Source ), Hasher( mode ) {}
 
-	ctStatusCall(hasher.update( data, count ));
-	ctStatusReturnCall( ret, hasher.finish() );
+	virtual u64 GetSize() const override { return this->Source.GetSize(); }
 
-	return ret;
-}
+	virtual u64 Read( u64 offset, u8 *dest, u64 count ) override
+	{
+		if( offset > this->HashedSize )
+		{
+			this->HashUpTo( offset );
+		}
+
+		const u64 readCount = this->Source.Read( offset, dest, count );
+		if( offset <= this->HashedSize && this->HashedSize < offset + readCount )
+		{
+			this->Update( &dest[this->HashedSize - offset], offset + readCount - this->HashedSize );
+		}
+		return readCount;
+	}
+
+	// hash the rest of the data, and return the hash of all of the data
+	status_return<hash> Finish()
+	{
+		this->HashUpTo( this->Source.GetSize() );
+		ctStatusCall( this->HashStatus );
+		return this->Hasher.Finish( this->HashedSize );
+	}
+
+private:
+	ReadStreamSource &Source;
+	EntityHasher Hasher;
+	u64 HashedSize = 0;
+	status HashStatus = status::ok;
+
+	void Update( const u8 *data, u64 count )
+	{
+		if( this->HashStatus == status::ok )
+		{
+			this->HashStatus = this->Hasher.Update( data, count );
+		}
+		this->HashedSize += count;
+	}
+
+	void HashUpTo( u64 end )
+	{
+		std::vector<u8> buffer( (size_t)std::min( end - this->HashedSize, u64( 1024 * 64 ) ) );
+		while( this->HashedSize < end )
+		{
+			const u64 readCount = this->Source.Read( this->HashedSize, buffer.data(), std::min( (u64)buffer.size(), end - this->HashedSize ) );
+			if( readCount == 0 )
+			{
+				this->HashStatus = status::cant_read;
+				return;
+			}
+			this->Update( buffer.data(), readCount );
+		}
+	}
+};
 
 static status_return<std::shared_ptr<Entity>> entityNew( const std::vector<const EntityManager::PackageRecord *> &records, const char *entityTypeString )
 {
@@ -94,14 +151,18 @@ static status entityValidate( const std::vector<const EntityManager::PackageReco
 	return status::not_found;
 }
 
-void EntityManager::InsertEntity( const entity_ref &ref, const std::shared_ptr<const Entity> &entity )
+EntityManager::~EntityManager()
 {
-	ctle::readers_writer_lock::write_guard guard( this->EntitiesLock );
-
-	this->Entities.emplace( ref, entity );
+	// finish any queued tasks before the rest of the manager is torn down
+	this->Pool.Deinitialize();
 }
 
 status EntityManager::Initialize( const std::string &path, const std::vector<const PackageRecord *> &records )
+{
+	return this->Initialize( path, records, Settings() );
+}
+
+status EntityManager::Initialize( const std::string &path, const std::vector<const PackageRecord *> &records, const Settings &settings )
 {
 	if( !this->Path.empty() )
 	{
@@ -124,127 +185,576 @@ status EntityManager::Initialize( const std::string &path, const std::vector<con
 	}
 
 #endif
+	
+	// set up the storage backend
+	if( settings.StorageBackend == entity_storage_backend::pack_files )
+	{
+		auto storage = std::make_unique<PackEntityStorage>();
+		ctStatusCall( storage->Initialize( path, settings.MaxPackFileSize, settings.HashMode ) );
+		this->Storage = std::move( storage );
+	}
+	else
+	{
+		auto storage = std::make_unique<FileEntityStorage>();
+		ctStatusCall( storage->Initialize( path, settings.HashMode ) );
+		this->Storage = std::move( storage );
+	}
+	this->HashMode = this->Storage->GetHashMode();
+
 	this->Path = path;
 
-	// copy the package records
+	// copy the package records and settings
 	this->Records = records;
+	this->Config = settings;
+
+	// set up the cache
+	this->Cache.reset( new EntityCache( settings.CacheShardCount ) );
+	this->Cache->SetBudget( settings.CacheMaxEntityCount, settings.CacheMaxSize );
+
+	// start the workers
+	ctStatusCall( this->Pool.Initialize( settings.WorkerCount, settings.MaxQueueDepth ) );
 
 	return status::ok;
 }
 
-status EntityManager::ReadTask( EntityManager *pThis, const entity_ref ref )
+static status_return<std::shared_ptr<Entity>> entityDeserialize( const std::vector<const EntityManager::PackageRecord *> &records, ReadStream &rstream, std::vector<entity_ref> *referencedEntities, WorkerPool *pool, const std::vector<std::string> *projection, std::shared_ptr<const void> dataOwner )
 {
-	const uint hash_size = 32;
+	// detect the compact encoding by the format header
+	if( rstream.Peek() == EntityFileFormatMarker )
+	{
+		rstream.Read<u8>();
+		const u8 version = rstream.Read<u8>();
+		ctValidate( version == EntityFileFormatCompact, status::corrupted ) << "Unsupported entity file format version " << (uint)version << ctValidateEnd;
+		rstream.SetCompactEncoding( true );
+	}
 
-	// skip if entity already is loaded
-	if( pThis->IsEntityLoaded( ref ) )
+	EntityReader reader( rstream );
+	reader.SetEntityRefCollector( referencedEntities );
+	reader.SetWorkerPool( pool );
+	reader.SetDataOwner( std::move( dataOwner ) );
+
+	// read file header and deserialize the entity
+	std::string entityTypeString;
+	ctStatusAutoReturnCall( sectionReader, reader.BeginReadSection( pdsKeyMacro( EntityFile ), false ) )
+	ctStatusCall( sectionReader->Read<std::string>( pdsKeyMacro( EntityType ), entityTypeString ) )
+	ctStatusAutoReturnCall( entity, entityNew( records, entityTypeString.c_str() ) );
+	sectionReader->SetProjection( projection );
+	ctStatusCall( entityRead( records, entity.get(), *sectionReader ) );
+	ctStatusCall( reader.EndReadSection( sectionReader ) );
+	return entity;
+}
+
+status_return<EntityCache::Item> EntityManager::ReadEntity( EntityManager *pThis, const entity_ref &ref, std::vector<entity_ref> *referencedEntities, const std::vector<std::string> *projection, std::shared_ptr<EntityData> data )
+{
+	ctValidate( pThis->Storage != nullptr, status::not_initialized ) << "The EntityManager is not initialized" << ctValidateEnd;
+
+	// projected reads seek in the data, so they are not streamed
+	if( pThis->Config.StreamingReadWindowSize > 0 && !projection && !data )
 	{
-		return status::ok;
+		return ReadEntityStreamed( pThis, ref, referencedEntities );
 	}
 
-	// create the file name and path from the hash
-	const std::string fileName = to_string( hash( ref ) ) + ".dat";
-	const std::string filePath = pThis->Path + "/" + fileName;
+	const uint hash_size = 32;
 
-	std::vector<u8> allocation;
-	if( !ctle::read_file( filePath, allocation ) )
+	// map or read in the entity data. the data is kept alive until the entity is deserialized, verified if the verification is in the background, and read by the lazy values of the entity
+	if( !data )
 	{
-		return status::cant_read;
+		data = std::make_shared<EntityData>();
+		ctStatusCall( pThis->Storage->Read( hash( ref ), pThis->Config.UseMemoryMappedFiles, *data ) );
 	}
+	const u8 *buffer = data->GetData();
+	const u64 total_size = data->GetSize();
 
 	// cant be less in size than the size of the hash at the end
-	if( allocation.size() < hash_size )
+	if( total_size < hash_size )
 	{
 		return status::corrupted;
 	}
 
-	u8 *buffer = allocation.data();
-	u64 total_size = allocation.size();
+	// calculate the hash on the data, and make sure it compares correctly with the hash, unless the verification is deferred or skipped
+	hash_verification verification = pThis->Config.HashVerification;
+	if( projection )
+	{
+		verification = ( pThis->Config.ProjectedHashVerification == hash_verification::on_first_access ) ? hash_verification::background : pThis->Config.ProjectedHashVerification;
+	}
+	if( pThis->ShouldVerifyOnRead( verification ) )
+	{
+		ctStatusCall( verifyHash( buffer, total_size, hash( ref ), pThis->HashMode, pThis->Pool ) );
+	}
+	else if( verification == hash_verification::background || verification == hash_verification::on_first_access )
+	{
+		{
+			// an entity which is reloaded after a failed verification is verified again. 
+			// if a verification is in progress, it is kept, since the data is the same.
+			std::lock_guard<std::mutex> guard( pThis->UnverifiedEntitiesLock );
+			UnverifiedEntity &unverified = pThis->UnverifiedEntities[ref];
+			if( unverified.Corrupted )
+			{
+				unverified = UnverifiedEntity();
+			}
+			pThis->UnverifiedEntityCount = pThis->UnverifiedEntities.size();
+		}
+
+		if( verification == hash_verification::background )
+		{
+			pThis->Pool.Submit( [pThis, ref, data]()
+				{
+					const status result = verifyHash( data->GetData(), data->GetSize(), hash( ref ), pThis->HashMode, pThis->Pool );
+					if( result == status::ok )
+					{
+						std::lock_guard<std::mutex> guard( pThis->UnverifiedEntitiesLock );
+						pThis->UnverifiedEntities.erase( ref );
+						pThis->UnverifiedEntityCount = pThis->UnverifiedEntities.size();
+					}
+					else
+					{
+						pThis->ReportCorruptedEntity( ref, result );
+					}
+				} );
+		}
+	}
+
+	// set up a memory stream and deserialize
+	ReadStream rstream( buffer, total_size );
+	ctStatusAutoReturnCall( entity, entityDeserialize( pThis->Records, rstream, referencedEntities, &pThis->Pool, projection, data ) );
+
+	EntityCache::Item item;
+	item.Ref = ref;
+	item.Value = std::move( entity );
+	item.Size = total_size;
+	return item;
+}
+
+bool EntityManager::ShouldVerifyOnRead( hash_verification verification )
+{
+	switch( verification )
+	{
+		case hash_verification::sampled:
+		{
+			const u64 rate = ( this->Config.HashVerificationSampleRate > 1 ) ? u64( this->Config.HashVerificationSampleRate ) : 1;
+			return ( this->LoadCount++ % rate ) == 0;
+		}
+		case hash_verification::background:
+		case hash_verification::on_first_access:
+			return false;
+		default:
+			return true;
+	}
+}
+
+status EntityManager::VerifyLoadedEntity( const entity_ref &ref )
+{
+	// read the data again, the data which was deserialized is not kept while the entity is unverified
+	EntityData data;
+	ctStatusCall( this->Storage->Read( hash( ref ), this->Config.UseMemoryMappedFiles, data ) );
+	return verifyHash( data.GetData(), data.GetSize(), hash( ref ), this->HashMode, this->Pool );
+}
+
+void EntityManager::ReportCorruptedEntity( const entity_ref &ref, status result )
+{
+	// keep the entity marked as corrupted, in case it is inserted into the cache after it is removed here
+	{
+		std::lock_guard<std::mutex> guard( this->UnverifiedEntitiesLock );
+		this->UnverifiedEntities[ref].Corrupted = true;
+		this->UnverifiedEntityCount = this->UnverifiedEntities.size();
+	}
+	this->Cache->Remove( ref );
+	++this->CorruptedEntityCount;
+
+	ctLogError << "The data of a loaded entity failed the deferred hash verification" << ctLogEnd;
 
-	// calculate the sha256 hash on the data, and make sure it compares correctly with the hash
-	ctStatusAutoReturnCall( digest, calculateHash( buffer, total_size) );
-	if( digest != hash( ref ) )
+	if( this->Config.CorruptionCallback )
+	{
+		this->Config.CorruptionCallback( ref, result );
+	}
+}
+
+status_return<EntityCache::Item> EntityManager::ReadEntityStreamed( EntityManager *pThis, const entity_ref &ref, std::vector<entity_ref> *referencedEntities )
+{
+	const uint hash_size = 32;
+
+	FileReadStreamSource source;
+	ctStatusCall( pThis->Storage->OpenSource( hash( ref ), source ) );
+	const u64 total_size = source.GetSize();
+
+	// cant be less in size than the size of the hash at the end
+	if( total_size < hash_size )
 	{
-		// sha hash does not compare correctly, file is corrupted
 		return status::corrupted;
 	}
 
-	// set up a memory stream and deserializer
-	ReadStream rstream( buffer, total_size );
-	EntityReader reader( rstream );
+	// deserialize from a stream which reads the data in windows, and hash the data as it is read. 
+	// the stream is released before the hash is finished, so there is no read-ahead still reading the source.
+	HashingReadStreamSource hashingSource( source, pThis->HashMode );
+	std::shared_ptr<Entity> entity;
+	{
+		ReadStream rstream( &hashingSource, pThis->Config.StreamingReadWindowSize );
+		ctStatusReturnCall( entity, entityDeserialize( pThis->Records, rstream, referencedEntities, &pThis->Pool, nullptr, nullptr ) );
+	}
 
-	// read file header and deserialize the entity
-	std::string entityTypeString;
-	ctStatusAutoReturnCall( sectionReader, reader.BeginReadSection( pdsKeyMacro( EntityFile ), false ) )
-	ctStatusCall( sectionReader->Read<std::string>( pdsKeyMacro( EntityType ), entityTypeString ) )
-	ctStatusAutoReturnCall( entity, entityNew( pThis->Records, entityTypeString.c_str() ) );
-	ctStatusCall( entityRead( pThis->Records, entity.get(), *sectionReader ) );
-	ctStatusCall( reader.EndReadSection( sectionReader ) );
+	// the entity is only returned if the hash of all of the data compares correctly
+	ctStatusAutoReturnCall( digest, hashingSource.Finish() );
+	ctValidate( digest == hash( ref ), status::corrupted ) << "The entity data is corrupted" << ctValidateEnd;
 
-	// transfer into the Entities map 
-	pThis->InsertEntity( ref, entity );
+	EntityCache::Item item;
+	item.Ref = ref;
+	item.Value = std::move( entity );
+	item.Size = total_size;
+	return item;
+}
 
-	// done
-	return status::ok;
+bool EntityManager::ClaimLoad( const entity_ref &ref, std::promise<status> &promise, std::shared_future<status> &pending )
+{
+	std::lock_guard<std::mutex> guard( this->InFlightLock );
+
+	const auto it = this->InFlight.find( ref );
+	if( it != this->InFlight.end() )
+	{
+		pending = it->second;
+		++this->JoinedLoads;
+		return false;
+	}
+
+	this->InFlight.emplace( ref, promise.get_future().share() );
+	return true;
+}
+
+void EntityManager::FinishLoad( const entity_ref &ref, std::promise<status> &promise, status result )
+{
+	{
+		std::lock_guard<std::mutex> guard( this->InFlightLock );
+		this->InFlight.erase( ref );
+	}
+	promise.set_value( result );
+
+	// the load may run on a thread outside of the pool, wake up the workers waiting for it
+	this->Pool.NotifyWaiters();
+}
+
+status EntityManager::ReadTask( EntityManager *pThis, const entity_ref ref, bool collectReferences )
+{
+	// skip if entity already is loaded
+	if( pThis->Cache->Find( ref ) )
+	{
+		return status::ok;
+	}
+
+	// if the entity is already being loaded, wait for that load instead of loading it again
+	std::promise<status> promise;
+	std::shared_future<status> pending;
+	if( !pThis->ClaimLoad( ref, promise, pending ) )
+	{
+		pThis->Pool.Wait( pending );
+		return pending.get();
+	}
+
+	// the entity may have been loaded between the lookup and the claim
+	status result = status::ok;
+	if( !pThis->Cache->Contains( ref ) )
+	{
+		std::vector<entity_ref> references;
+		auto item = ReadEntity( pThis, ref, ( collectReferences ) ? &references : nullptr );
+		result = item.status();
+
+		// transfer into the cache, before the load is finished, so the entity is either in flight or cached
+		if( item.status() )
+		{
+			if( collectReferences )
+			{
+				item.value().References = std::make_shared<const std::vector<entity_ref>>( std::move( references ) );
+			}
+			pThis->Cache->Insert( &item.value(), 1 );
+		}
+	}
+
+	pThis->FinishLoad( ref, promise, result );
+	return result;
 }
 
 std::future<status> EntityManager::LoadEntityAsync( const entity_ref &ref )
 {
-	return std::async( ReadTask, this, ref );
+	return this->Pool.Submit( [this, ref]() { return ReadTask( this, ref ); } );
 }
 
 status EntityManager::LoadEntity( const entity_ref &ref )
 {
-	auto futr = this->LoadEntityAsync( ref );
-	futr.wait();
-	return futr.get();
+	// no need to go through the pool, run on the calling thread
+	return ReadTask( this, ref );
 }
 
-status EntityManager::UnloadNonReferencedEntities()
+status_return<std::shared_ptr<const Entity>> EntityManager::LoadEntityProjected( const entity_ref &ref, const std::vector<std::string> &keyPaths )
 {
-	ctle::readers_writer_lock::write_guard guard( this->EntitiesLock );
+	ctStatusAutoReturnCall( item, ReadEntity( this, ref, nullptr, &keyPaths ) );
+	return std::shared_ptr<const Entity>( std::move( item.Value ) );
+}
 
-	auto it = this->Entities.begin();
-	while( it != this->Entities.end() )
+status EntityManager::LoadEntities( const std::vector<entity_ref> &refs )
+{
+	ctValidate( this->Storage != nullptr, status::not_initialized ) << "The EntityManager is not initialized" << ctValidateEnd;
+
+	// remove duplicates and entities which are already loaded, with a single lock of the cache
+	const std::vector<entity_ref> missing = this->Cache->FindMissing( refs );
+	std::vector<hash> keys( missing.begin(), missing.end() );
+	std::sort( keys.begin(), keys.end() );
+	keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+
+	// order the reads so they are as sequential as possible in the storage
+	this->Storage->SortForReading( keys );
+
+	// claim the loads, with a single lock. entities which are already being loaded are waited for instead, and 
+	// entities which were loaded since the lookup are skipped. (loads are inserted into the cache before they are 
+	// removed from InFlight, so an entity is either in flight or cached.)
+	std::vector<std::promise<status>> promises( keys.size() );
+	std::vector<std::shared_future<status>> pending;
 	{
-		// if this entity is only held by us, remove it, else skip to next
-		if( it->second.use_count() == 1 )
+		std::lock_guard<std::mutex> guard( this->InFlightLock );
+
+		size_t claimed = 0;
+		for( size_t i = 0; i < keys.size(); ++i )
 		{
-			it = this->Entities.erase( it );
+			const auto it = this->InFlight.find( keys[i] );
+			if( it != this->InFlight.end() )
+			{
+				pending.emplace_back( it->second );
+				continue;
+			}
+			if( this->Cache->Contains( entity_ref( keys[i] ) ) )
+			{
+				continue;
+			}
+			this->InFlight.emplace( keys[i], promises[claimed].get_future().share() );
+			keys[claimed++] = keys[i];
 		}
-		else
+		keys.resize( claimed );
+		promises.resize( claimed );
+		this->JoinedLoads += pending.size();
+	}
+
+	// read the data in storage order, where entities next to each other are read together. streamed entities are read by each load.
+	std::vector<std::shared_ptr<EntityData>> datas( keys.size() );
+	std::vector<status> readResults( keys.size(), status::ok );
+	if( this->Config.StreamingReadWindowSize == 0 )
+	{
+		this->Storage->ReadBatch( keys, this->Config.UseMemoryMappedFiles, datas, readResults );
+	}
+
+	// verify and deserialize in parallel
+	std::vector<status_return<EntityCache::Item>> results( keys.size(), status::fail );
+	this->Pool.ParallelFor( keys.size(), [this, &keys, &datas, &readResults, &results]( size_t index )
+		{
+			if( readResults[index] != status::ok )
+			{
+				results[index] = readResults[index];
+				return;
+			}
+			results[index] = ReadEntity( this, entity_ref( keys[index] ), nullptr, nullptr, std::move( datas[index] ) );
+		} );
+
+	// insert all loaded entities, with a single lock of the cache
+	status result = status::ok;
+	std::vector<EntityCache::Item> items;
+	items.reserve( keys.size() );
+	for( const auto &ret : results )
+	{
+		if( ret.status() )
+			items.emplace_back( ret.value() );
+		else if( result == status::ok )
+			result = ret.status();
+	}
+	this->Cache->Insert( items.data(), items.size() );
+
+	// finish the claimed loads, and wait for the loads of the other calls
+	{
+		std::lock_guard<std::mutex> guard( this->InFlightLock );
+		for( const auto &key : keys )
 		{
-			++it;
+			this->InFlight.erase( key );
 		}
 	}
+	for( size_t i = 0; i < keys.size(); ++i )
+	{
+		promises[i].set_value( results[i].status() );
+	}
+	this->Pool.NotifyWaiters();
+	for( const auto &futr : pending )
+	{
+		this->Pool.Wait( futr );
+		if( futr.get() != status::ok && result == status::ok )
+			result = futr.get();
+	}
 
+	return result;
+}
+
+void EntityManager::ScheduleGraphLoad( const std::shared_ptr<GraphLoad> &load, const entity_ref &ref, uint depth )
+{
+	// skip entities which are already scheduled, unless they now need to be loaded to a larger depth
+	{
+		std::lock_guard<std::mutex> guard( load->Lock );
+		const auto it = load->ScheduledDepth.find( ref );
+		if( it != load->ScheduledDepth.end() && it->second >= depth )
+		{
+			return;
+		}
+		load->ScheduledDepth[ref] = depth;
+	}
+
+	// count the task before it is submitted, so the load can't be finished by another task in the meantime
+	++load->PendingTasks;
+	this->Pool.Submit( [this, load, ref, depth]() { GraphLoadTask( this, load, ref, depth ); } );
+}
+
+void EntityManager::GraphLoadTask( EntityManager *pThis, const std::shared_ptr<GraphLoad> &load, const entity_ref ref, const uint depth )
+{
+	// load the entity, or join the load which is already in flight, and collect the references if they are needed
+	status result = ReadTask( pThis, ref, depth > 0 );
+
+	std::shared_ptr<const std::vector<entity_ref>> references;
+	if( result == status::ok && depth > 0 && !pThis->Cache->FindReferences( ref, references ) )
+	{
+		// the entity was loaded or added without collecting its references, read them once, and keep them for later loads
+		std::vector<entity_ref> referencedEntities;
+		auto item = ReadEntity( pThis, ref, &referencedEntities );
+		result = item.status();
+		if( item.status() )
+		{
+			references = std::make_shared<const std::vector<entity_ref>>( std::move( referencedEntities ) );
+			pThis->Cache->SetReferences( ref, references );
+		}
+	}
+
+	// schedule the referenced entities, before this task is marked as done
+	if( references )
+	{
+		for( const auto &child : *references )
+		{
+			if( child )
+			{
+				pThis->ScheduleGraphLoad( load, child, depth - 1 );
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> guard( load->Lock );
+	if( result != status::ok && load->Result == status::ok )
+	{
+		load->Result = result;
+	}
+	if( --load->PendingTasks == 0 )
+	{
+		load->Promise.set_value( load->Result );
+	}
+}
+
+std::future<status> EntityManager::LoadEntityGraphAsync( const entity_ref &ref, uint depth )
+{
+	auto load = std::make_shared<GraphLoad>();
+	auto futr = load->Promise.get_future();
+	this->ScheduleGraphLoad( load, ref, depth );
+	return futr;
+}
+
+status EntityManager::UnloadNonReferencedEntities()
+{
+	this->Cache->EvictUnreferenced();
 	return status::ok;
 }
 
 
 bool EntityManager::IsEntityLoaded( const entity_ref &ref )
 {
-	ctle::readers_writer_lock::read_guard guard( this->EntitiesLock );
-
-	return this->Entities.find( ref ) != this->Entities.end();
+	return this->Cache->Contains( ref );
 }
 
 std::shared_ptr<const Entity> EntityManager::GetLoadedEntity( const entity_ref &ref )
 {
-	ctle::readers_writer_lock::read_guard guard( this->EntitiesLock );
+	auto entity = this->Cache->Find( ref );
+	if( !entity || this->UnverifiedEntityCount == 0 )
+	{
+		return entity;
+	}
 
-	const auto it = this->Entities.find( ref );
-	if( it == this->Entities.end() )
-		return nullptr;
+	// check if the entity has been verified. if it is to be verified on first access, either claim 
+	// the verification, or wait for the verification which is in progress on another thread
+	std::promise<status> promise;
+	std::shared_future<status> verification;
+	bool verify = false;
+	{
+		std::lock_guard<std::mutex> guard( this->UnverifiedEntitiesLock );
+		const auto it = this->UnverifiedEntities.find( ref );
+		if( it == this->UnverifiedEntities.end() )
+		{
+			return entity;
+		}
+		if( it->second.Corrupted )
+		{
+			// a verification failed, after which the entity was inserted into the cache
+			this->Cache->Remove( ref );
+			return nullptr;
+		}
+		if( this->Config.HashVerification != hash_verification::on_first_access )
+		{
+			return entity;
+		}
+		if( !it->second.Verification.valid() )
+		{
+			it->second.Verification = promise.get_future().share();
+			verify = true;
+		}
+		verification = it->second.Verification;
+	}
 
-	return it->second;
+	if( verify )
+	{
+		// the entry is kept until the verification is done, and is kept as corrupted if it failed
+		const status result = this->VerifyLoadedEntity( ref );
+		if( result == status::ok )
+		{
+			std::lock_guard<std::mutex> guard( this->UnverifiedEntitiesLock );
+			this->UnverifiedEntities.erase( ref );
+			this->UnverifiedEntityCount = this->UnverifiedEntities.size();
+		}
+		else
+		{
+			this->ReportCorruptedEntity( ref, result );
+		}
+		promise.set_value( result );
+	}
+
+	// all callers get the result of the one verification
+	return ( verification.get() == status::ok ) ? entity : nullptr;
 }
 
-status_return<entity_ref> EntityManager::WriteTask( EntityManager *pThis, std::shared_ptr<const Entity> entity )
+status_return<EntityCache::Item> EntityManager::StoreEntity( EntityManager *pThis, const std::shared_ptr<const Entity> &entity )
 {
+	ctValidate( pThis->Storage != nullptr, status::not_initialized ) << "The EntityManager is not initialized" << ctValidateEnd;
+
+	EntityCache::Item item;
+	item.Value = entity;
+
+	// if this entity object is already added or loaded, it is immutable, and is already stored. 
+	// there is no need to serialize it again. (it is already cached, so the size is not needed.)
+	if( pThis->Cache->FindRef( entity.get(), item.Ref ) )
+	{
+		return item;
+	}
+
+	// in tree mode, without compact encoding, the data is hashed while it is serialized, so each leaf is hashed while 
+	// it is still in the cache. otherwise the data is hashed by FinishHash.
 	EntityValidator validator;
-	WriteStream wstream;
-	EntityWriter writer( wstream );
+	EntityHasher hasher( pThis->HashMode );
+	WriteStreamPool::Handle wstream = WriteStreamPool::Acquire( pThis->StoredSizeHint );
+	wstream->SetHasher( &hasher );
+	wstream->SetCompressionThreshold( pThis->Config.ArrayCompressionThreshold );
+	wstream->SetSectionsArrayOffsetThreshold( pThis->Config.SectionsArrayOffsetThreshold );
+	if( pThis->Config.CompactEncoding )
+	{
+		wstream->SetCompactEncoding( true );
+		wstream->Write( EntityFileFormatMarker );
+		wstream->Write( EntityFileFormatCompact );
+	}
+	EntityWriter writer( *wstream );
+	writer.SetWorkerPool( &pThis->Pool );
 
 	// make sure the entity is valid
 	ctStatusCall(entityValidate( pThis->Records, entity.get(), validator ) );
@@ -257,37 +767,103 @@ status_return<entity_ref> EntityManager::WriteTask( EntityManager *pThis, std::s
 	ctStatusCall( writer.EndWriteSection( sectionWriter ) );
 
 	// get file data
-	const u8 *writeBuffer = (u8 *)wstream.GetData();
-	const u64 totalBytesToWrite = wstream.GetSize();
+	const u8 *writeBuffer = (u8 *)wstream->GetData();
+	const u64 totalBytesToWrite = wstream->GetSize();
 
-	// calculate the hash on the data
-	ctStatusAutoReturnCall( digest, calculateHash( writeBuffer, totalBytesToWrite ) );
+	// hash the rest of the data
+	ctStatusAutoReturnCall( digest, wstream->FinishHash() );
 	
-	// create the file name and path from the hash
-	const std::string fileName = to_string( digest ) + ".dat";
-	const std::string filePath = pThis->Path + "/" + fileName;
+	// store the data, if it is not already stored
+	ctStatusCall( pThis->Storage->Write( digest, writeBuffer, totalBytesToWrite ) );
+
+	item.Ref = entity_ref( digest );
+	item.Size = totalBytesToWrite;
 
-	// if the file does not exist, create and write it
-	if( !ctle::file_exists( filePath ) )
-		ctStatusCall( ctle::write_file( filePath, writeBuffer, (size_t)totalBytesToWrite, true ) );
+	// keep a running average of the sizes, to size the streams of the next writes
+	const u64 sizeHint = pThis->StoredSizeHint;
+	pThis->StoredSizeHint = sizeHint - ( sizeHint / 8 ) + ( totalBytesToWrite / 8 );
+	return item;
+}
+
+status_return<entity_ref> EntityManager::WriteTask( EntityManager *pThis, std::shared_ptr<const Entity> entity )
+{
+	ctStatusAutoReturnCall( item, StoreEntity( pThis, entity ) );
 
-	// transfer into the Entities map 
-	pThis->InsertEntity( entity_ref( digest ), entity );
+	// transfer into the cache
+	pThis->Cache->Insert( &item, 1 );
 
 	// done
-	return entity_ref( digest );
+	return item.Ref;
 }
 
 std::future<status_return<entity_ref>> EntityManager::AddEntityAsync( const std::shared_ptr<const Entity> &entity )
 {
-	return std::async( WriteTask, this, entity );
+	return this->Pool.Submit( [this, entity]() { return WriteTask( this, entity ); } );
 }
 
 status_return<entity_ref> EntityManager::AddEntity( const std::shared_ptr<const Entity> &entity )
 {
-	auto futr = this->AddEntityAsync( entity );
-	futr.wait();
-	return futr.get();
+	// no need to go through the pool, run on the calling thread
+	return WriteTask( this, entity );
+}
+
+status_return<std::vector<entity_ref>> EntityManager::AddEntities( const std::vector<std::shared_ptr<const Entity>> &entities )
+{
+	ctValidate( this->Storage != nullptr, status::not_initialized ) << "The EntityManager is not initialized" << ctValidateEnd;
+
+	// serialize, hash and store in parallel
+	std::vector<status_return<EntityCache::Item>> results( entities.size(), status::fail );
+	this->Pool.ParallelFor( entities.size(), [this, &entities, &results]( size_t index )
+		{
+			results[index] = StoreEntity( this, entities[index] );
+		} );
+
+	std::vector<EntityCache::Item> items;
+	std::vector<entity_ref> refs;
+	items.reserve( entities.size() );
+	refs.reserve( entities.size() );
+	for( const auto &result : results )
+	{
+		ctStatusCall( result.status() );
+		items.emplace_back( result.value() );
+		refs.emplace_back( result.value().Ref );
+	}
+
+	// insert all entities, with a single lock of the cache
+	this->Cache->Insert( items.data(), items.size() );
+
+	return refs;
+}
+
+status EntityManager::CompactStorage( const std::function<bool( const entity_ref & )> &keep )
+{
+	ctValidate( this->Storage != nullptr, status::not_initialized ) << "The EntityManager is not initialized" << ctValidateEnd;
+
+	ctStatusCall( this->Storage->Compact( [&keep]( const hash &key ) { return keep( entity_ref( key ) ); } ) );
+
+	// cached entities may have been removed from the storage, so they must be stored again if they are re-added
+	this->Cache->ClearRefsOfValues();
+	return status::ok;
+}
+
+std::vector<WorkerPool::QueueMetrics> EntityManager::GetQueueMetrics() const
+{
+	return this->Pool.GetQueueMetrics();
+}
+
+u64 EntityManager::GetJoinedLoadCount() const
+{
+	return this->JoinedLoads;
+}
+
+EntityCache::Metrics EntityManager::GetCacheMetrics()
+{
+	return this->Cache->GetMetrics();
+}
+
+u64 EntityManager::GetCorruptedEntityCount() const
+{
+	return this->CorruptedEntityCount;
 }
 
 #include "_pds_undef_macros.inl"
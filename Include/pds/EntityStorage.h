@@ -0,0 +1,193 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+#pragma once
+#ifndef __PDS__ENTITYSTORAGE_H__
+#define __PDS__ENTITYSTORAGE_H__
+
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ctle/readers_writer_lock.h>
+
+#include "fwd.h"
+#include "MappedFile.h"
+#include "EntityHasher.h"
+
+namespace pds
+{
+
+// the storage backends which can be used by the EntityManager
+enum class entity_storage_backend : uint
+{
+	file_per_entity = 0,	// each entity is stored in a separate file named <hash>.dat
+	pack_files = 1,			// entities are appended to pack files, and located through an index
+};
+
+// EntityData holds the raw serialized data of a stored entity, either mapped
+// directly from the storage, or read into an allocation.
+class EntityData
+{
+public:
+	// map a range of a file. if size is 0, the file is mapped from offset to the end of the file
+	status Map( const std::string &filePath, u64 offset = 0, u64 size = 0 );
+
+	// read a range of a file into an allocation. if size is 0, the file is read from offset to the end of the file
+	status Load( const std::string &filePath, u64 offset = 0, u64 size = 0 );
+
+	// reference a range of data which is owned by another object, such as a read which is shared by multiple entities
+	void Share( std::shared_ptr<const void> owner, const u8 *data, u64 size );
+
+	// release the data
+	void Clear();
+
+	const u8 *GetData() const { return this->Data; }
+	u64 GetSize() const { return this->DataSize; }
+
+private:
+	MappedFile Mapping;
+	std::vector<u8> Allocation;
+	std::shared_ptr<const void> SharedOwner;
+	const u8 *Data = nullptr;
+	u64 DataSize = 0;
+};
+
+// EntityStorage is the interface of the content-addressed storage of serialized entities.
+// Entities are stored and located using the hash of the serialized data.
+// The storage methods must be thread safe.
+class EntityStorage
+{
+public:
+	virtual ~EntityStorage() = default;
+
+	// the hash mode of the entity refs of the store, which is recorded in the store metadata, see InitializeMetadata
+	entity_hash_mode GetHashMode() const { return this->HashMode; }
+
+	// returns true if the storage has an entity with the hash
+	virtual bool Contains( const hash &key ) = 0;
+
+	// stores the serialized data of an entity. if the hash is already stored, nothing is written
+	virtual status Write( const hash &key, const u8 *data, u64 size ) = 0;
+
+	// reads the serialized data of an entity, either mapped or into an allocation
+	virtual status Read( const hash &key, bool memoryMapped, EntityData &dest ) = 0;
+
+	// reads the serialized data of a batch of entities, which are sorted with SortForReading. results[i] is the 
+	// status of the read of keys[i]. the default reads the entities one at a time.
+	virtual void ReadBatch( const std::vector<hash> &keys, bool memoryMapped, std::vector<std::shared_ptr<EntityData>> &dest, std::vector<status> &results );
+
+	// opens the serialized data of an entity as a source, so it can be read in windows 
+	// instead of all at once. returns not_found if the entity is not stored.
+	virtual status OpenSource( const hash &key, FileReadStreamSource &dest ) = 0;
+
+	// removes all stored entities for which keep returns false, and reclaims the space used
+	virtual status Compact( const std::function<bool( const hash & )> &keep ) = 0;
+
+	// sorts a list of hashes in the order they are best read from the storage, so that 
+	// batched reads are done as sequentially as possible. the default sorts by hash value.
+	virtual void SortForReading( std::vector<hash> &keys );
+
+protected:
+	entity_hash_mode HashMode = entity_hash_mode::flat;
+
+	// reads the metadata of the store, <path>/store.meta, or records it if the store is new. a new store gets hashMode, 
+	// while an existing store keeps the hash mode it was created with. a store which has entities but no metadata was 
+	// created before the metadata was recorded, and has flat hashes.
+	status InitializeMetadata( const std::string &path, bool hasEntities, entity_hash_mode hashMode );
+};
+
+// FileEntityStorage stores each entity in a separate file, <path>/<hash>.dat
+class FileEntityStorage : public EntityStorage
+{
+public:
+	// hashMode is the hash mode of a new store, see EntityStorage::InitializeMetadata
+	status Initialize( const std::string &path, entity_hash_mode hashMode = entity_hash_mode::flat );
+
+	virtual bool Contains( const hash &key ) override;
+	virtual status Write( const hash &key, const u8 *data, u64 size ) override;
+	virtual status Read( const hash &key, bool memoryMapped, EntityData &dest ) override;
+	virtual status OpenSource( const hash &key, FileReadStreamSource &dest ) override;
+	virtual status Compact( const std::function<bool( const hash & )> &keep ) override;
+
+private:
+	std::string Path;
+
+	std::string GetFilePath( const hash &key ) const;
+};
+
+// PackEntityStorage appends entities to pack files, <path>/pack_<number>.pack, and keeps an
+// append-only index log, <path>/pack_index.idx, of the (pack, offset, size) of each hash.
+// The pack records are self-describing, so if the index is missing or damaged, it is
+// rebuilt by scanning the packs. Compact rewrites the kept entities to new packs, and
+// deletes the old packs.
+class PackEntityStorage : public EntityStorage
+{
+public:
+	// the pack files are closed, and a new pack is started, when they grow larger than maxPackSize.
+	// hashMode is the hash mode of a new store, see EntityStorage::InitializeMetadata
+	status Initialize( const std::string &path, u64 maxPackSize, entity_hash_mode hashMode = entity_hash_mode::flat );
+
+	virtual bool Contains( const hash &key ) override;
+	virtual status Write( const hash &key, const u8 *data, u64 size ) override;
+	virtual status Read( const hash &key, bool memoryMapped, EntityData &dest ) override;
+	virtual status OpenSource( const hash &key, FileReadStreamSource &dest ) override;
+	virtual status Compact( const std::function<bool( const hash & )> &keep ) override;
+	virtual void SortForReading( std::vector<hash> &keys ) override;
+
+	// entities which are stored next to each other in a pack (with at most MaxReadGap bytes between them) 
+	// are read with a single read, of at most MaxCoalescedReadSize bytes, which the entities share
+	virtual void ReadBatch( const std::vector<hash> &keys, bool memoryMapped, std::vector<std::shared_ptr<EntityData>> &dest, std::vector<status> &results ) override;
+	static const u64 MaxReadGap = 64 * 1024;
+	static const u64 MaxCoalescedReadSize = 16 * 1024 * 1024;
+
+	// returns the number of stored entities, and the number of pack files
+	size_t GetEntityCount();
+	size_t GetPackCount();
+
+private:
+	struct Location
+	{
+		u32 Pack = 0;
+		u64 Offset = 0; // offset of the entity data in the pack
+		u64 Size = 0;
+	};
+
+	// sorts locations in pack order
+	static bool LocationLess( const std::pair<hash, Location> &a, const std::pair<hash, Location> &b );
+
+	std::string Path;
+	u64 MaxPackSize = 0;
+
+	// the index, and the set of pack numbers in use. packs numbered below FirstPack 
+	// are left over from a compaction, and are not used
+	std::unordered_map<hash, Location> Index;
+	std::set<u32> Packs;
+	u32 FirstPack = 0;
+	ctle::readers_writer_lock IndexLock;
+
+	// the pack which is currently appended to, and the index log. writes are serialized with WriteLock
+	std::mutex WriteLock;
+	std::ofstream CurrentPackFile;
+	u32 CurrentPack = 0;
+	u64 CurrentPackSize = 0;
+	std::ofstream IndexFile;
+
+	std::string GetPackPath( u32 pack ) const;
+	std::string GetIndexPath() const;
+
+	status ReadIndex( const std::map<u32, u64> &packSizes, bool &indexIsClean );
+	status ScanPack( u32 pack, u64 startOffset, u64 &endOffset, bool &packIsClean );
+	status WriteIndex();
+	status AppendIndexEntry( const hash &key, const Location &location );
+	status StartNewPack();
+	status AppendEntity( const hash &key, const u8 *data, u64 size, Location &location );
+};
+
+}
+// namespace pds
+
+#ifdef PDS_IMPLEMENTATION
+#include "EntityStorage.inl"
+#endif//PDS_IMPLEMENTATION
+
+#endif//__PDS__ENTITYSTORAGE_H__
@@ -0,0 +1,799 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include <algorithm>
+#include <cstdio>
+
+#if defined(__GNUC__) && !defined(_MSC_VER)
+#include <dirent.h>
+#endif
+
+#include <ctle/file_funcs.h>
+#include <ctle/log.h>
+
+#include "WriteStream.h"
+#include "ReadStream.h"
+
+namespace pds
+{
+#include "_pds_macros.inl"
+
+// pack file header: magic "PDSPACK1"
+// pack record: u64 data size, hash, data
+static const u64 packFileMagic = 0x314b434150534450;
+static const u64 packFileHeaderSize = sizeof( u64 );
+static const u64 packRecordHeaderSize = sizeof( u64 ) + sizeof( hash );
+
+// index file header: magic "PDSINDX1", u32 first pack
+// index entry: hash, u32 pack, u64 data offset, u64 data size
+static const u64 packIndexMagic = 0x3158444e49534450;
+static const u64 packIndexHeaderSize = sizeof( u64 ) + sizeof( u32 );
+static const u64 packIndexEntrySize = sizeof( hash ) + sizeof( u32 ) + sizeof( u64 ) + sizeof( u64 );
+
+// store metadata file: magic "PDSMETA1", u8 hash mode
+static const u64 storeMetadataMagic = 0x314154454d534450;
+static const u64 storeMetadataSize = sizeof( u64 ) + sizeof( u8 );
+
+// list the names of the files in a directory
+static status storageListDirectory( const std::string &path, std::vector<std::string> &fileNames )
+{
+	fileNames.clear();
+
+#ifdef _MSC_VER
+
+	WIN32_FIND_DATAA findData = {};
+	HANDLE findHandle = ::FindFirstFileA( ( path + "\\*" ).c_str(), &findData );
+	if( findHandle == INVALID_HANDLE_VALUE )
+	{
+		return status::cant_read;
+	}
+	do
+	{
+		if( ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) == 0 )
+			fileNames.emplace_back( findData.cFileName );
+	}
+	while( ::FindNextFileA( findHandle, &findData ) );
+	::FindClose( findHandle );
+
+#elif defined(__GNUC__)
+
+	DIR *dir = ::opendir( path.c_str() );
+	if( dir == nullptr )
+	{
+		return status::cant_read;
+	}
+	while( struct dirent *entry = ::readdir( dir ) )
+	{
+		fileNames.emplace_back( entry->d_name );
+	}
+	::closedir( dir );
+
+#endif
+
+	return status::ok;
+}
+
+// get the size of a file, or 0 if the file can not be opened
+static u64 storageFileSize( const std::string &filePath )
+{
+	std::ifstream file( filePath, std::ios::binary | std::ios::ate );
+	if( !file )
+		return 0;
+	return (u64)file.tellg();
+}
+
+// get the pack number from a pack file name, pack_<number>.pack, or 0 if the name is not a pack file name
+static u32 storagePackNumber( const std::string &fileName )
+{
+	const std::string prefix = "pack_";
+	const std::string suffix = ".pack";
+	if( fileName.size() != prefix.size() + 8 + suffix.size()
+		|| fileName.compare( 0, prefix.size(), prefix ) != 0
+		|| fileName.compare( fileName.size() - suffix.size(), suffix.size(), suffix ) != 0 )
+		return 0;
+
+	u32 pack = 0;
+	for( size_t i = prefix.size(); i < prefix.size() + 8; ++i )
+	{
+		if( fileName[i] < '0' || fileName[i] > '9' )
+			return 0;
+		pack = pack * 10 + u32( fileName[i] - '0' );
+	}
+	return pack;
+}
+
+status EntityData::Map( const std::string &filePath, u64 offset, u64 size )
+{
+	this->Clear();
+
+	ctStatusCall( this->Mapping.Open( filePath, offset, size ) );
+	this->Data = this->Mapping.GetData();
+	this->DataSize = this->Mapping.GetSize();
+	return status::ok;
+}
+
+status EntityData::Load( const std::string &filePath, u64 offset, u64 size )
+{
+	this->Clear();
+
+	std::ifstream file( filePath, std::ios::binary | std::ios::ate );
+	if( !file )
+	{
+		return status::cant_read;
+	}
+
+	// check the range
+	const u64 fileSize = (u64)file.tellg();
+	if( size == 0 && offset <= fileSize )
+	{
+		size = fileSize - offset;
+	}
+	ctValidate( offset <= fileSize && size <= fileSize - offset, status::invalid_param )
+		<< "The range (offset: " << offset << ", size: " << size << ") is out of bounds of the file " << filePath << ctValidateEnd;
+
+	this->Allocation.resize( (size_t)size );
+	file.seekg( (std::streamoff)offset );
+	file.read( (char *)this->Allocation.data(), (std::streamsize)size );
+	if( !file )
+	{
+		this->Allocation.clear();
+		return status::cant_read;
+	}
+
+	this->Data = this->Allocation.data();
+	this->DataSize = size;
+	return status::ok;
+}
+
+void EntityData::Share( std::shared_ptr<const void> owner, const u8 *data, u64 size )
+{
+	this->Clear();
+
+	this->SharedOwner = std::move( owner );
+	this->Data = data;
+	this->DataSize = size;
+}
+
+void EntityData::Clear()
+{
+	this->Mapping.Close();
+	this->Allocation.clear();
+	this->SharedOwner.reset();
+	this->Data = nullptr;
+	this->DataSize = 0;
+}
+
+void EntityStorage::SortForReading( std::vector<hash> &keys )
+{
+	std::sort( keys.begin(), keys.end() );
+}
+
+void EntityStorage::ReadBatch( const std::vector<hash> &keys, bool memoryMapped, std::vector<std::shared_ptr<EntityData>> &dest, std::vector<status> &results )
+{
+	dest.resize( keys.size() );
+	results.resize( keys.size() );
+	for( size_t i = 0; i < keys.size(); ++i )
+	{
+		dest[i] = std::make_shared<EntityData>();
+		results[i] = this->Read( keys[i], memoryMapped, *dest[i] );
+	}
+}
+
+status EntityStorage::InitializeMetadata( const std::string &path, bool hasEntities, entity_hash_mode hashMode )
+{
+	const std::string metadataPath = path + "/store.meta";
+	if( ctle::file_exists( metadataPath ) )
+	{
+		EntityData data;
+		ctStatusCall( data.Load( metadataPath ) );
+		ctValidate( data.GetSize() == storeMetadataSize, status::corrupted ) << "The store metadata " << metadataPath << " is damaged" << ctValidateEnd;
+
+		ReadStream rstream( data.GetData(), data.GetSize() );
+		const u64 magic = rstream.Read<u64>();
+		const u8 mode = rstream.Read<u8>();
+		ctValidate( magic == storeMetadataMagic && mode <= u8( entity_hash_mode::tree ), status::corrupted ) << "The store metadata " << metadataPath << " is damaged" << ctValidateEnd;
+		this->HashMode = entity_hash_mode( mode );
+		return status::ok;
+	}
+
+	// record the metadata of the store
+	this->HashMode = ( hasEntities ) ? entity_hash_mode::flat : hashMode;
+	WriteStream wstream( storeMetadataSize );
+	wstream.Write( storeMetadataMagic );
+	wstream.Write( u8( this->HashMode ) );
+	ctStatusCall( ctle::write_file( metadataPath, (const u8 *)wstream.GetData(), (size_t)wstream.GetSize(), true ) );
+	return status::ok;
+}
+
+status FileEntityStorage::Initialize( const std::string &path, entity_hash_mode hashMode )
+{
+	this->Path = path;
+
+	// the store has entities if there are any entity files in the folder
+	std::vector<std::string> fileNames;
+	ctStatusCall( storageListDirectory( path, fileNames ) );
+	const std::string suffix = ".dat";
+	const bool hasEntities = std::any_of( fileNames.begin(), fileNames.end(), [&suffix]( const std::string &fileName )
+		{
+			return fileName.size() > suffix.size() && fileName.compare( fileName.size() - suffix.size(), suffix.size(), suffix ) == 0;
+		} );
+	return this->InitializeMetadata( path, hasEntities, hashMode );
+}
+
+std::string FileEntityStorage::GetFilePath( const hash &key ) const
+{
+	return this->Path + "/" + to_string( key ) + ".dat";
+}
+
+bool FileEntityStorage::Contains( const hash &key )
+{
+	return ctle::file_exists( this->GetFilePath( key ) );
+}
+
+status FileEntityStorage::Write( const hash &key, const u8 *data, u64 size )
+{
+	// the file name is the hash of the data, so if the file exists it already has the data
+	const std::string filePath = this->GetFilePath( key );
+	if( !ctle::file_exists( filePath ) )
+	{
+		ctStatusCall( ctle::write_file( filePath, data, (size_t)size, true ) );
+	}
+	return status::ok;
+}
+
+status FileEntityStorage::Read( const hash &key, bool memoryMapped, EntityData &dest )
+{
+	if( memoryMapped )
+		return dest.Map( this->GetFilePath( key ) );
+	else
+		return dest.Load( this->GetFilePath( key ) );
+}
+
+status FileEntityStorage::OpenSource( const hash &key, FileReadStreamSource &dest )
+{
+	if( !this->Contains( key ) )
+	{
+		return status::not_found;
+	}
+	return dest.Open( this->GetFilePath( key ) );
+}
+
+status FileEntityStorage::Compact( const std::function<bool( const hash & )> & /*keep*/ )
+{
+	ctLogError << "Compaction is not supported by the file per entity storage, use the pack file storage" << ctLogEnd;
+	return status::invalid;
+}
+
+std::string PackEntityStorage::GetPackPath( u32 pack ) const
+{
+	char fileName[32];
+	snprintf( fileName, sizeof( fileName ), "pack_%08u.pack", pack );
+	return this->Path + "/" + fileName;
+}
+
+std::string PackEntityStorage::GetIndexPath() const
+{
+	return this->Path + "/pack_index.idx";
+}
+
+bool PackEntityStorage::LocationLess( const std::pair<hash, Location> &a, const std::pair<hash, Location> &b )
+{
+	return ( a.second.Pack != b.second.Pack ) ? ( a.second.Pack < b.second.Pack ) : ( a.second.Offset < b.second.Offset );
+}
+
+status PackEntityStorage::Initialize( const std::string &path, u64 maxPackSize, entity_hash_mode hashMode )
+{
+	ctValidate( this->Path.empty(), status::already_initialized ) << "The PackEntityStorage is already initialized" << ctValidateEnd;
+
+	this->Path = path;
+	this->MaxPackSize = maxPackSize;
+
+	// find the pack files in the folder
+	std::vector<std::string> fileNames;
+	ctStatusCall( storageListDirectory( path, fileNames ) );
+	std::map<u32, u64> packSizes;
+	for( const auto &fileName : fileNames )
+	{
+		const u32 pack = storagePackNumber( fileName );
+		if( pack > 0 )
+		{
+			packSizes[pack] = storageFileSize( this->GetPackPath( pack ) );
+		}
+	}
+	ctStatusCall( this->InitializeMetadata( path, !packSizes.empty(), hashMode ) );
+
+	// read the index. if the index is damaged, it is cleared, and all packs are scanned
+	bool indexIsClean = true;
+	ctStatusCall( this->ReadIndex( packSizes, indexIsClean ) );
+
+	// remove packs which are left over from a compaction
+	for( auto it = packSizes.begin(); it != packSizes.end(); )
+	{
+		if( it->first < this->FirstPack )
+		{
+			std::remove( this->GetPackPath( it->first ).c_str() );
+			it = packSizes.erase( it );
+		}
+		else
+			++it;
+	}
+
+	// scan the end of the packs for records which are not in the index. this happens
+	// if the index was not written after an entity was written to a pack
+	std::map<u32, u64> indexedEnds;
+	for( const auto &entry : this->Index )
+	{
+		u64 &end = indexedEnds[entry.second.Pack];
+		end = std::max( end, entry.second.Offset + entry.second.Size );
+	}
+	const size_t indexedCount = this->Index.size();
+	bool lastPackIsClean = true;
+	for( const auto &pack : packSizes )
+	{
+		const auto it = indexedEnds.find( pack.first );
+		const u64 startOffset = ( it != indexedEnds.end() ) ? it->second : packFileHeaderSize;
+
+		u64 endOffset = 0;
+		ctStatusCall( this->ScanPack( pack.first, startOffset, endOffset, lastPackIsClean ) );
+		this->Packs.insert( pack.first );
+	}
+	if( this->Index.size() != indexedCount )
+	{
+		indexIsClean = false;
+	}
+
+	// rewrite the index if it was damaged or incomplete
+	if( !indexIsClean )
+	{
+		ctStatusCall( this->WriteIndex() );
+	}
+	else
+	{
+		this->IndexFile.open( this->GetIndexPath(), std::ios::binary | std::ios::app );
+		ctValidate( this->IndexFile.is_open(), status::cant_write ) << "Could not open the pack index " << this->GetIndexPath() << ctValidateEnd;
+	}
+
+	// continue appending to the last pack, if it is undamaged and not full
+	if( !this->Packs.empty() && lastPackIsClean && packSizes.rbegin()->second < this->MaxPackSize )
+	{
+		this->CurrentPack = *this->Packs.rbegin();
+		this->CurrentPackSize = packSizes.rbegin()->second;
+		this->CurrentPackFile.open( this->GetPackPath( this->CurrentPack ), std::ios::binary | std::ios::app );
+		ctValidate( this->CurrentPackFile.is_open(), status::cant_write ) << "Could not open the pack " << this->GetPackPath( this->CurrentPack ) << ctValidateEnd;
+	}
+	else
+	{
+		ctStatusCall( this->StartNewPack() );
+	}
+
+	return status::ok;
+}
+
+status PackEntityStorage::ReadIndex( const std::map<u32, u64> &packSizes, bool &indexIsClean )
+{
+	indexIsClean = true;
+	this->Index.clear();
+	this->FirstPack = 0;
+
+	EntityData data;
+	if( !ctle::file_exists( this->GetIndexPath() ) || !data.Load( this->GetIndexPath() ) || data.GetSize() < packIndexHeaderSize )
+	{
+		// no usable index, rebuild it from the packs
+		indexIsClean = false;
+		return status::ok;
+	}
+
+	ReadStream rstream( data.GetData(), data.GetSize() );
+	if( rstream.Read<u64>() != packIndexMagic )
+	{
+		ctLogError << "The pack index " << this->GetIndexPath() << " is damaged, and is rebuilt from the packs" << ctLogEnd;
+		indexIsClean = false;
+		return status::ok;
+	}
+	this->FirstPack = rstream.Read<u32>();
+
+	// a partial entry at the end is skipped, the entity is recovered when the pack is scanned
+	const u64 entryCount = ( data.GetSize() - packIndexHeaderSize ) / packIndexEntrySize;
+	if( packIndexHeaderSize + entryCount * packIndexEntrySize != data.GetSize() )
+	{
+		indexIsClean = false;
+	}
+
+	for( u64 i = 0; i < entryCount; ++i )
+	{
+		const hash key = rstream.Read<hash>();
+		Location location;
+		location.Pack = rstream.Read<u32>();
+		location.Offset = rstream.Read<u64>();
+		location.Size = rstream.Read<u64>();
+
+		// the entry must be inside a pack. if not, drop the index and scan all the packs instead
+		const auto it = packSizes.find( location.Pack );
+		if( it == packSizes.end()
+			|| location.Offset < packFileHeaderSize + packRecordHeaderSize
+			|| location.Offset > it->second
+			|| location.Size > it->second - location.Offset )
+		{
+			ctLogError << "The pack index " << this->GetIndexPath() << " does not match the packs, and is rebuilt from the packs" << ctLogEnd;
+			this->Index.clear();
+			this->FirstPack = 0;
+			indexIsClean = false;
+			return status::ok;
+		}
+
+		this->Index.emplace( key, location );
+	}
+
+	return status::ok;
+}
+
+status PackEntityStorage::ScanPack( u32 pack, u64 startOffset, u64 &endOffset, bool &packIsClean )
+{
+	const std::string packPath = this->GetPackPath( pack );
+	endOffset = 0;
+	packIsClean = false;
+
+	EntityData data;
+	if( !data.Map( packPath ) || data.GetSize() < packFileHeaderSize )
+	{
+		ctLogError << "The pack " << packPath << " is damaged, and is skipped" << ctLogEnd;
+		return status::ok;
+	}
+	ReadStream rstream( data.GetData(), data.GetSize() );
+	if( rstream.Read<u64>() != packFileMagic )
+	{
+		ctLogError << "The pack " << packPath << " is damaged, and is skipped" << ctLogEnd;
+		return status::ok;
+	}
+
+	// read the record headers, and add the records to the index
+	u64 position = std::max( startOffset, packFileHeaderSize );
+	while( position + packRecordHeaderSize <= data.GetSize() )
+	{
+		rstream.SetPosition( position );
+		const u64 size = rstream.Read<u64>();
+		const hash key = rstream.Read<hash>();
+		if( size > data.GetSize() - position - packRecordHeaderSize )
+			break;
+
+		Location location;
+		location.Pack = pack;
+		location.Offset = position + packRecordHeaderSize;
+		location.Size = size;
+		this->Index.emplace( key, location );
+
+		position += packRecordHeaderSize + size;
+	}
+
+	// if the records do not end at the end of the pack, the last write to the pack was not completed
+	endOffset = position;
+	packIsClean = ( position == data.GetSize() );
+	return status::ok;
+}
+
+status PackEntityStorage::WriteIndex()
+{
+	// write the full index to a temporary file, and replace the old index with it
+	const std::string indexPath = this->GetIndexPath();
+	const std::string tempPath = indexPath + ".tmp";
+
+	// write the entries in pack order, same as the order they are appended in, so a damaged 
+	// end of the index only affects entries at the end of the packs, which are recovered by ScanPack
+	std::vector<std::pair<hash, Location>> entries( this->Index.begin(), this->Index.end() );
+	std::sort( entries.begin(), entries.end(), LocationLess );
+
+	WriteStream wstream( packIndexHeaderSize + entries.size() * packIndexEntrySize );
+	wstream.Write( packIndexMagic );
+	wstream.Write( this->FirstPack );
+	for( const auto &entry : entries )
+	{
+		wstream.Write( entry.first );
+		wstream.Write( entry.second.Pack );
+		wstream.Write( entry.second.Offset );
+		wstream.Write( entry.second.Size );
+	}
+	ctStatusCall( ctle::write_file( tempPath, (const u8 *)wstream.GetData(), (size_t)wstream.GetSize(), true ) );
+
+	this->IndexFile.close();
+	std::remove( indexPath.c_str() );
+	ctValidate( std::rename( tempPath.c_str(), indexPath.c_str() ) == 0, status::cant_write ) << "Could not replace the pack index " << indexPath << ctValidateEnd;
+
+	this->IndexFile.open( indexPath, std::ios::binary | std::ios::app );
+	ctValidate( this->IndexFile.is_open(), status::cant_write ) << "Could not open the pack index " << indexPath << ctValidateEnd;
+	return status::ok;
+}
+
+status PackEntityStorage::AppendIndexEntry( const hash &key, const Location &location )
+{
+	WriteStream wstream( packIndexEntrySize );
+	wstream.Write( key );
+	wstream.Write( location.Pack );
+	wstream.Write( location.Offset );
+	wstream.Write( location.Size );
+
+	this->IndexFile.write( (const char *)wstream.GetData(), (std::streamsize)wstream.GetSize() );
+	this->IndexFile.flush();
+	ctValidate( this->IndexFile.good(), status::cant_write ) << "Could not write to the pack index " << this->GetIndexPath() << ctValidateEnd;
+	return status::ok;
+}
+
+status PackEntityStorage::StartNewPack()
+{
+	this->CurrentPackFile.close();
+
+	const u32 pack = ( this->Packs.empty() ) ? std::max( this->FirstPack, 1u ) : ( *this->Packs.rbegin() + 1 );
+	const std::string packPath = this->GetPackPath( pack );
+
+	WriteStream wstream( packFileHeaderSize );
+	wstream.Write( packFileMagic );
+
+	this->CurrentPackFile.open( packPath, std::ios::binary | std::ios::trunc );
+	this->CurrentPackFile.write( (const char *)wstream.GetData(), (std::streamsize)wstream.GetSize() );
+	this->CurrentPackFile.flush();
+	ctValidate( this->CurrentPackFile.good(), status::cant_write ) << "Could not create the pack " << packPath << ctValidateEnd;
+
+	{
+		ctle::readers_writer_lock::write_guard guard( this->IndexLock );
+		this->Packs.insert( pack );
+	}
+	this->CurrentPack = pack;
+	this->CurrentPackSize = packFileHeaderSize;
+	return status::ok;
+}
+
+status PackEntityStorage::AppendEntity( const hash &key, const u8 *data, u64 size, Location &location )
+{
+	// start a new pack if the current pack is full, or if the last write to it failed
+	const u64 recordSize = packRecordHeaderSize + size;
+	if( !this->CurrentPackFile.is_open()
+		|| ( this->CurrentPackSize > packFileHeaderSize && this->CurrentPackSize + recordSize > this->MaxPackSize ) )
+	{
+		ctStatusCall( this->StartNewPack() );
+	}
+
+	WriteStream wstream( packRecordHeaderSize );
+	wstream.Write( size );
+	wstream.Write( key );
+
+	this->CurrentPackFile.write( (const char *)wstream.GetData(), (std::streamsize)wstream.GetSize() );
+	this->CurrentPackFile.write( (const char *)data, (std::streamsize)size );
+	this->CurrentPackFile.flush();
+	if( !this->CurrentPackFile.good() )
+	{
+		// the end of the pack is now in an unknown state, so don't append any more to it
+		this->CurrentPackFile.close();
+		ctLogError << "Could not write to the pack " << this->GetPackPath( this->CurrentPack ) << ctLogEnd;
+		return status::cant_write;
+	}
+
+	location.Pack = this->CurrentPack;
+	location.Offset = this->CurrentPackSize + packRecordHeaderSize;
+	location.Size = size;
+	this->CurrentPackSize += recordSize;
+	return status::ok;
+}
+
+bool PackEntityStorage::Contains( const hash &key )
+{
+	ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+	return this->Index.find( key ) != this->Index.end();
+}
+
+status PackEntityStorage::Write( const hash &key, const u8 *data, u64 size )
+{
+	ctValidate( !this->Path.empty(), status::not_initialized ) << "The PackEntityStorage is not initialized" << ctValidateEnd;
+
+	if( this->Contains( key ) )
+		return status::ok;
+
+	std::lock_guard<std::mutex> writeGuard( this->WriteLock );
+
+	// check again, the entity may have been written while waiting for the lock
+	if( this->Contains( key ) )
+		return status::ok;
+
+	Location location;
+	ctStatusCall( this->AppendEntity( key, data, size, location ) );
+	ctStatusCall( this->AppendIndexEntry( key, location ) );
+
+	ctle::readers_writer_lock::write_guard guard( this->IndexLock );
+	this->Index.emplace( key, location );
+	return status::ok;
+}
+
+status PackEntityStorage::Read( const hash &key, bool memoryMapped, EntityData &dest )
+{
+	// keep the read lock while the pack is opened, so a compaction can't remove the pack
+	ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+
+	const auto it = this->Index.find( key );
+	if( it == this->Index.end() )
+	{
+		return status::not_found;
+	}
+
+	const Location &location = it->second;
+	if( memoryMapped )
+		return dest.Map( this->GetPackPath( location.Pack ), location.Offset, location.Size );
+	else
+		return dest.Load( this->GetPackPath( location.Pack ), location.Offset, location.Size );
+}
+
+status PackEntityStorage::OpenSource( const hash &key, FileReadStreamSource &dest )
+{
+	// keep the read lock while the pack is opened, so a compaction can't remove the pack
+	ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+
+	const auto it = this->Index.find( key );
+	if( it == this->Index.end() )
+	{
+		return status::not_found;
+	}
+
+	const Location &location = it->second;
+	return dest.Open( this->GetPackPath( location.Pack ), location.Offset, location.Size );
+}
+
+status PackEntityStorage::Compact( const std::function<bool( const hash & )> &keep )
+{
+	ctValidate( !this->Path.empty(), status::not_initialized ) << "The PackEntityStorage is not initialized" << ctValidateEnd;
+
+	// block all writes while compacting. since this is the only writer, the index can be read without the lock
+	std::lock_guard<std::mutex> writeGuard( this->WriteLock );
+
+	// list the entities to keep, in pack order, so the old packs are read front to back
+	std::vector<std::pair<hash, Location>> keptEntities;
+	for( const auto &entry : this->Index )
+	{
+		if( keep( entry.first ) )
+			keptEntities.emplace_back( entry );
+	}
+	std::sort( keptEntities.begin(), keptEntities.end(), LocationLess );
+
+	// copy the kept entities to new packs
+	const std::set<u32> oldPacks = this->Packs;
+	ctStatusCall( this->StartNewPack() );
+	const u32 firstNewPack = this->CurrentPack;
+
+	std::unordered_map<hash, Location> newIndex;
+	for( const auto &entry : keptEntities )
+	{
+		EntityData data;
+		ctStatusCall( data.Map( this->GetPackPath( entry.second.Pack ), entry.second.Offset, entry.second.Size ) );
+
+		Location location;
+		ctStatusCall( this->AppendEntity( entry.first, data.GetData(), data.GetSize(), location ) );
+		newIndex.emplace( entry.first, location );
+	}
+
+	// switch to the new packs
+	{
+		ctle::readers_writer_lock::write_guard guard( this->IndexLock );
+		this->Index.swap( newIndex );
+		for( u32 pack : oldPacks )
+		{
+			this->Packs.erase( pack );
+		}
+		this->FirstPack = firstNewPack;
+	}
+	ctStatusCall( this->WriteIndex() );
+
+	// remove the old packs. if a pack can't be removed now, it is removed on the next Initialize, since it is below FirstPack
+	for( u32 pack : oldPacks )
+	{
+		std::remove( this->GetPackPath( pack ).c_str() );
+	}
+
+	return status::ok;
+}
+
+void PackEntityStorage::SortForReading( std::vector<hash> &keys )
+{
+	std::vector<std::pair<hash, Location>> entries;
+	entries.reserve( keys.size() );
+	{
+		ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+		for( const auto &key : keys )
+		{
+			// hashes which are not stored are placed first, and will fail directly when read
+			const auto it = this->Index.find( key );
+			entries.emplace_back( key, ( it != this->Index.end() ) ? it->second : Location() );
+		}
+	}
+
+	std::stable_sort( entries.begin(), entries.end(), LocationLess );
+	for( size_t i = 0; i < entries.size(); ++i )
+	{
+		keys[i] = entries[i].first;
+	}
+}
+
+void PackEntityStorage::ReadBatch( const std::vector<hash> &keys, bool memoryMapped, std::vector<std::shared_ptr<EntityData>> &dest, std::vector<status> &results )
+{
+	dest.resize( keys.size() );
+	results.resize( keys.size() );
+
+	// keep the read lock while the packs are read, so a compaction can't remove the packs
+	ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+
+	std::vector<const Location *> locations( keys.size(), nullptr );
+	for( size_t i = 0; i < keys.size(); ++i )
+	{
+		dest[i] = std::make_shared<EntityData>();
+		const auto it = this->Index.find( keys[i] );
+		if( it != this->Index.end() )
+		{
+			locations[i] = &it->second;
+		}
+		results[i] = ( locations[i] ) ? status::ok : status::not_found;
+	}
+
+	for( size_t runStart = 0; runStart < keys.size(); )
+	{
+		if( !locations[runStart] )
+		{
+			++runStart;
+			continue;
+		}
+
+		// extend the run with the entities which follow closely in the same pack
+		const Location &first = *locations[runStart];
+		u64 runEnd = first.Offset + first.Size;
+		size_t runCount = 1;
+		while( runStart + runCount < keys.size() && locations[runStart + runCount] )
+		{
+			const Location &next = *locations[runStart + runCount];
+			if( next.Pack != first.Pack
+				|| next.Offset < runEnd
+				|| next.Offset - runEnd > MaxReadGap
+				|| next.Offset + next.Size - first.Offset > MaxCoalescedReadSize )
+			{
+				break;
+			}
+			runEnd = next.Offset + next.Size;
+			++runCount;
+		}
+
+		const std::string packPath = this->GetPackPath( first.Pack );
+		if( runCount == 1 )
+		{
+			results[runStart] = ( memoryMapped ) 
+				? dest[runStart]->Map( packPath, first.Offset, first.Size ) 
+				: dest[runStart]->Load( packPath, first.Offset, first.Size );
+		}
+		else
+		{
+			// read the whole run, and let the entities share it
+			auto run = std::make_shared<EntityData>();
+			const status result = ( memoryMapped ) 
+				? run->Map( packPath, first.Offset, runEnd - first.Offset ) 
+				: run->Load( packPath, first.Offset, runEnd - first.Offset );
+			for( size_t i = runStart; i < runStart + runCount; ++i )
+			{
+				results[i] = result;
+				if( result == status::ok )
+				{
+					dest[i]->Share( run, run->GetData() + ( locations[i]->Offset - first.Offset ), locations[i]->Size );
+				}
+			}
+		}
+
+		runStart += runCount;
+	}
+}
+
+size_t PackEntityStorage::GetEntityCount()
+{
+	ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+	return this->Index.size();
+}
+
+size_t PackEntityStorage::GetPackCount()
+{
+	ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+	return this->Packs.size();
+}
+
+#include "_pds_undef_macros.inl"
+}
+// namespace pds
@@ -0,0 +1,93 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+#pragma once
+#ifndef __PDS__LAZY_H__
+#define __PDS__LAZY_H__
+
+#include <atomic>
+#include <mutex>
+#include "fwd.h"
+
+namespace pds
+{
+
+// LazySource is the data of a section in the entity data, which is deserialized later. Owner keeps the data alive, 
+// which is all of the entity data, not only the section.
+struct LazySource
+{
+	std::shared_ptr<const void> Owner;
+	const u8 *Data = nullptr;
+	u64 Size = 0;
+	bool CompactEncoding = false;
+	bool KeyTolerant = false;
+};
+
+// Lazy holds a (typically large) value in an item, which is deserialized from the entity data on the first access,
+// instead of when the entity is read. If the reader does not keep the entity data (see EntityReader::SetDataOwner), 
+// the value is read directly. The first access is thread safe, so a Lazy in a const entity can be accessed from 
+// multiple threads.
+// Note that each Lazy which is not loaded keeps all of the entity data in memory, not only its own section. Each Lazy 
+// releases the data when it is loaded (or cleared), so the entity data is freed when the last Lazy of the entity which 
+// shares it is loaded. Load the values which will be needed anyway, if the memory of large entities is a concern.
+template<class _Ty> class Lazy
+{
+public:
+	using value_type = _Ty;
+
+	class MF;
+	friend MF;
+
+	// ctors/dtor and copy/move operators. copies of a value which is not loaded share the entity data.
+	Lazy() = default;
+	Lazy( const Lazy &rval ) { MF::DeepCopy( *this, &rval ); }
+	Lazy &operator=( const Lazy &rval ) { MF::DeepCopy( *this, &rval ); return *this; }
+	Lazy( Lazy &&rval ) : v_Value( std::move( rval.v_Value ) ), v_Pending( std::move( rval.v_Pending ) ), v_Loaded( rval.v_Loaded.load() ) { rval.v_Loaded = true; }
+	Lazy &operator=( Lazy &&rval ) { this->v_Value = std::move( rval.v_Value ); this->v_Pending = std::move( rval.v_Pending ); this->v_Loaded = rval.v_Loaded.load(); rval.v_Loaded = true; return *this; }
+	~Lazy() = default;
+
+	// value compare operators, loads both values
+	bool operator==( const Lazy &rval ) const { return MF::Equals( this, &rval ); }
+	bool operator!=( const Lazy &rval ) const { return !( MF::Equals( this, &rval ) ); }
+
+private:
+	struct Pending
+	{
+		std::mutex Lock;
+		LazySource Source;
+		status Result = status::ok;
+	};
+
+	mutable _Ty v_Value = {};
+	std::unique_ptr<Pending> v_Pending;
+	mutable std::atomic<bool> v_Loaded{ true };
+
+public:
+	// returns true if the value has been deserialized
+	bool IsLoaded() const noexcept { return this->v_Loaded.load( std::memory_order_acquire ); }
+
+	// deserializes the value, if it is not loaded. returns the status of the deserialization, also on later calls.
+	status Load() const
+	{
+		if( !this->v_Loaded.load( std::memory_order_acquire ) )
+		{
+			std::lock_guard<std::mutex> guard( this->v_Pending->Lock );
+			if( !this->v_Loaded.load( std::memory_order_relaxed ) )
+			{
+				this->v_Pending->Result = MF::ReadSource( this->v_Value, this->v_Pending->Source );
+				this->v_Pending->Source = {}; // release the entity data
+				this->v_Loaded.store( true, std::memory_order_release );
+			}
+		}
+		return ( this->v_Pending ) ? this->v_Pending->Result : status::ok;
+	}
+
+	// access the value, which is loaded on the first access. if the load fails, for instance if the entity data is 
+	// corrupted, the failure is logged, and the value is left empty. call Load first to handle the failure.
+	const _Ty &Value() const { MF::LoadForAccess( *this ); return this->v_Value; }
+	_Ty &Value() { MF::LoadForAccess( *this ); return this->v_Value; }
+};
+
+}
+// namespace pds
+
+#endif//__PDS__LAZY_H__
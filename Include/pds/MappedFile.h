@@ -0,0 +1,51 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+#pragma once
+#ifndef __PDS__MAPPEDFILE_H__
+#define __PDS__MAPPEDFILE_H__
+
+#include "fwd.h"
+
+namespace pds
+{
+
+// MappedFile maps a read-only view of a file (or a range of a file) into memory,
+// so that the file data can be read directly from the mapped pages, without
+// copying the data into an allocation.
+// The mapping is released when the object is destructed or Close is called.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	MappedFile( const MappedFile & ) = delete;
+	MappedFile &operator=( const MappedFile & ) = delete;
+	~MappedFile();
+
+	// Maps a file into memory. If size is 0, the file is mapped from offset to the end of the file.
+	// The offset does not need to be aligned to a page boundary.
+	status Open( const std::string &filePath, u64 offset = 0, u64 size = 0 );
+
+	// Unmaps the file
+	void Close();
+
+	// Returns the mapped data, and the size in bytes of the mapped data
+	const u8 *GetData() const { return this->Data; }
+	u64 GetSize() const { return this->DataSize; }
+
+private:
+	const u8 *Data = nullptr;
+	u64 DataSize = 0;
+
+	// the start and size of the view, which is aligned to the allocation granularity of the system
+	void *View = nullptr;
+	u64 ViewSize = 0;
+};
+
+}
+// namespace pds
+
+#ifdef PDS_IMPLEMENTATION
+#include "MappedFile.inl"
+#endif//PDS_IMPLEMENTATION
+
+#endif//__PDS__MAPPEDFILE_H__
@@ -0,0 +1,157 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#if defined(__GNUC__) && !defined(_MSC_VER)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <ctle/log.h>
+
+namespace pds
+{
+#include "_pds_macros.inl"
+
+MappedFile::~MappedFile()
+{
+	this->Close();
+}
+
+status MappedFile::Open( const std::string &filePath, u64 offset, u64 size )
+{
+	ctValidate( this->View == nullptr, status::already_initialized ) << "The MappedFile is already open" << ctValidateEnd;
+
+#ifdef _MSC_VER
+
+	HANDLE fileHandle = ::CreateFileA( filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+	if( fileHandle == INVALID_HANDLE_VALUE )
+	{
+		return status::cant_read;
+	}
+
+	LARGE_INTEGER fileSizeValue = {};
+	if( !::GetFileSizeEx( fileHandle, &fileSizeValue ) )
+	{
+		::CloseHandle( fileHandle );
+		return status::cant_read;
+	}
+	const u64 fileSize = (u64)fileSizeValue.QuadPart;
+
+	SYSTEM_INFO systemInfo = {};
+	::GetSystemInfo( &systemInfo );
+	const u64 granularity = (u64)systemInfo.dwAllocationGranularity;
+
+#elif defined(__GNUC__)
+
+	int fileDescriptor = ::open( filePath.c_str(), O_RDONLY );
+	if( fileDescriptor < 0 )
+	{
+		return status::cant_read;
+	}
+
+	struct stat fileStat = {};
+	if( ::fstat( fileDescriptor, &fileStat ) != 0 )
+	{
+		::close( fileDescriptor );
+		return status::cant_read;
+	}
+	const u64 fileSize = (u64)fileStat.st_size;
+
+	const u64 granularity = (u64)::sysconf( _SC_PAGESIZE );
+
+#endif
+
+	// check the range
+	if( size == 0 && offset <= fileSize )
+	{
+		size = fileSize - offset;
+	}
+	if( offset > fileSize || size > fileSize - offset )
+	{
+		ctLogError << "The range (offset: " << offset << ", size: " << size << ") is out of bounds of the file " << filePath << ctLogEnd;
+#ifdef _MSC_VER
+		::CloseHandle( fileHandle );
+#elif defined(__GNUC__)
+		::close( fileDescriptor );
+#endif
+		return status::invalid_param;
+	}
+
+	// an empty range can't be mapped, but is still valid
+	if( size == 0 )
+	{
+#ifdef _MSC_VER
+		::CloseHandle( fileHandle );
+#elif defined(__GNUC__)
+		::close( fileDescriptor );
+#endif
+		return status::ok;
+	}
+
+	// the view must start on an allocation boundary
+	const u64 viewOffset = offset - ( offset % granularity );
+	const u64 viewSize = size + ( offset - viewOffset );
+
+#ifdef _MSC_VER
+
+	// the view keeps the mapping and file alive, so the handles can be closed directly
+	HANDLE mappingHandle = ::CreateFileMappingA( fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr );
+	void *view = nullptr;
+	if( mappingHandle != nullptr )
+	{
+		view = ::MapViewOfFile( mappingHandle, FILE_MAP_READ, (DWORD)( viewOffset >> 32 ), (DWORD)( viewOffset & 0xffffffff ), (SIZE_T)viewSize );
+		::CloseHandle( mappingHandle );
+	}
+	::CloseHandle( fileHandle );
+	if( view == nullptr )
+	{
+		ctLogError << "Failed to map the file " << filePath << ctLogEnd;
+		return status::cant_read;
+	}
+
+#elif defined(__GNUC__)
+
+	// the mapping keeps the file alive, so the descriptor can be closed directly
+	void *view = ::mmap( nullptr, (size_t)viewSize, PROT_READ, MAP_PRIVATE, fileDescriptor, (off_t)viewOffset );
+	::close( fileDescriptor );
+	if( view == MAP_FAILED )
+	{
+		ctLogError << "Failed to map the file " << filePath << ctLogEnd;
+		return status::cant_read;
+	}
+
+	// the data is hashed and deserialized front to back
+	::madvise( view, (size_t)viewSize, MADV_SEQUENTIAL );
+
+#endif
+
+	this->View = view;
+	this->ViewSize = viewSize;
+	this->Data = (const u8 *)view + ( offset - viewOffset );
+	this->DataSize = size;
+
+	return status::ok;
+}
+
+void MappedFile::Close()
+{
+	if( this->View )
+	{
+#ifdef _MSC_VER
+		::UnmapViewOfFile( this->View );
+#elif defined(__GNUC__)
+		::munmap( this->View, (size_t)this->ViewSize );
+#endif
+	}
+
+	this->View = nullptr;
+	this->ViewSize = 0;
+	this->Data = nullptr;
+	this->DataSize = 0;
+}
+
+#include "_pds_undef_macros.inl"
+}
+// namespace pds
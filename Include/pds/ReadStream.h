@@ -6,41 +6,126 @@
 
 #include "pds.h"
 
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 namespace pds
 {
 
+// ReadStreamSource is the source of a ReadStream which is read in windows, 
+// instead of from a single memory area.
+class ReadStreamSource
+{
+public:
+	virtual ~ReadStreamSource() = default;
+
+	// the total size of the source data
+	virtual u64 GetSize() const = 0;
+
+	// read count bytes from offset into dest, and return the number of bytes read. 
+	// reads are done one at a time, but not always from the same thread.
+	virtual u64 Read( u64 offset, u8 *dest, u64 count ) = 0;
+};
+
+// FileReadStreamSource reads a range of a file
+class FileReadStreamSource : public ReadStreamSource
+{
+public:
+	// open a range of a file. if size is 0, the range is from offset to the end of the file
+	status Open( const std::string &filePath, u64 offset = 0, u64 size = 0 );
+
+	virtual u64 GetSize() const override { return this->Size; }
+	virtual u64 Read( u64 offset, u8 *dest, u64 count ) override;
+
+private:
+	std::ifstream File;
+	u64 Offset = 0;
+	u64 Size = 0;
+};
+
 // Memory read stream is a wrapper around a read-only memory area.
 // The stream is used to read structured values, and automatically 
 // does byte order swapping. It can read in more complex types than
 // just plain old data (POD) types, such as std::string, UUIDs and
 // std::vectors of the above types.
+// The stream can also read from a ReadStreamSource, in which case only a window 
+// of the data is held in memory. When the stream moves into a window, the next
+// window is read ahead on the I/O thread of the stream (which is started on the 
+// first read-ahead), so reading overlaps with deserialization.
 // Caveat: The stream is NOT thread safe, and should be accessed by 
 // only one thread at a time.
 
 class ReadStream
 {
 private:
-	const u8 *Data = nullptr;
+	static const u64 DefaultWindowSize = 1024 * 1024 * 4; // 4MB windows
+
+	struct Window
+	{
+		ReadStreamSource *Source = nullptr;
+		u64 Size = 0;
+		std::vector<u8> Buffers[2];
+		uint Current = 0;
+
+		// the read-ahead of the next window into the other buffer, which is done by the I/O thread.
+		// the request fields are guarded by Lock, and NextPending is set until the read is done.
+		u64 NextStart = 0;
+		u64 NextCount = 0;
+		u64 NextResult = 0;
+		bool NextPending = false;
+		bool Stop = false;
+		std::mutex Lock;
+		std::condition_variable Condition;
+		std::thread IOThread;
+
+		~Window();
+
+		// request a read of the next window into the other buffer, and wait for the requested read to finish
+		void StartNextRead( u64 nextStart, u64 nextCount );
+		u64 WaitForNextRead();
+
+		void IOThreadLoop();
+	};
+
+	// the data of the current window, which is the full stream if there is no source.
+	// the window is mutable, since it is also moved by Peek.
+	mutable const u8 *Data = nullptr;
+	mutable u64 WindowStart = 0;
+	mutable u64 WindowEnd = 0;
+	std::unique_ptr<Window> Windowed;
+
 	u64 DataSize = 0;
 	u64 DataPosition = 0;
 
+	// if set, sizes and counts are read as varints, see WriteStream::SetCompactEncoding
+	bool CompactEncoding = false;
+
 	// read raw bytes from the memory stream
 	u64 ReadRawData( void *dest, u64 count );
 
+	// move the window to the window which holds position. returns false if the position could not be read.
+	bool MoveWindow( u64 position ) const;
+
 	// read 1,2,4 or 8 byte values and make sure they are in the correct byte order
 	template <class T> u64 ReadValues( T *dest, u64 count );
 
 public:
 	ReadStream( const void *_Data, u64 _DataSize ) 
 		: Data( (u8 *)_Data )
+		, WindowEnd( _DataSize )
 		, DataSize( _DataSize )
 	{};
+	ReadStream( ReadStreamSource *_Source, u64 _WindowSize = DefaultWindowSize );
 
 	// get the Size of the stream in bytes
 	u64 GetSize() const;
 
+	// get the data of a memory stream, or nullptr if the stream reads windows from a source
+	const u8 *GetMemoryData() const { return ( this->Windowed ) ? nullptr : this->Data; }
+
 	// Position is the current data position. the beginning of the stream is position 0. the position will not move past the end of the stream.
 	u64 GetPosition() const;
 	bool SetPosition( u64 new_pos );
@@ -51,9 +136,16 @@ public:
 	// Peek at the next byte in the stream, without modifing the Position or any data. If the Position is beyond the end of the stream, the value will be 0
 	u8 Peek() const;
 
+	// set if the stream has data which is written with compact encoding. the reader templates then read sizes and counts as varints.
+	void SetCompactEncoding( bool compact ) { this->CompactEncoding = compact; }
+	bool GetCompactEncoding() const { return this->CompactEncoding; }
+
 	// read one item from the memory stream. makes sure to convert endianness
 	template <class T> T Read();
 
+	// read an unsigned LEB128 varint. if the stream ends before the varint does, the read bytes are returned.
+	u64 ReadVarint();
+
 	// read a number of items from the memory stream. makes sure to convert endianness
 	u64 Read( i8 *dest, u64 count );
 	u64 Read( i16 *dest, u64 count );
@@ -73,8 +165,9 @@ inline u8 ReadStream::Peek() const
 {
 	if( this->DataPosition >= this->DataSize )
 		return 0;
-	else
-		return this->Data[this->DataPosition];
+	if( ( this->DataPosition < this->WindowStart || this->DataPosition >= this->WindowEnd ) && !this->MoveWindow( this->DataPosition ) )
+		return 0;
+	return this->Data[this->DataPosition - this->WindowStart];
 }
 
 template <class T> inline u64 ReadStream::ReadValues( T *dest, u64 count )
@@ -121,6 +214,21 @@ template <> inline double ReadStream::Read<double>() { double dest = 0; this->Re
 template <> inline uuid ReadStream::Read<uuid>() { uuid dest = {}; this->Read( &dest, 1 ); return dest; }
 template <> inline hash ReadStream::Read<hash>() { hash dest = {}; this->Read( &dest, 1 ); return dest; }
 
+inline u64 ReadStream::ReadVarint()
+{
+	u64 value = 0;
+	for( uint shift = 0; shift < 64; shift += 7 )
+	{
+		const u8 byte = this->Read<u8>();
+		value |= u64( byte & 0x7f ) << shift;
+		if( ( byte & 0x80 ) == 0 )
+		{
+			break;
+		}
+	}
+	return value;
+}
+
 // 8 bit data
 inline u64 ReadStream::Read( i8 *dest, u64 count ) { return this->ReadValues<u8>( (u8*)dest, count ); }
 inline u64 ReadStream::Read( u8 *dest, u64 count ) { return this->ReadValues<u8>( dest, count ); }
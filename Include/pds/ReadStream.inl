@@ -5,10 +5,150 @@
 
 #include "ReadStream.h"
 
+#include <algorithm>
 #include <vector>
 
 namespace pds
 {
+#include "_pds_macros.inl"
+
+status FileReadStreamSource::Open( const std::string &filePath, u64 offset, u64 size )
+{
+	this->File.open( filePath, std::ios::binary | std::ios::ate );
+	ctValidate( this->File.is_open(), status::cant_read ) << "Could not open the file " << filePath << ctValidateEnd;
+
+	const u64 fileSize = (u64)this->File.tellg();
+	ctValidate( offset <= fileSize && offset + size <= fileSize, status::invalid_param ) << "The range is outside of the file " << filePath << ctValidateEnd;
+
+	this->Offset = offset;
+	this->Size = ( size == 0 ) ? ( fileSize - offset ) : size;
+	return status::ok;
+}
+
+u64 FileReadStreamSource::Read( u64 offset, u8 *dest, u64 count )
+{
+	if( offset >= this->Size )
+		return 0;
+	if( count > this->Size - offset )
+		count = this->Size - offset;
+
+	this->File.clear();
+	this->File.seekg( (std::streamoff)( this->Offset + offset ), std::ios::beg );
+	this->File.read( (char *)dest, (std::streamsize)count );
+	return (u64)this->File.gcount();
+}
+
+ReadStream::ReadStream( ReadStreamSource *_Source, u64 _WindowSize )
+	: Windowed( new Window() )
+	, DataSize( _Source->GetSize() )
+{
+	this->Windowed->Source = _Source;
+	this->Windowed->Size = ( _WindowSize < this->DataSize ) ? _WindowSize : this->DataSize;
+	this->Windowed->Buffers[0].resize( (size_t)this->Windowed->Size );
+	this->Windowed->Buffers[1].resize( (size_t)this->Windowed->Size );
+}
+
+ReadStream::Window::~Window()
+{
+	if( this->IOThread.joinable() )
+	{
+		{
+			std::lock_guard<std::mutex> lock( this->Lock );
+			this->Stop = true;
+		}
+		this->Condition.notify_all();
+		this->IOThread.join();
+	}
+}
+
+void ReadStream::Window::StartNextRead( u64 nextStart, u64 nextCount )
+{
+	if( !this->IOThread.joinable() )
+	{
+		this->IOThread = std::thread( &Window::IOThreadLoop, this );
+	}
+
+	{
+		std::lock_guard<std::mutex> lock( this->Lock );
+		this->NextStart = nextStart;
+		this->NextCount = nextCount;
+		this->NextPending = true;
+	}
+	this->Condition.notify_all();
+}
+
+u64 ReadStream::Window::WaitForNextRead()
+{
+	std::unique_lock<std::mutex> lock( this->Lock );
+	this->Condition.wait( lock, [this]() { return !this->NextPending; } );
+	return this->NextResult;
+}
+
+void ReadStream::Window::IOThreadLoop()
+{
+	std::unique_lock<std::mutex> lock( this->Lock );
+	for( ;; )
+	{
+		this->Condition.wait( lock, [this]() { return this->NextPending || this->Stop; } );
+		if( this->Stop )
+		{
+			return;
+		}
+
+		// read into the buffer which is not the current window, without holding the lock
+		const u64 start = this->NextStart;
+		const u64 count = this->NextCount;
+		u8 *dest = this->Buffers[this->Current ^ 1].data();
+		lock.unlock();
+		const u64 result = this->Source->Read( start, dest, count );
+		lock.lock();
+
+		this->NextResult = result;
+		this->NextPending = false;
+		this->Condition.notify_all();
+	}
+}
+
+bool ReadStream::MoveWindow( u64 position ) const
+{
+	if( !this->Windowed || position >= this->DataSize )
+		return false;
+	Window &window = *this->Windowed;
+
+	const u64 start = position - ( position % window.Size );
+	const u64 expectedCount = std::min( window.Size, this->DataSize - start );
+	u64 count = 0;
+
+	// use the read-ahead if it is the requested window, else wait for it to finish, so the source is not read from two threads
+	bool readAhead = false;
+	if( window.NextCount > 0 )
+	{
+		count = window.WaitForNextRead();
+		readAhead = ( window.NextStart == start );
+		window.NextCount = 0;
+	}
+	if( readAhead )
+	{
+		window.Current ^= 1;
+	}
+	else
+	{
+		count = window.Source->Read( start, window.Buffers[window.Current].data(), expectedCount );
+	}
+
+	this->Data = window.Buffers[window.Current].data();
+	this->WindowStart = start;
+	this->WindowEnd = start + count;
+
+	// start reading the next window
+	const u64 nextStart = start + window.Size;
+	if( count == expectedCount && nextStart < this->DataSize )
+	{
+		window.StartNextRead( nextStart, std::min( window.Size, this->DataSize - nextStart ) );
+	}
+
+	return position < this->WindowEnd;
+}
 
 u64 ReadStream::ReadRawData( void *dest, u64 count )
 {
@@ -20,11 +160,30 @@ u64 ReadStream::ReadRawData( void *dest, u64 count )
 		count = end_pos - this->DataPosition;
 	}
 
-	// copy the data and move the position
-	memcpy( dest, &this->Data[this->DataPosition], count );
-	this->DataPosition = end_pos;
-	return count;
+	// copy the data and move the position, if all of it is within the window (which is always the case if there is no source)
+	if( this->DataPosition >= this->WindowStart && end_pos <= this->WindowEnd )
+	{
+		memcpy( dest, &this->Data[this->DataPosition - this->WindowStart], count );
+		this->DataPosition = end_pos;
+		return count;
+	}
+
+	// copy the data window by window
+	u8 *destBytes = (u8 *)dest;
+	u64 readCount = 0;
+	while( readCount < count )
+	{
+		if( ( this->DataPosition < this->WindowStart || this->DataPosition >= this->WindowEnd ) && !this->MoveWindow( this->DataPosition ) )
+			break;
+
+		const u64 copyCount = std::min( count - readCount, this->WindowEnd - this->DataPosition );
+		memcpy( &destBytes[readCount], &this->Data[this->DataPosition - this->WindowStart], copyCount );
+		this->DataPosition += copyCount;
+		readCount += copyCount;
+	}
+	return readCount;
 }
 
+#include "_pds_undef_macros.inl"
 }
 // namespace pds
\ No newline at end of file
@@ -0,0 +1,229 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+#pragma once
+#ifndef __PDS__WORKERPOOL_H__
+#define __PDS__WORKERPOOL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fwd.h"
+
+namespace pds
+{
+
+// WorkerPool is a fixed-size pool of worker threads, used by the EntityManager to
+// run load and save tasks. Each worker owns a task queue. Tasks submitted from outside
+// the pool are distributed round-robin over the queues, and an idle worker will steal
+// tasks from the other queues.
+// The queues are bounded by a max depth. If the queue of a task is full, the task is put in
+// any other queue which has room. A submitting thread blocks only if all queues are full,
+// except if the submitting thread is itself a worker in the pool, in which case the task
+// is run inline. A task which needs to wait for sub-tasks should use Wait(), which runs
+// queued tasks while waiting, instead of blocking the worker.
+class WorkerPool
+{
+public:
+	// snapshot of the metrics of one of the worker queues.
+	// times are in nanoseconds, and are accumulated over all tasks run from the queue.
+	struct QueueMetrics
+	{
+		u64 Depth = 0;				// number of tasks currently waiting in the queue
+		u64 PeakDepth = 0;			// the max number of tasks which have been waiting in the queue at the same time
+		u64 SubmittedTasks = 0;		// total number of tasks which have been submitted to the queue
+		u64 CompletedTasks = 0;		// total number of tasks from the queue which have been run
+		u64 StolenTasks = 0;		// number of the completed tasks which were stolen and run by another worker
+		u64 BlockedSubmits = 0;		// number of times a submitting thread had to wait for the queue to have room
+		u64 TotalWaitTime = 0;		// total time the tasks have been waiting in the queue before being run
+		u64 TotalRunTime = 0;		// total time spent running the tasks
+	};
+
+	WorkerPool() = default;
+	WorkerPool( const WorkerPool & ) = delete;
+	WorkerPool &operator=( const WorkerPool & ) = delete;
+	~WorkerPool();
+
+	// Starts the worker threads. workerCount == 0 uses the hardware concurrency of the system.
+	// maxQueueDepth is the max number of tasks waiting in each queue, 0 means unbounded.
+	status Initialize( uint workerCount, uint maxQueueDepth );
+
+	// Runs all queued tasks to completion, and stops the worker threads. The queue metrics are kept until the next Initialize.
+	void Deinitialize();
+
+	// Submits a task to the pool, and returns a future for the return value of the task.
+	// If the pool is not initialized, the task is run directly on the calling thread.
+	template<class _Fn> auto Submit( _Fn &&func ) -> std::future<decltype( func() )>;
+
+	// Waits for a future returned by Submit. If called from a worker thread, the worker
+	// runs other queued tasks while waiting, so that the pool can not deadlock. When there
+	// are no tasks to run, the worker sleeps until a task is submitted or finished.
+	template<class _Ty> void Wait( const std::future<_Ty> &futr );
+	template<class _Ty> void Wait( const std::shared_future<_Ty> &futr );
+
+	// Wakes up the workers which are waiting in Wait(). Must be called after completing a future 
+	// outside of a pool task (such as by setting a std::promise), if a worker may be waiting for it.
+	void NotifyWaiters();
+
+	// Calls func( index ) for each index in [0,count), spread out over the workers. The calling
+	// thread takes part in running the items, and returns when all items are done.
+	template<class _Fn> void ParallelFor( size_t count, const _Fn &func );
+
+	// Returns the number of worker threads in the pool
+	uint GetWorkerCount() const { return (uint)this->Workers.size(); }
+
+	// Returns true if the calling thread is one of the worker threads of this pool
+	bool IsWorkerThread() const;
+
+	// Returns a snapshot of the metrics of each of the worker queues
+	std::vector<QueueMetrics> GetQueueMetrics() const;
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct Task
+	{
+		std::function<void()> Func;
+		clock::time_point SubmitTime;
+	};
+
+	struct Queue
+	{
+		mutable std::mutex Lock;
+		std::condition_variable NotFull;
+		std::deque<Task> Tasks;
+
+		u64 PeakDepth = 0;
+		u64 SubmittedTasks = 0;
+		u64 BlockedSubmits = 0;
+		std::atomic<u64> CompletedTasks { 0 };
+		std::atomic<u64> StolenTasks { 0 };
+		std::atomic<u64> TotalWaitTime { 0 };
+		std::atomic<u64> TotalRunTime { 0 };
+	};
+
+	std::vector<std::unique_ptr<Queue>> Queues;
+	std::vector<std::thread> Workers;
+	uint MaxQueueDepth = 0;
+
+	std::atomic<uint> NextQueue { 0 };
+	std::atomic<u64> PendingTasks { 0 };
+	bool Stopping = false;
+	std::mutex WakeLock;
+	std::condition_variable WakeCondition;
+
+	// workers sleeping in Wait(), which are woken when a task is submitted or finished
+	std::atomic<uint> Waiters { 0 };
+	u64 WaitGeneration = 0;
+	std::mutex WaitLock;
+	std::condition_variable WaitCondition;
+
+	void Enqueue( std::function<void()> func );
+	bool PopTask( uint workerIndex, Task &task, uint &queueIndex );
+	void RunTask( Task &task, uint queueIndex, bool stolen );
+	bool RunPendingTask();
+	template<class _Future> void WaitForFuture( const _Future &futr );
+	void WorkerThread( uint workerIndex );
+};
+
+template<class _Fn> auto WorkerPool::Submit( _Fn &&func ) -> std::future<decltype( func() )>
+{
+	using return_type = decltype( func() );
+
+	// std::function needs a copyable callable, so keep the packaged task in a shared_ptr
+	auto task = std::make_shared<std::packaged_task<return_type()>>( std::forward<_Fn>( func ) );
+	auto futr = task->get_future();
+	this->Enqueue( [task]() { ( *task )( ); } );
+	return futr;
+}
+
+template<class _Ty> void WorkerPool::Wait( const std::future<_Ty> &futr )
+{
+	this->WaitForFuture( futr );
+}
+
+template<class _Ty> void WorkerPool::Wait( const std::shared_future<_Ty> &futr )
+{
+	this->WaitForFuture( futr );
+}
+
+template<class _Future> void WorkerPool::WaitForFuture( const _Future &futr )
+{
+	if( !this->IsWorkerThread() )
+	{
+		futr.wait();
+		return;
+	}
+
+	// help out with the queued tasks until the future is ready
+	while( futr.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready )
+	{
+		if( this->RunPendingTask() )
+		{
+			continue;
+		}
+
+		// nothing to run. register as a waiter before checking again, so a task which finishes 
+		// after the check is guaranteed to see the waiter and wake it up
+		std::unique_lock<std::mutex> lock( this->WaitLock );
+		++this->Waiters;
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		const u64 generation = this->WaitGeneration;
+		if( futr.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready && this->PendingTasks == 0 )
+		{
+			this->WaitCondition.wait( lock, [this, generation]() { return this->WaitGeneration != generation; } );
+		}
+		--this->Waiters;
+	}
+}
+
+template<class _Fn> void WorkerPool::ParallelFor( size_t count, const _Fn &func )
+{
+	if( count == 0 )
+	{
+		return;
+	}
+
+	// the items are claimed one at a time, by the helper tasks and the calling thread
+	auto nextItem = std::make_shared<std::atomic<size_t>>( 0 );
+	auto runItems = [nextItem, count, &func]()
+	{
+		for( size_t index = ( *nextItem )++; index < count; index = ( *nextItem )++ )
+		{
+			func( index );
+		}
+	};
+
+	// no need for more helpers than workers, or than the items left for the calling thread
+	const size_t helperCount = std::min( size_t( this->GetWorkerCount() ), count - 1 );
+	std::vector<std::future<void>> helpers;
+	helpers.reserve( helperCount );
+	for( size_t i = 0; i < helperCount; ++i )
+	{
+		helpers.emplace_back( this->Submit( runItems ) );
+	}
+
+	runItems();
+
+	// func is referenced by the helpers, so wait for all of them, even if they did not get any items
+	for( const auto &helper : helpers )
+	{
+		this->Wait( helper );
+	}
+}
+
+}
+// namespace pds
+
+#ifdef PDS_IMPLEMENTATION
+#include "WorkerPool.inl"
+#endif//PDS_IMPLEMENTATION
+
+#endif//__PDS__WORKERPOOL_H__
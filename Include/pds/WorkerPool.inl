@@ -0,0 +1,278 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include <algorithm>
+
+#include <ctle/log.h>
+
+namespace pds
+{
+#include "_pds_macros.inl"
+
+// the pool and queue index of the worker running on this thread, if any
+static thread_local const WorkerPool *workerPoolCurrentPool = nullptr;
+static thread_local uint workerPoolCurrentIndex = 0;
+
+static u64 workerPoolNanoseconds( std::chrono::steady_clock::duration duration )
+{
+	return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>( duration ).count();
+}
+
+WorkerPool::~WorkerPool()
+{
+	this->Deinitialize();
+}
+
+status WorkerPool::Initialize( uint workerCount, uint maxQueueDepth )
+{
+	ctValidate( this->Workers.empty(), status::already_initialized ) << "The WorkerPool is already initialized" << ctValidateEnd;
+
+	if( workerCount == 0 )
+	{
+		workerCount = std::max( 1u, (uint)std::thread::hardware_concurrency() );
+	}
+
+	this->MaxQueueDepth = maxQueueDepth;
+	this->Stopping = false;
+
+	// one queue per worker
+	this->Queues.clear();
+	this->Queues.reserve( workerCount );
+	for( uint i = 0; i < workerCount; ++i )
+	{
+		this->Queues.emplace_back( std::make_unique<Queue>() );
+	}
+
+	this->Workers.reserve( workerCount );
+	for( uint i = 0; i < workerCount; ++i )
+	{
+		this->Workers.emplace_back( &WorkerPool::WorkerThread, this, i );
+	}
+
+	return status::ok;
+}
+
+void WorkerPool::Deinitialize()
+{
+	if( this->Workers.empty() )
+		return;
+
+	// signal the workers to stop. the workers will finish all queued tasks before exiting
+	{
+		std::lock_guard<std::mutex> guard( this->WakeLock );
+		this->Stopping = true;
+	}
+	this->WakeCondition.notify_all();
+
+	for( auto &worker : this->Workers )
+	{
+		worker.join();
+	}
+
+	// the queues are kept, so the metrics are still available
+	this->Workers.clear();
+}
+
+bool WorkerPool::IsWorkerThread() const
+{
+	return workerPoolCurrentPool == this;
+}
+
+void WorkerPool::Enqueue( std::function<void()> func )
+{
+	Task task = { std::move( func ), clock::now() };
+
+	// if the pool is not running, run the task directly
+	if( this->Workers.empty() )
+	{
+		task.Func();
+		return;
+	}
+
+	// workers push to their own queue, other threads distribute the tasks round-robin
+	const bool isWorker = this->IsWorkerThread();
+	const uint queueCount = (uint)this->Queues.size();
+	const uint firstQueueIndex = ( isWorker ) ? ( workerPoolCurrentIndex ) : ( this->NextQueue++ % queueCount );
+
+	// if the queue is full, use the first of the other queues which has room
+	uint queueIndex = firstQueueIndex;
+	std::unique_lock<std::mutex> lock( this->Queues[queueIndex]->Lock );
+	if( this->MaxQueueDepth > 0 && this->Queues[queueIndex]->Tasks.size() >= this->MaxQueueDepth )
+	{
+		for( uint i = 1; i < queueCount; ++i )
+		{
+			const uint index = ( firstQueueIndex + i ) % queueCount;
+			std::unique_lock<std::mutex> otherLock( this->Queues[index]->Lock );
+			if( this->Queues[index]->Tasks.size() < this->MaxQueueDepth )
+			{
+				lock = std::move( otherLock );
+				queueIndex = index;
+				break;
+			}
+		}
+	}
+
+	Queue &queue = *this->Queues[queueIndex];
+	++queue.SubmittedTasks;
+	if( this->MaxQueueDepth > 0 && queue.Tasks.size() >= this->MaxQueueDepth )
+	{
+		// a worker must never block on a queue, since that could deadlock the pool. run the task inline instead
+		if( isWorker )
+		{
+			lock.unlock();
+			this->RunTask( task, queueIndex, false );
+			return;
+		}
+
+		// all queues are full, wait for a worker to take a task from the queue
+		++queue.BlockedSubmits;
+		queue.NotFull.wait( lock, [this, &queue]() { return queue.Tasks.size() < this->MaxQueueDepth; } );
+	}
+	queue.Tasks.emplace_back( std::move( task ) );
+	queue.PeakDepth = std::max( queue.PeakDepth, (u64)queue.Tasks.size() );
+	++this->PendingTasks;
+	lock.unlock();
+
+	// take the wake lock before notifying, so a worker which is about to go to sleep does not miss the task
+	{
+		std::lock_guard<std::mutex> guard( this->WakeLock );
+	}
+	this->WakeCondition.notify_one();
+
+	// a worker waiting in Wait() can run the task
+	this->NotifyWaiters();
+}
+
+void WorkerPool::NotifyWaiters()
+{
+	// pairs with the fence in WaitForFuture, so either the waiter sees the completed future, or this sees the waiter
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+	if( this->Waiters == 0 )
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard( this->WaitLock );
+		++this->WaitGeneration;
+	}
+	this->WaitCondition.notify_all();
+}
+
+bool WorkerPool::PopTask( uint workerIndex, Task &task, uint &queueIndex )
+{
+	// first look in the worker's own queue, then try to steal from the other queues.
+	// the owner takes the oldest task from the front, thieves take from the back to avoid contending with the owner
+	const uint queueCount = (uint)this->Queues.size();
+	for( uint i = 0; i < queueCount; ++i )
+	{
+		const uint index = ( workerIndex + i ) % queueCount;
+		Queue &queue = *this->Queues[index];
+
+		std::unique_lock<std::mutex> lock( queue.Lock );
+		if( queue.Tasks.empty() )
+			continue;
+
+		if( index == workerIndex )
+		{
+			task = std::move( queue.Tasks.front() );
+			queue.Tasks.pop_front();
+		}
+		else
+		{
+			task = std::move( queue.Tasks.back() );
+			queue.Tasks.pop_back();
+		}
+		--this->PendingTasks;
+		lock.unlock();
+
+		// there is room in the queue now, wake up any blocked submitter
+		queue.NotFull.notify_one();
+
+		queueIndex = index;
+		return true;
+	}
+
+	return false;
+}
+
+void WorkerPool::RunTask( Task &task, uint queueIndex, bool stolen )
+{
+	Queue &queue = *this->Queues[queueIndex];
+
+	const auto startTime = clock::now();
+	task.Func();
+	const auto endTime = clock::now();
+
+	// the task may have completed a future which a worker is waiting for
+	this->NotifyWaiters();
+
+	queue.TotalWaitTime += workerPoolNanoseconds( startTime - task.SubmitTime );
+	queue.TotalRunTime += workerPoolNanoseconds( endTime - startTime );
+	++queue.CompletedTasks;
+	if( stolen )
+	{
+		++queue.StolenTasks;
+	}
+}
+
+bool WorkerPool::RunPendingTask()
+{
+	Task task;
+	uint queueIndex = 0;
+	if( !this->PopTask( workerPoolCurrentIndex, task, queueIndex ) )
+		return false;
+
+	this->RunTask( task, queueIndex, queueIndex != workerPoolCurrentIndex );
+	return true;
+}
+
+void WorkerPool::WorkerThread( uint workerIndex )
+{
+	workerPoolCurrentPool = this;
+	workerPoolCurrentIndex = workerIndex;
+
+	for( ;;)
+	{
+		Task task;
+		uint queueIndex = 0;
+		if( this->PopTask( workerIndex, task, queueIndex ) )
+		{
+			this->RunTask( task, queueIndex, queueIndex != workerIndex );
+			continue;
+		}
+
+		// nothing to do, sleep until there are tasks, or the pool is stopping
+		std::unique_lock<std::mutex> lock( this->WakeLock );
+		this->WakeCondition.wait( lock, [this]() { return this->Stopping || this->PendingTasks > 0; } );
+		if( this->Stopping && this->PendingTasks == 0 )
+			break;
+	}
+
+	workerPoolCurrentPool = nullptr;
+}
+
+std::vector<WorkerPool::QueueMetrics> WorkerPool::GetQueueMetrics() const
+{
+	std::vector<QueueMetrics> ret( this->Queues.size() );
+	for( size_t i = 0; i < this->Queues.size(); ++i )
+	{
+		const Queue &queue = *this->Queues[i];
+		QueueMetrics &metrics = ret[i];
+
+		std::lock_guard<std::mutex> guard( queue.Lock );
+		metrics.Depth = (u64)queue.Tasks.size();
+		metrics.PeakDepth = queue.PeakDepth;
+		metrics.SubmittedTasks = queue.SubmittedTasks;
+		metrics.BlockedSubmits = queue.BlockedSubmits;
+		metrics.CompletedTasks = queue.CompletedTasks;
+		metrics.StolenTasks = queue.StolenTasks;
+		metrics.TotalWaitTime = queue.TotalWaitTime;
+		metrics.TotalRunTime = queue.TotalRunTime;
+	}
+	return ret;
+}
+
+#include "_pds_undef_macros.inl"
+}
+// namespace pds
@@ -4,6 +4,11 @@
 #ifndef __PDS__WRITESTREAM_H__
 #define __PDS__WRITESTREAM_H__
 
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <vector>
+
 #include "fwd.h"
 #include <ctle/uuid.h>
 #include <ctle/digest.h>
@@ -11,17 +16,63 @@
 namespace pds
 {
 
+// WriteStreamSink receives the data of a WriteStream which is set up to write to a sink.
+// Data is appended in order, and data which has already been appended can be 
+// overwritten by Patch, which is used when block sizes are written at the end of blocks.
+class WriteStreamSink
+{
+public:
+	virtual ~WriteStreamSink() = default;
+
+	// append data at the end of the sink
+	virtual status Append( const u8 *data, u64 size ) = 0;
+
+	// overwrite data which has already been appended, starting at offset
+	virtual status Patch( u64 offset, const u8 *data, u64 size ) = 0;
+};
+
+// FileWriteStreamSink writes the data to a file, and patches it by seeking in the file.
+// The file can be read back in chunks, to hash or copy the finished data without loading all of it.
+class FileWriteStreamSink : public WriteStreamSink
+{
+public:
+	// creates (or truncates) the file
+	status Open( const std::string &path );
+	void Close();
+
+	status Append( const u8 *data, u64 size ) override;
+	status Patch( u64 offset, const u8 *data, u64 size ) override;
+
+	// get the size of the data in the file
+	u64 GetSize() const { return this->Size; }
+
+	// read back the data of the file, in chunks of at most chunkSize bytes, and call func( data, size ) for each chunk.
+	// func returns a status, and reading stops at the first chunk which is not status::ok
+	template<class _Fn> status ReadBack( const _Fn &func, u64 chunkSize = 1024 * 1024 );
+
+private:
+	std::fstream File;
+	std::string Path;
+	u64 Size = 0;
+};
+
 // Memory write stream is a write-only memory area.
 // The stream is used to write structured values. 
 // It can write out more complex types than just plain old data (POD) 
 // types, and also supports std::string, UUIDs and std::vectors of 
 // the above types.
+// The stream can also be set up to write to a WriteStreamSink. The data is then
+// buffered in memory only until a chunk is filled, and the chunk is then appended to 
+// the sink. Writes to positions which are already passed to the sink (such as when
+// block sizes are written) are patched in the sink. Call Flush to pass the remaining 
+// buffered data to the sink, and to get the status of the sink writes.
 // Caveat: The stream is NOT thread safe, and should be accessed by 
 // only one thread at a time.
 class WriteStream
 {
 private:
-	static const u64 InitialAllocationSize = 1024 * 1024 * 64; // 64MB initial size
+	static const u64 InitialAllocationSize = 1024 * 4; // 4KB initial size, the allocation grows geometrically
+	static const u64 DefaultSinkChunkSize = 1024 * 1024 * 4; // 4MB chunks are passed to the sink
 
 	u8 *Data = nullptr; // the allocated data
 	u64 DataSize = 0; // the size of the memory stream (not the reserved allocation)
@@ -30,6 +81,59 @@ private:
 	u64 DataReservedSize = 0; // the reserved size of the allocation
 	u32 PageSize = 0; // size of each page of allocation
 
+	// if a sink is set, the allocation holds the data from FlushedSize to DataSize, 
+	// and the data before FlushedSize has been appended to the sink
+	WriteStreamSink *Sink = nullptr;
+	u64 SinkChunkSize = 0;
+	u64 FlushedSize = 0;
+	status SinkStatus = status::ok;
+
+	// the positions of the placeholder values which are not yet filled in, in the order they were written
+	std::vector<u64> Placeholders;
+
+	// with compact encoding, a filled placeholder leaves a gap of unused bytes after its varint. the gaps are removed in 
+	// one pass when the last open placeholder is filled, so the data is moved at most once. GapsSize is the total size 
+	// of the gaps, and PlaceholderGapsSizes holds the GapsSize when each of the open placeholders was written.
+	struct PlaceholderGap
+	{
+		u64 Position;
+		u64 Size;
+	};
+	std::vector<PlaceholderGap> Gaps;
+	u64 GapsSize = 0;
+	std::vector<u64> PlaceholderGapsSizes;
+
+	// if a hasher is set in tree mode, and compact encoding is not used, the leaves are hashed as soon as they are written, 
+	// and have no unfilled placeholders. the leaves before HashedEnd are either hashed, or deferred until their placeholders 
+	// are filled. in flat mode, or with compact encoding, all of the data is hashed by FinishHash.
+	EntityHasher *Hasher = nullptr;
+	u64 HashedEnd = 0;
+	std::vector<u64> DeferredLeaves;
+	status HashStatus = status::ok;
+
+	// arrays with at least this many bytes of values are compressed when written, 0 disables compression
+	u64 CompressionThreshold = 0;
+
+	// if set, sizes and counts are written as varints, and placeholders shrink to the varint when filled
+	bool CompactEncoding = false;
+
+	// sections arrays with at least this many sections are written with an offset table, 0 disables offset tables
+	u64 SectionsArrayOffsetThreshold = 0;
+
+	// remove the gaps of the filled placeholders, when there are no open placeholders
+	void RemoveGaps();
+
+	// hash the leaves which are finished, if the data is hashed while written
+	bool HashesWhileWriting() const;
+	void HashFinishedLeaves();
+	bool LeafHasPlaceholder( u64 leafIndex ) const;
+
+	// append the buffered data to the sink
+	void FlushToSink();
+
+	// write raw bytes when the stream has a sink
+	void WriteToSink( const u8 *src, u64 count );
+
 	// reserve data for at least reserveSize.
 	void ReserveForSize( u64 reserveSize );
 	void FreeAllocation();
@@ -45,18 +149,79 @@ private:
 
 public:
 	WriteStream( u64 _InitialAllocationSize = InitialAllocationSize );
+	WriteStream( WriteStreamSink *_Sink, u64 _SinkChunkSize = DefaultSinkChunkSize );
 	~WriteStream();
 
-	// get a read-only pointer to the data
-	const void *GetData() const { return this->Data; }
+	// pass any buffered data to the sink, and return the status of the sink writes. 
+	// the stream can be written to after the flush. a stream without a sink always returns status::ok. 
+	status Flush();
+
+	// make sure the allocation can hold at least reserveSize bytes without growing
+	void Reserve( u64 reserveSize );
+
+	// empty the stream, but keep the allocation, so the stream can be reused for another write. not valid on a stream with a sink.
+	void Clear();
+
+	// if the allocation is larger than maxReservedSize, replace it with an allocation of maxReservedSize. the stream must be empty.
+	void Shrink( u64 maxReservedSize );
+
+	// write a u64 placeholder value (INT64_MAX on purpose, which is definitely wrong, so that a placeholder 
+	// which is not filled in triggers errors), which is filled in later with FillPlaceholder. used for block sizes, 
+	// which are not known until the block is written. placeholders are filled in the reverse order they are written.
+	// with compact encoding, the filled value is a varint, and the stream shrinks by the unused bytes of the placeholder 
+	// once all placeholders are filled. until then, the value is the block size minus the gaps within the block.
+	void WritePlaceholder();
+	void FillPlaceholder( u64 placeholderPosition, u64 value );
+
+	// hash the data with hasher. in tree mode without compact encoding, the leaves are hashed while they are written, 
+	// as soon as they are final (see Hasher above), while still in the cpu cache. in flat mode, or with compact encoding, 
+	// the data is hashed by FinishHash. must be set before anything is written, and is not supported on a stream with a sink.
+	void SetHasher( EntityHasher *hasher );
+
+	// the number of bytes which are hashed so far
+	u64 GetHashedSize() const;
+
+	// hash the data which is not yet hashed, and return the hash of all of the data. all placeholders must be filled.
+	status_return<hash> FinishHash();
+
+	// set the size (in bytes) of the values of an array, at which the values are compressed by the array writers. 
+	// set to 0 (the default) to write all arrays uncompressed. the setting is kept when the stream is cleared.
+	void SetCompressionThreshold( u64 threshold ) { this->CompressionThreshold = threshold; }
+	u64 GetCompressionThreshold() const { return this->CompressionThreshold; }
+
+	// set the number of sections of a sections array, at which the EntityWriter writes an offset table after the 
+	// sections, so the sections can be read in any order, or in parallel. set to 0 (the default) to not write offset tables.
+	void SetSectionsArrayOffsetThreshold( u64 threshold ) { this->SectionsArrayOffsetThreshold = threshold; }
+	u64 GetSectionsArrayOffsetThreshold() const { return this->SectionsArrayOffsetThreshold; }
 
-	// get the Size of the stream in bytes
+	// set the stream to use compact encoding, where the array writers write sizes and counts as (LEB128) varints instead 
+	// of fixed size values. when a placeholder is filled, the value is written as a varint, and when the last open 
+	// placeholder is filled, the data is moved back over the unused placeholder bytes. must be set before anything is 
+	// written, and is not supported on a stream with a sink, since data which is passed to the sink can not be moved. 
+	// the setting is kept when the stream is cleared.
+	void SetCompactEncoding( bool compact );
+	bool GetCompactEncoding() const { return this->CompactEncoding; }
+
+	// get a read-only pointer to the data, and the size of the data in bytes. not valid on a stream with a 
+	// sink, since the data which is passed to the sink is no longer held by the stream. use GetTotalSize instead.
+	const void *GetData() const;
 	u64 GetSize() const;
 
+	// get the size of the allocation in bytes
+	u64 GetReservedSize() const { return this->DataReservedSize; }
+
+	// get the total size of the written stream in bytes, including any data which is passed to the sink
+	u64 GetTotalSize() const { return this->DataSize; }
+
 	// Position is the current data position. the beginning of the stream is position 0. the stream grows whenever the position moves past the current end of the stream.
 	u64 GetPosition() const;
 	void SetPosition( u64 new_pos );
 
+	// get the current position, not counting the gaps of the filled placeholders, which are not yet removed. only differs 
+	// from GetPosition with compact encoding. use it for distances which are stored in the stream, such as offsets, where 
+	// no placeholder which is still open is between the two positions.
+	u64 GetCompactedPosition() const { return this->Position - this->GapsSize; }
+
 	// write one item to the memory stream. makes sure to convert endianness
 	void Write( const i8 &src );
 	void Write( const i16 &src );
@@ -71,6 +236,19 @@ public:
 	void Write( const uuid &src );
 	void Write( const hash &src );
 
+	// write an unsigned LEB128 varint, 7 bits per byte, with the high bit set on all bytes but the last. if minSize 
+	// is set, the varint is padded with continuation bytes to at least minSize bytes (at most 10), which reads as the same value.
+	void WriteVarint( u64 value, u64 minSize = 1 );
+
+	// reserve size bytes at the end of the stream, and return a pointer to them, so that they can be filled in directly, 
+	// such as by a compressor. the bytes are added to the stream by writes over them, or by WriteReserved. the pointer is 
+	// valid until the stream grows past the reserved bytes. the position must be at the end of the stream. returns nullptr 
+	// on a stream with a sink, since its data is passed on to the sink.
+	u8 *ReserveAtEnd( u64 size );
+
+	// add count bytes at the position, which are already filled in through ReserveAtEnd, to the stream
+	void WriteReserved( u64 count );
+
 	// write an array of items to the memory stream. makes sure to convert endianness
 	void Write( const i8 *src, u64 count );
 	void Write( const i16 *src, u64 count );
@@ -86,8 +264,61 @@ public:
 	void Write( const hash *src, u64 count );
 };
 
+// WriteStreamPool keeps a per-thread list of released WriteStreams, so that their allocations
+// can be reused by later writes on the same thread, instead of allocating a new buffer per write.
+// The allocations are sized in size classes (powers of 4, from 4KB), selected by the size hint of 
+// Acquire, so streams of similar sizes are interchangeable. Streams which have grown beyond 
+// MaxRetainedSize are shrunk when released, and the total size of the streams pooled by a thread 
+// is capped at MaxPooledTotalSize, so a single large write does not keep its allocation alive.
+class WriteStreamPool
+{
+public:
+	static const size_t MaxPooledStreams = 4; // max number of streams pooled per thread
+	static const u64 MinSizeClass = 1024 * 4; // 4KB, the smallest size class
+	static const u64 MaxRetainedSize = 1024 * 1024 * 4; // 4MB, larger streams are shrunk to this size when released
+	static const u64 MaxPooledTotalSize = 1024 * 1024 * 8; // 8MB, max total allocation size of the streams pooled per thread
+
+	// a stream which is owned by the caller, and returned to the pool when the handle is destroyed
+	class Handle
+	{
+	public:
+		Handle( std::unique_ptr<WriteStream> _stream ) : Stream( std::move( _stream ) ) {}
+		Handle( Handle && ) = default;
+		Handle &operator=( Handle && ) = default;
+		~Handle() { if( this->Stream ) WriteStreamPool::Release( std::move( this->Stream ) ); }
+
+		WriteStream &operator*() const { return *this->Stream; }
+		WriteStream *operator->() const { return this->Stream.get(); }
+
+	private:
+		std::unique_ptr<WriteStream> Stream;
+	};
+
+	// get an empty stream from the pool of the calling thread, or a new stream if the pool is empty. 
+	// sizeHint is the expected size of the write. it is rounded up to its size class, which selects 
+	// the smallest pooled stream that can hold it, and the allocation is reserved up front.
+	static Handle Acquire( u64 sizeHint = 0 );
+
+	// returns the size class of a size, the smallest power of 4 multiple of MinSizeClass which is at least size
+	static u64 GetSizeClass( u64 size );
+
+	// the number of streams currently pooled by the calling thread, and the total size of their allocations
+	static size_t GetPooledCount();
+	static u64 GetPooledSize();
+
+private:
+	static std::vector<std::unique_ptr<WriteStream>> &GetThreadPool();
+	static void Release( std::unique_ptr<WriteStream> stream );
+};
+
 inline void WriteStream::WriteRawData( const void *src, u64 count )
 {
+	if( this->Sink )
+	{
+		this->WriteToSink( (const u8 *)src, count );
+		return;
+	}
+
 	// cap the end position
 	u64 end_pos = this->Position + count;
 	if( end_pos > this->DataSize )
@@ -106,11 +337,6 @@ template <class T> inline void WriteStream::WriteValues( const T *src, u64 count
 	this->WriteRawData( src, count * sizeof( T ) );
 }
 
-inline u64 WriteStream::GetSize() const
-{
-	return this->DataSize;
-}
-
 inline u64 WriteStream::GetPosition() const
 {
 	return this->Position;
@@ -139,6 +365,34 @@ inline void WriteStream::Write( const double &src ) { this->Write( &src, 1 ); }
 inline void WriteStream::Write( const uuid &src ) { this->Write( &src, 1 ); }
 inline void WriteStream::Write( const hash &src ) { this->Write( &src, 1 ); }
 
+template<class _Fn> inline status FileWriteStreamSink::ReadBack( const _Fn &func, u64 chunkSize )
+{
+	if( !this->File.is_open() )
+	{
+		return status::not_initialized;
+	}
+
+	std::vector<u8> buffer( (size_t)std::min( chunkSize, this->Size ) );
+	this->File.seekg( 0, std::ios::beg );
+	for( u64 offset = 0; offset < this->Size; offset += buffer.size() )
+	{
+		const u64 readSize = std::min( (u64)buffer.size(), this->Size - offset );
+		this->File.read( (char *)buffer.data(), (std::streamsize)readSize );
+		if( !this->File.good() )
+		{
+			return status::cant_read;
+		}
+
+		const status result = func( (const u8 *)buffer.data(), readSize );
+		if( result != status::ok )
+		{
+			return result;
+		}
+	}
+
+	return status::ok;
+}
+
 // 8 bit data
 inline void WriteStream::Write( const i8 *src, u64 count ) { return this->WriteValues<u8>( (const u8*)src, count ); }
 inline void WriteStream::Write( const u8 *src, u64 count ) { return this->WriteValues<u8>( src, count ); }
@@ -3,21 +3,106 @@
 
 #pragma once
 
+#include <ctle/log.h>
+
 #include "WriteStream.h"
+#include "EntityHasher.h"
 
 namespace pds
 {
+#include "_pds_macros.inl"
 
 WriteStream::WriteStream( u64 _InitialAllocationSize ) 
 { 
 	this->ReserveForSize( _InitialAllocationSize ); 
 }
 
+WriteStream::WriteStream( WriteStreamSink *_Sink, u64 _SinkChunkSize )
+	: Sink( _Sink )
+	, SinkChunkSize( _SinkChunkSize )
+{
+	const u64 initialAllocationSize = InitialAllocationSize;
+	this->ReserveForSize( std::min( _SinkChunkSize, initialAllocationSize ) );
+}
+
 WriteStream::~WriteStream() 
 { 
 	this->FreeAllocation(); 
 }
 
+status WriteStream::Flush()
+{
+	if( !this->Sink )
+	{
+		return status::ok;
+	}
+
+	this->FlushToSink();
+	return this->SinkStatus;
+}
+
+void WriteStream::FlushToSink()
+{
+	// after the first failed sink write, the data is dropped, and only the failed status is kept
+	const u64 bufferedSize = this->DataSize - this->FlushedSize;
+	if( bufferedSize > 0 && this->SinkStatus == status::ok )
+	{
+		this->SinkStatus = this->Sink->Append( this->Data, bufferedSize );
+	}
+	this->FlushedSize = this->DataSize;
+}
+
+void WriteStream::WriteToSink( const u8 *src, u64 count )
+{
+	// the part of the data which is written before the buffered data has already been appended 
+	// to the sink, so patch it in the sink
+	if( this->Position < this->FlushedSize )
+	{
+		const u64 patchCount = std::min( count, this->FlushedSize - this->Position );
+		if( this->SinkStatus == status::ok )
+		{
+			this->SinkStatus = this->Sink->Patch( this->Position, src, patchCount );
+		}
+		this->Position += patchCount;
+		src += patchCount;
+		count -= patchCount;
+	}
+	if( count == 0 )
+	{
+		return;
+	}
+
+	const u64 end_pos = this->Position + count;
+	if( this->Position == this->DataSize )
+	{
+		// appending at the end of the stream. if the chunk is full, pass it on to the sink first
+		if( this->DataSize + count - this->FlushedSize > this->SinkChunkSize )
+		{
+			this->FlushToSink();
+		}
+
+		// if the data by itself is larger than a chunk, append it directly, without buffering it
+		if( count > this->SinkChunkSize )
+		{
+			if( this->SinkStatus == status::ok )
+			{
+				this->SinkStatus = this->Sink->Append( src, count );
+			}
+			this->DataSize = end_pos;
+			this->FlushedSize = end_pos;
+			this->Position = end_pos;
+			return;
+		}
+	}
+
+	if( end_pos > this->DataSize )
+	{
+		this->Resize( end_pos );
+	}
+	memcpy( &this->Data[this->Position - this->FlushedSize], src, count );
+	this->Position = end_pos;
+}
+
 void WriteStream::ReserveForSize( u64 reserveSize )
 {
 	// we need to resize the reserved data area, try doubling size
@@ -43,7 +128,7 @@ void WriteStream::ReserveForSize( u64 reserveSize )
 	// the area can never shrink, so we don't need to worry about capping
 	if( this->Data )
 	{
-		memcpy( pNewData, this->Data, this->DataSize );
+		memcpy( pNewData, this->Data, this->DataSize - this->FlushedSize );
 		this->FreeAllocation();
 	}
 
@@ -64,15 +149,424 @@ void WriteStream::FreeAllocation()
 	}
 }
 
+void WriteStream::Reserve( u64 reserveSize )
+{
+	if( reserveSize > this->DataReservedSize )
+	{
+		this->ReserveForSize( reserveSize );
+	}
+}
+
+void WriteStream::Clear()
+{
+	this->DataSize = 0;
+	this->Position = 0;
+	this->Placeholders.clear();
+	this->Gaps.clear();
+	this->GapsSize = 0;
+	this->PlaceholderGapsSizes.clear();
+	this->Hasher = nullptr;
+	this->HashedEnd = 0;
+	this->DeferredLeaves.clear();
+	this->HashStatus = status::ok;
+}
+
+const void *WriteStream::GetData() const
+{
+	ctSanityCheck( this->Sink == nullptr );
+	return this->Data;
+}
+
+u64 WriteStream::GetSize() const
+{
+	ctSanityCheck( this->Sink == nullptr );
+	return this->DataSize;
+}
+
+void WriteStream::Shrink( u64 maxReservedSize )
+{
+	ctSanityCheck( this->DataSize == 0 && !this->Sink );
+	if( this->DataReservedSize <= maxReservedSize )
+	{
+		return;
+	}
+
+	this->FreeAllocation();
+	this->DataReservedSize = 0;
+	this->ReserveForSize( maxReservedSize );
+}
+
+void WriteStream::WritePlaceholder()
+{
+	this->Placeholders.emplace_back( this->Position );
+	this->PlaceholderGapsSizes.emplace_back( this->GapsSize );
+	this->Write( (u64)INT64_MAX );
+}
+
+// encode value as a LEB128 varint into dest, which must have room for 10 bytes, padded to at least minSize bytes. returns the number of bytes
+static u64 encodeVarint( u64 value, u8 *dest, u64 minSize = 1 )
+{
+	u64 size = 0;
+	while( value >= 0x80 || size + 1 < minSize )
+	{
+		dest[size++] = u8( value | 0x80 );
+		value >>= 7;
+	}
+	dest[size++] = u8( value );
+	return size;
+}
+
+void WriteStream::SetCompactEncoding( bool compact )
+{
+	ctSanityCheck( this->DataSize == 0 && this->Sink == nullptr );
+	this->CompactEncoding = compact;
+}
+
+void WriteStream::WriteVarint( u64 value, u64 minSize )
+{
+	ctSanityCheck( minSize <= 10 );
+	u8 encoded[10];
+	const u64 size = encodeVarint( value, encoded, minSize );
+	this->Write( encoded, size );
+}
+
+u8 *WriteStream::ReserveAtEnd( u64 size )
+{
+	ctSanityCheck( this->Position == this->DataSize );
+	if( this->Sink )
+	{
+		return nullptr;
+	}
+	if( this->DataSize + size > this->DataReservedSize )
+	{
+		this->ReserveForSize( this->DataSize + size );
+	}
+	return &this->Data[this->DataSize];
+}
+
+void WriteStream::WriteReserved( u64 count )
+{
+	ctSanityCheck( this->Position == this->DataSize && this->Sink == nullptr && this->DataSize + count <= this->DataReservedSize );
+	this->Resize( this->DataSize + count );
+	this->Position = this->DataSize;
+}
+
+void WriteStream::FillPlaceholder( u64 placeholderPosition, u64 value )
+{
+	ctSanityCheck( !this->Placeholders.empty() && this->Placeholders.back() == placeholderPosition );
+
+	const u64 gapsSizeAtPlaceholder = this->PlaceholderGapsSizes.back();
+	this->PlaceholderGapsSizes.pop_back();
+
+	if( this->CompactEncoding )
+	{
+		// write the value as a varint, without the gaps within the block, which are all after the placeholder. 
+		// the unused bytes of the placeholder become a gap, and the gaps are removed when no placeholder is open.
+		ctSanityCheck( this->Position == this->DataSize && this->FlushedSize == 0 );
+		u8 encoded[10];
+		const u64 encodedSize = encodeVarint( value - ( this->GapsSize - gapsSizeAtPlaceholder ), encoded );
+		ctSanityCheck( encodedSize <= sizeof( u64 ) );
+		memcpy( &this->Data[placeholderPosition], encoded, encodedSize );
+
+		const u64 gapSize = sizeof( u64 ) - encodedSize;
+		if( gapSize > 0 )
+		{
+			this->Gaps.push_back( { placeholderPosition + encodedSize, gapSize } );
+			this->GapsSize += gapSize;
+		}
+		this->Placeholders.pop_back();
+		if( this->Placeholders.empty() )
+		{
+			this->RemoveGaps();
+		}
+		return;
+	}
+
+	const u64 end_pos = this->Position;
+	this->SetPosition( placeholderPosition );
+	this->Write( value );
+	this->SetPosition( end_pos ); // move back the where we were
+	this->Placeholders.pop_back();
+
+	// hash the deferred leaves which now have all their placeholders filled
+	if( this->Hasher && !this->DeferredLeaves.empty() )
+	{
+		auto it = this->DeferredLeaves.begin();
+		while( it != this->DeferredLeaves.end() )
+		{
+			if( this->LeafHasPlaceholder( *it ) )
+			{
+				++it;
+				continue;
+			}
+			if( this->HashStatus == status::ok )
+			{
+				this->HashStatus = this->Hasher->HashLeaf( *it, &this->Data[*it * EntityHasher::LeafSize], EntityHasher::LeafSize );
+			}
+			it = this->DeferredLeaves.erase( it );
+		}
+	}
+}
+
+void WriteStream::RemoveGaps()
+{
+	if( this->Gaps.empty() )
+	{
+		return;
+	}
+
+	// inner placeholders are filled before outer ones, so sort the gaps in stream order, and move each run of data 
+	// between two gaps back to directly follow the data before it
+	std::sort( this->Gaps.begin(), this->Gaps.end(), []( const PlaceholderGap &a, const PlaceholderGap &b ) { return a.Position < b.Position; } );
+	u64 dest = this->Gaps.front().Position;
+	for( size_t index = 0; index < this->Gaps.size(); ++index )
+	{
+		const u64 runStart = this->Gaps[index].Position + this->Gaps[index].Size;
+		const u64 runEnd = ( index + 1 < this->Gaps.size() ) ? this->Gaps[index + 1].Position : this->DataSize;
+		memmove( &this->Data[dest], &this->Data[runStart], runEnd - runStart );
+		dest += runEnd - runStart;
+	}
+
+	ctSanityCheck( dest + this->GapsSize == this->DataSize );
+	this->DataSize = dest;
+	this->Position = dest;
+	this->Gaps.clear();
+	this->GapsSize = 0;
+}
+
+void WriteStream::SetHasher( EntityHasher *hasher )
+{
+	ctSanityCheck( this->DataSize == 0 && this->Sink == nullptr );
+	this->Hasher = hasher;
+	this->HashedEnd = 0;
+	this->DeferredLeaves.clear();
+	this->HashStatus = status::ok;
+}
+
+bool WriteStream::HashesWhileWriting() const
+{
+	// the flat hash is in order, and the first placeholder (the block size of the entity) is open until the 
+	// end of the data, so nothing can be hashed before that. with compact encoding, the data after an open 
+	// placeholder is moved when the placeholder is filled, so no leaf is final until all placeholders are filled.
+	return this->Hasher && this->Hasher->GetMode() == entity_hash_mode::tree && !this->CompactEncoding;
+}
+
+u64 WriteStream::GetHashedSize() const
+{
+	return this->HashedEnd - u64( this->DeferredLeaves.size() ) * EntityHasher::LeafSize;
+}
+
+bool WriteStream::LeafHasPlaceholder( u64 leafIndex ) const
+{
+	const u64 leafStart = leafIndex * EntityHasher::LeafSize;
+	const u64 leafEnd = leafStart + EntityHasher::LeafSize;
+	for( const u64 placeholder : this->Placeholders )
+	{
+		if( placeholder < leafEnd && placeholder + sizeof( u64 ) > leafStart )
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void WriteStream::HashFinishedLeaves()
+{
+	// only the full leaves before the end of the data are finished, the last leaf may still grow
+	while( this->HashedEnd + EntityHasher::LeafSize <= this->DataSize )
+	{
+		const u64 leafIndex = this->HashedEnd / EntityHasher::LeafSize;
+		if( this->LeafHasPlaceholder( leafIndex ) )
+		{
+			this->DeferredLeaves.emplace_back( leafIndex );
+		}
+		else if( this->HashStatus == status::ok )
+		{
+			this->HashStatus = this->Hasher->HashLeaf( leafIndex, &this->Data[this->HashedEnd], EntityHasher::LeafSize );
+		}
+		this->HashedEnd += EntityHasher::LeafSize;
+	}
+}
+
+status_return<hash> WriteStream::FinishHash()
+{
+	ctValidate( this->Hasher != nullptr, status::not_initialized ) << "The stream has no hasher" << ctValidateEnd;
+	ctValidate( this->Placeholders.empty(), status::invalid ) << "The stream has placeholders which are not filled in" << ctValidateEnd;
+
+	// in flat mode, hash the rest of the data in order
+	if( this->Hasher->GetMode() == entity_hash_mode::flat )
+	{
+		if( this->HashedEnd < this->DataSize )
+		{
+			ctStatusCall( this->HashStatus );
+			this->HashStatus = this->Hasher->Update( &this->Data[this->HashedEnd], this->DataSize - this->HashedEnd );
+			this->HashedEnd = this->DataSize;
+		}
+		ctStatusCall( this->HashStatus );
+		return this->Hasher->Finish( this->DataSize );
+	}
+
+	// all placeholders are filled in, so the deferred leaves can be hashed, as well as the remaining leaves
+	for( const u64 leafIndex : this->DeferredLeaves )
+	{
+		ctStatusCall( this->HashStatus );
+		this->HashStatus = this->Hasher->HashLeaf( leafIndex, &this->Data[leafIndex * EntityHasher::LeafSize], EntityHasher::LeafSize );
+	}
+	this->DeferredLeaves.clear();
+	while( this->HashedEnd < this->DataSize )
+	{
+		ctStatusCall( this->HashStatus );
+		const u64 leafSize = std::min( this->DataSize - this->HashedEnd, u64( EntityHasher::LeafSize ) );
+		this->HashStatus = this->Hasher->HashLeaf( this->HashedEnd / EntityHasher::LeafSize, &this->Data[this->HashedEnd], leafSize );
+		this->HashedEnd += leafSize;
+	}
+	ctStatusCall( this->HashStatus );
+
+	return this->Hasher->Finish( this->DataSize );
+}
+
 void WriteStream::Resize( u64 newSize )
 {
-	if( newSize > this->DataReservedSize )
+	// the data up to the current end is written, so hash any leaves which are finished
+	if( this->HashesWhileWriting() && this->DataSize >= this->HashedEnd + EntityHasher::LeafSize )
+	{
+		this->HashFinishedLeaves();
+	}
+
+	// only the data after FlushedSize is held in the allocation
+	if( newSize - this->FlushedSize > this->DataReservedSize )
 	{
-		this->ReserveForSize( newSize );
+		this->ReserveForSize( newSize - this->FlushedSize );
 	}
 
 	this->DataSize = newSize;
 }
 
+status FileWriteStreamSink::Open( const std::string &path )
+{
+	this->Close();
+	this->Path = path;
+	this->Size = 0;
+	this->File.open( path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc );
+	return this->File.is_open() ? status::ok : status::cant_write;
+}
+
+void FileWriteStreamSink::Close()
+{
+	if( this->File.is_open() )
+	{
+		this->File.close();
+	}
+}
+
+status FileWriteStreamSink::Append( const u8 *data, u64 size )
+{
+	this->File.seekp( (std::streamoff)this->Size, std::ios::beg );
+	this->File.write( (const char *)data, (std::streamsize)size );
+	this->Size += size;
+	return this->File.good() ? status::ok : status::cant_write;
+}
+
+status FileWriteStreamSink::Patch( u64 offset, const u8 *data, u64 size )
+{
+	if( offset + size > this->Size )
+	{
+		return status::invalid_param;
+	}
+
+	this->File.seekp( (std::streamoff)offset, std::ios::beg );
+	this->File.write( (const char *)data, (std::streamsize)size );
+	return this->File.good() ? status::ok : status::cant_write;
+}
+
+std::vector<std::unique_ptr<WriteStream>> &WriteStreamPool::GetThreadPool()
+{
+	static thread_local std::vector<std::unique_ptr<WriteStream>> pool;
+	return pool;
+}
+
+u64 WriteStreamPool::GetSizeClass( u64 size )
+{
+	u64 sizeClass = MinSizeClass;
+	while( sizeClass < size && sizeClass <= ( ~u64( 0 ) >> 2 ) )
+	{
+		sizeClass <<= 2;
+	}
+	return ( sizeClass < size ) ? size : sizeClass;
+}
+
+WriteStreamPool::Handle WriteStreamPool::Acquire( u64 sizeHint )
+{
+	sizeHint = ( sizeHint > 0 ) ? GetSizeClass( sizeHint ) : 0;
+
+	auto &pool = GetThreadPool();
+	if( pool.empty() )
+	{
+		WriteStream *stream = ( sizeHint > 0 ) ? new WriteStream( sizeHint ) : new WriteStream();
+		return Handle( std::unique_ptr<WriteStream>( stream ) );
+	}
+
+	// pick the smallest stream which fits the hint, or else the largest stream
+	size_t best = 0;
+	for( size_t i = 1; i < pool.size(); ++i )
+	{
+		const u64 reserved = pool[i]->GetReservedSize();
+		const u64 bestReserved = pool[best]->GetReservedSize();
+		const bool bestFits = ( bestReserved >= sizeHint );
+		if( bestFits && reserved >= sizeHint && reserved < bestReserved )
+		{
+			best = i;
+		}
+		else if( !bestFits && reserved > bestReserved )
+		{
+			best = i;
+		}
+	}
+
+	std::unique_ptr<WriteStream> stream = std::move( pool[best] );
+	pool.erase( pool.begin() + best );
+	stream->Reserve( sizeHint );
+	return Handle( std::move( stream ) );
+}
+
+void WriteStreamPool::Release( std::unique_ptr<WriteStream> stream )
+{
+	auto &pool = GetThreadPool();
+	if( pool.size() >= MaxPooledStreams )
+	{
+		return;
+	}
+
+	// the next user of the stream starts out with the default settings
+	stream->Clear();
+	stream->SetCompressionThreshold( 0 );
+	stream->SetCompactEncoding( false );
+	stream->SetSectionsArrayOffsetThreshold( 0 );
+
+	// don't keep the allocation of a large write, and stay within the total cap of the thread
+	stream->Shrink( MaxRetainedSize );
+	if( GetPooledSize() + stream->GetReservedSize() > MaxPooledTotalSize )
+	{
+		return;
+	}
+	pool.emplace_back( std::move( stream ) );
+}
+
+size_t WriteStreamPool::GetPooledCount()
+{
+	return GetThreadPool().size();
+}
+
+u64 WriteStreamPool::GetPooledSize()
+{
+	u64 size = 0;
+	for( const auto &stream : GetThreadPool() )
+	{
+		size += stream->GetReservedSize();
+	}
+	return size;
+}
+
+#include "_pds_undef_macros.inl"
 }
 // namespace pds
\ No newline at end of file
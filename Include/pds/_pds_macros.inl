@@ -29,6 +29,9 @@
 #define pdsValidationError( errorid ) if( !validator.GetRecordErrorDescriptions() ) { validator.ReportError( errorid ); } else { auto _errorId = errorid; std::stringstream _errorStringStream; _errorStringStream
 #define pdsValidationErrorEnd ""; validator.ReportErrorDescription( _errorId , _errorStringStream.str() , __FILE__ , __LINE__ , __func__ ); }
 
+// pdsReadValidate records a read error with set_read_error and returns errorid, if cond is false. nothing is formatted when recorded
+#define pdsReadValidate( cond, errorid, code, value, expected ) if( !(cond) ) { set_read_error( sstream, read_error_code::code, nullptr, 0, u64( value ), u64( expected ) ); return errorid; }
+
 // pdsKeyMacro is used to define a key in the pds file stream
 #define pdsKeyMacro( name ) (#name) , (u8(sizeof(#name)-1))
 
@@ -27,4 +27,5 @@
 
 #undef pdsValidationError
 #undef pdsValidationErrorEnd
+#undef pdsReadValidate
 #undef pdsKeyMacro
@@ -95,6 +95,41 @@ enum class serialization_type_index : u8
 	vt_array_string = 0xe1, // array of strings
 };
 
+// Entity files which are written with compact encoding start with a format header of two bytes, the EntityFileFormatMarker, 
+// which is not a valid serialization_type_index, followed by the format version. With compact encoding, the sizes of large 
+// blocks, and the flags, counts and sizes of arrays and strings, are (LEB128) varints instead of fixed size values. 
+// Entity files without the header start directly with the EntityFile section block, and use fixed size values.
+constexpr const u8 EntityFileFormatMarker = 0xff;
+constexpr const u8 EntityFileFormatCompact = 0x01;
+
+// Flags of the header of array blocks. The low 8 bits of the array flags is the per item size, 0x100 flags that the
+// array has an index, and 0x200 that the index is 64 bit. The values of an array can be compressed:
+// * Layout of compressed values, which follows the (optional) index in the block:
+//		u64 DecodedSize; // the size of the values when decompressed
+//		u64 EncodedSize; // the size of the compressed data
+//		u8 EncodedData[]; // the values, filtered and compressed in the LZ4 block format
+// * With compact encoding, DecodedSize and EncodedSize are (LEB128) varints instead. EncodedSize is written after the values 
+//   are compressed into place, so it is padded to the width of the varint of the largest encoded size which is used, which is 
+//   DecodedSize minus 16 (the compressed values must be smaller than the values, including the two sizes). The varint is 
+//   padded with continuation bytes (see WriteStream::WriteVarint), so EncodedSize is read as any other varint.
+// * Filters are applied to the values before compression, and reverted after decompression
+constexpr const u16 ArrayValuesCompressedFlag = 0x400; // the values are compressed
+constexpr const u16 ArrayValuesShuffledFlag = 0x800; // the bytes of the values are shuffled before compression
+constexpr const u16 ArrayValuesDeltaFlag = 0x1000; // the values are delta encoded (per component) before compression
+
+// A sections array (vt_array_subsection) can have a trailing table of the offsets of its sections, which enables random access:
+// * Layout of the offset table, which ends the block, after the last section:
+//		u64 Offsets[ItemCount]; // the offset of each section, from the end of the array header (always fixed size, so the table can be located from the end of the block)
+constexpr const u16 ArraySectionsOffsetTableFlag = 0x2000; // the sections array has an offset table
+
+// returns true if the array type has integer values, which are delta encoded when compressed
+constexpr bool array_has_integer_values( serialization_type_index VT )
+{
+	return VT == serialization_type_index::vt_array_int
+		|| VT == serialization_type_index::vt_array_uint
+		|| ( VT >= serialization_type_index::vt_array_ivec2 && VT <= serialization_type_index::vt_array_uvec4 );
+}
+
 }
 // namespace pds
 
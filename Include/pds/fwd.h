@@ -146,7 +146,10 @@ class EntityReader;
 class EntityValidator;
 class WriteStream;
 class ReadStream;
+class FileReadStreamSource;
+class EntityHasher;
 class Varying;
+struct LazySource;
 
 // @brief IndexedVector is the template class for all indexed vectors in pds
 template <
@@ -177,6 +180,9 @@ template <
 	item_table_flags _Flags = item_table_flags(0),
 	class _MapTy = std::unordered_map<_Kty, std::unique_ptr<_Ty>>
 > class ItemTable;
+
+// @brief Lazy holds a value in an item, which is deserialized from the entity data on first access
+template <class _Ty> class Lazy;
 }
 // namespace pds
 
@@ -125,23 +125,20 @@ status ItemTable<_Kty, _Ty, _Flags, _MapTy>::MF::Write( const _MgmCl &obj, Entit
 	EntityWriter *section_writer;
 	ctStatusReturnCall( section_writer, writer.BeginWriteSectionsArray( pdsKeyMacro( Ents ), obj.v_Entries.size() ) );
 
-	// write out all the entities as an array
+	// write out all the entities as an array, in parallel if the writer has a worker pool
 	// for each non-empty entity, call the write method of the entity
+	std::vector<const _Ty *> values( obj.v_Entries.size() );
 	index = 0;
 	for( auto it = obj.v_Entries.begin(); it != obj.v_Entries.end(); ++it, ++index )
 	{
-		if( !writer.BeginWriteSectionInArray( section_writer, index ) )
-			return status::cant_write;
-		if( it->second )
-		{
-			ctStatusCall( _Ty::MF::Write( *( it->second ), *( section_writer ) ) );
-		}
-		if( !writer.EndWriteSectionInArray( section_writer, index ) )
-			return status::cant_write;
+		values[index] = it->second.get();
 	}
-
-	// sanity check, make sure all sections were written
-	ctSanityCheck( index == obj.v_Entries.size() );
+	ctStatusCall( writer.WriteSectionsInArray( section_writer, [&values]( size_t value_index, EntityWriter &entity_writer ) -> status
+	{
+		if( !values[value_index] )
+			return status::ok;
+		return _Ty::MF::Write( *( values[value_index] ), entity_writer );
+	} ) );
 
 	// end the Entries sections array
 	ctStatusCall( writer.EndWriteSectionsArray( section_writer ) );
@@ -170,32 +167,26 @@ status ItemTable<_Kty, _Ty, _Flags, _MapTy>::MF::Read( _MgmCl &obj, EntityReader
 		return status::corrupted;
 	}
 
-	// read in all the entities, push into map as key-value pairs
+	// read in all the entities, in parallel if the reader has a worker pool
+	std::vector<std::unique_ptr<_Ty>> values( map_size );
+	ctStatusCall( reader.ReadSectionsInArray( section_reader, [&values]( size_t index, bool has_data, EntityReader &entity_reader ) -> status
+	{
+		if( !has_data )
+			return status::ok;
+		values[index] = std::make_unique<_Ty>();
+		return _Ty::MF::Read( *( values[index] ), entity_reader );
+	} ) );
+
+	// push into map as key-value pairs, in the order of the stream
 	obj.v_Entries.clear();
 	for( size_t index = 0; index < map_size; ++index )
 	{
-		bool has_data = false;
-		if( !reader.BeginReadSectionInArray( section_reader, index, &has_data ) )
-			return status::cant_read;
-
-		if( has_data )
-			std::tie( it, success ) = obj.v_Entries.emplace( keys[index], std::make_unique<_Ty>() );
-		else
-			std::tie( it, success ) = obj.v_Entries.emplace( keys[index], nullptr );
-
+		std::tie( it, success ) = obj.v_Entries.emplace( keys[index], std::move( values[index] ) );
 		if( !success )
 		{
 			ctLogError << "Failed inserting key-value pair in ItemTable" << ctLogEnd;
 			return status::cant_read;
 		}
-
-		if( it->second )
-		{
-			ctStatusCall( _Ty::MF::Read( *( it->second ), *( section_reader ) ) );
-		}
-
-		if( !reader.EndReadSectionInArray( section_reader, index ) )
-			return status::cant_read;
 	}
 
 	// end the sections array
@@ -0,0 +1,156 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+#pragma once
+#ifndef __PDS__LAZY_MF_H__
+#define __PDS__LAZY_MF_H__
+
+#include <ctle/log.h>
+
+#include "../Lazy.h"
+
+#include "../ReadStream.h"
+#include "../EntityWriter.h"
+#include "../EntityReader.h"
+#include "../EntityValidator.h"
+
+namespace pds
+{
+#include "../_pds_macros.inl"
+
+template<class _Ty>
+class Lazy<_Ty>::MF
+{
+	using _MgmCl = Lazy<_Ty>;
+
+public:
+	static status Clear( _MgmCl &obj );
+	static status DeepCopy( _MgmCl &dest, const _MgmCl *source );
+	static bool Equals( const _MgmCl *lval, const _MgmCl *rval );
+
+	static status Write( const _MgmCl &obj, EntityWriter &writer );
+	static status Read( _MgmCl &obj, EntityReader &reader );
+
+	static status Validate( const _MgmCl &obj, EntityValidator &validator );
+
+	// deserialize the value from the source
+	static status ReadSource( _Ty &value, const LazySource &source );
+
+	// load the value for Value(), which can not return the status, so a failure is logged
+	static void LoadForAccess( const _MgmCl &obj );
+};
+
+template<class _Ty>
+status Lazy<_Ty>::MF::Clear( _MgmCl &obj )
+{
+	obj.v_Pending.reset();
+	obj.v_Loaded = true;
+	return _Ty::MF::Clear( obj.v_Value );
+}
+
+template<class _Ty>
+status Lazy<_Ty>::MF::DeepCopy( _MgmCl &dest, const _MgmCl *source )
+{
+	if( &dest == source )
+		return status::ok;
+	ctStatusCall( MF::Clear( dest ) );
+	if( !source )
+		return status::ok;
+
+	// if the source is not loaded, share its data instead of deserializing it
+	if( !source->IsLoaded() )
+	{
+		std::lock_guard<std::mutex> guard( source->v_Pending->Lock );
+		if( !source->v_Loaded.load( std::memory_order_relaxed ) )
+		{
+			dest.v_Pending = std::unique_ptr<Pending>( new Pending() );
+			dest.v_Pending->Source = source->v_Pending->Source;
+			dest.v_Loaded = false;
+			return status::ok;
+		}
+	}
+
+	return _Ty::MF::DeepCopy( dest.v_Value, &source->v_Value );
+}
+
+template<class _Ty>
+bool Lazy<_Ty>::MF::Equals( const _MgmCl *lval, const _MgmCl *rval )
+{
+	// early out if the pointers are equal (includes nullptr)
+	if( lval == rval )
+		return true;
+
+	// early out if one of the pointers is nullptr
+	if( !lval || !rval )
+		return false;
+
+	return _Ty::MF::Equals( &lval->Value(), &rval->Value() );
+}
+
+template<class _Ty>
+status Lazy<_Ty>::MF::Write( const _MgmCl &obj, EntityWriter &writer )
+{
+	ctStatusCall( obj.Load() );
+	return _Ty::MF::Write( obj.v_Value, writer );
+}
+
+template<class _Ty>
+status Lazy<_Ty>::MF::Read( _MgmCl &obj, EntityReader &reader )
+{
+	ctStatusCall( MF::Clear( obj ) );
+
+	// defer the read if the reader keeps the entity data, else read the value directly
+	LazySource source;
+	bool deferred = false;
+	ctStatusCall( reader.DeferSection( source, deferred ) );
+	if( !deferred )
+	{
+		return _Ty::MF::Read( obj.v_Value, reader );
+	}
+
+	obj.v_Pending = std::unique_ptr<Pending>( new Pending() );
+	obj.v_Pending->Source = std::move( source );
+	obj.v_Loaded = false;
+	return status::ok;
+}
+
+template<class _Ty>
+status Lazy<_Ty>::MF::Validate( const _MgmCl &obj, EntityValidator &validator )
+{
+	ctStatusCall( obj.Load() );
+	return _Ty::MF::Validate( obj.v_Value, validator );
+}
+
+template<class _Ty>
+status Lazy<_Ty>::MF::ReadSource( _Ty &value, const LazySource &source )
+{
+	ReadStream rstream( source.Data, source.Size );
+	rstream.SetCompactEncoding( source.CompactEncoding );
+
+	// the reader keeps the data alive, so lazy values in the value are also deferred
+	EntityReader reader( rstream );
+	reader.SetKeyTolerant( source.KeyTolerant );
+	reader.SetDataOwner( source.Owner );
+	const status result = _Ty::MF::Read( value, reader );
+	if( result != status::ok )
+	{
+		// leave the value empty, instead of partially read
+		_Ty::MF::Clear( value );
+	}
+	return result;
+}
+
+template<class _Ty>
+void Lazy<_Ty>::MF::LoadForAccess( const _MgmCl &obj )
+{
+	if( obj.Load() != status::ok )
+	{
+		ctLogError << "The deferred value could not be read from the entity data, and is left empty" << ctLogEnd;
+	}
+}
+
+#include "../_pds_undef_macros.inl"
+
+}
+// namespace pds
+
+#endif//__PDS__LAZY_MF_H__
@@ -10,6 +10,7 @@
 #include "fileops_common.h"
 #include "element_value_ptrs.h"
 #include "ReadStream.h"
+#include "BlockCompressor.h"
 
 // value_type: the serialization_type_index enum to read the block as
 // object_type: the C++ object that stores the data (can be a basic type), such as u32, or glm::vec3
@@ -27,6 +28,133 @@ enum class reader_status
 	success // success, has value
 };
 
+// read_error_code identifies why the read of a value failed, see read_error
+enum class read_error_code : u8
+{
+	none = 0,
+	unexpected_type, // the type of the block is not the expected type. value: the read type, expected: the expected type
+	block_beyond_stream, // the size of the block points beyond the end of the stream. value: the block size
+	unexpected_key_size, // the key size of the block is not the size of the key. value: the read size, expected: the key size
+	unexpected_key, // the key of the block is not the key
+	unexpected_block_size, // the size of the block or items is invalid for the value. value: the read size, expected: the expected size
+	empty_not_allowed, // the value is empty, which is not allowed for the value
+	incomplete_value, // the stream could not read all the data of the value. value: the read count, expected: the expected count
+	unexpected_end_position, // the data does not end at the end of the block. value: the position, expected: the end position
+	invalid_count, // a size or count in the stream is beyond the end of the block. value: the size or count, expected: the maximum
+	unsupported_encoding, // the block is encoded in a way which is not supported for the value. value: the flags of the block
+	index_mismatch, // the block has an index and the destination does not, or the other way around. value: 1 if the block has an index
+	invalid_compressed_data, // the compressed values of the block are invalid
+	key_not_found, // the key is not in the section, see EntityReader::SetKeyTolerant
+	section_beyond_block, // a section or block is beyond the end of the enclosing block. value: the position or size, expected: the end position
+	invalid_offset_table, // the offset table of a sections array is invalid. value: the section index or position
+	invalid_reader_call, // the reader was called out of order, or with an invalid parameter. value: the index, expected: the expected index
+	ambiguous_key, // more than one block in the section can have the key, see EntityReader::SetKeyTolerant. value: the number of blocks
+};
+
+// read_error is the last error found while reading values on a thread. it is recorded without allocations or formatting,
+// so reads which are expected to fail, such as when probing for optional layouts, are cheap. format_read_error formats
+// the error when it is needed. the errors are not logged when found, unless enabled with set_read_error_logging.
+struct read_error
+{
+	read_error_code code = read_error_code::none;
+	u64 position = 0; // the stream position when the error was found
+	u64 value = 0; // the read value, see read_error_code
+	u64 expected = 0; // the expected value, see read_error_code
+	u8 key_length = 0; // 0 if the key is not known
+	char key[EntityMaxKeyLength] = {};
+};
+
+// the last read error of the calling thread
+inline read_error &last_read_error()
+{
+	static thread_local read_error error;
+	return error;
+}
+
+// if enabled, read errors are formatted and logged when they are found. disabled by default. set per thread.
+inline bool &read_error_logging_enabled()
+{
+	static thread_local bool enabled = false;
+	return enabled;
+}
+inline void set_read_error_logging( bool enabled ) { read_error_logging_enabled() = enabled; }
+inline bool get_read_error_logging() { return read_error_logging_enabled(); }
+
+inline const char *read_error_description( read_error_code code )
+{
+	switch( code )
+	{
+		case read_error_code::none: return "No error";
+		case read_error_code::unexpected_type: return "The type in the input stream does not match the expected type";
+		case read_error_code::block_beyond_stream: return "The block size points beyond the end of the stream";
+		case read_error_code::unexpected_key_size: return "The size of the input key does not match the expected size";
+		case read_error_code::unexpected_key: return "Unexpected key name in the stream";
+		case read_error_code::unexpected_block_size: return "The size of the block in the input stream does not match the expected size";
+		case read_error_code::empty_not_allowed: return "The read stream value is empty, which is not allowed for the value";
+		case read_error_code::incomplete_value: return "The stream could not read all the data of the value";
+		case read_error_code::unexpected_end_position: return "The end position of the data does not equal the expected end position";
+		case read_error_code::invalid_count: return "A size or count in the stream is invalid, it is beyond the size of the block";
+		case read_error_code::unsupported_encoding: return "The block is encoded in a way which is not supported for this type of value";
+		case read_error_code::index_mismatch: return "Invalid array type, the index of the stream does not match the destination object";
+		case read_error_code::invalid_compressed_data: return "The compressed values in the stream are invalid";
+		case read_error_code::key_not_found: return "The key was not found in the section";
+		case read_error_code::section_beyond_block: return "The section or block is beyond the end of the enclosing block";
+		case read_error_code::invalid_offset_table: return "The offset table of the sections array is invalid";
+		case read_error_code::invalid_reader_call: return "The reader was called out of order, or with an invalid parameter";
+		case read_error_code::ambiguous_key: return "More than one block in the section can have the key";
+	}
+	return "Unknown error";
+}
+
+// format the read error into a message
+inline std::string format_read_error( const read_error &error )
+{
+	std::string message = read_error_description( error.code );
+	if( error.key_length > 0 )
+	{
+		message += ", key: \"" + std::string( error.key, error.key_length ) + "\"";
+	}
+	message += ", position: " + std::to_string( error.position );
+	if( error.value != 0 || error.expected != 0 )
+	{
+		message += ", read: " + std::to_string( error.value ) + ", expected: " + std::to_string( error.expected );
+	}
+	return message;
+}
+
+// set the key of the last read error of the thread, if the error was recorded without a key
+inline void set_read_error_key( const char *key, const u8 key_length )
+{
+	read_error &error = last_read_error();
+	if( key && error.key_length == 0 )
+	{
+		error.key_length = ( key_length < EntityMaxKeyLength ) ? key_length : u8( EntityMaxKeyLength );
+		memcpy( error.key, key, error.key_length );
+	}
+}
+
+// record a read error as the last error of the thread, and log it if logging is enabled. key is nullptr if not known.
+inline void set_read_error( const ReadStream &sstream, read_error_code code, const char *key, const u8 key_length, u64 value = 0, u64 expected = 0 )
+{
+	read_error &error = last_read_error();
+	error.code = code;
+	error.position = sstream.GetPosition();
+	error.value = value;
+	error.expected = expected;
+	error.key_length = 0;
+	set_read_error_key( key, key_length );
+	if( get_read_error_logging() )
+	{
+		ctLogError << format_read_error( error ) << ctLogEnd;
+	}
+}
+
+// read a size or count value. with compact encoding the value is a varint, otherwise it is a u64
+inline u64 read_size_value( ReadStream &sstream )
+{
+	return sstream.GetCompactEncoding() ? sstream.ReadVarint() : sstream.Read<u64>();
+}
+
 // read the header of a large block
 // returns the stream position of the expected end of the block, to validate the read position
 // a stream position of 0 is not possible, and indicates error
@@ -38,18 +166,16 @@ inline u64 begin_read_large_block( ReadStream &sstream, serialization_type_index
 	const u8 value_type = sstream.Read<u8>();
 	if( value_type != (u8)VT )
 	{
-		// not the expected type
-		ctLogError << "The type in the input stream:" << (u32)value_type << " does not match expected type: " << (u32)VT << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_type, key, key_size_in_bytes, value_type, (u8)VT );
 		return 0;
 	}
 
 	// check the size, and calculate expected end position
-	const u64 block_size = sstream.Read<u64>();
+	const u64 block_size = read_size_value( sstream );
 	const u64 expected_end_pos = sstream.GetPosition() + block_size;
-	if( expected_end_pos > sstream.GetSize() )
+	if( block_size > sstream.GetSize() || expected_end_pos > sstream.GetSize() )
 	{
-		// not the expected type
-		ctLogError << "The block size:" << block_size << " points beyond the end of the stream size" << ctLogEnd;
+		set_read_error( sstream, read_error_code::block_beyond_stream, key, key_size_in_bytes, block_size );
 		return 0;
 	}
 
@@ -57,9 +183,7 @@ inline u64 begin_read_large_block( ReadStream &sstream, serialization_type_index
 	const u8 read_key_size_in_bytes = sstream.Read<u8>();
 	if( read_key_size_in_bytes != key_size_in_bytes )
 	{
-		// not the expected type
-		std::string expected_key_name( key, key_size_in_bytes );
-		ctLogError << "The size of the input key:" << (u32)read_key_size_in_bytes << " does not match expected size: " << (u32)key_size_in_bytes << " for key: \"" << expected_key_name << "\"" << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_key_size, key, key_size_in_bytes, read_key_size_in_bytes, key_size_in_bytes );
 		return 0;
 	}
 
@@ -68,9 +192,7 @@ inline u64 begin_read_large_block( ReadStream &sstream, serialization_type_index
 	sstream.Read( (i8 *)read_key, (u64)key_size_in_bytes );
 	if( memcmp( key, read_key, (u64)key_size_in_bytes ) != 0 )
 	{
-		std::string expected_key_name( key, key_size_in_bytes );
-		std::string read_key_name( read_key, key_size_in_bytes );
-		ctLogError << "Unexpected key name in the stream. Expected name: " << expected_key_name << " read name: " << read_key_name << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_key, key, key_size_in_bytes );
 		return 0;
 	}
 
@@ -100,8 +222,7 @@ template<serialization_type_index VT, class T> inline reader_status read_single_
 	const u8 value_type = sstream.Read<u8>();
 	if( value_type != (u8)VT )
 	{
-		// not the expected type
-		ctLogError << "The type in the input stream:" << (u32)value_type << " does not match expected type: " << (u32)VT << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_type, key, key_size_in_bytes, value_type, (u8)VT );
 		return reader_status::fail;
 	}
 
@@ -124,14 +245,14 @@ template<serialization_type_index VT, class T> inline reader_status read_single_
 			// if empty is allowed, make sure that we have the block size of an empty block
 			if( block_size != expected_block_size_if_empty )
 			{
-				ctLogError << "The size of the block in the input stream:" << block_size << " does not match expected possible sizes: " << expected_block_size_if_empty << " (if empty value) or " << expected_block_size << " (if non-empty) " << ctLogEnd;
+				set_read_error( sstream, read_error_code::unexpected_block_size, key, key_size_in_bytes, block_size, expected_block_size_if_empty );
 				return reader_status::fail;
 			}
 		}
 		else
 		{
 			// empty is not allowed, so regardless of the size, it is invalid, error out
-			ctLogError << "The size of the block in the input stream:" << block_size << " does not match expected size (empty is not allowed): " << expected_block_size << ctLogEnd;
+			set_read_error( sstream, read_error_code::unexpected_block_size, key, key_size_in_bytes, block_size, expected_block_size );
 			return reader_status::fail;
 		}
 	}
@@ -142,7 +263,7 @@ template<serialization_type_index VT, class T> inline reader_status read_single_
 		const u64 read_count = sstream.Read( value_ptr( *dest_data ), value_count );
 		if( read_count != value_count )
 		{
-			ctLogError << "Could not read all expected values from the input stream. Expected count: " << value_count << " read count: " << read_count << ctLogEnd;
+			set_read_error( sstream, read_error_code::incomplete_value, key, key_size_in_bytes, read_count, value_count );
 			return reader_status::fail;
 		}
 	}
@@ -153,9 +274,7 @@ template<serialization_type_index VT, class T> inline reader_status read_single_
 	if( read_key_length != (u64)key_size_in_bytes
 		|| memcmp( key, read_key, (u64)key_size_in_bytes ) != 0 )
 	{
-		std::string expected_key_name( key, key_size_in_bytes );
-		std::string read_key_name( read_key, key_size_in_bytes ); // cap string at lenght of expected data
-		ctLogError << "Unexpected key name in the stream. Expected name: " << expected_key_name << " read name: " << read_key_name << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_key, key, key_size_in_bytes );
 		return reader_status::fail;
 	}
 
@@ -165,7 +284,7 @@ template<serialization_type_index VT, class T> inline reader_status read_single_
 	ctSanityCheck( end_pos == expected_end_pos );
 	if( end_pos != expected_end_pos )
 	{
-		ctLogError << "Invaild position in the read stream. Expected position: " << expected_end_pos << " current position: " << end_pos << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_end_position, key, key_size_in_bytes, end_pos, expected_end_pos );
 		return reader_status::fail;
 	}
 
@@ -199,7 +318,6 @@ template<> inline reader_status read_single_item<serialization_type_index::vt_st
 	const u64 expected_end_position = begin_read_large_block( sstream, serialization_type_index::vt_string, key, key_size_in_bytes );
 	if( expected_end_position == 0 )
 	{
-		ctLogError << "begin_read_large_block() failed unexpectedly" << ctLogEnd;
 		return reader_status::fail;
 	}
 
@@ -212,7 +330,7 @@ template<> inline reader_status read_single_item<serialization_type_index::vt_st
 			// empty value is allowed, early out if the block end checks out
 			if( !end_read_large_block( sstream, expected_end_position ) )
 			{
-				ctLogError << "End position of data " << sstream.GetPosition() << " does not equal the expected end position which is " << expected_end_position << ctLogEnd;
+				set_read_error( sstream, read_error_code::unexpected_end_position, key, key_size_in_bytes, sstream.GetPosition(), expected_end_position );
 				return reader_status::fail;
 			}
 
@@ -222,19 +340,19 @@ template<> inline reader_status read_single_item<serialization_type_index::vt_st
 		else
 		{
 			// empty is not allowed
-			ctLogError << "The read stream value is empty, which is not allowed for value \"" << key << "\"" << ctLogEnd;
+			set_read_error( sstream, read_error_code::empty_not_allowed, key, key_size_in_bytes );
 			return reader_status::fail;
 		}
 	}
 
 	// non-empty, read in the string size
-	const u64 string_size = sstream.Read<u64>();
+	const u64 string_size = read_size_value( sstream );
 
 	// make sure the item count is plausible before allocating the vector
 	const u64 expected_string_size = ( expected_end_position - sstream.GetPosition() );
 	if( string_size > expected_string_size )
 	{
-		ctLogError << "The string size in the stream is invalid, it is beyond the size of the value block" << ctLogEnd;
+		set_read_error( sstream, read_error_code::invalid_count, key, key_size_in_bytes, string_size, expected_string_size );
 		return reader_status::fail;
 	}
 
@@ -248,7 +366,7 @@ template<> inline reader_status read_single_item<serialization_type_index::vt_st
 		const u64 read_item_count = sstream.Read( p_data, string_size );
 		if( read_item_count != string_size )
 		{
-			ctLogError << "The stream could not read the whole string" << ctLogEnd;
+			set_read_error( sstream, read_error_code::incomplete_value, key, key_size_in_bytes, read_item_count, string_size );
 			return reader_status::fail;
 		}
 	}
@@ -256,14 +374,14 @@ template<> inline reader_status read_single_item<serialization_type_index::vt_st
 	// make sure we are at the expected end pos
 	if( !end_read_large_block( sstream, expected_end_position ) )
 	{
-		ctLogError << "End position of data " << sstream.GetPosition() << " does not equal the expected end position which is " << expected_end_position << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_end_position, key, key_size_in_bytes, sstream.GetPosition(), expected_end_position );
 		return reader_status::fail;
 	}
 
 	return reader_status::success;
 }
 
-inline reader_status end_read_empty_large_block( ReadStream &sstream, const char *key, const bool empty_value_is_allowed, const u64 expected_end_position )
+inline reader_status end_read_empty_large_block( ReadStream &sstream, const char *key, const u8 key_size_in_bytes, const bool empty_value_is_allowed, const u64 expected_end_position )
 {
 	// check that empty value this is allowed
 	if( empty_value_is_allowed )
@@ -271,7 +389,7 @@ inline reader_status end_read_empty_large_block( ReadStream &sstream, const char
 		// empty value is allowed, early out if the block end checks out
 		if( !end_read_large_block( sstream, expected_end_position ) )
 		{
-			ctLogError << "End position of data " << sstream.GetPosition() << " does not equal the expected end position which is " << expected_end_position << ctLogEnd;
+			set_read_error( sstream, read_error_code::unexpected_end_position, key, key_size_in_bytes, sstream.GetPosition(), expected_end_position );
 			return reader_status::fail;
 		}
 
@@ -281,20 +399,18 @@ inline reader_status end_read_empty_large_block( ReadStream &sstream, const char
 	else
 	{
 		// empty is not allowed
-		ctLogError << "The read stream value is empty, which is not allowed for value \"" << key << "\"" << ctLogEnd;
+		set_read_error( sstream, read_error_code::empty_not_allowed, key, key_size_in_bytes );
 		return reader_status::fail;
 	}
 }
 
 // reads an array header and value size from the stream, and decodes into flags, then reads the index if one exists. 
-inline bool read_array_metadata_and_index( ReadStream &sstream, size_t &out_per_item_size, size_t &out_item_count, const u64 block_end_position, vector<u32> *dest_index )
+// out_values_flags receives the ArrayValues* flags of how the values are encoded. if it is not set, the values must not be encoded.
+inline bool read_array_metadata_and_index( ReadStream &sstream, size_t &out_per_item_size, size_t &out_item_count, const u64 block_end_position, vector<u32> *dest_index, u16 *out_values_flags = nullptr )
 {
 	static_assert( sizeof( u64 ) <= sizeof( size_t ), "Unsupported size_t, current code requires it to be at least 8 bytes in size, equal to u64" );
 
-	const u64 start_position = sstream.GetPosition();
-	u64 expected_end_position = start_position + sizeof( u16 ) + sizeof( u64 );
-
-	const u16 array_flags = sstream.Read<u16>();
+	const u16 array_flags = sstream.GetCompactEncoding() ? u16( sstream.ReadVarint() ) : sstream.Read<u16>();
 	out_per_item_size = (size_t)( array_flags & 0xff );
 	const bool has_index = ( array_flags & 0x100 ) != 0;
 	const bool index_is_64bit = ( array_flags & 0x200 ) != 0;
@@ -302,12 +418,25 @@ inline bool read_array_metadata_and_index( ReadStream &sstream, size_t &out_per_
 	// we don't support 64 bit index (yet)
 	if( index_is_64bit )
 	{
-		ctLogError << "The block has a 64 bit index, which is not supported" << ctLogEnd;
+		set_read_error( sstream, read_error_code::unsupported_encoding, nullptr, 0, array_flags );
+		return false;
+	}
+
+	// make sure the values are encoded (or the sections have an offset table) only if the array type supports it
+	const u16 values_flags = array_flags & ( ArrayValuesCompressedFlag | ArrayValuesShuffledFlag | ArrayValuesDeltaFlag | ArraySectionsOffsetTableFlag );
+	if( out_values_flags )
+	{
+		*out_values_flags = values_flags;
+	}
+	else if( values_flags != 0 )
+	{
+		set_read_error( sstream, read_error_code::unsupported_encoding, nullptr, 0, array_flags );
 		return false;
 	}
 
 	// read in the item count
-	out_item_count = (size_t)sstream.Read<u64>();
+	out_item_count = (size_t)read_size_value( sstream );
+	u64 expected_end_position = sstream.GetPosition();
 
 	// if we have an index, read it
 	if( has_index )
@@ -315,17 +444,18 @@ inline bool read_array_metadata_and_index( ReadStream &sstream, size_t &out_per_
 		// make sure we DO expect an index
 		if( !dest_index )
 		{
-			ctLogError << "Invalid array type: The stream type has an index, but the destination object does not." << ctLogEnd;
+			set_read_error( sstream, read_error_code::index_mismatch, nullptr, 0, 1, 0 );
 			return false;
 		}
 
 		// read in the size of the index
 		ctSanityCheck( block_end_position >= sstream.GetPosition() );
-		const u64 index_count = sstream.Read<u64>();
+		const u64 index_count = read_size_value( sstream );
+		expected_end_position = sstream.GetPosition();
 		const u64 maximum_possible_index_count = ( block_end_position - sstream.GetPosition() ) / sizeof( u32 );
 		if( index_count > maximum_possible_index_count )
 		{
-			ctLogError << "The index item count in the stream is invalid, it is beyond the size of the block" << ctLogEnd;
+			set_read_error( sstream, read_error_code::invalid_count, nullptr, 0, index_count, maximum_possible_index_count );
 			return false;
 		}
 
@@ -337,27 +467,81 @@ inline bool read_array_metadata_and_index( ReadStream &sstream, size_t &out_per_
 		sstream.Read( p_index_data, index_count );
 
 		// modify the expected end position
-		expected_end_position += sizeof( u64 ) + ( index_count * sizeof( i32 ) );
+		expected_end_position += ( index_count * sizeof( i32 ) );
 	}
 	else
 	{
 		// make sure we do NOT expect an index
 		if( dest_index )
 		{
-			ctLogError << "Invalid array type: The stream type has does not have an index, but the destination object does." << ctLogEnd;
+			set_read_error( sstream, read_error_code::index_mismatch, nullptr, 0, 0, 1 );
 			return false;
 		}
 	}
 
 	if( expected_end_position != sstream.GetPosition() )
 	{
-		ctLogError << "Failed to read full array header from block." << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_end_position, nullptr, 0, sstream.GetPosition(), expected_end_position );
 		return false;
 	}
 
 	return true;
 }
 
+// reads and decodes the compressed values of an array, which follow the array metadata, into dest. 
+// the filters of values_flags are reverted, using the value_size and delta_stride of the array type.
+inline bool read_encoded_array_values( ReadStream &sstream, const u16 values_flags, const u64 block_end_position, const u64 value_size, const u64 delta_stride, std::vector<u8> &dest )
+{
+	ctSanityCheck( ( values_flags & ArrayValuesCompressedFlag ) != 0 );
+
+	const u64 decoded_size = read_size_value( sstream );
+	const u64 encoded_size = read_size_value( sstream );
+	if( sstream.GetPosition() > block_end_position || encoded_size != block_end_position - sstream.GetPosition() )
+	{
+		set_read_error( sstream, read_error_code::invalid_compressed_data, nullptr, 0, encoded_size );
+		return false;
+	}
+
+	// each byte of compressed data can at most expand to 255 bytes, so larger sizes are not plausible
+	if( decoded_size > encoded_size * 255 || ( value_size > 0 && ( decoded_size % value_size ) != 0 ) )
+	{
+		set_read_error( sstream, read_error_code::invalid_compressed_data, nullptr, 0, decoded_size );
+		return false;
+	}
+
+	std::vector<u8> encoded( (size_t)encoded_size );
+	if( sstream.Read( encoded.data(), encoded_size ) != encoded_size )
+	{
+		set_read_error( sstream, read_error_code::incomplete_value, nullptr, 0 );
+		return false;
+	}
+
+	dest.resize( (size_t)decoded_size );
+	if( BlockCompressor::Decompress( encoded.data(), encoded_size, dest.data(), decoded_size ) != status::ok )
+	{
+		set_read_error( sstream, read_error_code::invalid_compressed_data, nullptr, 0 );
+		return false;
+	}
+
+	// revert the filters, in the reverse order they were applied
+	if( ( values_flags & ArrayValuesShuffledFlag ) != 0 && value_size > 1 )
+	{
+		const std::vector<u8> shuffled( dest );
+		BlockCompressor::Unshuffle( shuffled.data(), dest.data(), decoded_size / value_size, value_size );
+	}
+	if( ( values_flags & ArrayValuesDeltaFlag ) != 0 )
+	{
+		if( delta_stride == 0 )
+		{
+			set_read_error( sstream, read_error_code::unsupported_encoding, nullptr, 0, values_flags );
+			return false;
+		}
+		BlockCompressor::DeltaDecode( dest.data(), decoded_size / value_size, value_size, delta_stride );
+	}
+
+	return true;
+}
+
 template<serialization_type_index VT, class T> inline reader_status read_array( ReadStream &sstream, const char *key, const u8 key_size_in_bytes, const bool empty_value_is_allowed, vector<T> *dest_items, vector<u32> *dest_index )
 {
 	static_assert( ( VT >= serialization_type_index::vt_array_bool ) && ( VT <= serialization_type_index::vt_array_hash ), "Invalid type for generic read_array template" );
@@ -370,18 +554,18 @@ template<serialization_type_index VT, class T> inline reader_status read_array(
 	const u64 block_end_position = begin_read_large_block( sstream, VT, key, key_size_in_bytes );
 	if( block_end_position == 0 )
 	{
-		ctLogError << "begin_read_large_block() failed unexpectedly" << ctLogEnd;
 		return reader_status::fail;
 	}
 	else if( block_end_position == sstream.GetPosition() )
 	{
-		return end_read_empty_large_block( sstream, key, empty_value_is_allowed, block_end_position );
+		return end_read_empty_large_block( sstream, key, key_size_in_bytes, empty_value_is_allowed, block_end_position );
 	}
 
 	// read item size & count and index if it exists, or make sure we do not expect an index
 	size_t per_item_size = 0;
 	size_t item_count = 0;
-	if( !read_array_metadata_and_index( sstream, per_item_size, item_count, block_end_position, dest_index ) )
+	u16 values_flags = 0;
+	if( !read_array_metadata_and_index( sstream, per_item_size, item_count, block_end_position, dest_index, &values_flags ) )
 	{
 		return reader_status::fail;
 	}
@@ -389,15 +573,39 @@ template<serialization_type_index VT, class T> inline reader_status read_array(
 	// make sure we have the right item size
 	if( value_size != per_item_size )
 	{
-		ctLogError << "The size of the items in the stream does not match the expected size" << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_block_size, key, key_size_in_bytes, per_item_size, value_size );
 		return reader_status::fail;
 	}
 
+	// if the values are compressed, decode them, and read the values from the decoded data
+	if( ( values_flags & ArrayValuesCompressedFlag ) != 0 )
+	{
+		const u64 delta_stride = array_has_integer_values( VT ) ? u64( element_type_information<T>::value_count ) : 0;
+		std::vector<u8> decoded;
+		if( !read_encoded_array_values( sstream, values_flags, block_end_position, value_size, delta_stride, decoded ) )
+		{
+			return reader_status::fail;
+		}
+		if( decoded.size() != item_count * value_size )
+		{
+			set_read_error( sstream, read_error_code::invalid_compressed_data, key, key_size_in_bytes, decoded.size(), item_count * value_size );
+			return reader_status::fail;
+		}
+
+		dest_items->resize( item_count / element_type_information<T>::value_count );
+		if( item_count > 0 )
+		{
+			ReadStream values_stream( decoded.data(), decoded.size() );
+			values_stream.Read( value_ptr( *( dest_items->data() ) ), item_count );
+		}
+		return reader_status::success;
+	}
+
 	// make sure the item count is plausible before allocating the vector
 	const u64 maximum_possible_item_count = ( block_end_position - sstream.GetPosition() ) / value_size;
 	if( item_count > maximum_possible_item_count )
 	{
-		ctLogError << "The array item count in the stream is invalid, it is beyond the size of the block" << ctLogEnd;
+		set_read_error( sstream, read_error_code::invalid_count, key, key_size_in_bytes, item_count, maximum_possible_item_count );
 		return reader_status::fail;
 	}
 
@@ -410,14 +618,14 @@ template<serialization_type_index VT, class T> inline reader_status read_array(
 	const u64 read_item_count = sstream.Read( value_ptr( *p_data ), item_count );
 	if( read_item_count != item_count )
 	{
-		ctLogError << "The stream could not read all the items for the array" << ctLogEnd;
+		set_read_error( sstream, read_error_code::incomplete_value, key, key_size_in_bytes, read_item_count, item_count );
 		return reader_status::fail;
 	}
 
 	// make sure we are at the expected end pos
 	if( !end_read_large_block( sstream, block_end_position ) )
 	{
-		ctLogError << "End position of data " << sstream.GetPosition() << " does not equal the expected end position which is " << block_end_position << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_end_position, key, key_size_in_bytes, sstream.GetPosition(), block_end_position );
 		return reader_status::fail;
 	}
 
@@ -433,12 +641,11 @@ template <> inline reader_status read_array<serialization_type_index::vt_array_b
 	const u64 block_end_position = begin_read_large_block( sstream, serialization_type_index::vt_array_bool, key, key_size_in_bytes );
 	if( block_end_position == 0 )
 	{
-		ctLogError << "begin_read_large_block() failed unexpectedly" << ctLogEnd;
 		return reader_status::fail;
 	}
 	else if( block_end_position == sstream.GetPosition() )
 	{
-		return end_read_empty_large_block( sstream, key, empty_value_is_allowed, block_end_position );
+		return end_read_empty_large_block( sstream, key, key_size_in_bytes, empty_value_is_allowed, block_end_position );
 	}
 
 	// read item size & count and index if it exists, or make sure we do not expect an index
@@ -457,7 +664,7 @@ template <> inline reader_status read_array<serialization_type_index::vt_array_b
 	const u64 maximum_possible_item_count = ( block_end_position - sstream.GetPosition() );
 	if( number_of_packed_u8s > maximum_possible_item_count )
 	{
-		ctLogError << "The array item count in the stream is invalid, it is beyond the size of the block" << ctLogEnd;
+		set_read_error( sstream, read_error_code::invalid_count, key, key_size_in_bytes, number_of_packed_u8s, maximum_possible_item_count );
 		return reader_status::fail;
 	}
 
@@ -479,13 +686,61 @@ template <> inline reader_status read_array<serialization_type_index::vt_array_b
 	// make sure we are at the expected end pos
 	if( !end_read_large_block( sstream, block_end_position ) )
 	{
-		ctLogError << "End position of data " << sstream.GetPosition() << " does not equal the expected end position which is " << block_end_position << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_end_position, key, key_size_in_bytes, sstream.GetPosition(), block_end_position );
 		return reader_status::fail;
 	}
 
 	return reader_status::success;
 }
 
+// reads string_count strings, each stored as the size and the characters, which must end before end_position
+inline bool read_array_strings( ReadStream &sstream, const u64 string_count, const u64 end_position, vector<string> *dest_items )
+{
+	// make sure the item count is plausible before allocating the vector
+	// (the size is assuming only empty strings, so only the size of the string size (sizeof(u64), or a single byte varint) per string)
+	const u64 minimum_string_size = sstream.GetCompactEncoding() ? 1 : sizeof( u64 );
+	const u64 maximum_possible_item_count = ( end_position - sstream.GetPosition() ) / minimum_string_size;
+	if( string_count > maximum_possible_item_count )
+	{
+		set_read_error( sstream, read_error_code::invalid_count, nullptr, 0, string_count, maximum_possible_item_count );
+		return false;
+	}
+
+	// resize the destination vector
+	dest_items->resize( (size_t)string_count );
+
+	// read in each string separately
+	for( u64 string_index = 0; string_index < string_count; ++string_index )
+	{
+		string &dest_string = ( *dest_items )[(size_t)string_index];
+
+		const u64 string_size = read_size_value( sstream );
+
+		// make sure the string is not outsize of possible size
+		const u64 maximum_possible_string_size = ( end_position - sstream.GetPosition() );
+		if( string_size > maximum_possible_string_size )
+		{
+			set_read_error( sstream, read_error_code::invalid_count, nullptr, 0, string_size, maximum_possible_string_size );
+			return false;
+		}
+
+		// setup the destination string, and read in the data
+		dest_string.resize( (size_t)string_size );
+		if( string_size > 0 )
+		{
+			i8 *p_data = (i8 *)&( dest_string.front() );
+			const u64 read_item_count = sstream.Read( p_data, string_size );
+			if( read_item_count != string_size )
+			{
+				set_read_error( sstream, read_error_code::incomplete_value, nullptr, 0, read_item_count, string_size );
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
 template<> inline reader_status read_array<serialization_type_index::vt_array_string, string>( ReadStream &sstream, const char *key, const u8 key_size_in_bytes, const bool empty_value_is_allowed, vector<string> *dest_items, vector<u32> *dest_index )
 {
 	static_assert( sizeof( u64 ) == sizeof( size_t ), "Unsupported size_t, current code requires it to be 8 bytes in size, equal to u64" );
@@ -496,67 +751,54 @@ template<> inline reader_status read_array<serialization_type_index::vt_array_st
 	const u64 block_end_position = begin_read_large_block( sstream, serialization_type_index::vt_array_string, key, key_size_in_bytes );
 	if( block_end_position == 0 )
 	{
-		ctLogError << "begin_read_large_block() failed unexpectedly" << ctLogEnd;
 		return reader_status::fail;
 	}
 	else if( block_end_position == sstream.GetPosition() )
 	{
-		return end_read_empty_large_block( sstream, key, empty_value_is_allowed, block_end_position );
+		return end_read_empty_large_block( sstream, key, key_size_in_bytes, empty_value_is_allowed, block_end_position );
 	}
 
 	// read item size & count and index if it exists, or make sure we do not expect an index
 	size_t per_item_size = 0;
 	size_t string_count = 0;
-	if( !read_array_metadata_and_index( sstream, per_item_size, string_count, block_end_position, dest_index ) )
-	{
-		return reader_status::fail;
-	}
-
-	// make sure the item count is plausible before allocating the vector
-	// (the size is assuming only empty strings, so only the size of the string size (sizeof(u64)) per string)
-	const u64 maximum_possible_item_count = ( block_end_position - sstream.GetPosition() ) / sizeof( u64 );
-	if( string_count > maximum_possible_item_count )
+	u16 values_flags = 0;
+	if( !read_array_metadata_and_index( sstream, per_item_size, string_count, block_end_position, dest_index, &values_flags ) )
 	{
-		ctLogError << "The array string count in the stream is invalid, it is beyond the size of the block" << ctLogEnd;
 		return reader_status::fail;
 	}
 
-	// resize the destination vector
-	dest_items->resize( string_count );
-
-	// read in each string separately
-	for( u64 string_index = 0; string_index < string_count; ++string_index )
+	// if the strings are compressed, decode them, and read the strings from the decoded data
+	if( ( values_flags & ArrayValuesCompressedFlag ) != 0 )
 	{
-		string &dest_string = ( *dest_items )[string_index];
-
-		const u64 string_size = sstream.Read<u64>();
-
-		// make sure the string is not outsize of possible size
-		const u64 maximum_possible_string_size = ( block_end_position - sstream.GetPosition() );
-		if( string_size > maximum_possible_string_size )
+		std::vector<u8> decoded;
+		if( !read_encoded_array_values( sstream, values_flags, block_end_position, 1, 0, decoded ) )
 		{
-			ctLogError << "A string size in a string array in the stream is invalid, it is beyond the size of the block" << ctLogEnd;
 			return reader_status::fail;
 		}
 
-		// setup the destination string, and read in the data
-		dest_string.resize( string_size );
-		if( string_size > 0 )
+		ReadStream values_stream( decoded.data(), decoded.size() );
+		values_stream.SetCompactEncoding( sstream.GetCompactEncoding() );
+		if( !read_array_strings( values_stream, string_count, decoded.size(), dest_items ) )
 		{
-			i8 *p_data = (i8 *)&( dest_string.front() );
-			const u64 read_item_count = sstream.Read( p_data, string_size );
-			if( read_item_count != string_size )
-			{
-				ctLogError << "The stream could not read one of the strings" << ctLogEnd;
-				return reader_status::fail;
-			}
+			return reader_status::fail;
+		}
+		if( !end_read_large_block( values_stream, decoded.size() ) )
+		{
+			set_read_error( sstream, read_error_code::invalid_compressed_data, key, key_size_in_bytes, values_stream.GetPosition(), decoded.size() );
+			return reader_status::fail;
 		}
+		return reader_status::success;
+	}
+
+	if( !read_array_strings( sstream, string_count, block_end_position, dest_items ) )
+	{
+		return reader_status::fail;
 	}
 
 	// make sure we are at the expected end pos
 	if( !end_read_large_block( sstream, block_end_position ) )
 	{
-		ctLogError << "End position of data " << sstream.GetPosition() << " does not equal the expected end position which is " << block_end_position << ctLogEnd;
+		set_read_error( sstream, read_error_code::unexpected_end_position, key, key_size_in_bytes, sstream.GetPosition(), block_end_position );
 		return reader_status::fail;
 	}
 
@@ -9,6 +9,7 @@
 #include "fileops_common.h"
 #include "element_value_ptrs.h"
 #include "WriteStream.h"
+#include "BlockCompressor.h"
 
 namespace pds
 {
@@ -24,6 +25,35 @@ template<serialization_type_index VT, class T> status write_single_value( WriteS
 // Write an array to stream.
 template<serialization_type_index VT, class T> status write_array( WriteStream &dstream, const char *key, const u8 key_size_in_bytes, const vector<T> *items, const vector<u32> *index );
 
+// write a size or count value. with compact encoding the value is a varint, otherwise it is a u64
+inline void write_size_value( WriteStream &dstream, const u64 value )
+{
+	if( dstream.GetCompactEncoding() )
+	{
+		dstream.WriteVarint( value );
+	}
+	else
+	{
+		dstream.Write( value );
+	}
+}
+
+// returns the number of bytes write_size_value writes for the value
+inline u64 size_value_size( const WriteStream &dstream, u64 value )
+{
+	if( !dstream.GetCompactEncoding() )
+	{
+		return sizeof( u64 );
+	}
+	u64 size = 1;
+	while( value >= 0x80 )
+	{
+		value >>= 7;
+		++size;
+	}
+	return size;
+}
+
 // called to begin a large block
 inline status begin_write_large_block( WriteStream &dstream, const serialization_type_index VT, const char *key, const u8 key_size_in_bytes )
 {
@@ -35,10 +65,9 @@ inline status begin_write_large_block( WriteStream &dstream, const serialization
 	const u64 expected_end_pos = start_pos + key_size_in_bytes + 10;
 
 	// write block header 
-	// write empty stand in value for now (INT64_MAX on purpose), which is definitely 
-	// wrong, as to trigger any test if the value is not overwritten with the correct value
+	// write a placeholder for the block size, which is filled in when the block ends
 	dstream.Write( value_type );
-	dstream.Write( (u64)INT64_MAX );
+	dstream.WritePlaceholder();
 	dstream.Write( key_size_in_bytes );
 	dstream.Write( (i8 *)key, key_size_in_bytes );
 
@@ -65,9 +94,7 @@ inline status end_write_large_block( WriteStream &dstream, const u64 start_pos )
 		<< "." << ctValidateEnd;
 
 	const u64 block_size = end_pos - start_pos - 9; // total block size - ( sizeof( serialization_type_index )=1 + sizeof( block_size_variable )=8 )
-	dstream.SetPosition( start_pos + 1 ); // skip over the serialization_type_index
-	dstream.Write( block_size );
-	dstream.SetPosition( end_pos ); // move back the where we were
+	dstream.FillPlaceholder( start_pos + 1, block_size ); // skip over the serialization_type_index
 	return ( end_pos > start_pos ) ? (status::ok) : (status::cant_write); // only thing we really can check
 }
 
@@ -142,33 +169,31 @@ template<> inline status write_single_value<serialization_type_index::vt_string,
 
 	// write the size of the string, and the actual string values
 	const u64 character_count = u64( string_value->size() );
-	const u64 values_size = character_count + sizeof( character_count );
-	dstream.Write( character_count );
+	const u64 values_size = character_count + size_value_size( dstream, character_count );
+	write_size_value( dstream, character_count );
 	if( character_count > 0 )
 	{
 		const i8 *data = (const i8 *)string_value->data();
 		dstream.Write( data, character_count );
 	}
 
-	// make sure all data was written
+	// make sure all data was written. (validated before the block is ended, since the end can move the data with compact encoding)
 	const u64 expected_end_pos = string_data_start_pos + values_size;
-
-	// end the block by going back to the start and writing the start position offset
-	ctStatusCall(end_write_large_block(dstream, start_pos));
-
-	// validate the write 
 	const u64 end_pos = dstream.GetPosition();
 	ctValidate(end_pos == expected_end_pos, status::cant_write)
 		<< "Failed to write value to stream. End position of data " << end_pos
 		<< " does not equal the expected end position which is " << expected_end_pos
 		<< "." << ctValidateEnd;
 
+	// end the block by going back to the start and writing the start position offset
+	ctStatusCall(end_write_large_block(dstream, start_pos));
+
 	// succeeded
 	return status::ok;
 }
 
-// write metadata and index for an array
-inline status write_array_metadata_and_index( WriteStream &dstream, size_t per_item_size, size_t item_count, const vector<u32> *index )
+// write metadata and index for an array. values_flags are the ArrayValues* flags of how the values are encoded
+inline status write_array_metadata_and_index( WriteStream &dstream, size_t per_item_size, size_t item_count, const vector<u32> *index, const u16 values_flags = 0 )
 {
 	static_assert( sizeof( u64 ) <= sizeof( size_t ), "Unsupported size_t, current code requires it to be at least 8 bytes in size, equal to u64" );
 	ctSanityCheck( per_item_size <= 0xff ); // max 8 bits for per item size
@@ -177,28 +202,37 @@ inline status write_array_metadata_and_index( WriteStream &dstream, size_t per_i
 	// set flags for the array
 	const u16 has_index_flag = ( index ) ? ( 0x100 ) : ( 0 );
 	const u16 index_is_64bit_flag = ( false ) ? ( 0x200 ) : ( 0 ); // we do not support 64 bit indices yet
-	const u16 array_flags = has_index_flag | index_is_64bit_flag | u16( per_item_size );
-	dstream.Write( array_flags );
+	const u16 array_flags = has_index_flag | index_is_64bit_flag | values_flags | u16( per_item_size );
+	u64 flags_size = sizeof( u16 );
+	if( dstream.GetCompactEncoding() )
+	{
+		dstream.WriteVarint( array_flags );
+		flags_size = size_value_size( dstream, array_flags );
+	}
+	else
+	{
+		dstream.Write( array_flags );
+	}
 
 	// write the number of items
-	dstream.Write( u64( item_count ) );
+	write_size_value( dstream, u64( item_count ) );
 
 	// if we have an index, write it 
 	u64 index_size = 0;
 	if( index )
 	{
 		const u64 index_count = index->size();
-		dstream.Write( index_count );
+		write_size_value( dstream, index_count );
 		dstream.Write( index->data(), index_count );
 
-		index_size = ( index_count * sizeof( u32 ) ) + sizeof( u64 ); // the index values and the value count
+		index_size = ( index_count * sizeof( u32 ) ) + size_value_size( dstream, index_count ); // the index values and the value count
 	}
 
 	// make sure all data was written
 	const u64 expected_end_pos =
 		start_pos
-		+ sizeof( u16 ) // the flags
-		+ sizeof( u64 ) // the item count
+		+ flags_size // the flags
+		+ size_value_size( dstream, u64( item_count ) ) // the item count
 		+ index_size;   // the (optional) index
 
 	const u64 end_pos = dstream.GetPosition();
@@ -210,6 +244,91 @@ inline status write_array_metadata_and_index( WriteStream &dstream, size_t per_i
 	return status::ok;
 }
 
+// returns the number of bytes write_array_metadata_and_index writes
+inline u64 array_metadata_and_index_size( const WriteStream &dstream, size_t per_item_size, size_t item_count, const vector<u32> *index, const u16 values_flags = 0 )
+{
+	const u16 array_flags = ( ( index ) ? u16( 0x100 ) : u16( 0 ) ) | values_flags | u16( per_item_size );
+	const u64 flags_size = ( dstream.GetCompactEncoding() ) ? size_value_size( dstream, array_flags ) : sizeof( u16 );
+	const u64 index_size = ( index ) ? ( size_value_size( dstream, index->size() ) + index->size() * sizeof( u32 ) ) : 0;
+	return flags_size + size_value_size( dstream, u64( item_count ) ) + index_size;
+}
+
+// write the metadata, index and compressed values of an array. values of value_size > 1 are byte shuffled, and if delta_stride 
+// is set, delta encoded, in one pass into a scratch buffer, which is compressed directly into space reserved at the end of the stream. 
+// if the values do not compress (or the stream has a sink), nothing is written, and written is false, so the values are written uncompressed.
+inline status write_compressed_array( WriteStream &dstream, size_t per_item_size, size_t item_count, const vector<u32> *index, const u8 *values, u64 values_size, u64 value_size, u64 delta_stride, bool &written )
+{
+	written = false;
+
+	// only use the compressed values if they are smaller, including the sizes which are added to the block
+	const u64 max_encoded_size = ( values_size > 2 * sizeof( u64 ) ) ? ( values_size - 2 * sizeof( u64 ) ) : 0;
+	if( max_encoded_size == 0 )
+	{
+		return status::ok;
+	}
+
+	u16 values_flags = ArrayValuesCompressedFlag;
+	if( value_size > 1 )
+	{
+		values_flags |= ArrayValuesShuffledFlag | ( ( delta_stride > 0 ) ? ArrayValuesDeltaFlag : u16( 0 ) );
+	}
+
+	// the encoded size is written before the encoded values, so reserve the width of the largest encoded size, 
+	// which with compact encoding is padded to that width
+	const u64 start_pos = dstream.GetPosition();
+	const u64 encoded_size_width = size_value_size( dstream, max_encoded_size );
+	const u64 header_size = array_metadata_and_index_size( dstream, per_item_size, item_count, index, values_flags ) + size_value_size( dstream, values_size ) + encoded_size_width;
+	u8 *reserved = dstream.ReserveAtEnd( header_size + max_encoded_size );
+	if( !reserved )
+	{
+		return status::ok;
+	}
+
+	// filter the values into the scratch buffer
+	std::vector<u8> filtered;
+	const u8 *src = values;
+	if( value_size > 1 )
+	{
+		const u64 value_count = values_size / value_size;
+		filtered.resize( (size_t)values_size );
+		if( delta_stride > 0 )
+		{
+			BlockCompressor::DeltaEncodeShuffle( values, filtered.data(), value_count, value_size, delta_stride );
+		}
+		else
+		{
+			BlockCompressor::Shuffle( values, filtered.data(), value_count, value_size );
+		}
+		src = filtered.data();
+	}
+
+	const u64 encoded_size = BlockCompressor::Compress( src, values_size, reserved + header_size, max_encoded_size );
+	if( encoded_size == 0 )
+	{
+		return status::ok;
+	}
+
+	// write the header in front of the encoded values, which are then added to the stream in place
+	ctStatusCall( write_array_metadata_and_index( dstream, per_item_size, item_count, index, values_flags ) );
+	write_size_value( dstream, values_size );
+	if( dstream.GetCompactEncoding() )
+	{
+		dstream.WriteVarint( encoded_size, encoded_size_width );
+	}
+	else
+	{
+		dstream.Write( encoded_size );
+	}
+	ctValidate( dstream.GetPosition() == start_pos + header_size, status::cant_write )
+		<< "End position of the compressed array header " << dstream.GetPosition()
+		<< " does not equal the expected end position which is " << start_pos + header_size
+		<< "." << ctValidateEnd;
+	dstream.WriteReserved( encoded_size );
+
+	written = true;
+	return status::ok;
+}
+
 // write array to stream
 template<serialization_type_index VT, class T> inline status write_array( WriteStream &dstream, const char *key, const u8 key_size_in_bytes, const vector<T> *items, const vector<u32> *index )
 {
@@ -229,6 +348,23 @@ template<serialization_type_index VT, class T> inline status write_array( WriteS
 	if( items )
 	{
 		const u64 values_count = items->size() * values_per_type;
+
+		// if the values are large enough, serialize them separately, and try to compress them
+		const u64 compression_threshold = dstream.GetCompressionThreshold();
+		if( compression_threshold > 0 && values_count > 0 && values_count * value_size >= compression_threshold )
+		{
+			// the values are stored little endian, same as in memory, so they are filtered and compressed straight from the items
+			const typename element_type_information<T>::value_type *p_values = value_ptr( *( items->data() ) );
+			const u64 delta_stride = array_has_integer_values( VT ) ? u64( values_per_type ) : 0;
+			bool written = false;
+			ctStatusCall( write_compressed_array( dstream, value_size, values_count, index, (const u8 *)p_values, values_count * value_size, value_size, delta_stride, written ) );
+			if( written )
+			{
+				ctStatusCall( end_write_large_block( dstream, start_pos ) );
+				return status::ok;
+			}
+		}
+
 		ctStatusCall( write_array_metadata_and_index( dstream, value_size, values_count, index ) );
 
 		// write the values
@@ -319,6 +455,36 @@ template<> inline status write_array<serialization_type_index::vt_array_string,
 	// write data if we have it
 	if( items )
 	{
+		// if the strings are large enough, serialize them separately, and try to compress them
+		const u64 compression_threshold = dstream.GetCompressionThreshold();
+		if( compression_threshold > 0 && items->size() > 0 )
+		{
+			u64 values_size = sizeof( u64 ) * items->size();
+			for( const auto &item : *items )
+			{
+				values_size += item.size();
+			}
+
+			if( values_size >= compression_threshold )
+			{
+				WriteStream values_stream( values_size );
+				values_stream.SetCompactEncoding( dstream.GetCompactEncoding() );
+				for( const auto &item : *items )
+				{
+					write_size_value( values_stream, u64( item.size() ) );
+					values_stream.Write( (const i8 *)item.data(), item.size() );
+				}
+
+				bool written = false;
+				ctStatusCall( write_compressed_array( dstream, 0, items->size(), index, (const u8 *)values_stream.GetData(), values_stream.GetSize(), 1, 0, written ) );
+				if( written )
+				{
+					ctStatusCall( end_write_large_block( dstream, start_pos ) );
+					return status::ok;
+				}
+			}
+		}
+
 		// write the item count and items
 		ctStatusCall( write_array_metadata_and_index( dstream, 0, items->size(), index ) );
 
@@ -326,14 +492,15 @@ template<> inline status write_array<serialization_type_index::vt_array_string,
 		{
 			const u64 values_start_pos = dstream.GetPosition();
 
-			// this is the minimum size, with only empty strings. each string will add to the values_size
-			u64 values_size = sizeof( u64 ) * items->size();
+			// each string adds its size value and characters to the values_size
+			u64 values_size = 0;
 
 			// write each string in the array
 			for( size_t string_index = 0; string_index < items->size(); ++string_index )
 			{
 				u64 string_length = ( *items )[string_index].size();
-				dstream.Write( string_length );
+				write_size_value( dstream, string_length );
+				values_size += size_value_size( dstream, string_length );
 				if( string_length > 0 )
 				{
 					i8 *p_data = (i8 *)( ( *items )[string_index].data() );
@@ -0,0 +1,92 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Benchmarks.h"
+
+#include <cstdlib>
+#include <new>
+
+#include <pds/EntityWriter.h>
+#include <pds/EntityReader.h>
+#include <pds/WriteStream.h>
+#include <pds/ReadStream.h>
+#include <pds/mf/ItemTable_MF.h>
+
+#include "TestPackA/TestEntityA.h"
+#include "TestPackA/v1_0/v1_0_TestEntityA_MF.h"
+
+using TestPackA::TestEntityA;
+using Table = ItemTable<u64, TestEntityA>;
+
+// count the heap allocations of the benchmark executable
+static std::atomic<u64> allocationCount( 0 );
+
+void *operator new( std::size_t size )
+{
+	++allocationCount;
+	void *ptr = std::malloc( size ? size : 1 );
+	if( !ptr )
+	{
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void operator delete( void *ptr ) noexcept
+{
+	std::free( ptr );
+}
+
+void operator delete( void *ptr, std::size_t ) noexcept
+{
+	std::free( ptr );
+}
+
+// runs func and returns the number of heap allocations it made
+template<class _Fn> static u64 countAllocations( const _Fn &func )
+{
+	const u64 start = allocationCount.load();
+	func();
+	return allocationCount.load() - start;
+}
+
+// counts the heap allocations of writing and reading an item table of entities, where each entity has a couple
+// of subsections. the data of the entities themselves (the table entries and strings) also allocate when read.
+void AllocationBenchmarks()
+{
+	for( size_t count : { size_t( 100 ), size_t( 10000 ) } )
+	{
+		Table table;
+		for( size_t i = 0; i < count; ++i )
+		{
+			TestEntityA &entity = table.Insert( u64_rand() );
+			entity.Name() = "entity_" + std::to_string( i );
+			entity.TestVariableA().set();
+		}
+
+		WriteStream reference;
+		{
+			EntityWriter writer( reference );
+			Table::MF::Write( table, writer );
+		}
+
+		std::cout << "Allocations, ItemTable with " << count << " items:" << std::endl;
+
+		WriteStream ws( reference.GetSize() );
+		const u64 writeAllocations = countAllocations( [&]()
+		{
+			EntityWriter writer( ws );
+			Table::MF::Write( table, writer );
+		} );
+		std::cout << "  write: " << writeAllocations << " allocations, " << ( double( writeAllocations ) / double( count ) ) << " per item" << std::endl;
+
+		Table readTable;
+		const u64 readAllocations = countAllocations( [&]()
+		{
+			ReadStream rs( reference.GetData(), reference.GetSize() );
+			EntityReader reader( rs );
+			Table::MF::Read( readTable, reader );
+		} );
+		std::cout << "  read: " << readAllocations << " allocations, " << ( double( readAllocations ) / double( count ) ) << " per item" << std::endl;
+	}
+}
@@ -0,0 +1,16 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Benchmarks.h"
+
+int main()
+{
+	setup_random_seed();
+
+	AllocationBenchmarks();
+	EntityCacheBenchmarks();
+	HashBenchmarks();
+	ItemTableBenchmarks();
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include <pds/pds.h>
+
+using namespace pds;
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TestHelpers/random_vals.h"
+
+// the benchmarks, each in a separate source file
+void AllocationBenchmarks();
+void EntityCacheBenchmarks();
+void HashBenchmarks();
+void ItemTableBenchmarks();
+
+// the thread counts to run the multi-threaded benchmarks with, doubling up to the hardware concurrency
+inline std::vector<uint> benchmarkThreadCounts()
+{
+	const uint maxThreads = std::max( std::thread::hardware_concurrency(), 1u );
+	std::vector<uint> counts;
+	for( uint count = 1; count < maxThreads; count *= 2 )
+	{
+		counts.emplace_back( count );
+	}
+	counts.emplace_back( maxThreads );
+	return counts;
+}
+
+// runs func( threadIndex ) on threadCount threads, started at the same time, and returns the wall time in seconds
+inline double runOnThreads( uint threadCount, const std::function<void( uint )> &func )
+{
+	std::atomic<uint> waitingThreads( threadCount );
+	std::vector<std::thread> threads;
+	std::chrono::steady_clock::time_point startTime;
+	for( uint t = 0; t < threadCount; ++t )
+	{
+		threads.emplace_back( [&waitingThreads, &func, t]()
+			{
+				// spin until all threads are started
+				--waitingThreads;
+				while( waitingThreads.load() != 0 ) {}
+				func( t );
+			} );
+	}
+	while( waitingThreads.load() != 0 ) {}
+	startTime = std::chrono::steady_clock::now();
+	for( auto &thread : threads )
+	{
+		thread.join();
+	}
+	return std::chrono::duration<double>( std::chrono::steady_clock::now() - startTime ).count();
+}
+
+// prints a result line, with the throughput in millions of operations per second
+inline void printBenchmarkResult( const std::string &name, uint threadCount, u64 operationCount, double seconds )
+{
+	std::cout << "  " << name << ", " << threadCount << " threads: " 
+		<< ( double( operationCount ) / seconds / 1000000.0 ) << " Mops/s" << std::endl;
+}
@@ -0,0 +1,59 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Benchmarks.h"
+
+#include <pds/EntityCache.h>
+
+#include "TestPackA/TestEntityA.h"
+
+using TestPackA::TestEntityA;
+
+// measures the lookup throughput of the entity cache, with a single shard and with multiple shards
+void EntityCacheBenchmarks()
+{
+	const size_t entityCount = 100000;
+	const u64 lookupsPerThread = 2000000;
+
+	std::vector<entity_ref> refs;
+	refs.reserve( entityCount );
+	for( size_t i = 0; i < entityCount; ++i )
+	{
+		refs.emplace_back( random_value<hash>() );
+	}
+
+	for( uint shardCount : { 1u, 16u, 64u } )
+	{
+		std::cout << "EntityCache lookups, " << shardCount << " shards:" << std::endl;
+
+		EntityCache cache( shardCount );
+		for( const auto &ref : refs )
+		{
+			cache.Insert( ref, std::make_shared<TestEntityA>(), 1 );
+		}
+
+		for( uint threadCount : benchmarkThreadCounts() )
+		{
+			std::atomic<u64> found( 0 );
+			const double seconds = runOnThreads( threadCount, [&cache, &refs, &found, lookupsPerThread]( uint threadIndex )
+				{
+					// step through the refs in a different pseudo-random order in each thread
+					u64 index = threadIndex * 7919;
+					u64 count = 0;
+					for( u64 i = 0; i < lookupsPerThread; ++i )
+					{
+						index = ( index * 6364136223846793005ull + 1442695040888963407ull );
+						if( cache.Find( refs[( index >> 33 ) % refs.size()] ) )
+							++count;
+					}
+					found += count;
+				} );
+
+			if( found.load() != threadCount * lookupsPerThread )
+			{
+				std::cout << "  error: entities missing from the cache" << std::endl;
+			}
+			printBenchmarkResult( "Find", threadCount, threadCount * lookupsPerThread, seconds );
+		}
+	}
+}
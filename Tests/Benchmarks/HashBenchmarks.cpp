@@ -0,0 +1,56 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Benchmarks.h"
+
+#include <ctle/hasher.h>
+#include <pds/EntityHasher.h>
+#include <pds/WorkerPool.h>
+
+// runs func repeatedly on the data for at least a short while, and prints the throughput in MB/s
+template<class _Fn> static void measureHash( const std::string &name, const std::vector<u8> &data, const _Fn &func )
+{
+	u64 runs = 0;
+	hash digest = {};
+	const auto startTime = std::chrono::steady_clock::now();
+	double seconds = 0;
+	do
+	{
+		digest = func( data.data(), (u64)data.size() );
+		++runs;
+		seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - startTime ).count();
+	} while( seconds < 0.5 );
+
+	std::cout << "  " << name << ": " << ( double( runs * data.size() ) / seconds / ( 1024.0 * 1024.0 ) ) << " MB/s"
+		<< " (" << to_string( digest ).substr( 0, 8 ) << ")" << std::endl;
+}
+
+template<class _Hasher> static hash flatHash( const u8 *data, u64 size )
+{
+	_Hasher hasher;
+	hasher.update( data, (size_t)size );
+	return hasher.finish().value();
+}
+
+// compares the throughput of the single-threaded flat hashes with the tree hash, on one thread and in parallel
+void HashBenchmarks()
+{
+	WorkerPool pool;
+	pool.Initialize( 0, 0 );
+
+	for( u64 size : { u64( 64 ) * 1024, u64( 1024 ) * 1024, u64( 16 ) * 1024 * 1024, u64( 256 ) * 1024 * 1024 } )
+	{
+		std::cout << "Hashing, " << ( size / 1024 ) << " KB buffers, " << ( pool.GetWorkerCount() + 1 ) << " threads for the parallel hash:" << std::endl;
+
+		std::vector<u8> data( (size_t)size );
+		for( auto &value : data )
+		{
+			value = u8_rand();
+		}
+
+		measureHash( "flat xxh128", data, flatHash<ctle::hasher_2x_xxh128_dcb7be9cd0fcf505> );
+		measureHash( "flat sha256", data, flatHash<ctle::hasher_sha256> );
+		measureHash( "tree, single thread", data, []( const u8 *ptr, u64 count ) { return EntityHasher::Calculate( ptr, count, entity_hash_mode::tree ).value(); } );
+		measureHash( "tree, parallel", data, [&pool]( const u8 *ptr, u64 count ) { return EntityHasher::Calculate( ptr, count, entity_hash_mode::tree, &pool ).value(); } );
+	}
+}
@@ -0,0 +1,80 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Benchmarks.h"
+
+#include <pds/EntityWriter.h>
+#include <pds/EntityReader.h>
+#include <pds/WriteStream.h>
+#include <pds/ReadStream.h>
+#include <pds/WorkerPool.h>
+#include <pds/mf/ItemTable_MF.h>
+
+#include "TestPackA/TestEntityA.h"
+#include "TestPackA/v1_0/v1_0_TestEntityA_MF.h"
+
+using TestPackA::TestEntityA;
+using Table = ItemTable<u64, TestEntityA>;
+
+// runs func repeatedly for at least a short while, and prints the throughput in MB/s of the table data
+template<class _Fn> static void measureTable( const std::string &name, u64 dataSize, const _Fn &func )
+{
+	u64 runs = 0;
+	const auto startTime = std::chrono::steady_clock::now();
+	double seconds = 0;
+	do
+	{
+		func();
+		++runs;
+		seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - startTime ).count();
+	} while( seconds < 0.5 );
+
+	std::cout << "  " << name << ": " << ( double( runs * dataSize ) / seconds / ( 1024.0 * 1024.0 ) ) << " MB/s" << std::endl;
+}
+
+// compares writing and reading large item tables in order, and in parallel on a worker pool
+void ItemTableBenchmarks()
+{
+	WorkerPool pool;
+	pool.Initialize( 0, 0 );
+
+	for( size_t count : { size_t( 1000 ), size_t( 100000 ) } )
+	{
+		Table table;
+		for( size_t i = 0; i < count; ++i )
+		{
+			TestEntityA &entity = table.Insert( u64_rand() );
+			entity.Name() = "entity_" + std::to_string( i );
+			entity.OptionalText().set( std::string( capped_rand( 0, 200 ), 'x' ) );
+		}
+
+		WriteStream reference;
+		{
+			EntityWriter writer( reference );
+			Table::MF::Write( table, writer );
+		}
+		const u64 dataSize = reference.GetSize();
+
+		std::cout << "ItemTable, " << count << " items, " << ( dataSize / 1024 ) << " KB, " << ( pool.GetWorkerCount() + 1 ) << " threads for the parallel paths:" << std::endl;
+
+		for( WorkerPool *usedPool : { (WorkerPool *)nullptr, &pool } )
+		{
+			const std::string mode = ( usedPool ) ? "parallel" : "in order";
+			measureTable( "write, " + mode, dataSize, [&]()
+			{
+				WriteStream ws( dataSize );
+				EntityWriter writer( ws );
+				writer.SetWorkerPool( usedPool );
+				Table::MF::Write( table, writer );
+			} );
+			measureTable( "read, " + mode, dataSize, [&]()
+			{
+				ReadStream rs( reference.GetData(), reference.GetSize() );
+				EntityReader reader( rs );
+				reader.SetWorkerPool( usedPool );
+				Table readTable;
+				Table::MF::Read( readTable, reader );
+			} );
+		}
+	}
+}
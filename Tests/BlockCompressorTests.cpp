@@ -0,0 +1,236 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <pds/BlockCompressor.h>
+#include <pds/EntityWriter.h>
+#include <pds/EntityReader.h>
+#include <pds/WriteStream.h>
+#include <pds/ReadStream.h>
+
+// data with runs and repeated sequences of random length, so it is compressible, but not trivially
+static std::vector<u8> compressibleData( size_t size )
+{
+	std::vector<u8> data;
+	data.reserve( size );
+	while( data.size() < size )
+	{
+		const size_t length = capped_rand( 1, 300 );
+		if( data.size() > 16 && ( rand() % 2 ) )
+		{
+			const size_t offset = capped_rand( 1, std::min( data.size(), size_t( 0xffff ) ) );
+			for( size_t i = 0; i < length && data.size() < size; ++i )
+			{
+				data.push_back( data[data.size() - offset] );
+			}
+		}
+		else
+		{
+			for( size_t i = 0; i < length && data.size() < size; ++i )
+			{
+				data.push_back( ( rand() % 4 ) ? u8( 'a' + rand() % 4 ) : u8_rand() );
+			}
+		}
+	}
+	return data;
+}
+
+static std::vector<u8> roundTrip( const std::vector<u8> &data, u64 &compressedSize )
+{
+	std::vector<u8> compressed( (size_t)BlockCompressor::GetMaxCompressedSize( data.size() ) );
+	compressedSize = BlockCompressor::Compress( data.data(), data.size(), compressed.data(), compressed.size() );
+	EXPECT_GT( compressedSize, u64( 0 ) );
+
+	std::vector<u8> decompressed( data.size() );
+	EXPECT_EQ( BlockCompressor::Decompress( compressed.data(), compressedSize, decompressed.data(), decompressed.size() ), status::ok );
+	return decompressed;
+}
+
+TEST( BlockCompressorTests, CompressAndDecompress )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		u64 compressedSize = 0;
+
+		// small sizes, which can not have any matches
+		for( size_t size = 0; size < 20; ++size )
+		{
+			std::vector<u8> data( size );
+			for( auto &value : data )
+				value = u8_rand();
+			EXPECT_EQ( roundTrip( data, compressedSize ), data );
+		}
+
+		// random data does not compress, but must fit in the max compressed size
+		std::vector<u8> randomData( capped_rand( 1, 100000 ) );
+		for( auto &value : randomData )
+			value = u8_rand();
+		EXPECT_EQ( roundTrip( randomData, compressedSize ), randomData );
+		EXPECT_LE( compressedSize, BlockCompressor::GetMaxCompressedSize( randomData.size() ) );
+
+		// compressible data, with overlapping matches and long literal runs
+		const std::vector<u8> data = compressibleData( capped_rand( 1000, 200000 ) );
+		EXPECT_EQ( roundTrip( data, compressedSize ), data );
+		EXPECT_LT( compressedSize, u64( data.size() ) );
+
+		const std::vector<u8> zeros( capped_rand( 1000, 200000 ), 0 );
+		EXPECT_EQ( roundTrip( zeros, compressedSize ), zeros );
+		EXPECT_LT( compressedSize, u64( zeros.size() / 100 ) );
+	}
+}
+
+TEST( BlockCompressorTests, CorruptedDataFails )
+{
+	setup_random_seed();
+
+	const std::vector<u8> data = compressibleData( 10000 );
+	std::vector<u8> compressed( (size_t)BlockCompressor::GetMaxCompressedSize( data.size() ) );
+	const u64 compressedSize = BlockCompressor::Compress( data.data(), data.size(), compressed.data(), compressed.size() );
+	std::vector<u8> decompressed( data.size() );
+
+	// the destination size must match exactly
+	EXPECT_NE( BlockCompressor::Decompress( compressed.data(), compressedSize, decompressed.data(), decompressed.size() - 1 ), status::ok );
+
+	// truncated data fails
+	EXPECT_NE( BlockCompressor::Decompress( compressed.data(), compressedSize / 2, decompressed.data(), decompressed.size() ), status::ok );
+
+	// damaged data never reads or writes out of bounds, but may decompress to other data
+	for( uint pass_index = 0; pass_index < 100; ++pass_index )
+	{
+		std::vector<u8> damaged( compressed.begin(), compressed.begin() + (ptrdiff_t)compressedSize );
+		damaged[rand() % damaged.size()] = u8_rand();
+		BlockCompressor::Decompress( damaged.data(), damaged.size(), decompressed.data(), decompressed.size() );
+	}
+}
+
+TEST( BlockCompressorTests, Filters )
+{
+	setup_random_seed();
+
+	for( u64 valueSize : { u64( 1 ), u64( 2 ), u64( 4 ), u64( 8 ) } )
+	{
+		const u64 count = (u64)capped_rand( 1, 1000 );
+		std::vector<u8> data( (size_t)( count * valueSize ) );
+		for( auto &value : data )
+			value = u8_rand();
+
+		std::vector<u8> shuffled( data.size() );
+		std::vector<u8> unshuffled( data.size() );
+		BlockCompressor::Shuffle( data.data(), shuffled.data(), count, valueSize );
+		BlockCompressor::Unshuffle( shuffled.data(), unshuffled.data(), count, valueSize );
+		EXPECT_EQ( unshuffled, data );
+
+		for( u64 stride : { u64( 1 ), u64( 3 ) } )
+		{
+			std::vector<u8> deltas = data;
+			BlockCompressor::DeltaEncode( deltas.data(), count, valueSize, stride );
+			std::vector<u8> fused( data.size() );
+			BlockCompressor::Shuffle( deltas.data(), shuffled.data(), count, valueSize );
+			BlockCompressor::DeltaEncodeShuffle( data.data(), fused.data(), count, valueSize, stride );
+			EXPECT_EQ( fused, shuffled );
+
+			BlockCompressor::DeltaDecode( deltas.data(), count, valueSize, stride );
+			EXPECT_EQ( deltas, data );
+		}
+	}
+
+	// increasing values are encoded as the (constant) difference
+	std::vector<u8> values = { 10, 0, 20, 0, 30, 0, 40, 1 };
+	BlockCompressor::DeltaEncode( values.data(), 4, 2, 1 );
+	EXPECT_EQ( values, std::vector<u8>( { 10, 0, 10, 0, 10, 0, 10, 1 } ) );
+}
+
+TEST( BlockCompressorTests, CompressedArrays )
+{
+	setup_random_seed();
+
+	// arrays of values which compress well, such as index buffers, and positions on a grid
+	std::vector<u32> indices( 10000 );
+	for( size_t i = 0; i < indices.size(); ++i )
+		indices[i] = u32( i / 3 + ( i % 3 ) );
+	std::vector<i32vec3> cells( 2000 );
+	for( size_t i = 0; i < cells.size(); ++i )
+		cells[i] = i32vec3( i32( i % 50 ), i32( i / 50 ), -100 );
+	std::vector<float> weights( 5000 );
+	for( size_t i = 0; i < weights.size(); ++i )
+		weights[i] = float( i % 16 ) * 0.25f;
+	std::vector<string> names( 500 );
+	for( size_t i = 0; i < names.size(); ++i )
+		names[i] = "node_" + std::to_string( i % 20 );
+	std::vector<u64> randomValues;
+	random_vector<u64>( randomValues, 100, 1000 );
+
+	const auto writeAll = [&]( WriteStream &ws )
+	{
+		EntityWriter ew( ws );
+		EXPECT_EQ( ew.Write( "Indices", 7, indices ), status::ok );
+		EXPECT_EQ( ew.Write( "Cells", 5, cells ), status::ok );
+		EXPECT_EQ( ew.Write( "Weights", 7, weights ), status::ok );
+		EXPECT_EQ( ew.Write( "Names", 5, names ), status::ok );
+		EXPECT_EQ( ew.Write( "RandomValues", 12, randomValues ), status::ok );
+	};
+
+	WriteStream uncompressed;
+	writeAll( uncompressed );
+	WriteStream compressed;
+	compressed.SetCompressionThreshold( 1024 );
+	writeAll( compressed );
+	EXPECT_LT( compressed.GetSize() * 4, uncompressed.GetSize() );
+
+	// the compressed arrays are read back transparently
+	ReadStream rs( compressed.GetData(), compressed.GetSize() );
+	EntityReader er( rs );
+	std::vector<u32> readIndices;
+	std::vector<i32vec3> readCells;
+	std::vector<float> readWeights;
+	std::vector<string> readNames;
+	std::vector<u64> readRandomValues;
+	EXPECT_EQ( er.Read( "Indices", 7, readIndices ), status::ok );
+	EXPECT_EQ( er.Read( "Cells", 5, readCells ), status::ok );
+	EXPECT_EQ( er.Read( "Weights", 7, readWeights ), status::ok );
+	EXPECT_EQ( er.Read( "Names", 5, readNames ), status::ok );
+	EXPECT_EQ( er.Read( "RandomValues", 12, readRandomValues ), status::ok );
+	EXPECT_EQ( readIndices, indices );
+	EXPECT_EQ( readCells, cells );
+	EXPECT_EQ( readWeights, weights );
+	EXPECT_EQ( readNames, names );
+	EXPECT_EQ( readRandomValues, randomValues );
+	EXPECT_EQ( rs.GetPosition(), rs.GetSize() );
+}
+
+TEST( BlockCompressorTests, CompressedArraysWithCompactEncoding )
+{
+	setup_random_seed();
+
+	// the encoded sizes of the compressed arrays are padded varints
+	std::vector<u32> indices( 10000 );
+	for( size_t i = 0; i < indices.size(); ++i )
+		indices[i] = u32( i / 3 + ( i % 3 ) );
+	std::vector<string> names( 500 );
+	for( size_t i = 0; i < names.size(); ++i )
+		names[i] = "node_" + std::to_string( i % 20 );
+
+	WriteStream compressed;
+	compressed.SetCompactEncoding( true );
+	compressed.SetCompressionThreshold( 1024 );
+	{
+		EntityWriter ew( compressed );
+		EXPECT_EQ( ew.Write( "Indices", 7, indices ), status::ok );
+		EXPECT_EQ( ew.Write( "Names", 5, names ), status::ok );
+	}
+	EXPECT_LT( compressed.GetSize() * 4, u64( indices.size() * sizeof( u32 ) ) );
+
+	ReadStream rs( compressed.GetData(), compressed.GetSize() );
+	rs.SetCompactEncoding( true );
+	EntityReader er( rs );
+	std::vector<u32> readIndices;
+	std::vector<string> readNames;
+	EXPECT_EQ( er.Read( "Indices", 7, readIndices ), status::ok );
+	EXPECT_EQ( er.Read( "Names", 5, readNames ), status::ok );
+	EXPECT_EQ( readIndices, indices );
+	EXPECT_EQ( readNames, names );
+	EXPECT_EQ( rs.GetPosition(), rs.GetSize() );
+}
@@ -0,0 +1,210 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <thread>
+
+#include <pds/EntityCache.h>
+
+#include "TestPackA/TestEntityA.h"
+
+using TestPackA::TestEntityA;
+
+static std::vector<entity_ref> insertRandomEntities( EntityCache &cache, size_t count, u64 size )
+{
+	std::vector<entity_ref> refs;
+	for( size_t i = 0; i < count; ++i )
+	{
+		refs.emplace_back( random_value<hash>() );
+		cache.Insert( refs.back(), std::make_shared<TestEntityA>(), size );
+	}
+	return refs;
+}
+
+TEST( EntityCacheTests, UnboundedCache )
+{
+	setup_random_seed();
+
+	EntityCache cache;
+	const auto refs = insertRandomEntities( cache, 100, 10 );
+	for( const auto &ref : refs )
+	{
+		EXPECT_TRUE( cache.Find( ref ) != nullptr );
+	}
+	EXPECT_TRUE( cache.Find( random_value<hash>() ) == nullptr );
+
+	auto metrics = cache.GetMetrics();
+	EXPECT_EQ( metrics.EntityCount, u64( 100 ) );
+	EXPECT_EQ( metrics.TotalSize, u64( 1000 ) );
+	EXPECT_EQ( metrics.Hits, u64( 100 ) );
+	EXPECT_EQ( metrics.Misses, u64( 1 ) );
+	EXPECT_EQ( metrics.Evictions, u64( 0 ) );
+
+	// keep one of the entities referenced, all the others are removed
+	auto kept = cache.Find( refs[50] );
+	EXPECT_EQ( cache.EvictUnreferenced(), size_t( 99 ) );
+	EXPECT_TRUE( cache.Contains( refs[50] ) );
+	EXPECT_FALSE( cache.Contains( refs[49] ) );
+	EXPECT_EQ( cache.GetMetrics().TotalSize, u64( 10 ) );
+}
+
+TEST( EntityCacheTests, EvictsToBudget )
+{
+	setup_random_seed();
+
+	// use a single shard, so the order of evictions is exact
+	EntityCache cache( 1 );
+	cache.SetBudget( 50, 0 );
+	const auto first = insertRandomEntities( cache, 50, 10 );
+	EXPECT_EQ( cache.GetMetrics().EntityCount, u64( 50 ) );
+
+	// keep half of the entities referenced, and touch some of the others, so they are recently used
+	std::vector<std::shared_ptr<const Entity>> referenced;
+	for( size_t i = 0; i < 25; ++i )
+	{
+		referenced.emplace_back( cache.Find( first[i] ) );
+	}
+
+	// insert more entities, which pushes out the unreferenced ones
+	const auto second = insertRandomEntities( cache, 25, 10 );
+	auto metrics = cache.GetMetrics();
+	EXPECT_EQ( metrics.EntityCount, u64( 50 ) );
+	EXPECT_EQ( metrics.Evictions, u64( 25 ) );
+	for( size_t i = 0; i < 25; ++i )
+	{
+		EXPECT_TRUE( cache.Contains( first[i] ) );
+		EXPECT_FALSE( cache.Contains( first[25 + i] ) );
+		EXPECT_TRUE( cache.Contains( second[i] ) );
+	}
+
+	// if all entities are referenced, the budget is exceeded until they are released
+	std::vector<std::shared_ptr<const Entity>> allReferenced;
+	for( const auto &ref : second )
+	{
+		auto ent = cache.Find( ref );
+		if( ent )
+			allReferenced.emplace_back( ent );
+	}
+	referenced.clear();
+	cache.SetBudget( 0, 10 * allReferenced.size() );
+	EXPECT_EQ( cache.GetMetrics().EntityCount, u64( allReferenced.size() ) );
+
+	auto extra = std::make_shared<TestEntityA>();
+	cache.Insert( random_value<hash>(), extra, 10 );
+	EXPECT_EQ( cache.GetMetrics().TotalSize, 10 * u64( allReferenced.size() ) + 10 );
+	allReferenced.clear();
+	extra.reset();
+	cache.SetBudget( 0, 100 );
+	EXPECT_EQ( cache.GetMetrics().TotalSize, u64( 100 ) );
+}
+
+TEST( EntityCacheTests, RecentlyUsedEntitiesAreKept )
+{
+	setup_random_seed();
+
+	EntityCache cache( 1 );
+	cache.SetBudget( 3, 0 );
+	const auto refs = insertRandomEntities( cache, 4, 10 );
+	EXPECT_FALSE( cache.Contains( refs[0] ) );
+
+	// refs[1] is older than refs[2], but is used, so refs[2] is evicted instead
+	cache.Find( refs[1] );
+	const auto newRefs = insertRandomEntities( cache, 1, 10 );
+	EXPECT_TRUE( cache.Contains( refs[1] ) );
+	EXPECT_FALSE( cache.Contains( refs[2] ) );
+	EXPECT_TRUE( cache.Contains( refs[3] ) );
+	EXPECT_TRUE( cache.Contains( newRefs[0] ) );
+	EXPECT_EQ( cache.GetMetrics().Evictions, u64( 2 ) );
+}
+
+TEST( EntityCacheTests, EvictionWorkIsBounded )
+{
+	setup_random_seed();
+
+	// a large cache where all entities are referenced
+	EntityCache cache( 1 );
+	const size_t count = 4 * EntityCache::EvictionStepBudget;
+	std::vector<std::shared_ptr<const Entity>> referenced;
+	for( size_t i = 0; i < count; ++i )
+	{
+		referenced.emplace_back( std::make_shared<TestEntityA>() );
+		cache.Insert( random_value<hash>(), referenced.back(), 1 );
+	}
+
+	// nothing can be evicted, and each call only moves the hand a bounded number of steps
+	cache.SetBudget( 100, 0 );
+	EXPECT_EQ( cache.GetMetrics().EntityCount, u64( count ) );
+
+	// when released, the entities are evicted over a number of calls, since each call is bounded
+	referenced.clear();
+	cache.SetBudget( 100, 0 );
+	EXPECT_GT( cache.GetMetrics().EntityCount, u64( 100 ) );
+	for( size_t i = 0; i < 20 && cache.GetMetrics().EntityCount > 100; ++i )
+	{
+		cache.SetBudget( 100, 0 );
+	}
+	EXPECT_EQ( cache.GetMetrics().EntityCount, u64( 100 ) );
+}
+
+TEST( EntityCacheTests, ShardedConcurrentAccess )
+{
+	setup_random_seed();
+
+	EntityCache cache( 10 );
+	EXPECT_EQ( cache.GetShardCount(), uint( 16 ) );
+	cache.SetBudget( 500, 0 );
+
+	// a set of entities which are kept referenced, and are always found
+	std::vector<std::shared_ptr<const Entity>> kept;
+	std::vector<entity_ref> keptRefs;
+	for( size_t i = 0; i < 100; ++i )
+	{
+		kept.emplace_back( std::make_shared<TestEntityA>() );
+		keptRefs.emplace_back( random_value<hash>() );
+	}
+	std::vector<EntityCache::Item> items( kept.size() );
+	for( size_t i = 0; i < kept.size(); ++i )
+	{
+		items[i].Ref = keptRefs[i];
+		items[i].Value = kept[i];
+		items[i].Size = 1;
+	}
+	cache.Insert( items.data(), items.size() );
+	EXPECT_TRUE( cache.FindMissing( keptRefs ).empty() );
+
+	// insert and look up from a number of threads at the same time
+	std::vector<std::vector<entity_ref>> threadRefs( 8 );
+	for( auto &refs : threadRefs )
+	{
+		for( size_t i = 0; i < 1000; ++i )
+			refs.emplace_back( random_value<hash>() );
+	}
+	std::atomic<size_t> keptMisses( 0 );
+	std::vector<std::thread> threads;
+	for( size_t t = 0; t < threadRefs.size(); ++t )
+	{
+		threads.emplace_back( [&cache, &keptRefs, &keptMisses, &refs = threadRefs[t]]()
+			{
+				for( size_t i = 0; i < refs.size(); ++i )
+				{
+					cache.Insert( refs[i], std::make_shared<TestEntityA>(), 1 );
+					cache.Find( refs[i / 2] );
+					if( !cache.Find( keptRefs[i % keptRefs.size()] ) )
+						++keptMisses;
+				}
+			} );
+	}
+	for( auto &thread : threads )
+	{
+		thread.join();
+	}
+
+	EXPECT_EQ( keptMisses.load(), size_t( 0 ) );
+	const auto metrics = cache.GetMetrics();
+	// threads which evict at the same time can end up slightly below the budget
+	EXPECT_LE( metrics.EntityCount, u64( 500 ) );
+	EXPECT_GE( metrics.EntityCount, u64( 500 - threadRefs.size() ) );
+	EXPECT_EQ( metrics.EntityCount + metrics.Evictions, u64( 100 + 8 * 1000 ) );
+	EXPECT_EQ( metrics.Hits + metrics.Misses, u64( 100 + 2 * 8 * 1000 ) );
+}
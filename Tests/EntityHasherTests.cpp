@@ -0,0 +1,213 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <pds/EntityHasher.h>
+#include <pds/WorkerPool.h>
+#include <pds/WriteStream.h>
+
+static std::vector<u8> randomData( size_t size )
+{
+	std::vector<u8> data( size );
+	for( auto &value : data )
+	{
+		value = u8_rand();
+	}
+	return data;
+}
+
+TEST( EntityHasherTests, SmallDataHasFlatHash )
+{
+	setup_random_seed();
+
+	for( size_t size : { size_t( 0 ), size_t( 1 ), size_t( 1000 ), size_t( EntityHasher::LeafSize ) } )
+	{
+		const auto data = randomData( size );
+		auto treeHash = EntityHasher::Calculate( data.data(), data.size(), entity_hash_mode::tree );
+		auto flatHash = EntityHasher::Calculate( data.data(), data.size(), entity_hash_mode::flat );
+		EXPECT_TRUE( treeHash.status() );
+		EXPECT_TRUE( flatHash.status() );
+		EXPECT_EQ( treeHash.value(), flatHash.value() );
+	}
+}
+
+TEST( EntityHasherTests, FlatHashIsThePlainHash )
+{
+	setup_random_seed();
+
+	const u64 leafSize = EntityHasher::LeafSize;
+	const auto data = randomData( size_t( 3 * leafSize + 1234 ) );
+	auto flatHash = EntityHasher::Calculate( data.data(), data.size() );
+	EXPECT_TRUE( flatHash.status() );
+
+	EntityHasher::Hasher plainHasher;
+	EXPECT_EQ( plainHasher.update( data.data(), data.size() ), status::ok );
+	EXPECT_EQ( flatHash.value(), plainHasher.finish().value() );
+
+	// hash in random sized parts, in order
+	EntityHasher updateHasher;
+	size_t offset = 0;
+	while( offset < data.size() )
+	{
+		const size_t count = std::min( capped_rand( 1, 100000 ), data.size() - offset );
+		EXPECT_EQ( updateHasher.Update( &data[offset], count ), status::ok );
+		offset += count;
+	}
+	auto updateHash = updateHasher.Finish( data.size() );
+	EXPECT_TRUE( updateHash.status() );
+	EXPECT_EQ( updateHash.value(), flatHash.value() );
+
+	// leaves can't be hashed out of order, and all of the data must be hashed
+	EntityHasher leafHasher;
+	EXPECT_NE( leafHasher.HashLeaf( 0, data.data(), leafSize ), status::ok );
+	EntityHasher missingHasher;
+	EXPECT_EQ( missingHasher.Update( data.data(), leafSize ), status::ok );
+	EXPECT_FALSE( missingHasher.Finish( data.size() ).status() );
+}
+
+TEST( EntityHasherTests, LeavesInAnyOrder )
+{
+	setup_random_seed();
+
+	const u64 leafSize = EntityHasher::LeafSize;
+	const auto data = randomData( size_t( 3 * leafSize + 1234 ) );
+	auto treeHash = EntityHasher::Calculate( data.data(), data.size(), entity_hash_mode::tree );
+	EXPECT_TRUE( treeHash.status() );
+	EXPECT_NE( treeHash.value(), EntityHasher::Calculate( data.data(), data.size(), entity_hash_mode::flat ).value() );
+
+	// hash in random sized parts, in order
+	EntityHasher updateHasher( entity_hash_mode::tree );
+	size_t offset = 0;
+	while( offset < data.size() )
+	{
+		const size_t count = std::min( capped_rand( 1, 100000 ), data.size() - offset );
+		EXPECT_EQ( updateHasher.Update( &data[offset], count ), status::ok );
+		offset += count;
+	}
+	auto updateHash = updateHasher.Finish( data.size() );
+	EXPECT_TRUE( updateHash.status() );
+	EXPECT_EQ( updateHash.value(), treeHash.value() );
+
+	// hash the leaves in reverse order
+	EntityHasher leafHasher( entity_hash_mode::tree );
+	for( u64 leaf = 4; leaf > 0; --leaf )
+	{
+		const u64 start = ( leaf - 1 ) * leafSize;
+		EXPECT_EQ( leafHasher.HashLeaf( leaf - 1, &data[start], std::min( leafSize, data.size() - start ) ), status::ok );
+	}
+	auto leafHash = leafHasher.Finish( data.size() );
+	EXPECT_TRUE( leafHash.status() );
+	EXPECT_EQ( leafHash.value(), treeHash.value() );
+
+	// a missing leaf is an error
+	EntityHasher missingHasher( entity_hash_mode::tree );
+	EXPECT_EQ( missingHasher.HashLeaf( 0, data.data(), leafSize ), status::ok );
+	EXPECT_FALSE( missingHasher.Finish( data.size() ).status() );
+}
+
+TEST( EntityHasherTests, HashWhileWriting )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		// write data with nested placeholders, which are filled in after more data is written
+		const entity_hash_mode mode = ( pass_index % 2 ) ? entity_hash_mode::tree : entity_hash_mode::flat;
+		EntityHasher hasher( mode );
+		WriteStream ws;
+		ws.SetHasher( &hasher );
+
+		std::vector<u64> openPlaceholders;
+		const auto data = randomData( 100000 );
+		for( uint i = 0; i < 200; ++i )
+		{
+			const size_t count = capped_rand( 1, data.size() );
+			ws.Write( data.data(), count );
+			if( rand() % 3 == 0 )
+			{
+				openPlaceholders.emplace_back( ws.GetPosition() );
+				ws.WritePlaceholder();
+			}
+			else if( !openPlaceholders.empty() && rand() % 2 == 0 )
+			{
+				ws.FillPlaceholder( openPlaceholders.back(), u64_rand() );
+				openPlaceholders.pop_back();
+			}
+		}
+
+		// the hash can't be finished before all placeholders are filled in
+		if( !openPlaceholders.empty() )
+		{
+			EXPECT_FALSE( ws.FinishHash().status() );
+		}
+		while( !openPlaceholders.empty() )
+		{
+			ws.FillPlaceholder( openPlaceholders.back(), u64_rand() );
+			openPlaceholders.pop_back();
+		}
+
+		auto streamHash = ws.FinishHash();
+		EXPECT_TRUE( streamHash.status() );
+		EXPECT_EQ( streamHash.value(), EntityHasher::Calculate( (const u8 *)ws.GetData(), ws.GetSize(), mode ).value() );
+	}
+}
+
+TEST( EntityHasherTests, ParallelLeafHashing )
+{
+	setup_random_seed();
+
+	WorkerPool pool;
+	EXPECT_EQ( pool.Initialize( 4, 0 ), status::ok );
+
+	for( u64 leafCount : { u64( 1 ), u64( EntityHasher::ParallelMinLeafCount ), u64( 13 ) } )
+	{
+		const auto data = randomData( size_t( leafCount * EntityHasher::LeafSize - 17 ) );
+		auto sequentialHash = EntityHasher::Calculate( data.data(), data.size(), entity_hash_mode::tree );
+		auto parallelHash = EntityHasher::Calculate( data.data(), data.size(), entity_hash_mode::tree, &pool );
+		EXPECT_TRUE( sequentialHash.status() );
+		EXPECT_TRUE( parallelHash.status() );
+		EXPECT_EQ( sequentialHash.value(), parallelHash.value() );
+	}
+}
+
+TEST( EntityHasherTests, HashedSizeWhileWriting )
+{
+	setup_random_seed();
+
+	// write data the way an entity is written, with a block size placeholder which is open until the end
+	const auto data = randomData( size_t( 4 * EntityHasher::LeafSize + 1000 ) );
+	for( const entity_hash_mode mode : { entity_hash_mode::flat, entity_hash_mode::tree } )
+	{
+		for( const bool compact : { false, true } )
+		{
+			EntityHasher hasher( mode );
+			WriteStream ws;
+			ws.SetHasher( &hasher );
+			ws.SetCompactEncoding( compact );
+
+			ws.Write( u8( 0xaa ) );
+			const u64 placeholderPosition = ws.GetPosition();
+			ws.WritePlaceholder();
+			ws.Write( data.data(), data.size() );
+			ws.Write( u8( 0xbb ) ); // the written data is hashed when the stream grows
+
+			// only tree mode without compact encoding hashes while writing. the first leaf has the open placeholder, 
+			// and the last leaf may still grow, so the leaves in between are hashed.
+			if( mode == entity_hash_mode::tree && !compact )
+			{
+				EXPECT_EQ( ws.GetHashedSize(), 3 * EntityHasher::LeafSize );
+			}
+			else
+			{
+				EXPECT_EQ( ws.GetHashedSize(), 0 );
+			}
+
+			ws.FillPlaceholder( placeholderPosition, ws.GetPosition() - placeholderPosition - sizeof( u64 ) );
+			auto streamHash = ws.FinishHash();
+			EXPECT_TRUE( streamHash.status() );
+			EXPECT_EQ( ws.GetHashedSize(), ws.GetSize() );
+			EXPECT_EQ( streamHash.value(), EntityHasher::Calculate( (const u8 *)ws.GetData(), ws.GetSize(), mode ).value() );
+		}
+	}
+}
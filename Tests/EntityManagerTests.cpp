@@ -0,0 +1,891 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#include <pds/EntityHasher.h>
+#include <pds/EntityManager.h>
+#include <pds/MappedFile.h>
+#include <pds/WriteStream.h>
+
+#include "TestPackA/TestEntityA.h"
+#include "TestPackA/TestEntityB.h"
+#include "TestPackA/v1_0/v1_0_TestEntityA_MF.h"
+
+using TestPackA::TestEntityA;
+using TestPackA::TestEntityB;
+namespace fs = std::filesystem;
+
+static std::shared_ptr<TestEntityA> createRandomEntityA()
+{
+	auto ent = std::make_shared<TestEntityA>();
+	ent->Name() = random_value<string>();
+	ent->OptionalText().set( random_value<string>() );
+	return ent;
+}
+
+static void addAndReloadEntities( const EntityManager::Settings &settings, const char *folderName )
+{
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( setupTestFolder( folderName ), { TestPackA::GetPackageRecord() }, settings ), status::ok );
+
+	// add entities, and keep copies to compare with
+	std::vector<TestEntityA> copies;
+	std::vector<entity_ref> refs;
+	for( size_t i = 0; i < 20; ++i )
+	{
+		auto ent = createRandomEntityA();
+		copies.emplace_back( *ent );
+
+		auto ref = manager.AddEntity( ent );
+		EXPECT_TRUE( ref.status() );
+		refs.emplace_back( ref.value() );
+	}
+
+	// adding the exact same data gives the same reference
+	auto sameRef = manager.AddEntity( std::make_shared<TestEntityA>( copies[0] ) );
+	EXPECT_TRUE( sameRef.status() );
+	EXPECT_EQ( sameRef.value(), refs[0] );
+
+	// drop all entities, and load them back
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	for( const auto &ref : refs )
+	{
+		EXPECT_FALSE( manager.IsEntityLoaded( ref ) );
+	}
+
+	std::vector<std::future<status>> futures;
+	for( const auto &ref : refs )
+	{
+		futures.emplace_back( manager.LoadEntityAsync( ref ) );
+	}
+	for( auto &futr : futures )
+	{
+		EXPECT_EQ( futr.get(), status::ok );
+	}
+
+	for( size_t i = 0; i < refs.size(); ++i )
+	{
+		auto ent = TestEntityA::EntitySafeCast( manager.GetLoadedEntity( refs[i] ) );
+		EXPECT_TRUE( ent != nullptr );
+		EXPECT_TRUE( TestEntityA::MF::Equals( ent.get(), &copies[i] ) );
+	}
+
+	// loading an entity which does not exist fails
+	EXPECT_NE( manager.LoadEntity( entity_ref( random_value<hash>() ) ), status::ok );
+}
+
+// changes the last byte of the file of an entity, so the data no longer compares with the hash
+static void damageEntityFile( const std::string &folder, const entity_ref &ref )
+{
+	const fs::path filePath = fs::path( folder ) / ( to_string( hash( ref ) ) + ".dat" );
+	const u64 fileSize = (u64)fs::file_size( filePath );
+	std::fstream file( filePath, std::ios::in | std::ios::out | std::ios::binary );
+	file.seekp( (std::streamoff)( fileSize - 1 ) );
+	file.put( 'x' );
+}
+
+TEST( EntityManagerTests, AddAndLoadEntities )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.UseMemoryMappedFiles = false;
+	addAndReloadEntities( settings, "AddAndLoadEntities" );
+}
+
+TEST( EntityManagerTests, AddAndLoadEntitiesMemoryMapped )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.UseMemoryMappedFiles = true;
+	settings.WorkerCount = 2;
+	settings.MaxQueueDepth = 4;
+	addAndReloadEntities( settings, "AddAndLoadEntitiesMemoryMapped" );
+}
+
+TEST( EntityManagerTests, AddAndLoadEntitiesPackFiles )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.StorageBackend = entity_storage_backend::pack_files;
+	settings.MaxPackFileSize = 4096;
+	settings.UseMemoryMappedFiles = false;
+	addAndReloadEntities( settings, "AddAndLoadEntitiesPackFiles" );
+
+	settings.UseMemoryMappedFiles = true;
+	addAndReloadEntities( settings, "AddAndLoadEntitiesPackFilesMemoryMapped" );
+}
+
+TEST( EntityManagerTests, AddAndLoadEntitiesStreamed )
+{
+	setup_random_seed();
+
+	// use small windows, so the entities are read in many windows, with read-ahead
+	EntityManager::Settings settings;
+	settings.StreamingReadWindowSize = 16;
+	addAndReloadEntities( settings, "AddAndLoadEntitiesStreamed" );
+
+	settings.StorageBackend = entity_storage_backend::pack_files;
+	settings.MaxPackFileSize = 4096;
+	addAndReloadEntities( settings, "AddAndLoadEntitiesStreamedPackFiles" );
+
+	// an entity with damaged data is read, but not returned, since the hash does not compare
+	const std::string folder = setupTestFolder( "AddAndLoadEntitiesStreamedCorrupted" );
+	settings.StorageBackend = entity_storage_backend::file_per_entity;
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+	auto ref = manager.AddEntity( createRandomEntityA() );
+	EXPECT_TRUE( ref.status() );
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	damageEntityFile( folder, ref.value() );
+	EXPECT_EQ( manager.LoadEntity( ref.value() ), status::corrupted );
+	EXPECT_FALSE( manager.IsEntityLoaded( ref.value() ) );
+}
+
+TEST( EntityManagerTests, AddAndLoadEntitiesCompact )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.CompactEncoding = true;
+	addAndReloadEntities( settings, "AddAndLoadEntitiesCompact" );
+	settings.StreamingReadWindowSize = 16;
+	addAndReloadEntities( settings, "AddAndLoadEntitiesCompactStreamed" );
+
+	// the compact entity is smaller, and both encodings are read by the same manager
+	const std::string folder = setupTestFolder( "AddAndLoadEntitiesCompactSize" );
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+	EntityManager fixedManager;
+	EXPECT_EQ( fixedManager.Initialize( folder, { TestPackA::GetPackageRecord() } ), status::ok );
+
+	auto ent = createRandomEntityA();
+	auto compactRef = manager.AddEntity( ent );
+	auto fixedRef = fixedManager.AddEntity( std::make_shared<TestEntityA>( *ent ) );
+	EXPECT_TRUE( compactRef.status() );
+	EXPECT_TRUE( fixedRef.status() );
+	EXPECT_NE( compactRef.value(), fixedRef.value() );
+	const auto fileSize = [&folder]( const entity_ref &ref ) { return fs::file_size( fs::path( folder ) / ( to_string( hash( ref ) ) + ".dat" ) ); };
+	EXPECT_LT( fileSize( compactRef.value() ), fileSize( fixedRef.value() ) );
+
+	EXPECT_EQ( fixedManager.LoadEntity( compactRef.value() ), status::ok );
+	EXPECT_EQ( manager.LoadEntity( fixedRef.value() ), status::ok );
+	EXPECT_TRUE( TestEntityA::MF::Equals( TestEntityA::EntitySafeCast( fixedManager.GetLoadedEntity( compactRef.value() ) ).get(), ent.get() ) );
+	EXPECT_TRUE( TestEntityA::MF::Equals( TestEntityA::EntitySafeCast( manager.GetLoadedEntity( fixedRef.value() ) ).get(), ent.get() ) );
+}
+
+TEST( EntityManagerTests, LargeEntitiesAreFlatHashed )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.UseMemoryMappedFiles = false;
+	const std::string folder = setupTestFolder( "LargeEntitiesAreFlatHashed" );
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+
+	// an entity which is larger than several hash leaves
+	auto ent = createRandomEntityA();
+	ent->Name() = std::string( size_t( 3 * EntityHasher::LeafSize ), 'a' );
+	for( auto &c : ent->Name() )
+	{
+		c = char( 'a' + rand() % 26 );
+	}
+	const TestEntityA copy = *ent;
+	auto ref = manager.AddEntity( ent );
+	EXPECT_TRUE( ref.status() );
+
+	// the ref is the plain hash of all of the stored data, even though the data was hashed while it was written
+	const fs::path filePath = fs::path( folder ) / ( to_string( hash( ref.value() ) ) + ".dat" );
+	std::vector<u8> data( (size_t)fs::file_size( filePath ) );
+	{
+		std::ifstream file( filePath, std::ios::binary );
+		file.read( (char *)data.data(), (std::streamsize)data.size() );
+	}
+	EntityHasher::Hasher plainHasher;
+	EXPECT_EQ( plainHasher.update( data.data(), data.size() ), status::ok );
+	EXPECT_EQ( plainHasher.finish().value(), hash( ref.value() ) );
+
+	// adding an equal entity gives the same ref, and the entity is loaded, in full and streamed
+	auto same = std::make_shared<TestEntityA>( copy );
+	EXPECT_EQ( manager.AddEntity( same ).value(), ref.value() );
+	ent.reset();
+	same.reset();
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+	EXPECT_TRUE( TestEntityA::MF::Equals( TestEntityA::EntitySafeCast( manager.GetLoadedEntity( ref.value() ) ).get(), &copy ) );
+
+	settings.StreamingReadWindowSize = 1024 * 64;
+	EntityManager streamingManager;
+	EXPECT_EQ( streamingManager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+	EXPECT_EQ( streamingManager.LoadEntity( ref.value() ), status::ok );
+}
+
+TEST( EntityManagerTests, HashModeIsRecordedInTheStore )
+{
+	setup_random_seed();
+
+	for( const auto backend : { entity_storage_backend::file_per_entity, entity_storage_backend::pack_files } )
+	{
+		EntityManager::Settings settings;
+		settings.StorageBackend = backend;
+		settings.HashMode = entity_hash_mode::tree;
+		const std::string folder = setupTestFolder( "HashModeIsRecordedInTheStore" );
+
+		// a large entity in a new tree mode store gets the tree hash as ref
+		auto ent = createRandomEntityA();
+		ent->Name() = std::string( size_t( 3 * EntityHasher::LeafSize ), 'a' );
+		for( auto &c : ent->Name() )
+		{
+			c = char( 'a' + rand() % 26 );
+		}
+		const TestEntityA copy = *ent;
+		entity_ref ref;
+		{
+			EntityManager manager;
+			EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+			EXPECT_EQ( manager.GetHashMode(), entity_hash_mode::tree );
+			ref = manager.AddEntity( ent ).value();
+		}
+		{
+			std::unique_ptr<EntityStorage> storage;
+			if( backend == entity_storage_backend::pack_files )
+			{
+				auto packStorage = std::make_unique<PackEntityStorage>();
+				EXPECT_EQ( packStorage->Initialize( folder, settings.MaxPackFileSize ), status::ok );
+				storage = std::move( packStorage );
+			}
+			else
+			{
+				auto fileStorage = std::make_unique<FileEntityStorage>();
+				EXPECT_EQ( fileStorage->Initialize( folder ), status::ok );
+				storage = std::move( fileStorage );
+			}
+			EXPECT_EQ( storage->GetHashMode(), entity_hash_mode::tree );
+
+			EntityData data;
+			EXPECT_EQ( storage->Read( hash( ref ), false, data ), status::ok );
+			EXPECT_EQ( EntityHasher::Calculate( data.GetData(), data.GetSize(), entity_hash_mode::tree ).value(), hash( ref ) );
+			EXPECT_NE( EntityHasher::Calculate( data.GetData(), data.GetSize(), entity_hash_mode::flat ).value(), hash( ref ) );
+		}
+
+		// the store keeps its mode when it is opened with other settings, and the entity is verified with the recorded mode, in full and streamed
+		for( const u64 windowSize : { u64( 0 ), u64( 1024 * 64 ) } )
+		{
+			EntityManager::Settings flatSettings;
+			flatSettings.StorageBackend = backend;
+			flatSettings.StreamingReadWindowSize = windowSize;
+			EntityManager manager;
+			EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, flatSettings ), status::ok );
+			EXPECT_EQ( manager.GetHashMode(), entity_hash_mode::tree );
+			EXPECT_EQ( manager.LoadEntity( ref ), status::ok );
+			EXPECT_TRUE( TestEntityA::MF::Equals( TestEntityA::EntitySafeCast( manager.GetLoadedEntity( ref ) ).get(), &copy ) );
+		}
+	}
+
+	// a store which has entities, but no recorded metadata, was created with flat hashes
+	EntityManager::Settings settings;
+	const std::string folder = setupTestFolder( "HashModeIsRecordedInTheStore" );
+	{
+		EntityManager manager;
+		EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+		EXPECT_TRUE( manager.AddEntity( createRandomEntityA() ).status() );
+	}
+	fs::remove( fs::path( folder ) / "store.meta" );
+	settings.HashMode = entity_hash_mode::tree;
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+	EXPECT_EQ( manager.GetHashMode(), entity_hash_mode::flat );
+}
+
+static void addAndReloadEntityBatch( const EntityManager::Settings &settings, const char *folderName )
+{
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( setupTestFolder( folderName ), { TestPackA::GetPackageRecord() }, settings ), status::ok );
+
+	// add a batch of entities, including the same entity twice
+	std::vector<std::shared_ptr<const Entity>> entities;
+	for( size_t i = 0; i < 100; ++i )
+	{
+		entities.emplace_back( createRandomEntityA() );
+	}
+	entities.emplace_back( entities[10] );
+
+	auto refs = manager.AddEntities( entities );
+	EXPECT_TRUE( refs.status() );
+	EXPECT_EQ( refs.value().size(), entities.size() );
+	EXPECT_EQ( refs.value()[10], refs.value().back() );
+
+	// the refs are the same as when added one at a time
+	auto singleRef = manager.AddEntity( std::make_shared<TestEntityA>( *TestEntityA::EntitySafeCast( entities[20] ) ) );
+	EXPECT_TRUE( singleRef.status() );
+	EXPECT_EQ( singleRef.value(), refs.value()[20] );
+
+	// keep a copy of the entities, drop all and load back as a batch, with duplicates and an already loaded entity
+	std::vector<TestEntityA> copies;
+	for( const auto &ent : entities )
+	{
+		copies.emplace_back( *TestEntityA::EntitySafeCast( ent ) );
+	}
+	auto keptEntity = entities[0];
+	entities.clear();
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	EXPECT_TRUE( manager.IsEntityLoaded( refs.value()[0] ) );
+	EXPECT_FALSE( manager.IsEntityLoaded( refs.value()[1] ) );
+
+	std::vector<entity_ref> loadRefs = refs.value();
+	loadRefs.insert( loadRefs.end(), refs.value().begin(), refs.value().begin() + 10 );
+	EXPECT_EQ( manager.LoadEntities( loadRefs ), status::ok );
+	for( size_t i = 0; i < copies.size(); ++i )
+	{
+		auto ent = TestEntityA::EntitySafeCast( manager.GetLoadedEntity( refs.value()[i] ) );
+		EXPECT_TRUE( ent != nullptr );
+		EXPECT_TRUE( TestEntityA::MF::Equals( ent.get(), &copies[i] ) );
+	}
+	EXPECT_EQ( manager.GetLoadedEntity( refs.value()[0] ), keptEntity );
+
+	// a missing entity fails the batch, but the rest of the batch is loaded
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	loadRefs = { refs.value()[5], entity_ref( random_value<hash>() ), refs.value()[6] };
+	EXPECT_NE( manager.LoadEntities( loadRefs ), status::ok );
+	EXPECT_TRUE( manager.IsEntityLoaded( refs.value()[5] ) );
+	EXPECT_TRUE( manager.IsEntityLoaded( refs.value()[6] ) );
+}
+
+TEST( EntityManagerTests, BatchedAddAndLoadEntities )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.WorkerCount = 4;
+	settings.MaxQueueDepth = 2;
+	addAndReloadEntityBatch( settings, "BatchedAddAndLoadEntities" );
+
+	settings.StorageBackend = entity_storage_backend::pack_files;
+	settings.MaxPackFileSize = 4096;
+	addAndReloadEntityBatch( settings, "BatchedAddAndLoadEntitiesPackFiles" );
+}
+
+TEST( EntityManagerTests, LoadEntityGraph )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.WorkerCount = 4;
+	settings.MaxQueueDepth = 2;
+
+	EntityManager manager;
+	const std::string folder = setupTestFolder( "LoadEntityGraph" );
+	EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+
+	// build a graph of three levels, where all the nodes in the middle level share a leaf
+	auto addNode = [&manager]( const std::vector<entity_ref> &children ) 
+	{
+		auto ent = std::make_shared<TestEntityB>();
+		ent->Name2() = random_value<string>();
+		ent->Children() = children;
+		auto ref = manager.AddEntity( ent );
+		EXPECT_TRUE( ref.status() );
+		return ref.value();
+	};
+
+	const entity_ref sharedLeaf = addNode( {} );
+	std::vector<entity_ref> middle;
+	std::vector<entity_ref> leaves = { sharedLeaf };
+	for( size_t i = 0; i < 10; ++i )
+	{
+		std::vector<entity_ref> children = { sharedLeaf, entity_ref() };
+		for( size_t j = 0; j < 5; ++j )
+		{
+			children.emplace_back( addNode( {} ) );
+			leaves.emplace_back( children.back() );
+		}
+		middle.emplace_back( addNode( children ) );
+	}
+	const entity_ref root = addNode( middle );
+
+	auto countLoaded = [&manager]( const std::vector<entity_ref> &refs )
+	{
+		size_t count = 0;
+		for( const auto &ref : refs )
+			count += manager.IsEntityLoaded( ref ) ? 1 : 0;
+		return count;
+	};
+
+	// load one level at a time
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	EXPECT_EQ( manager.LoadEntityGraphAsync( root, 0 ).get(), status::ok );
+	EXPECT_TRUE( manager.IsEntityLoaded( root ) );
+	EXPECT_EQ( countLoaded( middle ), size_t( 0 ) );
+
+	EXPECT_EQ( manager.LoadEntityGraphAsync( root, 1 ).get(), status::ok );
+	EXPECT_EQ( countLoaded( middle ), middle.size() );
+	EXPECT_EQ( countLoaded( leaves ), size_t( 0 ) );
+
+	// load the full graph in one call
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	EXPECT_EQ( manager.LoadEntityGraphAsync( root, 10 ).get(), status::ok );
+	EXPECT_TRUE( manager.IsEntityLoaded( root ) );
+	EXPECT_EQ( countLoaded( middle ), middle.size() );
+	EXPECT_EQ( countLoaded( leaves ), leaves.size() );
+
+	// the references were collected when the graph was loaded, so loading the graph again does not read from the storage
+	const fs::path movedFolder = fs::path( folder ).string() + "_moved";
+	fs::remove_all( movedFolder );
+	fs::rename( folder, movedFolder );
+	EXPECT_EQ( manager.LoadEntityGraphAsync( root, 10 ).get(), status::ok );
+	fs::rename( movedFolder, folder );
+
+	// a missing entity in the graph fails the load, but the rest of the graph is loaded
+	const entity_ref brokenRoot = addNode( { middle[0], entity_ref( random_value<hash>() ) } );
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	EXPECT_NE( manager.LoadEntityGraphAsync( brokenRoot, 2 ).get(), status::ok );
+	EXPECT_TRUE( manager.IsEntityLoaded( brokenRoot ) );
+	EXPECT_TRUE( manager.IsEntityLoaded( middle[0] ) );
+	EXPECT_TRUE( manager.IsEntityLoaded( sharedLeaf ) );
+}
+
+TEST( EntityManagerTests, CacheBudget )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.CacheMaxEntityCount = 5;
+
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( setupTestFolder( "CacheBudget" ), { TestPackA::GetPackageRecord() }, settings ), status::ok );
+
+	// the added entities are not held, so only the last ones are kept in the cache
+	std::vector<entity_ref> refs;
+	for( size_t i = 0; i < 20; ++i )
+	{
+		auto ref = manager.AddEntity( createRandomEntityA() );
+		EXPECT_TRUE( ref.status() );
+		refs.emplace_back( ref.value() );
+	}
+	auto metrics = manager.GetCacheMetrics();
+	EXPECT_EQ( metrics.EntityCount, u64( 5 ) );
+	EXPECT_EQ( metrics.Evictions, u64( 15 ) );
+
+	// evicted entities are loaded again on request
+	const auto evicted = std::find_if( refs.begin(), refs.end(), [&manager]( const entity_ref &ref ) { return !manager.IsEntityLoaded( ref ); } );
+	EXPECT_TRUE( evicted != refs.end() );
+	EXPECT_EQ( manager.LoadEntity( *evicted ), status::ok );
+	auto ent = manager.GetLoadedEntity( *evicted );
+	EXPECT_TRUE( ent != nullptr );
+	metrics = manager.GetCacheMetrics();
+	EXPECT_EQ( metrics.Misses, u64( 1 ) );
+	EXPECT_EQ( metrics.Hits, u64( 1 ) );
+	EXPECT_EQ( metrics.EntityCount, u64( 5 ) );
+}
+
+TEST( EntityManagerTests, ConcurrentLoadsOfSameEntity )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.WorkerCount = 8;
+
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( setupTestFolder( "ConcurrentLoadsOfSameEntity" ), { TestPackA::GetPackageRecord() }, settings ), status::ok );
+
+	std::vector<entity_ref> refs;
+	for( size_t i = 0; i < 4; ++i )
+	{
+		auto ref = manager.AddEntity( createRandomEntityA() );
+		EXPECT_TRUE( ref.status() );
+		refs.emplace_back( ref.value() );
+	}
+	const entity_ref missingRef( random_value<hash>() );
+
+	for( size_t pass = 0; pass < 10; ++pass )
+	{
+		EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+		const auto metricsBefore = manager.GetCacheMetrics();
+		const u64 joinedBefore = manager.GetJoinedLoadCount();
+
+		// request each entity many times at once, along with batches of the same entities
+		std::vector<std::future<status>> futures;
+		std::vector<std::future<status>> missingFutures;
+		for( size_t i = 0; i < 64; ++i )
+		{
+			futures.emplace_back( manager.LoadEntityAsync( refs[i % refs.size()] ) );
+			missingFutures.emplace_back( manager.LoadEntityAsync( missingRef ) );
+		}
+		EXPECT_EQ( manager.LoadEntities( refs ), status::ok );
+		for( auto &futr : futures )
+		{
+			EXPECT_EQ( futr.get(), status::ok );
+		}
+		for( auto &futr : missingFutures )
+		{
+			EXPECT_NE( futr.get(), status::ok );
+		}
+		for( const auto &ref : refs )
+		{
+			EXPECT_TRUE( manager.IsEntityLoaded( ref ) );
+		}
+
+		// all the requests which did not find the entity either joined a load, or loaded it
+		const auto metricsAfter = manager.GetCacheMetrics();
+		const u64 misses = metricsAfter.Misses - metricsBefore.Misses;
+		const u64 joined = manager.GetJoinedLoadCount() - joinedBefore;
+		EXPECT_LE( joined, misses );
+		EXPECT_GE( misses - joined, u64( 1 ) );
+	}
+}
+
+TEST( EntityManagerTests, ReAddingStoredEntities )
+{
+	setup_random_seed();
+	const std::string folder = setupTestFolder( "ReAddingStoredEntities" );
+
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() } ), status::ok );
+
+	std::shared_ptr<const Entity> ent = createRandomEntityA();
+	auto ref = manager.AddEntity( ent );
+	EXPECT_TRUE( ref.status() );
+	const fs::path filePath = fs::path( folder ) / ( to_string( hash( ref.value() ) ) + ".dat" );
+	EXPECT_TRUE( fs::exists( filePath ) );
+
+	// re-adding the same object returns the ref directly, without writing the entity again
+	fs::remove( filePath );
+	auto sameRef = manager.AddEntity( ent );
+	EXPECT_TRUE( sameRef.status() );
+	EXPECT_EQ( sameRef.value(), ref.value() );
+	EXPECT_FALSE( fs::exists( filePath ) );
+
+	// a copy of the object is a different object, and is serialized and stored
+	auto copyRef = manager.AddEntities( { std::make_shared<TestEntityA>( *TestEntityA::EntitySafeCast( ent ) ) } );
+	EXPECT_TRUE( copyRef.status() );
+	EXPECT_EQ( copyRef.value()[0], ref.value() );
+	EXPECT_TRUE( fs::exists( filePath ) );
+
+	// a loaded object is also known
+	ent.reset();
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+	ent = manager.GetLoadedEntity( ref.value() );
+	fs::remove( filePath );
+	sameRef = manager.AddEntity( ent );
+	EXPECT_TRUE( sameRef.status() );
+	EXPECT_EQ( sameRef.value(), ref.value() );
+	EXPECT_FALSE( fs::exists( filePath ) );
+}
+
+TEST( EntityManagerTests, ReAddingCompactedEntities )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.StorageBackend = entity_storage_backend::pack_files;
+
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( setupTestFolder( "ReAddingCompactedEntities" ), { TestPackA::GetPackageRecord() }, settings ), status::ok );
+
+	std::shared_ptr<const Entity> ent = createRandomEntityA();
+	auto ref = manager.AddEntity( ent );
+	EXPECT_TRUE( ref.status() );
+
+	// after the entity is removed from the storage, re-adding the object stores it again
+	EXPECT_EQ( manager.CompactStorage( []( const entity_ref & ) { return false; } ), status::ok );
+	auto sameRef = manager.AddEntity( ent );
+	EXPECT_TRUE( sameRef.status() );
+	EXPECT_EQ( sameRef.value(), ref.value() );
+	ent.reset();
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+}
+
+TEST( EntityManagerTests, HashVerificationPolicies )
+{
+	setup_random_seed();
+
+	EntityManager::Settings settings;
+	settings.HashVerification = hash_verification::sampled;
+	settings.HashVerificationSampleRate = 3;
+	addAndReloadEntities( settings, "HashVerificationSampled" );
+	settings.HashVerification = hash_verification::background;
+	addAndReloadEntities( settings, "HashVerificationBackground" );
+	settings.HashVerification = hash_verification::on_first_access;
+	addAndReloadEntities( settings, "HashVerificationOnFirstAccess" );
+
+	std::atomic<int> callbackCount( 0 );
+	settings.CorruptionCallback = [&callbackCount]( const entity_ref &, status result )
+	{
+		EXPECT_EQ( result, status::corrupted );
+		++callbackCount;
+	};
+
+	// only the first of each sample rate loads is verified, so a damaged entity may be loaded
+	{
+		const std::string folder = setupTestFolder( "HashVerificationSampledCorrupted" );
+		settings.HashVerification = hash_verification::sampled;
+		settings.HashVerificationSampleRate = 1000;
+		EntityManager manager;
+		EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+		auto ref = manager.AddEntity( createRandomEntityA() );
+		EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+		damageEntityFile( folder, ref.value() );
+		EXPECT_EQ( manager.LoadEntity( ref.value() ), status::corrupted );
+		EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+		EXPECT_TRUE( manager.GetLoadedEntity( ref.value() ) != nullptr );
+	}
+
+	// a damaged entity is loaded, and then removed when the background verification fails
+	{
+		const std::string folder = setupTestFolder( "HashVerificationBackgroundCorrupted" );
+		settings.HashVerification = hash_verification::background;
+		EntityManager manager;
+		EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+		auto ref = manager.AddEntity( createRandomEntityA() );
+		EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+		damageEntityFile( folder, ref.value() );
+		EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+		for( int i = 0; i < 1000 && manager.GetCorruptedEntityCount() == 0; ++i )
+		{
+			std::this_thread::sleep_for( std::chrono::milliseconds( 5 ) );
+		}
+		EXPECT_EQ( manager.GetCorruptedEntityCount(), u64( 1 ) );
+		EXPECT_EQ( callbackCount, 1 );
+		EXPECT_TRUE( manager.GetLoadedEntity( ref.value() ) == nullptr );
+		EXPECT_FALSE( manager.IsEntityLoaded( ref.value() ) );
+	}
+
+	// a damaged entity is loaded, but not returned on the first access
+	{
+		const std::string folder = setupTestFolder( "HashVerificationOnFirstAccessCorrupted" );
+		settings.HashVerification = hash_verification::on_first_access;
+		EntityManager manager;
+		EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+		auto ref = manager.AddEntity( createRandomEntityA() );
+		auto intactRef = manager.AddEntity( createRandomEntityA() );
+		EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+		damageEntityFile( folder, ref.value() );
+		EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+		EXPECT_EQ( manager.LoadEntity( intactRef.value() ), status::ok );
+		EXPECT_TRUE( manager.IsEntityLoaded( ref.value() ) );
+		EXPECT_TRUE( manager.GetLoadedEntity( ref.value() ) == nullptr );
+		EXPECT_TRUE( manager.GetLoadedEntity( intactRef.value() ) != nullptr );
+		EXPECT_FALSE( manager.IsEntityLoaded( ref.value() ) );
+		EXPECT_EQ( manager.GetCorruptedEntityCount(), u64( 1 ) );
+		EXPECT_EQ( callbackCount, 2 );
+	}
+
+	// concurrent first accesses share the one verification, and none of them gets the damaged entity
+	{
+		const std::string folder = setupTestFolder( "HashVerificationOnFirstAccessConcurrent" );
+		settings.HashVerification = hash_verification::on_first_access;
+		EntityManager manager;
+		EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+		auto ref = manager.AddEntity( createRandomEntityA() );
+		EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+		damageEntityFile( folder, ref.value() );
+		EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+
+		std::atomic<int> returnedCount( 0 );
+		std::vector<std::thread> threads;
+		for( int i = 0; i < 8; ++i )
+		{
+			threads.emplace_back( [&manager, &ref, &returnedCount]()
+				{
+					if( manager.GetLoadedEntity( ref.value() ) != nullptr )
+					{
+						++returnedCount;
+					}
+				} );
+		}
+		for( auto &thread : threads )
+		{
+			thread.join();
+		}
+		EXPECT_EQ( returnedCount, 0 );
+		EXPECT_EQ( manager.GetCorruptedEntityCount(), u64( 1 ) );
+		EXPECT_EQ( callbackCount, 3 );
+	}
+}
+
+TEST( EntityManagerTests, ProjectedLoads )
+{
+	setup_random_seed();
+
+	const std::string folder = setupTestFolder( "ProjectedLoads" );
+	EntityManager::Settings settings;
+	settings.StreamingReadWindowSize = 1024;
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() }, settings ), status::ok );
+
+	auto ent = createRandomEntityA();
+	ent->TestVariableA().set();
+	const TestEntityA original = *ent;
+	auto ref = manager.AddEntity( std::move( ent ) );
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+
+	// only the name is read, and the projected entity is not cached
+	auto projected = manager.LoadEntityProjected( ref.value(), { "Name" } );
+	EXPECT_EQ( projected.status(), status::ok );
+	auto projectedA = TestEntityA::EntitySafeCast( projected.value() );
+	EXPECT_TRUE( projectedA != nullptr );
+	EXPECT_EQ( projectedA->Name(), original.Name() );
+	EXPECT_FALSE( projectedA->OptionalText().has_value() );
+	EXPECT_FALSE( projectedA->TestVariableA().has_value() );
+	EXPECT_FALSE( manager.IsEntityLoaded( ref.value() ) );
+
+	// multiple key paths
+	projected = manager.LoadEntityProjected( ref.value(), { "OptTxt", "TstVarA" } );
+	EXPECT_EQ( projected.status(), status::ok );
+	projectedA = TestEntityA::EntitySafeCast( projected.value() );
+	EXPECT_TRUE( projectedA->Name().empty() );
+	EXPECT_EQ( projectedA->OptionalText(), original.OptionalText() );
+	EXPECT_TRUE( projectedA->TestVariableA().has_value() );
+
+	// the full entity is still loaded as usual
+	EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+	EXPECT_TRUE( TestEntityA::MF::Equals( TestEntityA::EntitySafeCast( manager.GetLoadedEntity( ref.value() ) ).get(), &original ) );
+
+	// damaged entities are detected by the default verification policy
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+	damageEntityFile( folder, ref.value() );
+	EXPECT_EQ( manager.LoadEntityProjected( ref.value(), { "Name" } ).status(), status::corrupted );
+}
+
+TEST( EntityManagerTests, LazyMembers )
+{
+	setup_random_seed();
+
+	const std::string folder = setupTestFolder( "LazyMembers" );
+	EntityManager manager;
+	EXPECT_EQ( manager.Initialize( folder, { TestPackA::GetPackageRecord() } ), status::ok );
+
+	auto ent = createRandomEntityA();
+	const size_t count = capped_rand( 10, 200 );
+	ent->LazyTable().set();
+	for( size_t i = 0; i < count; ++i )
+	{
+		ent->LazyTable().value().Value().Insert( item_ref::make_ref() ).Name() = random_value<string>();
+	}
+	const TestEntityA original = *ent;
+	auto ref = manager.AddEntity( std::move( ent ) );
+	EXPECT_EQ( manager.UnloadNonReferencedEntities(), status::ok );
+
+	// the table is not read until it is accessed
+	EXPECT_EQ( manager.LoadEntity( ref.value() ), status::ok );
+	auto loaded = TestEntityA::EntitySafeCast( manager.GetLoadedEntity( ref.value() ) );
+	EXPECT_TRUE( loaded != nullptr );
+	EXPECT_EQ( loaded->Name(), original.Name() );
+	EXPECT_FALSE( loaded->LazyTable().value().IsLoaded() );
+
+	// copies share the data which is not read yet
+	const TestEntityA copy = *loaded;
+	EXPECT_FALSE( copy.LazyTable().value().IsLoaded() );
+
+	// the first access can be from multiple threads
+	std::vector<std::thread> threads;
+	for( size_t i = 0; i < 4; ++i )
+	{
+		threads.emplace_back( [&loaded, count]() { EXPECT_EQ( loaded->LazyTable().value().Value().Size(), count ); } );
+	}
+	for( auto &thread : threads )
+	{
+		thread.join();
+	}
+	EXPECT_TRUE( loaded->LazyTable().value().IsLoaded() );
+	EXPECT_EQ( loaded->LazyTable().value().Load(), status::ok );
+	EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), &original ) );
+
+	// a table which is not read is read when written
+	EXPECT_FALSE( copy.LazyTable().value().IsLoaded() );
+	auto copyRef = manager.AddEntity( std::make_shared<TestEntityA>( copy ) );
+	EXPECT_EQ( copyRef.status(), status::ok );
+	EXPECT_EQ( manager.LoadEntity( copyRef.value() ), status::ok );
+	EXPECT_TRUE( TestEntityA::MF::Equals( TestEntityA::EntitySafeCast( manager.GetLoadedEntity( copyRef.value() ) ).get(), &original ) );
+	EXPECT_TRUE( TestEntityA::MF::Equals( &copy, &original ) );
+}
+
+TEST( EntityManagerTests, LazyMemberDataRetention )
+{
+	setup_random_seed();
+
+	typedef TestEntityA::lazy_test_table LazyTable;
+	LazyTable table;
+	const size_t count = capped_rand( 10, 100 );
+	for( size_t i = 0; i < count; ++i )
+	{
+		table.Value().Insert( item_ref::make_ref() ).Name() = random_value<string>();
+	}
+
+	WriteStream ws;
+	EntityWriter ew( ws );
+	EntityWriter *sw = ew.BeginWriteSection( "Table", 5 ).value();
+	EXPECT_EQ( LazyTable::MF::Write( table, *sw ), status::ok );
+	EXPECT_EQ( ew.EndWriteSection( sw ), status::ok );
+
+	// read lazy values from a buffer, which is kept alive by each value until it is loaded
+	auto data = std::make_shared<std::vector<u8>>( (const u8 *)ws.GetData(), (const u8 *)ws.GetData() + ws.GetSize() );
+	const auto readTable = [&data]( LazyTable &dest )
+	{
+		ReadStream rs( data->data(), data->size() );
+		EntityReader er( rs );
+		er.SetDataOwner( data );
+		EntityReader *sr = er.BeginReadSection( "Table", 5, false ).value();
+		EXPECT_EQ( LazyTable::MF::Read( dest, *sr ), status::ok );
+		EXPECT_EQ( er.EndReadSection( sr ), status::ok );
+	};
+	LazyTable first;
+	LazyTable second;
+	readTable( first );
+	readTable( second );
+	EXPECT_EQ( data.use_count(), 3 );
+	EXPECT_EQ( first.Load(), status::ok );
+	EXPECT_EQ( data.use_count(), 2 );
+	EXPECT_EQ( second.Value().Size(), count );
+	EXPECT_EQ( data.use_count(), 1 );
+
+	// a value which can not be read fails the load, and is left empty. Value() logs the failure
+	LazyTable damaged;
+	readTable( damaged );
+	std::fill( data->begin() + 16, data->end(), u8( 0xff ) );
+	EXPECT_NE( damaged.Load(), status::ok );
+	EXPECT_EQ( damaged.Value().Size(), size_t( 0 ) );
+	EXPECT_EQ( data.use_count(), 1 );
+}
+
+TEST( EntityManagerTests, MappedFileRanges )
+{
+	const std::string filePath = setupTestFolder( "MappedFileRanges" ) + "/data.bin";
+
+	// write a file which spans a couple of pages
+	std::vector<u8> data( 3 * 65536 + 123 );
+	for( size_t i = 0; i < data.size(); ++i )
+	{
+		data[i] = u8( i * 7 + ( i >> 8 ) );
+	}
+	std::ofstream( filePath, std::ios::binary ).write( (const char *)data.data(), (std::streamsize)data.size() );
+
+	// map the full file
+	MappedFile full;
+	EXPECT_EQ( full.Open( filePath ), status::ok );
+	EXPECT_EQ( full.GetSize(), u64( data.size() ) );
+	EXPECT_EQ( memcmp( full.GetData(), data.data(), data.size() ), 0 );
+
+	// map a range which is not page aligned
+	MappedFile range;
+	EXPECT_EQ( range.Open( filePath, 70001, 1000 ), status::ok );
+	EXPECT_EQ( range.GetSize(), u64( 1000 ) );
+	EXPECT_EQ( memcmp( range.GetData(), &data[70001], 1000 ), 0 );
+	range.Close();
+	EXPECT_EQ( range.GetData(), nullptr );
+
+	// out of bounds and missing files fail
+	MappedFile invalid;
+	EXPECT_EQ( invalid.Open( filePath, data.size() - 10, 11 ), status::invalid_param );
+	EXPECT_EQ( invalid.Open( filePath + ".missing" ), status::cant_read );
+}
@@ -7,6 +7,7 @@
 #include <pds/EntityReader.h>
 #include <pds/WriteStream.h>
 #include <pds/ReadStream.h>
+#include <pds/reader_templates.h>
 
 template<class T> void TestEntityWriter_TestValueType( const WriteStream &ws, EntityWriter &ew, const std::vector<std::string> &key_names )
 {
@@ -51,6 +52,7 @@ template<class T> void TestEntityWriter_TestValueType( const WriteStream &ws, En
 
 	// set up a temporary entity reader and read back the values
 	ReadStream rs( ws.GetData(), ws.GetSize() );
+	rs.SetCompactEncoding( ws.GetCompactEncoding() );
 	EntityReader er( rs );
 	rs.SetPosition( start_pos );
 
@@ -111,7 +113,9 @@ TEST( EntityReadWriteTests, TestEntityWriterAndReadback )
 
 	for( uint pass_index = 0; pass_index < ( global_number_of_passes ); ++pass_index )
 	{
+		// every other pass, try to compress the arrays. random values rarely compress, so most arrays are written uncompressed anyway
 		WriteStream ws;
+		ws.SetCompressionThreshold( ( pass_index % 2 ) ? 16 : 0 );
 		EntityWriter ew( ws );
 
 		std::vector<std::string> key_names =
@@ -191,3 +195,305 @@ TEST( EntityReadWriteTests, TestEntityWriterAndReadback )
 		TestEntityWriter_TestValueType<entity_ref>( ws, ew, key_names );
 	}
 }
+
+TEST( EntityReadWriteTests, KeyTolerantReader )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		const u32 name = random_value<u32>();
+		const u32 other_name = random_value<u32>();
+		const vec3 position = random_value<vec3>();
+		const std::string text = random_value<std::string>();
+		std::vector<u64> values;
+		random_vector<u64>( values, 0, 100 );
+
+		// write a section with values of different kinds, and keys which end the same
+		WriteStream ws;
+		ws.SetCompactEncoding( ( pass_index % 2 ) != 0 );
+		EntityWriter ew( ws );
+		EntityWriter *sw = ew.BeginWriteSection( "Section", 7 ).value();
+		EXPECT_EQ( sw->Write( "OtherName", 9, other_name ), status::ok );
+		EXPECT_EQ( sw->Write( "Name", 4, name ), status::ok );
+		EXPECT_EQ( sw->Write( "Unknown", 7, text ), status::ok );
+		EXPECT_EQ( sw->Write( "Position", 8, position ), status::ok );
+		EXPECT_EQ( sw->Write( "Empty", 5, optional_value<u32>() ), status::ok );
+		EntityWriter *aw = sw->BeginWriteSectionsArray( "Items", 5, values.size() ).value();
+		for( size_t i = 0; i < values.size(); ++i )
+		{
+			EXPECT_EQ( sw->BeginWriteSectionInArray( aw, i ), status::ok );
+			EXPECT_EQ( aw->Write( "Value", 5, values[i] ), status::ok );
+			EXPECT_EQ( aw->Write( "Index", 5, u64( i ) ), status::ok );
+			EXPECT_EQ( sw->EndWriteSectionInArray( aw, i ), status::ok );
+		}
+		EXPECT_EQ( sw->EndWriteSectionsArray( aw ), status::ok );
+		EXPECT_EQ( sw->Write( "Text", 4, text ), status::ok );
+		EXPECT_EQ( ew.EndWriteSection( sw ), status::ok );
+		EXPECT_EQ( ew.Write( "After", 5, u64( 1234 ) ), status::ok );
+
+		// read the values in another order, and skip some of them
+		ReadStream rs( ws.GetData(), ws.GetSize() );
+		rs.SetCompactEncoding( ws.GetCompactEncoding() );
+		EntityReader er( rs );
+		er.SetKeyTolerant( true );
+		EntityReader *sr = er.BeginReadSection( "Section", 7, false ).value();
+
+		std::string read_text;
+		u32 read_name = 0;
+		u32 read_other_name = 0;
+		vec3 read_position = {};
+		optional_value<u32> read_empty;
+		EXPECT_EQ( sr->Read( "Text", 4, read_text ), status::ok );
+		EXPECT_EQ( sr->Read( "Name", 4, read_name ), status::ok );
+		EXPECT_EQ( sr->Read( "Empty", 5, read_empty ), status::ok );
+		EXPECT_EQ( sr->Read( "Position", 8, read_position ), status::ok );
+		EXPECT_EQ( sr->Read( "OtherName", 9, read_other_name ), status::ok );
+		EXPECT_EQ( read_text, text );
+		EXPECT_EQ( read_name, name );
+		EXPECT_EQ( read_other_name, other_name );
+		EXPECT_EQ( read_position, position );
+		EXPECT_FALSE( read_empty.has_value() );
+
+		// keys which are not in the section, or have another type, are not found
+		u32 missing = 0;
+		EXPECT_EQ( sr->Read( "Missing", 7, missing ), status::not_found );
+		EXPECT_EQ( sr->Read( "Text", 4, missing ), status::not_found );
+
+		// the values in the sections of an array can also be read in any order
+		EntityReader *ar = sr->BeginReadSectionsArray( "Items", 5, false ).value();
+		for( size_t i = 0; i < values.size(); ++i )
+		{
+			u64 value = 0;
+			u64 index = 0;
+			EXPECT_EQ( sr->BeginReadSectionInArray( ar, i ), status::ok );
+			EXPECT_EQ( ar->Read( "Index", 5, index ), status::ok );
+			if( i % 2 )
+			{
+				EXPECT_EQ( ar->Read( "Value", 5, value ), status::ok );
+				EXPECT_EQ( value, values[i] );
+			}
+			EXPECT_EQ( sr->EndReadSectionInArray( ar, i ), status::ok );
+			EXPECT_EQ( index, u64( i ) );
+		}
+		EXPECT_EQ( sr->EndReadSectionsArray( ar ), status::ok );
+
+		EXPECT_EQ( er.EndReadSection( sr ), status::ok );
+		u64 after = 0;
+		EXPECT_EQ( er.Read( "After", 5, after ), status::ok );
+		EXPECT_EQ( after, u64( 1234 ) );
+	}
+}
+
+TEST( EntityReadWriteTests, KeyTolerantReaderMissingOptionalValues )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		const u32 name = random_value<u32>();
+
+		// write an older version of the section, without the values which were added later
+		WriteStream ws;
+		EntityWriter ew( ws );
+		EntityWriter *sw = ew.BeginWriteSection( "Section", 7 ).value();
+		EXPECT_EQ( sw->Write( "Name", 4, name ), status::ok );
+		EXPECT_EQ( ew.EndWriteSection( sw ), status::ok );
+
+		// read it with the current version, which has optional values, and sections where null is allowed
+		ReadStream rs( ws.GetData(), ws.GetSize() );
+		EntityReader er( rs );
+		er.SetKeyTolerant( true );
+		EntityReader *sr = er.BeginReadSection( "Section", 7, false ).value();
+
+		u32 read_name = 0;
+		optional_value<u32> added_value;
+		added_value.set( random_value<u32>() );
+		optional_vector<u64> added_vector;
+		added_vector.set();
+		added_vector.values().emplace_back( random_value<u64>() );
+		optional_idx_vector<string> added_idx_vector;
+		added_idx_vector.set();
+		EXPECT_EQ( sr->Read( "Name", 4, read_name ), status::ok );
+		EXPECT_EQ( sr->Read( "AddedValue", 10, added_value ), status::ok );
+		EXPECT_EQ( sr->Read( "AddedVector", 11, added_vector ), status::ok );
+		EXPECT_EQ( sr->Read( "AddedIdxVector", 14, added_idx_vector ), status::ok );
+		EXPECT_EQ( read_name, name );
+		EXPECT_FALSE( added_value.has_value() );
+		EXPECT_FALSE( added_vector.has_value() );
+		EXPECT_FALSE( added_idx_vector.has_value() );
+
+		// missing sections are read as null, if null is allowed
+		auto added_section = sr->BeginReadSection( "AddedSection", 12, true );
+		EXPECT_EQ( added_section.status(), status::ok );
+		EXPECT_EQ( added_section.value(), nullptr );
+		auto added_array = sr->BeginReadSectionsArray( "AddedArray", 10, true );
+		EXPECT_EQ( added_array.status(), status::ok );
+		EXPECT_EQ( added_array.value(), nullptr );
+
+		// values and sections which are required still fail the read
+		u32 required_value = 0;
+		EXPECT_EQ( sr->Read( "AddedValue", 10, required_value ), status::not_found );
+		EXPECT_EQ( sr->BeginReadSection( "AddedSection", 12, false ).status(), status::not_found );
+
+		EXPECT_EQ( er.EndReadSection( sr ), status::ok );
+	}
+}
+
+TEST( EntityReadWriteTests, KeyTolerantReaderAmbiguousKeys )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		const u32 name = random_value<u32>();
+		const bool scale = random_value<bool>();
+
+		// the empty value of "XScale" has the size of a bool value with the key "Scale", and ends with "Scale"
+		WriteStream ws;
+		EntityWriter ew( ws );
+		EntityWriter *sw = ew.BeginWriteSection( "Section", 7 ).value();
+		EXPECT_EQ( sw->Write( "XScale", 6, optional_value<bool>() ), status::ok );
+		EXPECT_EQ( sw->Write( "Scale", 5, scale ), status::ok );
+		EXPECT_EQ( sw->Write( "Name", 4, name ), status::ok );
+		EXPECT_EQ( ew.EndWriteSection( sw ), status::ok );
+
+		const auto read_section = [&]( const std::function<void( EntityReader * )> &read_values )
+		{
+			ReadStream rs( ws.GetData(), ws.GetSize() );
+			EntityReader er( rs );
+			er.SetKeyTolerant( true );
+			EntityReader *sr = er.BeginReadSection( "Section", 7, false ).value();
+			read_values( sr );
+			EXPECT_EQ( er.EndReadSection( sr ), status::ok );
+		};
+
+		// in the order they were written, each value is the block at the position of the reader
+		read_section( [&]( EntityReader *sr )
+		{
+			optional_value<bool> read_xscale;
+			read_xscale.set( true );
+			bool read_scale = !scale;
+			u32 read_name = 0;
+			EXPECT_EQ( sr->Read( "XScale", 6, read_xscale ), status::ok );
+			EXPECT_EQ( sr->Read( "Scale", 5, read_scale ), status::ok );
+			EXPECT_EQ( sr->Read( "Name", 4, read_name ), status::ok );
+			EXPECT_FALSE( read_xscale.has_value() );
+			EXPECT_EQ( read_scale, scale );
+			EXPECT_EQ( read_name, name );
+		} );
+
+		// out of order, both blocks can have the key "Scale", so it is refused. "XScale" only matches its own block.
+		read_section( [&]( EntityReader *sr )
+		{
+			u32 read_name = 0;
+			bool read_scale = false;
+			optional_value<bool> read_xscale;
+			read_xscale.set( true );
+			EXPECT_EQ( sr->Read( "Name", 4, read_name ), status::ok );
+			last_read_error() = {};
+			EXPECT_EQ( sr->Read( "Scale", 5, read_scale ), status::invalid );
+			EXPECT_EQ( last_read_error().code, read_error_code::ambiguous_key );
+			EXPECT_EQ( last_read_error().value, u64( 2 ) );
+			EXPECT_EQ( sr->Read( "XScale", 6, read_xscale ), status::ok );
+			EXPECT_FALSE( read_xscale.has_value() );
+			EXPECT_EQ( read_name, name );
+		} );
+	}
+}
+
+TEST( EntityReadWriteTests, ReadErrors )
+{
+	setup_random_seed();
+
+	WriteStream ws;
+	EntityWriter ew( ws );
+	EXPECT_EQ( ew.Write( "Name", 4, random_value<u32>() ), status::ok );
+	EXPECT_EQ( ew.Write( "Text", 4, random_value<std::string>() ), status::ok );
+
+	// failed reads record the error, they are not logged by default
+	EXPECT_FALSE( get_read_error_logging() );
+
+	const auto read_first = [&]( const char *key, auto &value, bool key_tolerant )
+	{
+		ReadStream rs( ws.GetData(), ws.GetSize() );
+		EntityReader er( rs );
+		er.SetKeyTolerant( key_tolerant );
+		last_read_error() = {};
+		return er.Read( key, u8( strlen( key ) ), value );
+	};
+
+	u32 u32_value = 0;
+	EXPECT_NE( read_first( "Nome", u32_value, false ), status::ok );
+	EXPECT_EQ( last_read_error().code, read_error_code::unexpected_key );
+	EXPECT_EQ( std::string( last_read_error().key, last_read_error().key_length ), "Nome" );
+
+	float float_value = 0;
+	EXPECT_NE( read_first( "Name", float_value, false ), status::ok );
+	EXPECT_EQ( last_read_error().code, read_error_code::unexpected_type );
+	EXPECT_EQ( last_read_error().value, u64( serialization_type_index::vt_uint ) );
+	EXPECT_EQ( last_read_error().expected, u64( serialization_type_index::vt_float ) );
+
+	u64 u64_value = 0;
+	EXPECT_NE( read_first( "Name", u64_value, false ), status::ok );
+	EXPECT_EQ( last_read_error().code, read_error_code::unexpected_block_size );
+
+	EXPECT_EQ( read_first( "Missing", u32_value, true ), status::not_found );
+	EXPECT_EQ( last_read_error().code, read_error_code::key_not_found );
+	EXPECT_EQ( std::string( last_read_error().key, last_read_error().key_length ), "Missing" );
+
+	// the error is formatted when needed
+	const std::string message = format_read_error( last_read_error() );
+	EXPECT_NE( message.find( read_error_description( read_error_code::key_not_found ) ), std::string::npos );
+	EXPECT_NE( message.find( "\"Missing\"" ), std::string::npos );
+
+	// a successful read leaves the error as is
+	EXPECT_EQ( read_first( "Name", u32_value, false ), status::ok );
+	EXPECT_EQ( last_read_error().code, read_error_code::none );
+
+	// the checks of the reader itself are recorded the same way
+	{
+		ReadStream rs( ws.GetData(), ws.GetSize() );
+		EntityReader er( rs );
+		last_read_error() = {};
+		EXPECT_NE( er.EndReadSection( &er ), status::ok );
+		EXPECT_EQ( last_read_error().code, read_error_code::invalid_reader_call );
+	}
+}
+
+TEST( EntityReadWriteTests, TestEntityWriterAndReadbackCompact )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < ( global_number_of_passes ); ++pass_index )
+	{
+		// write with the compact encoding, where sizes and counts are varints. every other pass, try to compress the arrays.
+		WriteStream ws;
+		ws.SetCompactEncoding( true );
+		ws.SetCompressionThreshold( ( pass_index % 2 ) ? 16 : 0 );
+		EntityWriter ew( ws );
+
+		std::vector<std::string> key_names =
+		{
+		std::string( "PLbYYDnVEpoPO2Yz" ),
+		std::string( "h3HHExIVS4eCngO1UZr4" ),
+		std::string( "c" ),
+		std::string( "hellofoobar" ),
+		};
+
+		TestEntityWriter_TestValueType<bool>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<i8>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<u16>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<i32>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<u64>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<double>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<f32vec3>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<i16vec4>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<f64mat4>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<uuid>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<hash>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<string>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<item_ref>( ws, ew, key_names );
+		TestEntityWriter_TestValueType<entity_ref>( ws, ew, key_names );
+	}
+}
@@ -0,0 +1,218 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <filesystem>
+
+#include <pds/EntityStorage.h>
+
+namespace fs = std::filesystem;
+
+// random blobs of data, with random keys
+static std::map<hash, std::vector<u8>> createRandomBlobs( size_t count )
+{
+	std::map<hash, std::vector<u8>> blobs;
+	for( size_t i = 0; i < count; ++i )
+	{
+		std::vector<u8> data( capped_rand( 1, 2000 ) );
+		for( auto &val : data )
+		{
+			val = u8_rand();
+		}
+		blobs.emplace( random_value<hash>(), std::move( data ) );
+	}
+	return blobs;
+}
+
+static void expectBlobsStored( EntityStorage &storage, const std::map<hash, std::vector<u8>> &blobs )
+{
+	for( const auto &blob : blobs )
+	{
+		EXPECT_TRUE( storage.Contains( blob.first ) );
+		for( bool memoryMapped : { false, true } )
+		{
+			EntityData data;
+			EXPECT_EQ( storage.Read( blob.first, memoryMapped, data ), status::ok );
+			EXPECT_EQ( data.GetSize(), u64( blob.second.size() ) );
+			EXPECT_EQ( memcmp( data.GetData(), blob.second.data(), blob.second.size() ), 0 );
+		}
+	}
+
+	// read all blobs, and a missing one, in a batch
+	std::vector<hash> keys = { random_value<hash>() };
+	for( const auto &blob : blobs )
+	{
+		keys.emplace_back( blob.first );
+	}
+	storage.SortForReading( keys );
+	for( bool memoryMapped : { false, true } )
+	{
+		std::vector<std::shared_ptr<EntityData>> datas;
+		std::vector<status> results;
+		storage.ReadBatch( keys, memoryMapped, datas, results );
+		EXPECT_EQ( datas.size(), keys.size() );
+		EXPECT_EQ( results.size(), keys.size() );
+		for( size_t i = 0; i < keys.size(); ++i )
+		{
+			const auto it = blobs.find( keys[i] );
+			if( it == blobs.end() )
+			{
+				EXPECT_NE( results[i], status::ok );
+				continue;
+			}
+			EXPECT_EQ( results[i], status::ok );
+			EXPECT_EQ( datas[i]->GetSize(), u64( it->second.size() ) );
+			EXPECT_EQ( memcmp( datas[i]->GetData(), it->second.data(), it->second.size() ), 0 );
+		}
+	}
+}
+
+TEST( EntityStorageTests, FilePerEntity )
+{
+	setup_random_seed();
+	const auto blobs = createRandomBlobs( 50 );
+
+	FileEntityStorage storage;
+	EXPECT_EQ( storage.Initialize( setupTestFolder( "FilePerEntity" ) ), status::ok );
+	for( const auto &blob : blobs )
+	{
+		EXPECT_EQ( storage.Write( blob.first, blob.second.data(), blob.second.size() ), status::ok );
+	}
+	expectBlobsStored( storage, blobs );
+
+	EntityData data;
+	EXPECT_FALSE( storage.Contains( random_value<hash>() ) );
+	EXPECT_NE( storage.Read( random_value<hash>(), false, data ), status::ok );
+}
+
+TEST( EntityStorageTests, PackFilesReopenAndRecover )
+{
+	setup_random_seed();
+	const std::string folder = setupTestFolder( "PackFilesReopenAndRecover" );
+	const auto blobs = createRandomBlobs( 200 );
+
+	// write all blobs, into a number of small packs
+	size_t packCount = 0;
+	{
+		PackEntityStorage storage;
+		EXPECT_EQ( storage.Initialize( folder, 16 * 1024 ), status::ok );
+		for( const auto &blob : blobs )
+		{
+			EXPECT_EQ( storage.Write( blob.first, blob.second.data(), blob.second.size() ), status::ok );
+			EXPECT_EQ( storage.Write( blob.first, blob.second.data(), blob.second.size() ), status::ok );
+		}
+		EXPECT_EQ( storage.GetEntityCount(), blobs.size() );
+		packCount = storage.GetPackCount();
+		EXPECT_GT( packCount, size_t( 1 ) );
+		expectBlobsStored( storage, blobs );
+	}
+
+	// reopen using the index
+	{
+		PackEntityStorage storage;
+		EXPECT_EQ( storage.Initialize( folder, 16 * 1024 ), status::ok );
+		EXPECT_EQ( storage.GetEntityCount(), blobs.size() );
+		EXPECT_EQ( storage.GetPackCount(), packCount );
+		expectBlobsStored( storage, blobs );
+	}
+
+	// remove the index, it is rebuilt from the packs
+	fs::remove( fs::path( folder ) / "pack_index.idx" );
+	{
+		PackEntityStorage storage;
+		EXPECT_EQ( storage.Initialize( folder, 16 * 1024 ), status::ok );
+		EXPECT_EQ( storage.GetEntityCount(), blobs.size() );
+		expectBlobsStored( storage, blobs );
+	}
+
+	// cut off the end of the index, the missing entries are recovered from the packs
+	const fs::path indexPath = fs::path( folder ) / "pack_index.idx";
+	fs::resize_file( indexPath, fs::file_size( indexPath ) - 100 );
+	{
+		PackEntityStorage storage;
+		EXPECT_EQ( storage.Initialize( folder, 16 * 1024 ), status::ok );
+		EXPECT_EQ( storage.GetEntityCount(), blobs.size() );
+		expectBlobsStored( storage, blobs );
+	}
+
+	// add a partial record at the end of the last pack, as if a write was interrupted.
+	// the partial record is skipped, and new entities are written to a new pack
+	const auto moreBlobs = createRandomBlobs( 10 );
+	{
+		PackEntityStorage storage;
+		EXPECT_EQ( storage.Initialize( folder, 1024 * 1024 ), status::ok );
+		packCount = storage.GetPackCount();
+	}
+	char lastPackName[32];
+	snprintf( lastPackName, sizeof( lastPackName ), "pack_%08u.pack", uint( packCount ) );
+	const fs::path lastPackPath = fs::path( folder ) / lastPackName;
+	EXPECT_TRUE( fs::exists( lastPackPath ) );
+	{
+		std::ofstream lastPack( lastPackPath, std::ios::binary | std::ios::app );
+		const u64 partialRecordSize = 10000;
+		lastPack.write( (const char *)&partialRecordSize, sizeof( partialRecordSize ) );
+	}
+	{
+		PackEntityStorage storage;
+		EXPECT_EQ( storage.Initialize( folder, 1024 * 1024 ), status::ok );
+		EXPECT_EQ( storage.GetPackCount(), packCount + 1 );
+		for( const auto &blob : moreBlobs )
+		{
+			EXPECT_EQ( storage.Write( blob.first, blob.second.data(), blob.second.size() ), status::ok );
+		}
+		expectBlobsStored( storage, blobs );
+		expectBlobsStored( storage, moreBlobs );
+	}
+}
+
+TEST( EntityStorageTests, PackFilesCompaction )
+{
+	setup_random_seed();
+	const std::string folder = setupTestFolder( "PackFilesCompaction" );
+	const auto blobs = createRandomBlobs( 200 );
+
+	// keep every other blob
+	std::map<hash, std::vector<u8>> keptBlobs;
+	std::set<hash> removedKeys;
+	bool keep = true;
+	for( const auto &blob : blobs )
+	{
+		if( keep )
+			keptBlobs.emplace( blob );
+		else
+			removedKeys.insert( blob.first );
+		keep = !keep;
+	}
+
+	{
+		PackEntityStorage storage;
+		EXPECT_EQ( storage.Initialize( folder, 16 * 1024 ), status::ok );
+		for( const auto &blob : blobs )
+		{
+			EXPECT_EQ( storage.Write( blob.first, blob.second.data(), blob.second.size() ), status::ok );
+		}
+		const size_t packCountBefore = storage.GetPackCount();
+
+		EXPECT_EQ( storage.Compact( [&keptBlobs]( const hash &key ) { return keptBlobs.find( key ) != keptBlobs.end(); } ), status::ok );
+		EXPECT_EQ( storage.GetEntityCount(), keptBlobs.size() );
+		EXPECT_LT( storage.GetPackCount(), packCountBefore );
+		expectBlobsStored( storage, keptBlobs );
+		for( const auto &key : removedKeys )
+		{
+			EXPECT_FALSE( storage.Contains( key ) );
+		}
+	}
+
+	// reopen, the removed entities must stay removed
+	{
+		PackEntityStorage storage;
+		EXPECT_EQ( storage.Initialize( folder, 16 * 1024 ), status::ok );
+		EXPECT_EQ( storage.GetEntityCount(), keptBlobs.size() );
+		expectBlobsStored( storage, keptBlobs );
+		for( const auto &key : removedKeys )
+		{
+			EXPECT_FALSE( storage.Contains( key ) );
+		}
+	}
+}
@@ -8,6 +8,7 @@
 #include <pds/EntityReader.h>
 #include <pds/WriteStream.h>
 #include <pds/ReadStream.h>
+#include <pds/WorkerPool.h>
 
 #include <pds/mf/ItemTable_MF.h>
 
@@ -247,3 +248,100 @@ TEST( ItemTableTests, ReadWriteTests )
 		ItemTableReadWriteTests_TestKeyType<string>( ws, ew );
 	}
 }
+
+TEST( ItemTableTests, ParallelRead )
+{
+	setup_random_seed();
+
+	WorkerPool pool;
+	EXPECT_EQ( pool.Initialize( 4, 0 ), status::ok );
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		typedef ItemTable<entity_ref, TestEntityA> Dict;
+		Dict random_dict;
+		GenerateRandomItemTable<Dict>( random_dict );
+
+		// every other pass has offset tables, and every other pair of passes uses compact encoding
+		WriteStream ws;
+		ws.SetSectionsArrayOffsetThreshold( ( pass_index % 2 ) ? 1 : 0 );
+		ws.SetCompactEncoding( ( ( pass_index / 2 ) % 2 ) != 0 );
+		EntityWriter ew( ws );
+		EXPECT_EQ( Dict::MF::Write( random_dict, ew ), status::ok );
+
+		// read the table in order, and in parallel
+		const auto readTable = [&]( WorkerPool *readPool, Dict &dest, std::vector<entity_ref> &refs )
+		{
+			ReadStream rs( ws.GetData(), ws.GetSize() );
+			rs.SetCompactEncoding( ws.GetCompactEncoding() );
+			EntityReader er( rs );
+			er.SetEntityRefCollector( &refs );
+			er.SetWorkerPool( readPool );
+			EXPECT_EQ( Dict::MF::Read( dest, er ), status::ok );
+			EXPECT_EQ( rs.GetPosition(), rs.GetSize() );
+		};
+		Dict serial_dict;
+		Dict parallel_dict;
+		std::vector<entity_ref> serial_refs;
+		std::vector<entity_ref> parallel_refs;
+		readTable( nullptr, serial_dict, serial_refs );
+		readTable( &pool, parallel_dict, parallel_refs );
+
+		// the result must match exactly, including the order of the map and of the collected refs
+		EXPECT_TRUE( parallel_dict == random_dict );
+		EXPECT_EQ( parallel_refs, serial_refs );
+		ASSERT_EQ( parallel_dict.Size(), serial_dict.Size() );
+		auto serial_it = serial_dict.Entries().begin();
+		for( const auto &entry : parallel_dict.Entries() )
+		{
+			EXPECT_EQ( entry.first, serial_it->first );
+			++serial_it;
+		}
+	}
+
+	pool.Deinitialize();
+}
+
+TEST( ItemTableTests, ParallelWrite )
+{
+	setup_random_seed();
+
+	WorkerPool pool;
+	EXPECT_EQ( pool.Initialize( 4, 0 ), status::ok );
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		typedef ItemTable<u64, TestEntityA> Dict;
+		Dict random_dict;
+		GenerateRandomItemTable<Dict>( random_dict, 0, 500 );
+
+		// write the table in order, and in parallel, with all combinations of settings
+		const auto writeTable = [&]( WorkerPool *writePool, WriteStream &ws )
+		{
+			ws.SetSectionsArrayOffsetThreshold( ( pass_index % 2 ) ? 1 : 0 );
+			ws.SetCompactEncoding( ( ( pass_index / 2 ) % 2 ) != 0 );
+			ws.SetCompressionThreshold( ( ( pass_index / 4 ) % 2 ) ? 16 : 0 );
+			EntityWriter ew( ws );
+			ew.SetWorkerPool( writePool );
+			EXPECT_EQ( Dict::MF::Write( random_dict, ew ), status::ok );
+		};
+		WriteStream serial_ws;
+		WriteStream parallel_ws;
+		writeTable( nullptr, serial_ws );
+		writeTable( &pool, parallel_ws );
+
+		// the data must be identical
+		ASSERT_EQ( parallel_ws.GetSize(), serial_ws.GetSize() );
+		EXPECT_EQ( memcmp( parallel_ws.GetData(), serial_ws.GetData(), (size_t)serial_ws.GetSize() ), 0 );
+
+		// and read back to the same table
+		ReadStream rs( parallel_ws.GetData(), parallel_ws.GetSize() );
+		rs.SetCompactEncoding( parallel_ws.GetCompactEncoding() );
+		EntityReader er( rs );
+		Dict readback_dict;
+		EXPECT_EQ( Dict::MF::Read( readback_dict, er ), status::ok );
+		EXPECT_TRUE( readback_dict == random_dict );
+	}
+
+	pool.Deinitialize();
+}
@@ -3,6 +3,10 @@
 
 #include "Tests.h"
 
+#include <filesystem>
+#include <fstream>
+
+#include <pds/EntityHasher.h>
 #include <pds/WriteStream.h>
 #include <pds/ReadStream.h>
 
@@ -122,3 +126,323 @@ TEST( ReadWriteTests, MemoryWriteReadStream )
 		rs = nullptr;
 	}
 }
+
+TEST( ReadWriteTests, WriteStreamGrowsAndIsReused )
+{
+	setup_random_seed();
+
+	// the stream starts small, and grows to fit the data
+	WriteStream ws;
+	const u64 initialReservedSize = ws.GetReservedSize();
+	std::vector<u64> values( 100000 );
+	for( auto &value : values )
+	{
+		value = u64_rand();
+	}
+	ws.Write( values.data(), values.size() );
+	EXPECT_EQ( ws.GetSize(), values.size() * sizeof( u64 ) );
+	EXPECT_GE( ws.GetReservedSize(), ws.GetSize() );
+	EXPECT_GT( ws.GetReservedSize(), initialReservedSize );
+	EXPECT_EQ( memcmp( ws.GetData(), values.data(), values.size() * sizeof( u64 ) ), 0 );
+
+	// clearing keeps the allocation
+	const u64 grownReservedSize = ws.GetReservedSize();
+	ws.Clear();
+	EXPECT_EQ( ws.GetSize(), u64( 0 ) );
+	EXPECT_EQ( ws.GetPosition(), u64( 0 ) );
+	EXPECT_EQ( ws.GetReservedSize(), grownReservedSize );
+
+	// a released stream is reused by the next acquire on the same thread, and is empty
+	const size_t pooledCount = WriteStreamPool::GetPooledCount();
+	const void *streamData = nullptr;
+	{
+		WriteStreamPool::Handle stream = WriteStreamPool::Acquire( 1024 * 64 );
+		EXPECT_GE( stream->GetReservedSize(), u64( 1024 * 64 ) );
+		stream->Write( values.data(), 16 );
+		streamData = stream->GetData();
+	}
+	EXPECT_EQ( WriteStreamPool::GetPooledCount(), std::max( pooledCount, size_t( 1 ) ) );
+	{
+		WriteStreamPool::Handle stream = WriteStreamPool::Acquire( 1024 * 64 );
+		EXPECT_EQ( stream->GetData(), streamData );
+		EXPECT_EQ( stream->GetSize(), u64( 0 ) );
+	}
+
+	// hints are rounded up to size classes
+	EXPECT_EQ( WriteStreamPool::GetSizeClass( 1 ), u64( WriteStreamPool::MinSizeClass ) );
+	EXPECT_EQ( WriteStreamPool::GetSizeClass( WriteStreamPool::MinSizeClass + 1 ), u64( 4 * WriteStreamPool::MinSizeClass ) );
+	{
+		WriteStreamPool::Handle stream = WriteStreamPool::Acquire( 1024 * 60 );
+		EXPECT_GE( stream->GetReservedSize(), u64( 1024 * 64 ) );
+	}
+
+	// streams which have grown too large are shrunk when pooled, and the pool of the thread is capped in total size
+	{
+		WriteStreamPool::Handle stream = WriteStreamPool::Acquire( 4 * WriteStreamPool::MaxRetainedSize );
+		EXPECT_GE( stream->GetReservedSize(), u64( 4 * WriteStreamPool::MaxRetainedSize ) );
+	}
+	EXPECT_LE( WriteStreamPool::GetPooledSize(), u64( WriteStreamPool::MaxPooledTotalSize ) );
+	{
+		WriteStreamPool::Handle stream = WriteStreamPool::Acquire( WriteStreamPool::MaxRetainedSize );
+		EXPECT_EQ( stream->GetReservedSize(), u64( WriteStreamPool::MaxRetainedSize ) );
+	}
+	EXPECT_LE( WriteStreamPool::GetPooledSize(), u64( WriteStreamPool::MaxPooledTotalSize ) );
+}
+
+class MemoryWriteStreamSink : public WriteStreamSink
+{
+public:
+	std::vector<u8> Data;
+	size_t AppendCount = 0;
+
+	status Append( const u8 *data, u64 size ) override
+	{
+		this->Data.insert( this->Data.end(), data, data + size );
+		++this->AppendCount;
+		return status::ok;
+	}
+
+	status Patch( u64 offset, const u8 *data, u64 size ) override
+	{
+		EXPECT_LE( offset + size, this->Data.size() );
+		memcpy( &this->Data[offset], data, size );
+		return status::ok;
+	}
+};
+
+// writes random values, large arrays, and back-patches of earlier values, to all the streams
+static void writeRandomValuesWithPatches( const std::vector<WriteStream *> &streams )
+{
+	std::vector<u64> largeArray( 1000 );
+	std::vector<u64> patchPositions;
+	for( uint i = 0; i < 2000; ++i )
+	{
+		const u64 value = u64_rand();
+		const u64 position = streams[0]->GetPosition();
+		switch( rand() % 10 )
+		{
+			case 0:
+				// a large array, larger than the sink chunk size
+				for( auto &item : largeArray )
+					item = u64_rand();
+				for( auto stream : streams )
+					stream->Write( largeArray.data(), largeArray.size() );
+				break;
+			case 1:
+			case 2:
+				// patch a value which was written earlier, like the block size of a block
+				if( !patchPositions.empty() )
+				{
+					const u64 patchPosition = patchPositions[rand() % patchPositions.size()];
+					for( auto stream : streams )
+					{
+						stream->SetPosition( patchPosition );
+						stream->Write( value );
+						stream->SetPosition( position );
+					}
+				}
+				break;
+			default:
+				patchPositions.emplace_back( position );
+				for( auto stream : streams )
+					stream->Write( value );
+				break;
+		}
+	}
+}
+
+TEST( ReadWriteTests, WriteStreamToSink )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		WriteStream memoryStream;
+		MemoryWriteStreamSink sink;
+		WriteStream sinkStream( &sink, 256 );
+
+		FileWriteStreamSink fileSink;
+		const std::string filePath = ( std::filesystem::temp_directory_path() / "pds_WriteStreamToSink.dat" ).string();
+		EXPECT_EQ( fileSink.Open( filePath ), status::ok );
+		WriteStream fileStream( &fileSink, 1024 );
+
+		writeRandomValuesWithPatches( { &memoryStream, &sinkStream, &fileStream } );
+		EXPECT_EQ( sinkStream.Flush(), status::ok );
+		EXPECT_EQ( fileStream.Flush(), status::ok );
+
+		// the sinks have the same data as the memory stream, and got it in more than one chunk
+		const u64 size = memoryStream.GetSize();
+		EXPECT_EQ( sinkStream.GetTotalSize(), size );
+		EXPECT_EQ( fileStream.GetTotalSize(), size );
+		EXPECT_GT( sink.AppendCount, size_t( 1 ) );
+		ASSERT_EQ( sink.Data.size(), size );
+		EXPECT_EQ( memcmp( sink.Data.data(), memoryStream.GetData(), size ), 0 );
+
+		// only the last unfinished chunk is held in the memory of the stream
+		EXPECT_LT( sinkStream.GetReservedSize(), u64( 1024 ) );
+
+		// read back the file in small chunks
+		EXPECT_EQ( fileSink.GetSize(), size );
+		std::vector<u8> fileData;
+		EXPECT_EQ( fileSink.ReadBack( [&fileData]( const u8 *data, u64 dataSize )
+			{
+				fileData.insert( fileData.end(), data, data + dataSize );
+				return status::ok;
+			}, 1000 ), status::ok );
+		ASSERT_EQ( fileData.size(), size );
+		EXPECT_EQ( memcmp( fileData.data(), memoryStream.GetData(), size ), 0 );
+
+		fileSink.Close();
+		std::filesystem::remove( filePath );
+	}
+}
+
+class MemoryReadStreamSource : public ReadStreamSource
+{
+public:
+	std::vector<u8> Data;
+	size_t ReadCount = 0;
+
+	virtual u64 GetSize() const override { return this->Data.size(); }
+
+	virtual u64 Read( u64 offset, u8 *dest, u64 count ) override
+	{
+		++this->ReadCount;
+		if( offset >= this->Data.size() )
+			return 0;
+		count = std::min( count, (u64)this->Data.size() - offset );
+		memcpy( dest, &this->Data[offset], count );
+		return count;
+	}
+};
+
+TEST( ReadWriteTests, ReadStreamFromSource )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		// random values, and arrays which are larger than the windows
+		std::vector<u64> values( 2000 );
+		for( auto &value : values )
+		{
+			value = u64_rand();
+		}
+		MemoryReadStreamSource source;
+		source.Data.resize( values.size() * sizeof( u64 ) );
+		memcpy( source.Data.data(), values.data(), source.Data.size() );
+
+		// also read the same data from a file
+		const std::string filePath = ( std::filesystem::temp_directory_path() / "pds_ReadStreamFromSource.dat" ).string();
+		{
+			std::ofstream file( filePath, std::ios::binary | std::ios::trunc );
+			file.write( "header", 6 );
+			file.write( (const char *)source.Data.data(), (std::streamsize)source.Data.size() );
+		}
+		FileReadStreamSource fileSource;
+		EXPECT_EQ( fileSource.Open( filePath, 6 ), status::ok );
+		EXPECT_EQ( fileSource.GetSize(), source.Data.size() );
+
+		ReadStream memoryStream( &source, 100 );
+		ReadStream fileStream( &fileSource, 256 );
+		for( ReadStream *rs : { &memoryStream, &fileStream } )
+		{
+			EXPECT_EQ( rs->GetSize(), values.size() * sizeof( u64 ) );
+
+			size_t index = 0;
+			while( index < values.size() )
+			{
+				const size_t count = std::min( size_t( capped_rand( 1, 100 ) ), values.size() - index );
+				std::vector<u64> dest( count );
+				EXPECT_EQ( rs->Peek(), u8( values[index] & 0xff ) );
+				EXPECT_EQ( rs->Read( dest.data(), count ), u64( count ) );
+				EXPECT_TRUE( std::equal( dest.begin(), dest.end(), values.begin() + index ) );
+				index += count;
+
+				// sometimes move back and read a value again
+				if( rand() % 10 == 0 )
+				{
+					const size_t backIndex = size_t( rand() ) % index;
+					EXPECT_TRUE( rs->SetPosition( backIndex * sizeof( u64 ) ) );
+					EXPECT_EQ( rs->Read<u64>(), values[backIndex] );
+					EXPECT_TRUE( rs->SetPosition( index * sizeof( u64 ) ) );
+				}
+			}
+			EXPECT_TRUE( rs->IsEOF() );
+			EXPECT_EQ( rs->Peek(), u8( 0 ) );
+			u64 pastEnd = 0;
+			EXPECT_EQ( rs->Read( &pastEnd, 1 ), u64( 0 ) );
+		}
+
+		// the data was read in many windows
+		EXPECT_GT( source.ReadCount, size_t( 100 ) );
+	}
+}
+
+TEST( ReadWriteTests, CompactEncoding )
+{
+	setup_random_seed();
+
+	// varints use 7 bits per byte
+	std::vector<u64> values = { 0, 1, 0x7f, 0x80, 0x3fff, 0x4000, ~u64( 0 ) };
+	WriteStream ws;
+	for( const u64 value : values )
+	{
+		ws.WriteVarint( value );
+	}
+	EXPECT_EQ( ws.GetSize(), u64( 1 + 1 + 1 + 2 + 2 + 3 + 10 ) );
+
+	// varints of all lengths read back
+	for( size_t i = 0; i < 1000; ++i )
+	{
+		values.emplace_back( u64_rand() >> ( rand() % 64 ) );
+		ws.WriteVarint( values.back() );
+	}
+	ReadStream rs( ws.GetData(), ws.GetSize() );
+	for( const u64 value : values )
+	{
+		EXPECT_EQ( rs.ReadVarint(), value );
+	}
+	EXPECT_TRUE( rs.IsEOF() );
+
+	// nested placeholders shrink to varints when filled, and the data is hashed as it ends up
+	for( const u64 blockSize : { u64( 10 ), u64( 1000 ), u64( 3 * EntityHasher::LeafSize ) } )
+	{
+		EntityHasher hasher;
+		WriteStream compact;
+		compact.SetHasher( &hasher );
+		compact.SetCompactEncoding( true );
+
+		std::vector<u8> payload( (size_t)blockSize );
+		for( auto &value : payload )
+		{
+			value = u8_rand();
+		}
+
+		compact.Write( u8( 0xaa ) );
+		const u64 outerPosition = compact.GetPosition();
+		compact.WritePlaceholder();
+		const u64 innerPosition = compact.GetPosition();
+		compact.WritePlaceholder();
+		compact.Write( payload.data(), payload.size() );
+		compact.FillPlaceholder( innerPosition, compact.GetPosition() - innerPosition - sizeof( u64 ) );
+		compact.Write( u8( 0xbb ) );
+		compact.FillPlaceholder( outerPosition, compact.GetPosition() - outerPosition - sizeof( u64 ) );
+		EXPECT_EQ( compact.GetPosition(), compact.GetSize() );
+
+		ReadStream crs( compact.GetData(), compact.GetSize() );
+		EXPECT_EQ( crs.Read<u8>(), u8( 0xaa ) );
+		const u64 outerSize = crs.ReadVarint();
+		EXPECT_EQ( crs.GetPosition() + outerSize, crs.GetSize() );
+		EXPECT_EQ( crs.ReadVarint(), blockSize );
+		std::vector<u8> readPayload( (size_t)blockSize );
+		crs.Read( readPayload.data(), blockSize );
+		EXPECT_EQ( readPayload, payload );
+		EXPECT_EQ( crs.Read<u8>(), u8( 0xbb ) );
+		EXPECT_TRUE( crs.IsEOF() );
+
+		auto streamHash = compact.FinishHash();
+		EXPECT_TRUE( streamHash.status() );
+		EXPECT_EQ( streamHash.value(), EntityHasher::Calculate( (const u8 *)compact.GetData(), compact.GetSize() ).value() );
+	}
+}
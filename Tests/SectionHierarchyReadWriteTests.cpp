@@ -3,6 +3,8 @@
 
 #include "Tests.h"
 
+#include <thread>
+
 #include <pds/EntityWriter.h>
 #include <pds/EntityReader.h>
 #include <pds/WriteStream.h>
@@ -295,7 +297,9 @@ TEST( SectionHierarchyReadWriteTests, TestEntitySectionWriterAndReadback )
 		section_object my_hierarchy;
 		my_hierarchy.SetupRandom( (int)capped_rand( 2, 5 ) );
 
+		// every other pass writes offset tables
 		WriteStream ws;
+		ws.SetSectionsArrayOffsetThreshold( ( pass_index % 2 ) ? 1 : 0 );
 		EntityWriter ew( ws );
 
 		EXPECT_TRUE( my_hierarchy.Write( ws, ew ) );
@@ -315,6 +319,122 @@ TEST( SectionHierarchyReadWriteTests, TestEntitySectionWriterAndReadback )
 	}
 }
 
+TEST( SectionHierarchyReadWriteTests, TestEntitySectionWriterAndReadbackCompact )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		section_object my_hierarchy;
+		my_hierarchy.SetupRandom( (int)capped_rand( 2, 5 ) );
+
+		// write the nested sections with the compact encoding. every other pass writes offset tables
+		WriteStream ws;
+		ws.SetCompactEncoding( true );
+		ws.SetSectionsArrayOffsetThreshold( ( pass_index % 2 ) ? 1 : 0 );
+		EntityWriter ew( ws );
+
+		EXPECT_TRUE( my_hierarchy.Write( ws, ew ) );
+
+		ReadStream rs( ws.GetData(), ws.GetSize() );
+		rs.SetCompactEncoding( true );
+		EntityReader er( rs );
+
+		section_object readback_hierarchy;
+		readback_hierarchy.Read( rs, er );
+
+		EXPECT_EQ( readback_hierarchy.CountItems(), my_hierarchy.CountItems() );
+
+		readback_hierarchy.Compare( &my_hierarchy );
+	}
+}
+
+TEST( SectionHierarchyReadWriteTests, SectionsArrayRandomAccess )
+{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < global_number_of_passes; ++pass_index )
+	{
+		std::vector<u64> values;
+		std::vector<std::string> names;
+		random_vector<u64>( values, 1, 200 );
+		for( size_t i = 0; i < values.size(); ++i )
+			names.emplace_back( random_value<std::string>() );
+
+		WriteStream ws;
+		ws.SetCompactEncoding( ( pass_index % 2 ) != 0 );
+		ws.SetSectionsArrayOffsetThreshold( 1 );
+		EntityWriter ew( ws );
+		EntityWriter *aw = ew.BeginWriteSectionsArray( "Items", 5, values.size() ).value();
+		for( size_t i = 0; i < values.size(); ++i )
+		{
+			EXPECT_EQ( ew.BeginWriteSectionInArray( aw, i ), status::ok );
+			EXPECT_EQ( aw->Write( "Value", 5, values[i] ), status::ok );
+			EXPECT_EQ( aw->Write( "Name", 4, names[i] ), status::ok );
+			EXPECT_EQ( ew.EndWriteSectionInArray( aw, i ), status::ok );
+		}
+		EXPECT_EQ( ew.EndWriteSectionsArray( aw ), status::ok );
+		EXPECT_EQ( ew.Write( "After", 5, u64( 1234 ) ), status::ok );
+
+		ReadStream rs( ws.GetData(), ws.GetSize() );
+		rs.SetCompactEncoding( ws.GetCompactEncoding() );
+		EntityReader er( rs );
+		EntityReader *ar = er.BeginReadSectionsArray( "Items", 5, false ).value();
+		EXPECT_TRUE( er.HasSectionsArrayOffsets() );
+		EXPECT_EQ( er.GetReadSectionsArraySize(), values.size() );
+
+		// read every other section, in reverse order
+		for( size_t i = values.size(); i-- > 0; )
+		{
+			if( i % 2 )
+				continue;
+			u64 value = 0;
+			std::string name;
+			EXPECT_EQ( er.BeginReadSectionInArray( ar, i ), status::ok );
+			EXPECT_EQ( ar->Read( "Value", 5, value ), status::ok );
+			EXPECT_EQ( ar->Read( "Name", 4, name ), status::ok );
+			EXPECT_EQ( er.EndReadSectionInArray( ar, i ), status::ok );
+			EXPECT_EQ( value, values[i] );
+			EXPECT_EQ( name, names[i] );
+		}
+
+		// decode all sections in parallel, each thread with a separate stream
+		std::vector<std::pair<u64, u64>> ranges( values.size() );
+		for( size_t i = 0; i < values.size(); ++i )
+			EXPECT_EQ( er.GetSectionInArrayRange( ar, i, ranges[i].first, ranges[i].second ), status::ok );
+		std::vector<u64> readValues( values.size() );
+		std::vector<std::string> readNames( values.size() );
+		std::vector<std::thread> threads;
+		const size_t threadCount = 4;
+		for( size_t t = 0; t < threadCount; ++t )
+		{
+			threads.emplace_back( [&, t]()
+			{
+				for( size_t i = t; i < values.size(); i += threadCount )
+				{
+					ReadStream srs( ws.GetData(), ws.GetSize() );
+					srs.SetCompactEncoding( ws.GetCompactEncoding() );
+					srs.SetPosition( ranges[i].first );
+					EntityReader ser( srs, ranges[i].second );
+					ser.Read( "Value", 5, readValues[i] );
+					ser.Read( "Name", 4, readNames[i] );
+				}
+			} );
+		}
+		for( auto &thread : threads )
+			thread.join();
+		EXPECT_EQ( readValues, values );
+		EXPECT_EQ( readNames, names );
+
+		// the array can be ended without reading all sections
+		EXPECT_EQ( er.EndReadSectionsArray( ar ), status::ok );
+		u64 after = 0;
+		EXPECT_EQ( er.Read( "After", 5, after ), status::ok );
+		EXPECT_EQ( after, u64( 1234 ) );
+		EXPECT_EQ( rs.GetPosition(), rs.GetSize() );
+	}
+}
+
 // implement the random value function for std::unique_ptr<section_object>
 template<> std::unique_ptr<section_object> random_value< std::unique_ptr<section_object> >()
 {
@@ -28,12 +28,22 @@ using namespace pds;
 #include <map>
 #include <unordered_map>
 #include <algorithm>
+#include <filesystem>
 
 #include "TestHelpers/random_vals.h"
 
 // set this to a higher number to run more passes where the values are randomized
 const size_t global_number_of_passes = 10;
 
+// creates an empty folder for the test to store entities in
+inline std::string setupTestFolder( const char *name )
+{
+	const std::filesystem::path folder = std::filesystem::temp_directory_path() / "pds_tests" / name;
+	std::filesystem::remove_all( folder );
+	std::filesystem::create_directories( folder );
+	return folder.string();
+}
+
 // method which creates an inversed map, where the values of the original map points at the keys of the original map
 template<typename K, typename V>
 inline std::map<V, K> inverse_map( std::map<K, V> &map )
@@ -0,0 +1,171 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <pds/WorkerPool.h>
+
+static u64 sumQueueMetrics( const std::vector<WorkerPool::QueueMetrics> &metrics, u64 WorkerPool::QueueMetrics:: *member )
+{
+	u64 sum = 0;
+	for( const auto &m : metrics )
+		sum += m.*member;
+	return sum;
+}
+
+TEST( WorkerPoolTests, RunsAllTasks )
+{
+	WorkerPool pool;
+	EXPECT_EQ( pool.Initialize( 4, 0 ), status::ok );
+	EXPECT_EQ( pool.GetWorkerCount(), uint( 4 ) );
+	EXPECT_EQ( pool.Initialize( 4, 0 ), status::already_initialized );
+
+	std::vector<std::future<u64>> futures;
+	for( u64 i = 0; i < 1000; ++i )
+	{
+		futures.emplace_back( pool.Submit( [i]() { return i * i; } ) );
+	}
+	for( u64 i = 0; i < 1000; ++i )
+	{
+		EXPECT_EQ( futures[i].get(), i * i );
+	}
+
+	// stop the pool, so all the metrics are final
+	pool.Deinitialize();
+	EXPECT_EQ( pool.GetWorkerCount(), uint( 0 ) );
+
+	const auto metrics = pool.GetQueueMetrics();
+	EXPECT_EQ( metrics.size(), size_t( 4 ) );
+	EXPECT_EQ( sumQueueMetrics( metrics, &WorkerPool::QueueMetrics::SubmittedTasks ), u64( 1000 ) );
+	EXPECT_EQ( sumQueueMetrics( metrics, &WorkerPool::QueueMetrics::CompletedTasks ), u64( 1000 ) );
+	EXPECT_EQ( sumQueueMetrics( metrics, &WorkerPool::QueueMetrics::Depth ), u64( 0 ) );
+}
+
+TEST( WorkerPoolTests, RunsInlineWhenNotInitialized )
+{
+	WorkerPool pool;
+
+	const auto callingThread = std::this_thread::get_id();
+	auto futr = pool.Submit( [callingThread]() { return std::this_thread::get_id() == callingThread; } );
+	EXPECT_TRUE( futr.get() );
+}
+
+TEST( WorkerPoolTests, BoundedQueueDepth )
+{
+	WorkerPool pool;
+	EXPECT_EQ( pool.Initialize( 2, 4 ), status::ok );
+
+	std::atomic<u64> counter { 0 };
+	std::vector<std::future<void>> futures;
+	for( size_t i = 0; i < 200; ++i )
+	{
+		futures.emplace_back( pool.Submit( [&counter]()
+			{
+			std::this_thread::sleep_for( std::chrono::microseconds( 50 ) );
+			++counter;
+			} ) );
+	}
+	for( auto &futr : futures )
+	{
+		futr.get();
+	}
+	EXPECT_EQ( counter, u64( 200 ) );
+
+	// the queues must never have grown past the max depth
+	pool.Deinitialize();
+	const auto metrics = pool.GetQueueMetrics();
+	for( const auto &m : metrics )
+	{
+		EXPECT_LE( m.PeakDepth, u64( 4 ) );
+	}
+	EXPECT_GT( sumQueueMetrics( metrics, &WorkerPool::QueueMetrics::BlockedSubmits ), u64( 0 ) );
+	EXPECT_GT( sumQueueMetrics( metrics, &WorkerPool::QueueMetrics::TotalRunTime ), u64( 0 ) );
+}
+
+TEST( WorkerPoolTests, NestedSubmitsDoNotDeadlock )
+{
+	WorkerPool pool;
+	EXPECT_EQ( pool.Initialize( 2, 2 ), status::ok );
+
+	// each task submits sub-tasks, and waits for them. since the queues are tiny,
+	// some of the sub-tasks will run inline, and the rest are run by the workers while waiting
+	std::vector<std::future<u64>> futures;
+	for( u64 i = 0; i < 16; ++i )
+	{
+		futures.emplace_back( pool.Submit( [&pool, i]()
+			{
+			EXPECT_TRUE( pool.IsWorkerThread() );
+			std::vector<std::future<u64>> subFutures;
+			for( u64 s = 0; s < 8; ++s )
+			{
+				subFutures.emplace_back( pool.Submit( [i, s]() { return i + s; } ) );
+			}
+			u64 sum = 0;
+			for( auto &futr : subFutures )
+			{
+				pool.Wait( futr );
+				sum += futr.get();
+			}
+			return sum;
+			} ) );
+	}
+	for( u64 i = 0; i < 16; ++i )
+	{
+		EXPECT_EQ( futures[i].get(), i * 8 + 28 );
+	}
+	EXPECT_FALSE( pool.IsWorkerThread() );
+}
+
+TEST( WorkerPoolTests, ParallelForRunsEachIndexOnce )
+{
+	WorkerPool pool;
+	EXPECT_EQ( pool.Initialize( 4, 2 ), status::ok );
+
+	std::vector<std::atomic<uint>> counts( 1000 );
+	pool.ParallelFor( counts.size(), [&counts]( size_t index ) { ++counts[index]; } );
+	for( const auto &count : counts )
+	{
+		EXPECT_EQ( count.load(), uint( 1 ) );
+	}
+
+	// nested inside a task, the worker takes part in the loop
+	std::atomic<uint> total( 0 );
+	auto futr = pool.Submit( [&pool, &total]()
+		{
+			pool.ParallelFor( 100, [&total]( size_t ) { ++total; } );
+		} );
+	pool.Wait( futr );
+	EXPECT_EQ( total.load(), uint( 100 ) );
+
+	// empty loops, and loops without a running pool, are fine
+	pool.ParallelFor( 0, []( size_t ) {} );
+	pool.Deinitialize();
+	pool.ParallelFor( 10, [&total]( size_t ) { ++total; } );
+	EXPECT_EQ( total.load(), uint( 110 ) );
+}
+
+TEST( WorkerPoolTests, WaitForFutureCompletedOutsideOfPool )
+{
+	WorkerPool pool;
+	EXPECT_EQ( pool.Initialize( 2, 0 ), status::ok );
+
+	// the workers have nothing else to run, so they sleep in Wait until the promise is set and the pool is notified
+	std::promise<u64> promise;
+	std::shared_future<u64> pending = promise.get_future().share();
+	std::vector<std::future<u64>> futures;
+	for( u64 i = 0; i < 2; ++i )
+	{
+		futures.emplace_back( pool.Submit( [&pool, pending, i]()
+			{
+			pool.Wait( pending );
+			return pending.get() + i;
+			} ) );
+	}
+
+	std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+	promise.set_value( 10 );
+	pool.NotifyWaiters();
+
+	EXPECT_EQ( futures[0].get(), u64( 10 ) );
+	EXPECT_EQ( futures[1].get(), u64( 11 ) );
+}
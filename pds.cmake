@@ -20,11 +20,20 @@ set(
 
 	./Include/pds/fileops_common.h		
 
+	./Include/pds/BlockCompressor.h
+	./Include/pds/BlockCompressor.inl
+
 	./Include/pds/Entity.h
+	./Include/pds/EntityCache.h
+	./Include/pds/EntityCache.inl
+	./Include/pds/EntityHasher.h
+	./Include/pds/EntityHasher.inl
 	./Include/pds/EntityManager.h
 	./Include/pds/EntityManager.inl
 	./Include/pds/EntityReader.h
 	./Include/pds/EntityReader.inl
+	./Include/pds/EntityStorage.h
+	./Include/pds/EntityStorage.inl
 	./Include/pds/EntityValidator.h
 	./Include/pds/EntityWriter.h
 	./Include/pds/EntityWriter.inl
@@ -36,6 +45,10 @@ set(
 	./Include/pds/ReadStream.inl
 	./Include/pds/WriteStream.h
 	./Include/pds/WriteStream.inl
+	./Include/pds/WorkerPool.h
+	./Include/pds/WorkerPool.inl
+	./Include/pds/MappedFile.h
+	./Include/pds/MappedFile.inl
 	./Include/pds/pds.h
 	
 	./Include/pds/BidirectionalMap.h
@@ -49,6 +62,8 @@ set(
 	./Include/pds/mf/DirectedGraph_MF.h
 	./Include/pds/ItemTable.h
 	./Include/pds/mf/ItemTable_MF.h
+	./Include/pds/Lazy.h
+	./Include/pds/mf/Lazy_MF.h
 
 	./Include/pds/Varying.h
 	./Include/pds/mf/Varying_MF.h
@@ -119,10 +134,15 @@ if(BUILD_PERSISTENT_DS_TESTS)
 		./Tests/Tests.cpp 
 		./Tests/HeaderLibraries.cpp 
 		./Tests/BidirectionalMapTests.cpp
+		./Tests/BlockCompressorTests.cpp
 		./Tests/DirectedGraphTests.cpp
 		./Tests/DynamicTypesTests.cpp
 		./Tests/EntityReaderRandomTests.cpp
 		./Tests/EntityReadWriteTests.cpp
+		./Tests/EntityCacheTests.cpp
+		./Tests/EntityHasherTests.cpp
+		./Tests/EntityManagerTests.cpp
+		./Tests/EntityStorageTests.cpp
 		./Tests/EntityTests.cpp
 		./Tests/ItemTableTests.cpp
 		./Tests/IndexedVectorTests.cpp
@@ -133,6 +153,7 @@ if(BUILD_PERSISTENT_DS_TESTS)
 		./Tests/TestHelpers/random_vals.cpp 
 		./Tests/TestPackA/TestPackA.cpp
 		./Tests/VaryingTests.cpp
+		./Tests/WorkerPoolTests.cpp
 		
 		dependencies.cmake
 		pds.cmake
@@ -151,6 +172,40 @@ if(BUILD_PERSISTENT_DS_TESTS)
 		gtest 
 		)
 
+	# Benchmarks measure the performance of the library, and are run manually
+	add_executable( 
+		benchmarks
+		./Tests/Benchmarks/Benchmarks.h
+		./Tests/Benchmarks/Benchmarks.cpp
+		./Tests/Benchmarks/AllocationBenchmarks.cpp
+		./Tests/Benchmarks/EntityCacheBenchmarks.cpp
+		./Tests/Benchmarks/HashBenchmarks.cpp
+		./Tests/Benchmarks/ItemTableBenchmarks.cpp
+		./Tests/TestHelpers/random_vals.h
+		./Tests/TestHelpers/random_vals.cpp 
+		./Tests/TestPackA/TestPackA.cpp
+		./Tests/HeaderLibraries.cpp 
+		
+		${pds_library_files}
+		
+		dependencies.cmake
+		pds.cmake
+		)	
+
+	target_include_directories(	
+		benchmarks 
+		PUBLIC ${PROJECT_SOURCE_DIR}/Include
+		PUBLIC ${xxhash_SOURCE_DIR}
+		PUBLIC ${ctle_SOURCE_DIR}/include
+		PUBLIC ${PROJECT_SOURCE_DIR}/Tests 
+		) 
+
+	find_package( Threads REQUIRED )
+	target_link_libraries( 	
+		benchmarks 
+		Threads::Threads
+		)
+
 else() # BUILD_PERSISTENT_DS_TESTS
 
 	message(NOTICE "Not building the persistent-ds tests. To enable, use -DBUILD_PERSISTENT_DS_TESTS=ON")